@@ -25,6 +25,7 @@ namespace fl {
 		const size_t MAX_BUF_SIZE = 300000;
 		const size_t DEFAULT_MINIMUM_COPIES = 2;
 		const size_t DEFAULT_MAX_CONNECTION_PER_STORAGE = 2;
+		const size_t DEFAULT_STORAGE_CONNECTIONS = 0;
 		const size_t DEFAULT_AVERAGE_ITEM_SIZE = 32000;
 		
 		const TCacheLineIndex DEFAULT_ITEMS_IN_LINE = 32 * 1024;
@@ -104,6 +105,10 @@ namespace fl {
 			{
 				return _maxConnectionPerStorage;
 			}
+			size_t storageConnections() const
+			{
+				return _storageConnections;
+			}
 			size_t averageItemSize() const
 			{
 				return _averageItemSize;
@@ -160,6 +165,7 @@ namespace fl {
 			
 			size_t _minimumCopies;
 			size_t _maxConnectionPerStorage;
+			size_t _storageConnections;
 			
 			size_t _averageItemSize;
 			
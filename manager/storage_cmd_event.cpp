@@ -139,28 +139,45 @@ void StorageCMDSync::repeat(class StorageCMDEvent *ev)
 
 StorageCMDRangeIndexCheck::StorageCMDRangeIndexCheck(Manager *manager, EPollWorkerThread *thread)
 	: _manager(manager), _thread(thread), _operationTimer(new TimerEvent()), _recheckTimer(new TimerEvent()),
-		_storageCMDSync(NULL)
+		_storageCMDSync(NULL), _step(STEP_SUBTREES), _subtrees(0), _isFullCheck(true)
 {
+	bzero(&_buckets, sizeof(_buckets));
 }
 
 StorageCMDRangeIndexCheck::~StorageCMDRangeIndexCheck()
 {
 }
 
-void StorageCMDRangeIndexCheck::_fillCMD(StorageCMDEvent *ev)
+void StorageCMDRangeIndexCheck::_fillCMD(StorageCMDEvent *ev, const TItemKey fromKey)
 {
 	NetworkBuffer &buffer = ev->networkBuffer();
 	buffer.clear();
 	StorageCmd &storageCmd = *(StorageCmd*)buffer.reserveBuffer(sizeof(StorageCmd));
-	storageCmd.cmd = EStorageCMD::STORAGE_GET_RANGE_ITEMS;
+	if (_step != STEP_ITEMS) {
+		storageCmd.cmd = EStorageCMD::STORAGE_GET_RANGE_DIGEST;
+		RangeDigestRequest rangeDigestRequest;
+		rangeDigestRequest.serverID = ev->storage()->id();
+		rangeDigestRequest.rangeID = _currentRange->rangeID();
+		rangeDigestRequest.subtrees = (_step == STEP_BUCKETS) ? _subtrees : 0;
+		storageCmd.size = sizeof(rangeDigestRequest);
+		buffer.add((char*)&rangeDigestRequest, sizeof(rangeDigestRequest));
+		return;
+	}
+	storageCmd.cmd = EStorageCMD::STORAGE_GET_RANGE_ITEMS_V2;
 	RangeItemsRequest rangeItemRequest;
 	rangeItemRequest.serverID = ev->storage()->id();
 	rangeItemRequest.rangeID = _currentRange->rangeID();
+	rangeItemRequest.fromKey = fromKey;
+	static const uint32_t RANGE_ITEMS_PAGE = 16384;
+	rangeItemRequest.maxCount = RANGE_ITEMS_PAGE;
+	rangeItemRequest.changedSince.tag = 0;
+	rangeItemRequest.flags = _isFullCheck ? 0 : RANGE_ITEMS_BUCKETS;
+	memcpy(rangeItemRequest.buckets, _buckets, sizeof(_buckets));
 	storageCmd.size = sizeof(rangeItemRequest);
 	buffer.add((char*)&rangeItemRequest, sizeof(rangeItemRequest));
 }
 
-bool StorageCMDRangeIndexCheck::_parse(class StorageCMDEvent *ev)
+bool StorageCMDRangeIndexCheck::_parse(class StorageCMDEvent *ev, TItemKey &nextKey, bool &isLast)
 {
 	NetworkBuffer &data = ev->networkBuffer();
 	Buffer dataBuffer(std::move(data));
@@ -179,8 +196,10 @@ bool StorageCMDRangeIndexCheck::_parse(class StorageCMDEvent *ev)
 			dataBuffer.get(&ie, sizeof(ie));
 			auto itemKey = ie.itemKey;
 			auto res = _items.insert(TItemEntryMap::value_type(itemKey, emptyVector));
-			res.first->second.push_back(ItemEntry(ev->storage(), ie.size, ie.timeTag));
+			res.first->second.push_back(ItemEntry(ev->storage(), ie.size, ie.timeTag, ie.crc));
 		}
+		nextKey = header.nextKey;
+		isLast = header.flags & RANGE_ITEMS_LAST;
 		return true;
 	}
 	catch (Buffer::Error &er)
@@ -190,16 +209,59 @@ bool StorageCMDRangeIndexCheck::_parse(class StorageCMDEvent *ev)
 	return false;
 }
 
+bool StorageCMDRangeIndexCheck::_parseDigests(class StorageCMDEvent *ev, TRangeDigestVector &digests)
+{
+	NetworkBuffer &data = ev->networkBuffer();
+	Buffer dataBuffer(std::move(data));
+	try
+	{
+		dataBuffer.skip(sizeof(StorageAnswer));
+		RangeDigestHeader header;
+		dataBuffer.get(&header, sizeof(header));
+		if (header.rangeID != _currentRange->rangeID()) {
+			log::Error::L("Receive a bad rangeID %u, wait for %u\n", header.rangeID, _currentRange->rangeID());
+			return false;
+		}
+		size_t subtrees = (_step == STEP_BUCKETS) ? __builtin_popcount(_subtrees) : 1;
+		digests.resize(subtrees * RANGE_DIGEST_FANOUT);
+		dataBuffer.get(&digests[0], sizeof(TRangeDigest) * digests.size());
+		return true;
+	}
+	catch (Buffer::Error &er)
+	{
+		log::Error::L("Receive a bad storage range digest answer\n");
+	}
+	return false;
+}
+
 void StorageCMDRangeIndexCheck::ready(class StorageCMDEvent *ev, const StorageAnswer &sa)
 {
 	bool completed = true;
 	for (auto r = _requests.begin(); r != _requests.end(); r++) {
 		if (r->_event == ev) {
 			if (sa.status == EStorageAnswerStatus::STORAGE_ANSWER_OK) {
-				if (_parse(ev))
+				bool isLast = true;
+				if (_step != STEP_ITEMS) {
+					if (_parseDigests(ev, r->_digests))
+						r->_status = sa.status;
+					else
+						r->_status = EStorageAnswerStatus::STORAGE_ANSWER_ERROR;
+				} else if (!_parse(ev, r->_fromKey, isLast))
+					r->_status = EStorageAnswerStatus::STORAGE_ANSWER_ERROR;
+				else if (isLast)
 					r->_status = sa.status;
-				else
+				else { // ask the next page
+					ev->reopen();
+					_fillCMD(ev, r->_fromKey);
+					if (ev->makeCMD()) {
+						_operationTimer->stop();
+						if (!_setOperationTimer())
+							log::Error::L("StorageCMDRangeIndexCheck: Can't prolong the operation timer\n");
+						completed = false;
+						continue;
+					}
 					r->_status = EStorageAnswerStatus::STORAGE_ANSWER_ERROR;
+				}
 			}
 			else
 				r->_status = sa.status;
@@ -221,7 +283,7 @@ void StorageCMDRangeIndexCheck::repeat(class StorageCMDEvent *ev)
 			if (r->_reconnects < MAX_STORAGE_RECONNECTS) {
 				r->_reconnects++;
 				ev->reopen();
-				_fillCMD(ev);
+				_fillCMD(ev, r->_fromKey);
 				if (ev->makeCMD())
 					return;
 			}
@@ -243,8 +305,8 @@ void StorageCMDRangeIndexCheck::_checkItems()
 		log::Error::L("_checkItems has been received not null _storageCMDSync\n");
 		return;
 	}
-	log::Warning::L("Check range %u (items: %u, servers: %u)\n", _currentRange->rangeID(), _items.size(), 
-		_requests.size());
+	log::Warning::L("Check range %u (items: %u, servers: %u, %s)\n", _currentRange->rangeID(), _items.size(), 
+		_requests.size(), _isFullCheck ? "all items" : "different buckets");
 	
 	RangeSyncEntry syncEntry;
 	bzero(&syncEntry, sizeof(syncEntry));
@@ -257,6 +319,7 @@ void StorageCMDRangeIndexCheck::_checkItems()
 
 	for (auto item = _items.begin(); item != _items.end(); item++) {
 		TSize size = 0;
+		TCrc crc = 0;
 		ModTimeTag timeTag;
 		timeTag.tag = 0;
 		TStorageList storages;
@@ -264,6 +327,7 @@ void StorageCMDRangeIndexCheck::_checkItems()
 			if (itemEntry->timeTag.tag > timeTag.tag) {
 				timeTag = itemEntry->timeTag;
 				size = itemEntry->size;
+				crc = itemEntry->crc;
 				storages.clear();
 				if (size > 0) {
 					storages.push_back(itemEntry->storage);
@@ -272,7 +336,12 @@ void StorageCMDRangeIndexCheck::_checkItems()
 				if (size != itemEntry->size) {
 					log::Error::L("Item %u/%u has different size on storage %u\n", item->first, _currentRange->rangeID(), 
 						itemEntry->storage->id());
+				} else if (crc && itemEntry->crc && (crc != itemEntry->crc)) { // 0 - the storage doesn't know the checksum
+					log::Error::L("Item %u/%u has different checksum on storage %u\n", item->first, _currentRange->rangeID(), 
+						itemEntry->storage->id());
 				} else {
+					if (!crc)
+						crc = itemEntry->crc;
 					storages.push_back(itemEntry->storage);
 				}
 			}
@@ -283,7 +352,9 @@ void StorageCMDRangeIndexCheck::_checkItems()
 			for (auto itemEntry = item->second.begin();  itemEntry != item->second.end();  itemEntry++) {
 				if (itemEntry->timeTag.tag < timeTag.tag) {
 					syncEntry.header.size = 0;
-					syncEntry.fromServer = 0;
+					syncEntry.fromServer = 0; // nothing is copied, the storage applies it locally
+					syncEntry.ip = 0;
+					syncEntry.port = 0;
 					if (size == 0) { // need delete
 						log::Info::L("Delete Item %u/%u from %u\n", item->first, _currentRange->rangeID(), 
 							itemEntry->storage->id());
@@ -339,27 +410,108 @@ void StorageCMDRangeIndexCheck::_checkItems()
 	}
 }
 
-void StorageCMDRangeIndexCheck::_checkRange()
+bool StorageCMDRangeIndexCheck::_checkRange()
 {
 	bool isReadyToReplication = true;
+	bool isComplete = true;
 	for (auto r = _requests.begin(); r != _requests.end(); r++) {
 		if (r->_event) {
 			_thread->addToDeletedNL(r->_event);
 			r->_event = NULL;
 		}
-		if (r->_storage->isActive() && (r->_status != EStorageAnswerStatus::STORAGE_ANSWER_OK) && 
+		if ((r->_status != EStorageAnswerStatus::STORAGE_ANSWER_OK) && 
 			(r->_status != EStorageAnswerStatus::STORAGE_ANSWER_NOT_FOUND)) {
-			isReadyToReplication = false;
+			isComplete = false;
+			if (r->_storage->isActive())
+				isReadyToReplication = false;
 		}
 	}
-	if (isReadyToReplication) {
-		_checkItems();
-	}
-	else {
+	if (!isReadyToReplication) {
 		log::Warning::L("Range %u not ready to replication\n", _currentRange->rangeID());
+	} else if (_step == STEP_ITEMS) {
+		_checkItems();
+	} else {
+		if (!isComplete || (_requests.size() < _manager->config()->minimumCopies())) {
+			// the digests can't show the missing copies
+			_step = STEP_ITEMS;
+			_isFullCheck = true;
+			return _sendRequests();
+		}
+		if (_compareDigests())
+			return _sendRequests();
 	}
 	_requests.clear();
 	_items.clear();
+	return false;
+}
+
+bool StorageCMDRangeIndexCheck::_isDigestDifferent(const size_t pos)
+{
+	bool isFirst = true;
+	TRangeDigest digest = 0;
+	for (auto r = _requests.begin(); r != _requests.end(); r++) {
+		// a storage without the range has an empty one
+		TRangeDigest storageDigest = (r->_status == EStorageAnswerStatus::STORAGE_ANSWER_OK) ? r->_digests[pos] : 0;
+		if (isFirst) {
+			digest = storageDigest;
+			isFirst = false;
+		} else if (storageDigest != digest)
+			return true;
+	}
+	return false;
+}
+
+bool StorageCMDRangeIndexCheck::_compareDigests()
+{
+	if (_step == STEP_SUBTREES) {
+		_subtrees = 0;
+		for (uint32_t subtree = 0; subtree < RANGE_DIGEST_FANOUT; subtree++) {
+			if (_isDigestDifferent(subtree))
+				_subtrees |= (1 << subtree);
+		}
+		if (!_subtrees)
+			return false;
+		_step = STEP_BUCKETS;
+		return true;
+	}
+	// the buckets come for each different subtree in order
+	bool isDifferent = false;
+	bzero(&_buckets, sizeof(_buckets));
+	size_t pos = 0;
+	for (uint32_t subtree = 0; subtree < RANGE_DIGEST_FANOUT; subtree++) {
+		if (!(_subtrees & (1 << subtree)))
+			continue;
+		for (uint32_t bucket = subtree * RANGE_DIGEST_FANOUT; bucket < (subtree + 1) * RANGE_DIGEST_FANOUT; bucket++) {
+			if (_isDigestDifferent(pos++)) {
+				_buckets[bucket / 8] |= (1 << (bucket % 8));
+				isDifferent = true;
+			}
+		}
+	}
+	if (!isDifferent) // the subtrees have been repaired in the meantime
+		return false;
+	_step = STEP_ITEMS;
+	_isFullCheck = false;
+	return true;
+}
+
+bool StorageCMDRangeIndexCheck::_sendRequests()
+{
+	for (auto r = _requests.begin(); r != _requests.end(); r++) {
+		r->_fromKey = 0;
+		r->_reconnects = 0;
+		r->_digests.clear();
+		r->_event = new StorageCMDEvent(r->_storage, _thread, this);
+		_fillCMD(r->_event, 0);
+		if (r->_event->makeCMD()) {
+			r->_status = EStorageAnswerStatus::STORAGE_NO_ANSWER;
+		} else {
+			_thread->addToDeletedNL(r->_event);
+			r->_event = NULL;
+			r->_status = EStorageAnswerStatus::STORAGE_ANSWER_ERROR;
+		}
+	}
+	return _setOperationTimer();
 }
 
 void StorageCMDRangeIndexCheck::timerCall(class TimerEvent *te)
@@ -370,7 +522,8 @@ void StorageCMDRangeIndexCheck::timerCall(class TimerEvent *te)
 			return;
 		}
 		te->stop();
-		_checkRange();
+		if (_checkRange()) // the next step of the range check has been started
+			return;
 		if (_ranges.empty()) { // ranges check finished
 			while (!_setRecheckTimer()) {
 				log::Fatal::L("Can't reset recheck timer\n");
@@ -454,20 +607,16 @@ bool StorageCMDRangeIndexCheck::start()
 	}
 	_currentRange = _ranges.back();
 	_ranges.pop_back();
+	_step = STEP_SUBTREES;
 	auto storages = _currentRange->storages();
-	for (auto storage = storages.begin(); storage != storages.end(); storage++) {
-		StorageCMDEvent *storageEvent = new StorageCMDEvent(*storage, _thread, this);
-		_fillCMD(storageEvent);
-		EStorageAnswerStatus status =  EStorageAnswerStatus::STORAGE_ANSWER_ERROR;
-		if (storageEvent->makeCMD()) {
-			status = EStorageAnswerStatus::STORAGE_NO_ANSWER;
-		} else {
-			_thread->addToDeletedNL(storageEvent);
-			storageEvent = NULL;
-		}
-		_requests.push_back(StorageRequest(storageEvent, *storage, status));
-	}
-	
+	for (auto storage = storages.begin(); storage != storages.end(); storage++)
+		_requests.push_back(StorageRequest(NULL, *storage, EStorageAnswerStatus::STORAGE_NO_ANSWER));
+	return _sendRequests();
+}
+
+bool StorageCMDRangeIndexCheck::_setOperationTimer()
+{
+	// the storages have this time for each page of the range items
 	static const uint32_t STORAGES_MAXIMUM_WAIT_TIME_SEC_TIME = 5; // 5 seconds	
 	if (!_operationTimer->setTimer(STORAGES_MAXIMUM_WAIT_TIME_SEC_TIME, 0, 0, 0, this))
 		return false;
@@ -619,7 +768,7 @@ void StorageCMDGet::_fillCMD()
 bool StorageCMDGet::start(EPollWorkerThread *thread, StorageCMDGetInterface *interface)
 {
 	for (auto storage = _storages.begin(); storage != _storages.end(); storage++) {
-		_storageEvent = _pool->get(*storage, thread, this);
+		_storageEvent = _pool->get(*storage, thread, this, true);
 		if (_storageEvent)
 			break;
 	}
@@ -710,6 +859,12 @@ bool StorageCMDGet::getNextChunk(EPollWorkerThread *thread)
 	return start(thread, _interface);
 }
 
+void StorageCMDGet::setSentSize(const TItemSize sentSize, StorageCMDGetInterface *interface)
+{
+	_remainingSize = _itemSize - sentSize;
+	_interface = interface;
+}
+
 StorageCMDPut::StorageCMDPut(const ItemHeader &item, class StorageCMDEventPool *pool, File *postTmpFile, 
 	BString &putData)
 	: _item(item), _pool(pool), _interface(NULL), _postTmpFile(postTmpFile), _putData(putData)
@@ -875,31 +1030,50 @@ void StorageCMDPut::repeat(class StorageCMDEvent *ev)
 	}
 }
 
-StorageCMDItemInfo::StorageCMDItemInfo(StorageCMDEventPool *pool, const ItemIndex &item, EPollWorkerThread *thread)
-	: _pool(pool), _item(item), _thread(thread), _interface(NULL), _timer(NULL)
+StorageCMDItemInfo::StorageCMDItemInfo(StorageCMDEventPool *pool, const ItemIndex &item, EPollWorkerThread *thread,
+	const TItemSize firstChunkSize, const TItemModTime ifModifiedSince, const bool acceptGzip)
+	: _pool(pool), _item(item), _thread(thread), _interface(NULL), _timer(NULL), _firstChunkSize(firstChunkSize),
+	_ifModifiedSince(ifModifiedSince), _acceptGzip(acceptGzip), _firstChunkEncoding(ITEM_ENCODING_IDENTITY)
 {
 }
 
-void StorageCMDItemInfo::_fillCMD(StorageCMDEvent *storageEvent)
+void StorageCMDItemInfo::_fillCMD(StorageCMDEvent *storageEvent, const bool withChunk)
 {
 	NetworkBuffer &buffer = storageEvent->networkBuffer();
 	buffer.clear();
 	StorageCmd &storageCmd = *(StorageCmd*)buffer.reserveBuffer(sizeof(StorageCmd));
-	storageCmd.cmd = EStorageCMD::STORAGE_ITEM_INFO;
-	storageCmd.size = sizeof(_item);
-	buffer.add((char*)&_item, sizeof(_item));
+	if (withChunk) {
+		storageCmd.cmd = EStorageCMD::STORAGE_GET_ITEM_INFO_AND_CHUNK;
+		GetItemInfoAndChunkRequest request;
+		request.rangeID = _item.rangeID;
+		request.itemKey = _item.itemKey;
+		request.chunkSize = _firstChunkSize;
+		request.ifModifiedSince = _ifModifiedSince;
+		request.flags = _acceptGzip ? GET_ACCEPT_GZIP : 0;
+		storageCmd.size = sizeof(request);
+		buffer.add((char*)&request, sizeof(request));
+	} else {
+		storageCmd.cmd = EStorageCMD::STORAGE_ITEM_INFO;
+		storageCmd.size = sizeof(_item);
+		buffer.add((char*)&_item, sizeof(_item));
+	}
 }
 
 bool StorageCMDItemInfo::start(const TStorageList &storages, StorageCMDItemInfoInterface *interface)
 {
 	bool haveActiveRequests = false;
+	bool isChunkAsked = false;
 	for (auto storage = storages.begin(); storage != storages.end(); storage++) {
-		auto storageEvent = _pool->get(*storage, _thread, this);
+		auto storageEvent = _pool->get(*storage, _thread, this, true);
 		if (storageEvent) {
-			_fillCMD(storageEvent);
+			// only one storage reads the data, the others just confirm that it has the latest version
+			bool withChunk = _firstChunkSize && !isChunkAsked && (*storage)->isUp();
+			_fillCMD(storageEvent, withChunk);
 			if (storageEvent->makeCMD()) {
-				_requests.push_back(StorageRequest(storageEvent, *storage));
+				_requests.push_back(StorageRequest(storageEvent, *storage, withChunk));
 				haveActiveRequests = true;
+				if (withChunk)
+					isChunkAsked = true;
 				continue;
 			} else {
 				_pool->free(storageEvent);
@@ -956,6 +1130,23 @@ bool StorageCMDItemInfo::getStoragesAndFillItem(ItemInfo &item, TStorageList &st
 		return true;
 }
 
+const BString *StorageCMDItemInfo::firstChunk(const ItemInfo &item)
+{
+	for (auto a = _requests.begin(); a != _requests.end(); a++) {
+		if (!a->_withChunk || (a->_status != EStorageAnswerStatus::STORAGE_ANSWER_OK))
+			continue;
+		if ((a->_item.timeTag.tag != item.timeTag.tag) || (a->_item.size != item.size))
+			return NULL;
+		if (_firstChunkEncoding == ITEM_ENCODING_GZIP) // the whole gzip stream of the item
+			return _firstChunk.size() ? &_firstChunk : NULL;
+		TItemSize chunkSize = (_firstChunkSize < item.size) ? _firstChunkSize : item.size;
+		if ((TItemSize)_firstChunk.size() != chunkSize)
+			return NULL;
+		return &_firstChunk;
+	}
+	return NULL;
+}
+
 TStorageList StorageCMDItemInfo::getPutStorages(const TSize size, const size_t minimumCopies)
 {
 	TStorageList storages;
@@ -994,7 +1185,7 @@ void StorageCMDItemInfo::repeat(class StorageCMDEvent *ev)
 			if (a->_reconnects < MAX_STORAGE_RECONNECTS) {
 				a->_reconnects++;
 				ev->reopen();
-				_fillCMD(ev);
+				_fillCMD(ev, a->_withChunk);
 				if (ev->makeCMD())
 					return;
 			}
@@ -1027,9 +1218,18 @@ void StorageCMDItemInfo::ready(class StorageCMDEvent *ev, const StorageAnswer &s
 		if (a->_event == ev) {
 			if (sa.status == EStorageAnswerStatus::STORAGE_ANSWER_OK) {
 				NetworkBuffer &data = ev->networkBuffer();
-				if ((size_t)data.size() >= (sizeof(StorageAnswer) + sizeof(a->_item))) {
+				static const size_t CHUNK_START = sizeof(StorageAnswer) + sizeof(ItemInfo);
+				// a chunk asked with acceptGzip is preceded by its encoding
+				const size_t minSize = (a->_withChunk && _acceptGzip) ? CHUNK_START + sizeof(TItemEncoding) : CHUNK_START;
+				if ((size_t)data.size() >= minSize) {
 					a->_status = sa.status;
 					memcpy(&a->_item, data.c_str() + sizeof(StorageAnswer), sizeof(a->_item));
+					if (a->_withChunk) {
+						_firstChunkEncoding = _acceptGzip ? *(TItemEncoding*)(data.c_str() + CHUNK_START) 
+							: ITEM_ENCODING_IDENTITY;
+						_firstChunk.clear();
+						_firstChunk.add(data.c_str() + minSize, data.size() - minSize);
+					}
 				} else {
 					log::Error::L("Receive a bad item info answer - the sizes are mismatch\n");
 					a->_status = EStorageAnswerStatus::STORAGE_ANSWER_ERROR;
@@ -1147,7 +1347,7 @@ bool StorageCMDDeleteItem::start(const TStorageList &storages, StorageCMDDeleteI
 {
 	bool haveActiveRequests = false;
 	for (auto storage = storages.begin(); storage != storages.end(); storage++) {
-		auto storageEvent = _pool->get(*storage, thread, this);
+		auto storageEvent = _pool->get(*storage, thread, this, true);
 		if (storageEvent) {
 			_fillCMD(storageEvent);
 			if (storageEvent->makeCMD()) {
@@ -1170,16 +1370,30 @@ StorageCMDEventPool::~StorageCMDEventPool()
 	for (auto storageVector = _freeEvents.begin(); storageVector != _freeEvents.end(); storageVector++)
 		for (auto storage = storageVector->second.begin(); storage != storageVector->second.end(); storage++)
 			delete *storage;
+	for (auto request = _freeRequests.begin(); request != _freeRequests.end(); request++)
+		delete *request;
+	for (auto storageVector = _connections.begin(); storageVector != _connections.end(); storageVector++)
+		for (auto connection = storageVector->second.begin(); connection != storageVector->second.end(); connection++)
+			delete *connection;
 }
 
-StorageCMDEventPool::StorageCMDEventPool(const size_t maxConnectionPerStorage) 
-	: _maxConnectionPerStorage(maxConnectionPerStorage)
+StorageCMDEventPool::StorageCMDEventPool(const size_t maxConnectionPerStorage, const size_t storageConnections)
+	: _maxConnectionPerStorage(maxConnectionPerStorage), _storageConnections(storageConnections)
 {
 
 }
 
 void StorageCMDEventPool::free(StorageCMDEvent *se)
 {
+	if (se->isMultiplexed()) {
+		se->_cancel();
+		if (_freeRequests.size() < MAX_FREE_REQUESTS) {
+			_freeRequests.push_back(se);
+			return;
+		}
+		se->addToDelete();
+		return;
+	}
 	if (se->isCompletedState()) {
 		static TStorageCMDEventVector emptyVector;
 		auto res = _freeEvents.insert(TStorageCMDEventMap::value_type(se->storage()->id(), emptyVector));
@@ -1194,8 +1408,18 @@ void StorageCMDEventPool::free(StorageCMDEvent *se)
 }
 
 StorageCMDEvent *StorageCMDEventPool::get(StorageNode *storageNode, EPollWorkerThread *thread, 
-	BasicStorageCMD *interface)
+	BasicStorageCMD *interface, const bool canMultiplex)
 {
+	if (canMultiplex && _storageConnections) {
+		if (_freeRequests.empty())
+			return new StorageCMDEvent(storageNode, thread, interface, this);
+		auto storageEvent = _freeRequests.back();
+		_freeRequests.pop_back();
+		storageEvent->setWaitState();
+		storageEvent->setStorage(storageNode);
+		storageEvent->set(thread, interface);
+		return storageEvent;
+	}
 	auto f = _freeEvents.find(storageNode->id());
 	if ((f == _freeEvents.end()) || f->second.empty()) {
 		return new StorageCMDEvent(storageNode, thread, interface);
@@ -1208,23 +1432,59 @@ StorageCMDEvent *StorageCMDEventPool::get(StorageNode *storageNode, EPollWorkerT
 	}
 }
 
+StorageConnection *StorageCMDEventPool::connection(StorageNode *storageNode, EPollWorkerThread *thread)
+{
+	auto &connections = _connections[storageNode->id()];
+	StorageConnection *leastLoaded = NULL;
+	for (auto connection = connections.begin(); connection != connections.end(); connection++) {
+		if (!leastLoaded || ((*connection)->activeRequests() < leastLoaded->activeRequests()))
+			leastLoaded = *connection;
+	}
+	// a new connection is opened only when all the existing ones are busy
+	if ((connections.size() < _storageConnections) && (!leastLoaded || leastLoaded->activeRequests())) {
+		leastLoaded = new StorageConnection(storageNode, thread);
+		connections.push_back(leastLoaded);
+	}
+	return leastLoaded;
+}
+
 StorageCMDEvent::StorageCMDEvent(StorageNode *storage, EPollWorkerThread *thread, BasicStorageCMD *interface)
-	: Event(0), _thread(thread), _interface(interface), _storage(storage), _state(WAIT_CONNECTION)
+	: Event(0), _socket(new Socket()), _pool(NULL), _connection(NULL), _requestID(0), _thread(thread),
+		_interface(interface), _storage(storage), _state(WAIT_CONNECTION)
+{
+	_socket->setNonBlockIO();
+	_descr = _socket->descr();
+}
+
+StorageCMDEvent::StorageCMDEvent(StorageNode *storage, EPollWorkerThread *thread, BasicStorageCMD *interface,
+	StorageCMDEventPool *pool)
+	: Event(0), _pool(pool), _connection(NULL), _requestID(0), _thread(thread), _interface(interface),
+		_storage(storage), _state(WAIT_CONNECTION)
 {
-	_socket.setNonBlockIO();
-	_descr = _socket.descr();
 }
 
 StorageCMDEvent::~StorageCMDEvent()
 {
+	_cancel();
+}
 	
+void StorageCMDEvent::_cancel()
+{
+	if (_connection) {
+		_connection->cancel(this);
+		_connection = NULL;
+	}
 }
 
 void StorageCMDEvent::reopen()
 {
-	_socket.reopen();
-	_descr = _socket.descr();
 	_state = WAIT_CONNECTION;
+	if (isMultiplexed()) {
+		_cancel();
+		return;
+	}
+	_socket->reopen();
+	_descr = _socket->descr();
 	_op = EPOLL_CTL_ADD;	
 }
 
@@ -1261,8 +1521,18 @@ bool StorageCMDEvent::_send()
 
 bool StorageCMDEvent::makeCMD()
 {
+	if (isMultiplexed()) {
+		_cancel();
+		_connection = _pool->connection(_storage, _thread);
+		if (!_connection->add(this)) {
+			_connection = NULL;
+			return false;
+		}
+		_state = WAIT_ANSWER;
+		return true;
+	}
 	while (true) {
-		auto res = _socket.connectNonBlock(_storage->ip(), _storage->port());
+		auto res = _socket->connectNonBlock(_storage->ip(), _storage->port());
 		if (res == Socket::CN_ERORR) {
 			log::Warning::L("StorageCMDEvent: Can't connect to %s:%u\n", Socket::ip2String(_storage->ip()).c_str(), 
 				_storage->port());
@@ -1297,11 +1567,16 @@ bool StorageCMDEvent::makeCMD()
 
 void StorageCMDEvent::addToDelete()
 {
+	_cancel();
 	_state = COMPLETED;
 	_thread->addToDeletedNL(this);
 }
 bool StorageCMDEvent::removeFromPoll()
 {
+	if (isMultiplexed()) {
+		_cancel();
+		return true;
+	}
 	if (_op == EPOLL_CTL_ADD)
 		return true;
 	
@@ -1318,6 +1593,17 @@ void StorageCMDEvent::_cmdReady(const StorageAnswer &sa, const char *data)
 {
 	removeFromPoll();
 	_state = COMPLETED;
+	_interface->ready(this, sa);
+}
+
+void StorageCMDEvent::_answerReady(const StorageAnswer &sa, const char *data)
+{
+	// commands find the answer in the network buffer the same way as on their own connection
+	_connection = NULL;
+	_buffer.clear();
+	_buffer.add((char*)&sa, sizeof(sa));
+	_buffer.add(data, sa.size);
+	_state = COMPLETED;
 	_interface->ready(this, sa);	
 }
 
@@ -1376,3 +1662,166 @@ const Event::ECallResult StorageCMDEvent::call(const TEvents events)
 	return SKIP;
 }
 
+StorageConnection::StorageConnection(StorageNode *storage, EPollWorkerThread *thread)
+	: Event(0), _thread(thread), _storage(storage), _state(DISCONNECTED)
+{
+	_socket.setNonBlockIO();
+	_descr = _socket.descr();
+}
+
+StorageConnection::~StorageConnection()
+{
+	for (auto request = _requests.requests().begin(); request != _requests.requests().end(); request++)
+		request->second->_connection = NULL;
+}
+
+void StorageConnection::_reopen()
+{
+	_socket.reopen();
+	_descr = _socket.descr();
+	_op = EPOLL_CTL_ADD;
+}
+
+bool StorageConnection::_connect()
+{
+	while (true) {
+		auto res = _socket.connectNonBlock(_storage->ip(), _storage->port());
+		if (res == Socket::CN_ERORR) {
+			log::Warning::L("StorageConnection: Can't connect to %s:%u\n", Socket::ip2String(_storage->ip()).c_str(),
+				_storage->port());
+			return false;
+		}
+		if (res == Socket::CN_NEED_RESET) {
+			log::Warning::L("StorageConnection: Reset connection to %s:%u\n",
+				Socket::ip2String(_storage->ip()).c_str(), _storage->port());
+			_reopen();
+			continue;
+		}
+		_state = (res == Socket::CN_CONNECTED) ? CONNECTED : WAIT_CONNECTION;
+		return true;
+	}
+	return false;
+}
+
+bool StorageConnection::_updateEvents()
+{
+	TEvents events = E_INPUT | E_ERROR | E_HUP;
+	if ((_state == WAIT_CONNECTION) || (_sendBuffer.sended() < _sendBuffer.size()))
+		events |= E_OUTPUT;
+	if ((events == _events) && (_op != EPOLL_CTL_ADD))
+		return true;
+	_events = events;
+	if (_thread->ctrl(this)) {
+		return true;
+	} else {
+		log::Error::L("StorageConnection: Can't add an event to the event thread %u/%u\n", _state, _op);
+		return false;
+	}
+}
+
+bool StorageConnection::add(StorageCMDEvent *ev)
+{
+	NetworkBuffer &request = ev->networkBuffer();
+	if ((size_t)request.size() < sizeof(StorageCmd)) {
+		log::Error::L("StorageConnection: Receive a request without a command\n");
+		return false;
+	}
+	if ((_state == DISCONNECTED) && !_connect())
+		return false;
+
+	// requests are only queued here and leave together on the next output event
+	ev->_requestID = _requests.add(_sendBuffer, request.c_str(), request.size(), ev);
+	if (!_updateEvents()) {
+		_requests.remove(ev->_requestID, ev);
+		return false;
+	}
+	return true;
+}
+
+void StorageConnection::cancel(StorageCMDEvent *ev)
+{
+	// an answer to a cancelled request is just skipped, when it comes
+	_requests.remove(ev->_requestID, ev);
+}
+
+bool StorageConnection::_send()
+{
+	if (_sendBuffer.sended() >= _sendBuffer.size())
+		return true;
+	auto res = _sendBuffer.send(_descr);
+	if ((res == NetworkBuffer::ERROR) || (res == NetworkBuffer::CONNECTION_CLOSE))
+		return false;
+	if (res == NetworkBuffer::OK)
+		_sendBuffer.clear();
+	return true;
+}
+
+bool StorageConnection::_read()
+{
+	auto res = _readBuffer.read(_descr);
+	if ((res == NetworkBuffer::ERROR) || (res == NetworkBuffer::CONNECTION_CLOSE))
+		return false;
+	else if (res == NetworkBuffer::IN_PROGRESS)
+		return true;
+
+	size_t parsed = _requests.parse(_readBuffer.c_str(), _readBuffer.size(),
+		[](StorageCMDEvent *ev, const StorageAnswer &sa, const char *data) {
+			ev->_answerReady(sa, data);
+		});
+	if (parsed >= (size_t)_readBuffer.size()) {
+		_readBuffer.clear();
+	} else if (parsed > 0) { // keeps the beginning of the next answer
+		BString rest;
+		rest.add(_readBuffer.c_str() + parsed, _readBuffer.size() - parsed);
+		_readBuffer.clear();
+		_readBuffer.add(rest.c_str(), rest.size());
+	}
+	return true;
+}
+
+void StorageConnection::_error()
+{
+	if (!_requests.empty())
+		log::Error::L("Storage %s:%u (%u) dropped connection with %u requests in flight\n",
+			Socket::ip2String(_storage->ip()).c_str(), _storage->port(), _storage->id(), _requests.size());
+	_reopen();
+	_state = DISCONNECTED;
+	_sendBuffer.clear();
+	_readBuffer.clear();
+	TRequestMap requests;
+	_requests.take(requests);
+	for (auto request = requests.begin(); request != requests.end(); request++) {
+		request->second->_connection = NULL;
+		request->second->_interface->repeat(request->second);
+	}
+}
+
+const Event::ECallResult StorageConnection::call(const TEvents events)
+{
+	if (_state == DISCONNECTED)
+		return SKIP;
+
+	if (((events & E_HUP) == E_HUP) || ((events & E_ERROR) == E_ERROR)) {
+		_error();
+		return SKIP;
+	}
+	if ((_state == WAIT_CONNECTION) && (events & E_OUTPUT)) {
+		if (!_connect()) {
+			_error();
+			return SKIP;
+		}
+	}
+	if (_state == CONNECTED) {
+		if ((events & E_INPUT) && !_read()) {
+			_error();
+			return SKIP;
+		}
+		if (!_send()) {
+			_error();
+			return SKIP;
+		}
+	}
+	if (!_updateEvents())
+		_error();
+	return SKIP;
+}
@@ -12,6 +12,7 @@
 // Description: Metis storage communication event class
 ///////////////////////////////////////////////////////////////////////////////
 #include <map>
+#include <memory>
 #include "event_queue.hpp"
 #include "types.hpp"
 #include "cluster_manager.hpp"
@@ -21,6 +22,7 @@
 #include "timer_event.hpp"
 #include "compatibility.hpp"
 #include "index.hpp"
+#include "tagged_requests.hpp"
 
 namespace fl {
 	namespace metis {
@@ -65,6 +67,8 @@ namespace fl {
 
 			bool canFinish();
 			bool getNextChunk(EPollWorkerThread *thread);
+			// the beginning of the item has been already sent, the next chunks go to the interface
+			void setSentSize(const TItemSize sentSize, StorageCMDGetInterface *interface);
 			virtual void ready(class StorageCMDEvent *ev, const StorageAnswer &sa);
 			virtual void repeat(class StorageCMDEvent *ev);
 		private:
@@ -137,12 +141,21 @@ namespace fl {
 		class StorageCMDItemInfo : public BasicStorageCMD, TimerEventInterface
 		{
 		public:
-			StorageCMDItemInfo(StorageCMDEventPool *pool, const ItemIndex &item, EPollWorkerThread *thread);
+			// firstChunkSize - the first up storage also sends this much of the item together with its info,
+			// acceptGzip - a compressed item can come as its whole gzip stream instead of the chunk
+			StorageCMDItemInfo(StorageCMDEventPool *pool, const ItemIndex &item, EPollWorkerThread *thread, 
+				const TItemSize firstChunkSize = 0, const TItemModTime ifModifiedSince = 0, const bool acceptGzip = false);
 			virtual ~StorageCMDItemInfo();
 			bool start(const TStorageList &storages, StorageCMDItemInfoInterface *interface);
 
 			TStorageList getPutStorages(const TSize size, const size_t minimumCopies);
 			bool getStoragesAndFillItem(ItemInfo &item, TStorageList &storageNodes);
+			// returns the first chunk if it has come from a storage with the chosen version of the item
+			const BString *firstChunk(const ItemInfo &item);
+			TItemEncoding firstChunkEncoding() const
+			{
+				return _firstChunkEncoding;
+			}
 			
 			virtual void ready(class StorageCMDEvent *ev, const StorageAnswer &sa) override;
 			virtual void repeat(class StorageCMDEvent *ev) override;
@@ -153,17 +166,22 @@ namespace fl {
 			EPollWorkerThread *_thread;
 			StorageCMDItemInfoInterface *_interface;
 			TimerEvent *_timer;
-			void _fillCMD(class StorageCMDEvent *storageEvent);
+			TItemSize _firstChunkSize;
+			TItemModTime _ifModifiedSince;
+			bool _acceptGzip;
+			TItemEncoding _firstChunkEncoding;
+			BString _firstChunk;
+			void _fillCMD(class StorageCMDEvent *storageEvent, const bool withChunk);
 			void _error(class StorageCMDEvent *ev);
 			struct StorageRequest
 			{
-				StorageRequest(StorageCMDEvent *event, StorageNode *storage)
-					: _status(STORAGE_NO_ANSWER), _event(event), _storage(storage), _reconnects(0)
+				StorageRequest(StorageCMDEvent *event, StorageNode *storage, const bool withChunk = false)
+					: _status(STORAGE_NO_ANSWER), _event(event), _storage(storage), _reconnects(0), _withChunk(withChunk)
 				{
 					bzero(&_item, sizeof(_item));
 				}
 				StorageRequest(const EStorageAnswerStatus status, StorageNode *storage) 
-					: _status(status), _event(NULL), _storage(storage), _reconnects(0)
+					: _status(status), _event(NULL), _storage(storage), _reconnects(0), _withChunk(false)
 				{
 					bzero(&_item, sizeof(_item));
 				}
@@ -172,6 +190,7 @@ namespace fl {
 				StorageCMDEvent *_event;
 				StorageNode *_storage;
 				uint8_t _reconnects;
+				bool _withChunk;
 			};
 			typedef std::vector<StorageRequest> TStorageRequestVector;
 			TStorageRequestVector _requests;
@@ -296,11 +315,18 @@ namespace fl {
 			TServerID managerID() const;
 			TRangeID rangeID() const;
 		private:
-			void _fillCMD(StorageCMDEvent *ev);
+			void _fillCMD(StorageCMDEvent *ev, const TItemKey fromKey);
 			bool _setRecheckTimer();
-			void _checkRange();
+			bool _setOperationTimer();
+			bool _sendRequests();
+			// returns true, when the next step of the range check has been started
+			bool _checkRange();
+			bool _compareDigests();
+			bool _isDigestDifferent(const size_t pos);
 			void _checkItems();
-			bool _parse(class StorageCMDEvent *ev);
+			bool _parse(class StorageCMDEvent *ev, TItemKey &nextKey, bool &isLast);
+			typedef std::vector<TRangeDigest> TRangeDigestVector;
+			bool _parseDigests(class StorageCMDEvent *ev, TRangeDigestVector &digests);
 			class Manager *_manager;
 			EPollWorkerThread *_thread;
 			TimerEvent *_operationTimer;
@@ -308,15 +334,28 @@ namespace fl {
 			StorageCMDSync *_storageCMDSync;
 			TRangePtrVector _ranges;
 			TRangePtr _currentRange;
+			// the storages compare the digest subtrees of a range first, then the buckets of the different subtrees,
+			// and only the items of the different buckets are listed
+			enum ECheckStep
+			{
+				STEP_SUBTREES,
+				STEP_BUCKETS,
+				STEP_ITEMS,
+			};
+			ECheckStep _step;
+			uint16_t _subtrees;
+			bool _isFullCheck;
+			uint8_t _buckets[RANGE_DIGEST_BUCKETS / 8];
 			struct ItemEntry
 			{
-				ItemEntry(StorageNode *storage, const TSize size, const ModTimeTag timeTag)
-					: storage(storage), size(size), timeTag(timeTag)
+				ItemEntry(StorageNode *storage, const TSize size, const ModTimeTag timeTag, const TCrc crc)
+					: storage(storage), size(size), timeTag(timeTag), crc(crc)
 				{
 				}
 				StorageNode *storage;
 				TSize size;
 				ModTimeTag timeTag;
+				TCrc crc;
 			};
 			typedef std::vector<ItemEntry> TItemEntryVector;
 			typedef unordered_map<TItemKey, TItemEntryVector> TItemEntryMap;
@@ -325,13 +364,15 @@ namespace fl {
 			struct StorageRequest
 			{
 				StorageRequest(StorageCMDEvent *event, StorageNode *storage, const EStorageAnswerStatus status)
-					: _status(status), _event(event), _storage(storage), _reconnects(0)
+					: _status(status), _event(event), _storage(storage), _reconnects(0), _fromKey(0)
 				{
 				}
 				EStorageAnswerStatus _status;
 				StorageCMDEvent *_event;
 				StorageNode *_storage;
 				uint8_t _reconnects;
+				TItemKey _fromKey; // the beginning of the page, which is being read
+				TRangeDigestVector _digests;
 			};
 			typedef std::vector<StorageRequest> TStorageRequestVector;
 			TStorageRequestVector _requests;
@@ -342,6 +383,9 @@ namespace fl {
 		{
 		public:
 			StorageCMDEvent(StorageNode *storage, EPollWorkerThread *thread, BasicStorageCMD *interface);
+			// a request without its own socket, it's sent over one of the multiplexed connections of the pool
+			StorageCMDEvent(StorageNode *storage, EPollWorkerThread *thread, BasicStorageCMD *interface, 
+				class StorageCMDEventPool *pool);
 			virtual const ECallResult call(const TEvents events);
 			EPollWorkerThread *thread()
 			{
@@ -376,15 +420,25 @@ namespace fl {
 			void addToDelete();
 			bool makeCMD();
 			void reopen();
+			bool isMultiplexed() const
+			{
+				return _pool != NULL;
+			}
 		private:
 			friend class EPollWorkerThread;
 			friend class StorageCMDEventPool;
+			friend class StorageConnection;
 			virtual ~StorageCMDEvent();
 			bool _send();
 			void _error();
 			bool _read();
 			void _cmdReady(const StorageAnswer &sa, const char *data);
-			Socket _socket;
+			void _answerReady(const StorageAnswer &sa, const char *data);
+			void _cancel();
+			std::unique_ptr<Socket> _socket;
+			class StorageCMDEventPool *_pool;
+			class StorageConnection *_connection;
+			TStorageRequestID _requestID;
 			EPollWorkerThread *_thread;
 			BasicStorageCMD *_interface;
 			NetworkBuffer _buffer;
@@ -400,17 +454,68 @@ namespace fl {
 			EState _state;
 		};
 		
+		// A connection, which carries many tagged requests to a storage at once. Answers are matched to the requests
+		// by their ids, and if the connection breaks all requests in flight are repeated by their commands.
+		class StorageConnection : public Event
+		{
+		public:
+			StorageConnection(StorageNode *storage, EPollWorkerThread *thread);
+			virtual const ECallResult call(const TEvents events);
+			// queues the command from the network buffer of the event
+			bool add(StorageCMDEvent *ev);
+			void cancel(StorageCMDEvent *ev);
+			size_t activeRequests() const
+			{
+				return _requests.size();
+			}
+		private:
+			friend class EPollWorkerThread;
+			friend class StorageCMDEventPool;
+			virtual ~StorageConnection();
+			bool _connect();
+			void _reopen();
+			bool _send();
+			bool _read();
+			void _error();
+			bool _updateEvents();
+			Socket _socket;
+			EPollWorkerThread *_thread;
+			StorageNode *_storage;
+			NetworkBuffer _sendBuffer;
+			NetworkBuffer _readBuffer;
+			typedef TaggedRequests<StorageCMDEvent*> TStorageRequests;
+			typedef TStorageRequests::TRequestMap TRequestMap;
+			TStorageRequests _requests;
+			enum EState : uint8_t
+			{
+				DISCONNECTED,
+				WAIT_CONNECTION,
+				CONNECTED,
+			};
+			EState _state;
+		};
+		
 		class StorageCMDEventPool
 		{
 		public:
-			StorageCMDEventPool(const size_t maxConnectionPerStorage);
-			StorageCMDEvent *get(StorageNode *storageNode, EPollWorkerThread *thread, BasicStorageCMD *interface);
+			StorageCMDEventPool(const size_t maxConnectionPerStorage, const size_t storageConnections = 0);
+			// canMultiplex - the command can be sent over a multiplexed connection, when they are enabled
+			StorageCMDEvent *get(StorageNode *storageNode, EPollWorkerThread *thread, BasicStorageCMD *interface, 
+				const bool canMultiplex = false);
 			void free(StorageCMDEvent *se);			
+			// returns the least loaded multiplexed connection to the storage
+			StorageConnection *connection(StorageNode *storageNode, EPollWorkerThread *thread);
 			~StorageCMDEventPool();
 		private:
+			static const size_t MAX_FREE_REQUESTS = 1024;
 			size_t _maxConnectionPerStorage;
+			size_t _storageConnections;
 			typedef std::map<TServerID, TStorageCMDEventVector> TStorageCMDEventMap;
 			TStorageCMDEventMap _freeEvents;
+			TStorageCMDEventVector _freeRequests;
+			typedef std::vector<StorageConnection*> TStorageConnectionVector;
+			typedef std::map<TServerID, TStorageConnectionVector> TStorageConnectionMap;
+			TStorageConnectionMap _connections;
 		};
 	};
 };
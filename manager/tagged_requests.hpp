@@ -0,0 +1,111 @@
+#pragma once
+#ifndef __FL_METIS_MANAGER_TAGGED_REQUESTS_HPP
+#define	__FL_METIS_MANAGER_TAGGED_REQUESTS_HPP
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Matching of storage answers to tagged requests
+///////////////////////////////////////////////////////////////////////////////
+
+#include "config.h"
+#ifdef HAVE_CXX11
+	#include <unordered_map>
+	using std::unordered_map;
+#else
+	#include <boost/unordered_map.hpp>
+	using boost::unordered_map;
+#endif
+
+#include "bstring.hpp"
+#include "../types.hpp"
+
+namespace fl {
+	namespace metis {
+		using fl::strings::BString;
+
+		// Requests are tagged by ids, which the storage puts after the headers of their answers, so many requests can
+		// share one connection and be answered in any order
+		template <typename TRequest>
+		class TaggedRequests
+		{
+		public:
+			typedef unordered_map<TStorageRequestID, TRequest> TRequestMap;
+			TaggedRequests()
+				: _lastRequestID(0)
+			{
+			}
+			// adds the command from the request data tagged by a new id to the buffer, returns the id
+			TStorageRequestID add(BString &buffer, const char *request, const size_t size, TRequest value)
+			{
+				StorageCmd storageCmd = *(StorageCmd*)request;
+				storageCmd.cmd = (EStorageCMD)(storageCmd.cmd | STORAGE_CMD_REQUEST_ID);
+				TStorageRequestID requestID = ++_lastRequestID;
+				buffer.add((char*)&storageCmd, sizeof(storageCmd));
+				buffer.add((char*)&requestID, sizeof(requestID));
+				buffer.add(request + sizeof(StorageCmd), size - sizeof(StorageCmd));
+				_requests[requestID] = value;
+				return requestID;
+			}
+			// an answer to a removed request is just skipped, when it comes
+			bool remove(const TStorageRequestID requestID, TRequest value)
+			{
+				auto f = _requests.find(requestID);
+				if ((f == _requests.end()) || (f->second != value))
+					return false;
+				_requests.erase(f);
+				return true;
+			}
+			// calls answerReady(request, answer, data) for every complete answer in data, returns the size of the
+			// parsed answers, the rest is the beginning of the next answer
+			template <typename TAnswerReady>
+			size_t parse(const char *data, const size_t size, TAnswerReady answerReady)
+			{
+				static const size_t ANSWER_HEADER_SIZE = sizeof(StorageAnswer) + sizeof(TStorageRequestID);
+				size_t parsed = 0;
+				while (size >= (parsed + ANSWER_HEADER_SIZE)) {
+					const char *answer = data + parsed;
+					StorageAnswer sa = *(StorageAnswer*)answer;
+					if (size < (parsed + ANSWER_HEADER_SIZE + sa.size))
+						break;
+					TStorageRequestID requestID = *(TStorageRequestID*)(answer + sizeof(StorageAnswer));
+					parsed += ANSWER_HEADER_SIZE + sa.size;
+					auto f = _requests.find(requestID);
+					if (f == _requests.end())
+						continue;
+					TRequest value = f->second;
+					_requests.erase(f);
+					answerReady(value, sa, answer + ANSWER_HEADER_SIZE);
+				}
+				return parsed;
+			}
+			// moves all requests in flight to requests, as the connection has been broken
+			void take(TRequestMap &requests)
+			{
+				requests.clear();
+				requests.swap(_requests);
+			}
+			const TRequestMap &requests() const
+			{
+				return _requests;
+			}
+			size_t size() const
+			{
+				return _requests.size();
+			}
+			bool empty() const
+			{
+				return _requests.empty();
+			}
+		private:
+			TRequestMap _requests;
+			TStorageRequestID _lastRequestID;
+		};
+	};
+};
+
+#endif	// __FL_METIS_MANAGER_TAGGED_REQUESTS_HPP
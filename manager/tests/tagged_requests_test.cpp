@@ -0,0 +1,158 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Tagged storage requests unit tests
+///////////////////////////////////////////////////////////////////////////////
+
+#include <boost/test/unit_test.hpp>
+#include <vector>
+#include <string>
+#include "tagged_requests.hpp"
+
+using namespace fl::metis;
+
+BOOST_AUTO_TEST_SUITE( metis )
+
+typedef TaggedRequests<int> TTestRequests;
+
+struct TestAnswer
+{
+	int request;
+	EStorageAnswerStatus status;
+	std::string data;
+};
+typedef std::vector<TestAnswer> TTestAnswerVector;
+
+static void addAnswer(BString &stream, const TStorageRequestID requestID, const std::string &data)
+{
+	StorageAnswer sa;
+	sa.status = STORAGE_ANSWER_OK;
+	sa.size = data.size();
+	stream.add((char*)&sa, sizeof(sa));
+	stream.add((char*)&requestID, sizeof(requestID));
+	stream.add(data.c_str(), data.size());
+}
+
+static size_t parse(TTestRequests &requests, const char *data, const size_t size, TTestAnswerVector &answers)
+{
+	return requests.parse(data, size, [&answers](const int request, const StorageAnswer &sa, const char *data) {
+		TestAnswer answer;
+		answer.request = request;
+		answer.status = sa.status;
+		answer.data.assign(data, sa.size);
+		answers.push_back(answer);
+	});
+}
+
+BOOST_AUTO_TEST_CASE (testTaggedRequestsAdd)
+{
+	const TServerID SERVER_ID = 7;
+	StorageCmd storageCmd;
+	storageCmd.cmd = STORAGE_PING;
+	storageCmd.size = sizeof(SERVER_ID);
+	BString request;
+	request.add((char*)&storageCmd, sizeof(storageCmd));
+	request.add((char*)&SERVER_ID, sizeof(SERVER_ID));
+
+	// every command is tagged by its own id, which follows the header
+	TTestRequests requests;
+	BString buffer;
+	TStorageRequestID firstID = requests.add(buffer, request.c_str(), request.size(), 1);
+	TStorageRequestID secondID = requests.add(buffer, request.c_str(), request.size(), 2);
+	BOOST_CHECK(firstID != secondID);
+	BOOST_CHECK(requests.size() == 2);
+	const size_t TAGGED_SIZE = sizeof(StorageCmd) + sizeof(TStorageRequestID) + sizeof(SERVER_ID);
+	BOOST_REQUIRE((size_t)buffer.size() == TAGGED_SIZE * 2);
+	const char *data = buffer.c_str() + TAGGED_SIZE;
+	const StorageCmd &taggedCmd = *(const StorageCmd*)data;
+	BOOST_CHECK(taggedCmd.cmd == (STORAGE_PING | STORAGE_CMD_REQUEST_ID));
+	BOOST_CHECK(taggedCmd.size == sizeof(SERVER_ID));
+	BOOST_CHECK(*(const TStorageRequestID*)(data + sizeof(StorageCmd)) == secondID);
+	BOOST_CHECK(*(const TServerID*)(data + sizeof(StorageCmd) + sizeof(TStorageRequestID)) == SERVER_ID);
+}
+
+BOOST_AUTO_TEST_CASE (testTaggedRequestsOutOfOrder)
+{
+	StorageCmd storageCmd;
+	storageCmd.cmd = STORAGE_NO_CMD;
+	storageCmd.size = 0;
+	TTestRequests requests;
+	BString buffer;
+	std::vector<TStorageRequestID> ids;
+	for (int i = 0; i < 3; i++)
+		ids.push_back(requests.add(buffer, (char*)&storageCmd, sizeof(storageCmd), i));
+
+	// the answers come in the reverse order and go to their own requests
+	BString stream;
+	addAnswer(stream, ids[2], "third");
+	addAnswer(stream, ids[0], "");
+	addAnswer(stream, ids[1], "second");
+	TTestAnswerVector answers;
+	BOOST_CHECK(parse(requests, stream.c_str(), stream.size(), answers) == (size_t)stream.size());
+	BOOST_REQUIRE(answers.size() == 3);
+	BOOST_CHECK((answers[0].request == 2) && (answers[0].data == "third"));
+	BOOST_CHECK((answers[1].request == 0) && answers[1].data.empty());
+	BOOST_CHECK((answers[2].request == 1) && (answers[2].data == "second"));
+	BOOST_CHECK(answers[2].status == STORAGE_ANSWER_OK);
+	BOOST_CHECK(requests.empty());
+
+	// a repeated answer has no request anymore and is skipped
+	answers.clear();
+	BOOST_CHECK(parse(requests, stream.c_str(), stream.size(), answers) == (size_t)stream.size());
+	BOOST_CHECK(answers.empty());
+}
+
+BOOST_AUTO_TEST_CASE (testTaggedRequestsPartialAnswer)
+{
+	StorageCmd storageCmd;
+	storageCmd.cmd = STORAGE_NO_CMD;
+	storageCmd.size = 0;
+	TTestRequests requests;
+	BString buffer;
+	TStorageRequestID firstID = requests.add(buffer, (char*)&storageCmd, sizeof(storageCmd), 1);
+	TStorageRequestID secondID = requests.add(buffer, (char*)&storageCmd, sizeof(storageCmd), 2);
+	TStorageRequestID cancelledID = requests.add(buffer, (char*)&storageCmd, sizeof(storageCmd), 3);
+	BOOST_CHECK(!requests.remove(cancelledID, 2));
+	BOOST_CHECK(requests.remove(cancelledID, 3));
+
+	BString stream;
+	addAnswer(stream, cancelledID, "cancelled");
+	addAnswer(stream, secondID, "second");
+	const size_t firstSeek = stream.size();
+	addAnswer(stream, firstID, "first");
+
+	// the answers come by parts, an incomplete one is left for the next read
+	TTestAnswerVector answers;
+	BString received;
+	size_t seek = 0;
+	while (seek < (size_t)stream.size()) {
+		size_t readSize = std::min((size_t)5, stream.size() - seek);
+		received.add(stream.c_str() + seek, readSize);
+		seek += readSize;
+		size_t parsed = parse(requests, received.c_str(), received.size(), answers);
+		BString rest;
+		rest.add(received.c_str() + parsed, received.size() - parsed);
+		received.clear();
+		received.add(rest.c_str(), rest.size());
+		if (seek < firstSeek)
+			BOOST_CHECK(answers.empty());
+	}
+	BOOST_CHECK(received.empty());
+	BOOST_REQUIRE(answers.size() == 2);
+	BOOST_CHECK((answers[0].request == 2) && (answers[0].data == "second"));
+	BOOST_CHECK((answers[1].request == 1) && (answers[1].data == "first"));
+
+	// the requests in flight are taken, when the connection breaks
+	requests.add(buffer, (char*)&storageCmd, sizeof(storageCmd), 4);
+	TTestRequests::TRequestMap inFlight;
+	requests.take(inFlight);
+	BOOST_CHECK(requests.empty());
+	BOOST_REQUIRE(inFlight.size() == 1);
+	BOOST_CHECK(inFlight.begin()->second == 4);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -106,11 +106,23 @@ bool ManagerHttpInterface::parseHeader(const char *name, const size_t nameLength
 				_status |= ST_KEEP_ALIVE;
 			else
 				_status &= (~ST_KEEP_ALIVE);
+		} else if (_parseAcceptGzip(name, nameLength, value, valueLen)) {
+			_status |= ST_ACCEPT_GZIP;
 		}
 	}
 	return true;
 }
 
+bool ManagerHttpInterface::_parseAcceptGzip(const char *name, const size_t nameLength, const char *value, 
+	const size_t valueLen)
+{
+	static const char ACCEPT_ENCODING[] = "Accept-Encoding";
+	static const char GZIP[] = "gzip";
+	if ((nameLength != sizeof(ACCEPT_ENCODING) - 1) || strncasecmp(name, ACCEPT_ENCODING, nameLength))
+		return false;
+	return memmem(value, valueLen, GZIP, sizeof(GZIP) - 1) != NULL;
+}
+
 ManagerHttpInterface::EFormResult ManagerHttpInterface::_formNotModified(BString &networkBuffer)
 {
 	auto contentType = MimeType::getMimeTypeStr(_contentType);
@@ -162,8 +174,11 @@ ManagerHttpInterface::EFormResult ManagerHttpInterface::formResult(BString &netw
 	networkBuffer.clear();
 	
 	ManagerHttpThreadSpecificData *threadSpec = (ManagerHttpThreadSpecificData *)http->thread()->threadSpecificData();
+	// the data of the item comes together with its info, so a small item needs only one round trip
+	TItemSize firstChunkSize = isHeadRequest ? 0 : _manager->config()->maxMemmoryChunk();
+	// a compressed item can be sent as it is stored, when the client accepts gzip
 	std::unique_ptr<StorageCMDItemInfo> storageCmd(new StorageCMDItemInfo(&threadSpec->storageCmdEventPool, 
-		_item.index, http->thread()));
+		_item.index, http->thread(), firstChunkSize, _ifModifiedSince, (_status & ST_ACCEPT_GZIP)));
 	
 	if (!storageCmd->start(_range->storages(), this)) {
 		log::Error::L("_formGet: Can't make StorageItemInfo from the pool\n");
@@ -192,7 +207,7 @@ ManagerHttpInterface::EFormResult ManagerHttpInterface::_get(StorageCMDItemInfo
 		log::Error::L("Can't get item info\n");
 		return EFormResult::RESULT_ERROR;
 	}
-	delete _storageCmd;
+	std::unique_ptr<BasicStorageCMD> itemInfoCmd(_storageCmd);
 	_storageCmd = NULL;
 	if (storageNodes.empty()) {
 		_manager->cache().remove(_item.index);
@@ -211,9 +226,51 @@ ManagerHttpInterface::EFormResult ManagerHttpInterface::_get(StorageCMDItemInfo
 			return _keepAliveState();
 		}
 	}
+	const BString *firstChunk = cmd->firstChunk(_item);
+	if (firstChunk) {
+		if (cmd->firstChunkEncoding() == ITEM_ENCODING_GZIP)
+			return _sendGzipItem(*firstChunk);
+		return _sendFirstChunk(*firstChunk, storageNodes);
+	}
 	return _get(storageNodes);
 }
 
+ManagerHttpInterface::EFormResult ManagerHttpInterface::_sendFirstChunk(const BString &chunk, TStorageList &storages)
+{
+	auto networkBuffer = _httpEvent->networkBuffer();
+	networkBuffer->clear();
+	auto contentType = MimeType::getMimeTypeStr(_contentType);
+	HttpAnswer answer(*networkBuffer, _ERROR_STRINGS[ERROR_200_OK], contentType, (_status & ST_KEEP_ALIVE)); 
+	answer.addLastModified(_item.timeTag.modTime);
+	answer.setContentLength(_item.size);
+	networkBuffer->add(chunk.c_str(), chunk.size());
+	if ((TItemSize)chunk.size() == _item.size) {
+		_manager->cache().replaceData(_item, chunk.c_str());
+		return _keepAliveState();
+	}
+	// the rest of the item is read by chunks from the storages with its latest version
+	ManagerHttpThreadSpecificData *threadSpec = (ManagerHttpThreadSpecificData *)_httpEvent->thread()->threadSpecificData();
+	StorageCMDGet *getCmd = new StorageCMDGet(storages, &threadSpec->storageCmdEventPool, _item, 
+		_manager->config()->maxMemmoryChunk());
+	getCmd->setSentSize(chunk.size(), this);
+	_storageCmd = getCmd;
+	return EFormResult::RESULT_OK_PARTIAL_SEND;
+}
+
+ManagerHttpInterface::EFormResult ManagerHttpInterface::_sendGzipItem(const BString &compressed)
+{
+	auto networkBuffer = _httpEvent->networkBuffer();
+	networkBuffer->clear();
+	auto contentType = MimeType::getMimeTypeStr(_contentType);
+	HttpAnswer answer(*networkBuffer, _ERROR_STRINGS[ERROR_200_OK], contentType, (_status & ST_KEEP_ALIVE)); 
+	answer.addLastModified(_item.timeTag.modTime);
+	*networkBuffer << "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n";
+	answer.setContentLength(compressed.size());
+	networkBuffer->add(compressed.c_str(), compressed.size());
+	// the cache keeps items as they are, so the stream isn't cached
+	return _keepAliveState();
+}
+
 void ManagerHttpInterface::itemGetChunkError(class StorageCMDGet *cmd, const bool isSended)
 {
 	if (isSended) { // if data was sent then close connection
@@ -307,7 +364,7 @@ ThreadSpecificData *ManagerHttpThreadSpecificDataFactory::create()
 }
 
 ManagerHttpThreadSpecificData::ManagerHttpThreadSpecificData(class Config *config)
-	: config(config), storageCmdEventPool(config->maxConnectionPerStorage())
+	: config(config), storageCmdEventPool(config->maxConnectionPerStorage(), config->storageConnections())
 {
 }
 
@@ -57,17 +57,21 @@ namespace fl {
 			static const TStatus ST_KEEP_ALIVE = 0x1;
 			static const TStatus ST_HEAD_REQUEST = 0x2;
 			static const TStatus ST_ERROR_NOT_FOUND = 0x4;
+			static const TStatus ST_ACCEPT_GZIP = 0x8;
 			MimeType::EMimeType _contentType;
 			TRangePtr _range;
 			time_t _ifModifiedSince;
 			
 			EFormResult _get(TStorageList &storages);
 			EFormResult _get(StorageCMDItemInfo *cmd);
+			EFormResult _sendFirstChunk(const BString &chunk, TStorageList &storages);
+			EFormResult _sendGzipItem(const BString &compressed);
 			EFormResult _keepAliveState()
 			{
 				return (_status & ST_KEEP_ALIVE) ? EFormResult::RESULT_OK_KEEP_ALIVE : EFormResult::RESULT_OK_CLOSE;
 			}
 			EFormResult _formNotModified(BString &networkBuffer);
+			bool _parseAcceptGzip(const char *name, const size_t nameLength, const char *value, const size_t valueLen);
 		};
 	
 		class ManagerEventFactory : public WorkEventFactory 
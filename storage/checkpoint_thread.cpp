@@ -0,0 +1,40 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Metis' storage index checkpoint thread implementation
+///////////////////////////////////////////////////////////////////////////////
+
+#include <unistd.h>
+#include "checkpoint_thread.hpp"
+#include "../metis_log.hpp"
+#include "storage.hpp"
+
+using namespace fl::metis;
+
+CheckpointThread::CheckpointThread(class Storage *storage, const uint32_t interval)
+	: _storage(storage), _interval(interval)
+{
+	static const uint32_t CHECKPOINT_THREAD_STACK_SIZE = 100000;
+	setStackSize(CHECKPOINT_THREAD_STACK_SIZE);
+	if (!create()) {
+		log::Fatal::L("Can't create a checkpoint thread\n");
+		throw std::exception();
+	}
+}
+
+CheckpointThread::~CheckpointThread()
+{
+}
+
+void CheckpointThread::run()
+{
+	while (true) {
+		sleep(_interval);
+		if (!_storage->checkpoint())
+			log::Error::L("Can't save an index checkpoint\n");
+	}
+}
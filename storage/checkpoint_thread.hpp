@@ -0,0 +1,35 @@
+#pragma once
+#ifndef __FL_METIS_STORAGE_CHECKPOINT_THREAD_HPP
+#define	__FL_METIS_STORAGE_CHECKPOINT_THREAD_HPP
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Metis' storage index checkpoint thread
+///////////////////////////////////////////////////////////////////////////////
+
+#include "../types.hpp"
+#include "thread.hpp"
+
+namespace fl {
+	namespace metis {
+		using fl::threads::Thread;
+		
+		class CheckpointThread : public Thread
+		{
+		public:
+			CheckpointThread(class Storage *storage, const uint32_t interval);
+			virtual ~CheckpointThread();
+		private:
+			virtual void run();
+			class Storage *_storage;
+			uint32_t _interval;
+		};
+	};
+};
+
+#endif	// __FL_METIS_STORAGE_CHECKPOINT_THREAD_HPP
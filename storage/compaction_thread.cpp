@@ -0,0 +1,42 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Metis' storage slice compaction thread implementation
+///////////////////////////////////////////////////////////////////////////////
+
+#include <unistd.h>
+#include "compaction_thread.hpp"
+#include "../metis_log.hpp"
+#include "storage.hpp"
+
+using namespace fl::metis;
+
+CompactionThread::CompactionThread(class Storage *storage, const double minDeadRatio, const uint32_t maxRate)
+	: _storage(storage), _minDeadRatio(minDeadRatio), _maxRate(maxRate)
+{
+	static const uint32_t COMPACTION_THREAD_STACK_SIZE = 100000;
+	setStackSize(COMPACTION_THREAD_STACK_SIZE);
+	if (!create()) {
+		log::Fatal::L("Can't create a compaction thread\n");
+		throw std::exception();
+	}
+}
+
+CompactionThread::~CompactionThread()
+{
+}
+
+void CompactionThread::run()
+{
+	static const uint32_t COMPACTION_CHECK_INTERVAL = 60;
+	// old pointers can still be used by requests, which have found them just before the swap
+	static const uint32_t COMPACTION_GRACE_PERIOD = 10;
+	while (true) {
+		sleep(COMPACTION_CHECK_INTERVAL);
+		while (_storage->compact(_minDeadRatio, _maxRate, COMPACTION_GRACE_PERIOD));
+	}
+}
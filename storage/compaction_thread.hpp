@@ -0,0 +1,36 @@
+#pragma once
+#ifndef __FL_METIS_STORAGE_COMPACTION_THREAD_HPP
+#define	__FL_METIS_STORAGE_COMPACTION_THREAD_HPP
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Metis' storage slice compaction thread
+///////////////////////////////////////////////////////////////////////////////
+
+#include "../types.hpp"
+#include "thread.hpp"
+
+namespace fl {
+	namespace metis {
+		using fl::threads::Thread;
+		
+		class CompactionThread : public Thread
+		{
+		public:
+			CompactionThread(class Storage *storage, const double minDeadRatio, const uint32_t maxRate);
+			virtual ~CompactionThread();
+		private:
+			virtual void run();
+			class Storage *_storage;
+			double _minDeadRatio;
+			uint32_t _maxRate;
+		};
+	};
+};
+
+#endif	// __FL_METIS_STORAGE_COMPACTION_THREAD_HPP
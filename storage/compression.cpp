@@ -0,0 +1,92 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Compression of stored items implementation
+///////////////////////////////////////////////////////////////////////////////
+
+#include <strings.h>
+#include <zlib.h>
+#include "compression.hpp"
+
+using namespace fl::metis;
+using fl::strings::BString;
+
+namespace
+{
+	const int GZIP_WINDOW_BITS = 15 + 16; // the biggest window with a gzip header and trailer
+	const int MEM_LEVEL = 8;
+	const TItemSize PROBE_SIZE = 4096;
+	const double MAX_PROBE_RATIO = 0.9;
+	const TItemSize MIN_SAVING_PART = 8; // the compressed item has to be at least 1/8 smaller
+
+	// deflates into the end of compressed and returns the compressed size, 0 - on errors or if it exceeds maxSize
+	TItemSize deflateData(const char *data, const TItemSize size, const int level, const TItemSize maxSize,
+		BString &compressed)
+	{
+		z_stream stream;
+		bzero(&stream, sizeof(stream));
+		if (deflateInit2(&stream, level, Z_DEFLATED, GZIP_WINDOW_BITS, MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+			return 0;
+		const TItemSize bound = deflateBound(&stream, size);
+		stream.next_in = (Bytef*)data;
+		stream.avail_in = size;
+		stream.next_out = (Bytef*)compressed.reserveBuffer(bound);
+		stream.avail_out = bound;
+		int res = deflate(&stream, Z_FINISH);
+		const TItemSize compressedSize = stream.total_out;
+		deflateEnd(&stream);
+		if ((res != Z_STREAM_END) || (compressedSize > maxSize)) {
+			compressed.trimLast(bound);
+			return 0;
+		}
+		compressed.trimLast(bound - compressedSize);
+		return compressedSize;
+	}
+};
+
+bool fl::metis::storage::gzipCompress(const char *data, const TItemSize size, const int level, BString &compressed)
+{
+	if (size > (PROBE_SIZE * 4)) {
+		BString probe;
+		if (!deflateData(data, PROBE_SIZE, Z_BEST_SPEED, (TItemSize)(PROBE_SIZE * MAX_PROBE_RATIO), probe))
+			return false;
+	}
+	compressed.clear();
+	return deflateData(data, size, level, size - (size / MIN_SAVING_PART), compressed) > 0;
+}
+
+bool fl::metis::storage::gzipUncompress(const char *data, const TItemSize size, const TItemSize originalSize,
+	BString &uncompressed)
+{
+	if ((size < GZIP_SIZE_FIELD) || (gzipOriginalSize(data + size - GZIP_SIZE_FIELD) != originalSize))
+		return false;
+	z_stream stream;
+	bzero(&stream, sizeof(stream));
+	if (inflateInit2(&stream, GZIP_WINDOW_BITS) != Z_OK)
+		return false;
+	const BString::TSize startSize = uncompressed.size();
+	stream.next_in = (Bytef*)data;
+	stream.avail_in = size;
+	// one more byte of the room lets inflate notice the data, which is longer than expected
+	stream.next_out = (Bytef*)uncompressed.reserveBuffer(originalSize + 1);
+	stream.avail_out = originalSize + 1;
+	int res = inflate(&stream, Z_FINISH);
+	const uLong totalOut = stream.total_out;
+	inflateEnd(&stream);
+	if ((res != Z_STREAM_END) || (totalOut != originalSize)) {
+		uncompressed.trimLast(uncompressed.size() - startSize);
+		return false;
+	}
+	uncompressed.trimLast(1);
+	return true;
+}
+
+TItemSize fl::metis::storage::gzipOriginalSize(const char *sizeField)
+{
+	const uint8_t *bytes = (const uint8_t*)sizeField; // little endian
+	return (TItemSize)bytes[0] | ((TItemSize)bytes[1] << 8) | ((TItemSize)bytes[2] << 16) | ((TItemSize)bytes[3] << 24);
+}
@@ -0,0 +1,37 @@
+#pragma once
+#ifndef __FL_METIS_STORAGE_COMPRESSION_HPP
+#define	__FL_METIS_STORAGE_COMPRESSION_HPP
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Compression of stored items
+///////////////////////////////////////////////////////////////////////////////
+
+#include "bstring.hpp"
+#include "../types.hpp"
+
+namespace fl {
+	namespace metis {
+		namespace storage {
+		using fl::strings::BString;
+
+		// Items are compressed into gzip streams, so a manager can send them with Content-Encoding: gzip as they are.
+		// Returns false, when the item isn't worth compressing: the beginning of a big item is probed first, so already
+		// compressed formats like images cost only a small deflate
+		bool gzipCompress(const char *data, const TItemSize size, const int level, BString &compressed);
+		// checks that the stream has exactly originalSize bytes of data, the gzip CRC-32 is checked by zlib on the way
+		bool gzipUncompress(const char *data, const TItemSize size, const TItemSize originalSize, BString &uncompressed);
+		// a gzip stream ends with the original size of the data (modulo 2^32)
+		static const TItemSize GZIP_SIZE_FIELD = 4;
+		TItemSize gzipOriginalSize(const char *sizeField);
+
+		};
+	};
+};
+
+#endif	// __FL_METIS_STORAGE_COMPRESSION_HPP
@@ -20,7 +20,10 @@ using fl::db::ESC;
 Config::Config(int argc, char *argv[])
 	: GlobalConfig(argc, argv), _serverID(0), _status(0), _logLevel(FL_LOG_LEVEL), _cmdTimeout(0), 
 		_workerQueueLength(0), _workers(0),	_bufferSize(0), _maxFreeBuffers(0), _port(0), _storageStatus(0), 
-		_minDiskFree(0), _maxSliceSize(0)
+		_minDiskFree(0), _maxSliceSize(0), _sendFileMinSize(0), 
+		_diskThreads(0), _compactionThreshold(0), _compactionRate(0), 
+		_checkpointInterval(0), _scrubInterval(0), _scrubRate(0), 
+		_syncThreads(0), _syncThreadsPerServer(0)
 {
 	double minDiskFree = DEFAULT_MIN_DISK_FREE;
 	char ch;
@@ -69,8 +72,73 @@ Config::Config(int argc, char *argv[])
 		
 		_minDiskFree = _pt.get<decltype(_minDiskFree)>("metis-storage.minDiskFree", minDiskFree);
 		_maxSliceSize = _pt.get<decltype(_maxSliceSize)>("metis-storage.maxSliceSize", DEFAULT_MAX_SLICE_SIZE);
+		if (_maxSliceSize > MAX_SLICE_SIZE) {
+			printf("maxSliceSize can't be more than %u\n", MAX_SLICE_SIZE);
+			throw std::exception();
+		}
 		
 		_tmpDir = _pt.get<decltype(_tmpDir)>("metis-storage.tmpDir", "/tmp");
+		if (_pt.get<std::string>("metis-storage.directPut", "on") == "on")
+			_status |= ST_DIRECT_PUT;
+		if (_pt.get<std::string>("metis-storage.shardPerCore", "off") == "on")
+			_status |= ST_SHARD_PER_CORE;
+		_sendFileMinSize = _pt.get<decltype(_sendFileMinSize)>("metis-storage.sendFileMinSize", 
+			DEFAULT_SEND_FILE_MIN_SIZE);
+		_diskThreads = _pt.get<decltype(_diskThreads)>("metis-storage.diskThreads", DEFAULT_DISK_THREADS);
+		
+		std::string fsyncPolicy = _pt.get<std::string>("metis-storage.fsync", "none");
+		if (fsyncPolicy == "batch")
+			_storageOptions.fsyncPolicy = FSYNC_BATCH;
+		else if (fsyncPolicy == "interval")
+			_storageOptions.fsyncPolicy = FSYNC_INTERVAL;
+		else if (fsyncPolicy != "none") {
+			printf("Unknown fsync policy %s, it can be none, interval or batch\n", fsyncPolicy.c_str());
+			throw std::exception();
+		}
+		_storageOptions.fsyncInterval = _pt.get<decltype(_storageOptions.fsyncInterval)>("metis-storage.fsyncInterval", 
+			DEFAULT_FSYNC_INTERVAL);
+		if (!_storageOptions.fsyncInterval)
+			_storageOptions.fsyncInterval = DEFAULT_FSYNC_INTERVAL;
+		_storageOptions.writeSlices = _pt.get<decltype(_storageOptions.writeSlices)>("metis-storage.writeSlices", _workers);
+		if (!_storageOptions.writeSlices)
+			_storageOptions.writeSlices = 1;
+		if (shardPerCore()) {
+			if (_storageOptions.writeSlices < _workers)
+				_storageOptions.writeSlices = _workers;
+			_storageOptions.indexShards = _workers;
+		}
+		_storageOptions.punchHoleMinSize = _pt.get<decltype(_storageOptions.punchHoleMinSize)>(
+			"metis-storage.punchHoleMinSize", DEFAULT_PUNCH_HOLE_MIN_SIZE);
+		_storageOptions.indexLoadThreads = _pt.get<decltype(_storageOptions.indexLoadThreads)>(
+			"metis-storage.indexLoadThreads", 0);
+		_storageOptions.objectCacheSize = _pt.get<decltype(_storageOptions.objectCacheSize)>(
+			"metis-storage.objectCacheSize", DEFAULT_OBJECT_CACHE_SIZE);
+		_storageOptions.objectCacheMaxItemSize = _pt.get<decltype(_storageOptions.objectCacheMaxItemSize)>(
+			"metis-storage.objectCacheMaxItemSize", DEFAULT_OBJECT_CACHE_MAX_ITEM_SIZE);
+		_storageOptions.objectCacheMinHits = _pt.get<decltype(_storageOptions.objectCacheMinHits)>(
+			"metis-storage.objectCacheMinHits", DEFAULT_OBJECT_CACHE_MIN_HITS);
+		_storageOptions.compressLevel = _pt.get<decltype(_storageOptions.compressLevel)>(
+			"metis-storage.compressLevel", DEFAULT_COMPRESS_LEVEL);
+		_storageOptions.compressMinSize = _pt.get<decltype(_storageOptions.compressMinSize)>(
+			"metis-storage.compressMinSize", DEFAULT_COMPRESS_MIN_SIZE);
+		_storageOptions.compressMaxSize = _pt.get<decltype(_storageOptions.compressMaxSize)>(
+			"metis-storage.compressMaxSize", DEFAULT_COMPRESS_MAX_SIZE);
+		if (_storageOptions.compressMaxSize > maxMemmoryChunk()) // a chunked item would be uncompressed for every chunk
+			_storageOptions.compressMaxSize = maxMemmoryChunk();
+		_compactionThreshold = _pt.get<decltype(_compactionThreshold)>("metis-storage.compactionThreshold", 
+			DEFAULT_COMPACTION_THRESHOLD);
+		_compactionRate = _pt.get<decltype(_compactionRate)>("metis-storage.compactionRate", DEFAULT_COMPACTION_RATE);
+		_checkpointInterval = _pt.get<decltype(_checkpointInterval)>("metis-storage.checkpointInterval", 
+			DEFAULT_CHECKPOINT_INTERVAL);
+		_scrubInterval = _pt.get<decltype(_scrubInterval)>("metis-storage.scrubInterval", DEFAULT_SCRUB_INTERVAL);
+		_scrubRate = _pt.get<decltype(_scrubRate)>("metis-storage.scrubRate", DEFAULT_SCRUB_RATE);
+		_syncThreads = _pt.get<decltype(_syncThreads)>("metis-storage.syncThreads", DEFAULT_SYNC_THREADS);
+		if (!_syncThreads)
+			_syncThreads = 1;
+		_syncThreadsPerServer = _pt.get<decltype(_syncThreadsPerServer)>("metis-storage.syncThreadsPerServer", 
+			DEFAULT_SYNC_THREADS_PER_SERVER);
+		if (!_syncThreadsPerServer)
+			_syncThreadsPerServer = 1;
 	}
 	catch (ini_parser_error &err)
 	{
@@ -86,7 +154,7 @@ Config::Config(int argc, char *argv[])
 
 void Config::_usage()
 {
-	printf("usage: metis_storage -s serverID -d dataPath [-c configPath] [-m minDiskFree]\n");
+	printf("usage: metis_storage -s serverID -d dataPath[,dataPath...] [-c configPath] [-m minDiskFree]\n");
 }
 
 void Config::_loadFromDB()
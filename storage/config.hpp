@@ -28,6 +28,56 @@ namespace fl {
 				
 		const double DEFAULT_MIN_DISK_FREE = 0.05; // 5%
 		const TSize DEFAULT_MAX_SLICE_SIZE = 1024 * 1024 * 1024; // 1GB
+		const TSize MAX_SLICE_SIZE = 0x7FFFFFFF; // the index keeps item sizes in 31 bits
+		enum EFsyncPolicy : uint8_t
+		{
+			FSYNC_NONE = 0, // data is flushed by the OS
+			FSYNC_INTERVAL, // all slices are flushed every fsyncInterval seconds
+			FSYNC_BATCH, // an add is answered after its batch has been flushed
+		};
+		const uint32_t DEFAULT_FSYNC_INTERVAL = 1;
+		
+		const TItemSize DEFAULT_PUNCH_HOLE_MIN_SIZE = 1024 * 1024; // space of removed items from 1MB is freed at once
+		const uint64_t DEFAULT_OBJECT_CACHE_SIZE = 128 * 1024 * 1024; // 0 - the object cache is disabled
+		const TItemSize DEFAULT_OBJECT_CACHE_MAX_ITEM_SIZE = 16 * 1024;
+		const uint32_t DEFAULT_OBJECT_CACHE_MIN_HITS = 2;
+		const int DEFAULT_COMPRESS_LEVEL = 0; // gzip level of stored items, 0 - items are stored as they are
+		const TItemSize DEFAULT_COMPRESS_MIN_SIZE = 1024;
+		const TItemSize DEFAULT_COMPRESS_MAX_SIZE = DEFAULT_MAX_MEMMORY_CHUNK;
+		
+		struct StorageOptions
+		{
+			StorageOptions()
+				: fsyncPolicy(FSYNC_NONE), fsyncInterval(DEFAULT_FSYNC_INTERVAL), writeSlices(1), 
+					punchHoleMinSize(DEFAULT_PUNCH_HOLE_MIN_SIZE), indexLoadThreads(0), 
+					objectCacheSize(DEFAULT_OBJECT_CACHE_SIZE), objectCacheMaxItemSize(DEFAULT_OBJECT_CACHE_MAX_ITEM_SIZE),
+					objectCacheMinHits(DEFAULT_OBJECT_CACHE_MIN_HITS), compressLevel(DEFAULT_COMPRESS_LEVEL), 
+					compressMinSize(DEFAULT_COMPRESS_MIN_SIZE), compressMaxSize(DEFAULT_COMPRESS_MAX_SIZE), indexShards(1)
+			{
+			}
+			EFsyncPolicy fsyncPolicy;
+			uint32_t fsyncInterval;
+			size_t writeSlices;
+			TItemSize punchHoleMinSize;
+			size_t indexLoadThreads; // 0 - one per CPU
+			uint64_t objectCacheSize;
+			TItemSize objectCacheMaxItemSize;
+			uint32_t objectCacheMinHits; // misses of an object before it's admitted to the cache
+			int compressLevel;
+			TItemSize compressMinSize;
+			TItemSize compressMaxSize; // compressed items are read as a whole, so they have to fit in one memory chunk
+			size_t indexShards; // ranges are spread over the shards of the index by rangeID % indexShards
+		};
+		
+		const size_t DEFAULT_DISK_THREADS = 4; // 0 - slices are read and written synchronously in the network workers
+		const TSize DEFAULT_SEND_FILE_MIN_SIZE = 16 * 1024; // chunks from 16KB are sent by sendfile, 0 - disabled
+		const double DEFAULT_COMPACTION_THRESHOLD = 0; // dead bytes ratio of a slice, 0 - compaction is disabled
+		const uint32_t DEFAULT_COMPACTION_RATE = 20; // MB/s, 0 - unlimited
+		const uint32_t DEFAULT_CHECKPOINT_INTERVAL = 600; // seconds, 0 - index checkpoints are disabled
+		const uint32_t DEFAULT_SCRUB_INTERVAL = 86400; // seconds between scrub passes, 0 - scrubbing is disabled
+		const uint32_t DEFAULT_SCRUB_RATE = 5; // MB/s, 0 - unlimited
+		const size_t DEFAULT_SYNC_THREADS = 4;
+		const size_t DEFAULT_SYNC_THREADS_PER_SERVER = 2; // items synced from one source storage at the same time
 		
 		class Config : public GlobalConfig
 		{
@@ -96,6 +146,57 @@ namespace fl {
 			{
 				return _tmpDir.c_str();
 			}
+			static const TStatus ST_DIRECT_PUT = 0x2;
+			const bool directPut() const
+			{
+				return _status & ST_DIRECT_PUT;
+			}
+			static const TStatus ST_SHARD_PER_CORE = 0x4;
+			// every worker owns the ranges of its index shard and a write slice, and is pinned to a CPU
+			const bool shardPerCore() const
+			{
+				return _status & ST_SHARD_PER_CORE;
+			}
+			TSize sendFileMinSize() const
+			{
+				return _sendFileMinSize;
+			}
+			size_t diskThreads() const
+			{
+				return _diskThreads;
+			}
+			double compactionThreshold() const
+			{
+				return _compactionThreshold;
+			}
+			uint32_t compactionRate() const
+			{
+				return _compactionRate;
+			}
+			uint32_t checkpointInterval() const
+			{
+				return _checkpointInterval;
+			}
+			uint32_t scrubInterval() const
+			{
+				return _scrubInterval;
+			}
+			uint32_t scrubRate() const
+			{
+				return _scrubRate;
+			}
+			size_t syncThreads() const
+			{
+				return _syncThreads;
+			}
+			size_t syncThreadsPerServer() const
+			{
+				return _syncThreadsPerServer;
+			}
+			const StorageOptions &storageOptions() const
+			{
+				return _storageOptions;
+			}
 		private:
 			void _usage();
 			void _loadFromDB();
@@ -123,6 +224,16 @@ namespace fl {
 			TSize _maxSliceSize;
 			
 			std::string _tmpDir;
+			TSize _sendFileMinSize;
+			size_t _diskThreads;
+			double _compactionThreshold;
+			uint32_t _compactionRate;
+			uint32_t _checkpointInterval;
+			uint32_t _scrubInterval;
+			uint32_t _scrubRate;
+			size_t _syncThreads;
+			size_t _syncThreadsPerServer;
+			StorageOptions _storageOptions;
 		};
 	}
 }
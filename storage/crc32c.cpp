@@ -0,0 +1,85 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: CRC32C (Castagnoli) checksums of stored items implementation
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cstring>
+#include "crc32c.hpp"
+#ifdef __x86_64__
+	#include <nmmintrin.h>
+#endif
+
+using namespace fl::metis;
+
+namespace
+{
+	const TCrc CRC32C_POLY = 0x82F63B78; // reversed Castagnoli polynomial
+
+	class SoftwareTable
+	{
+	public:
+		SoftwareTable()
+		{
+			for (uint32_t i = 0; i < 256; i++) {
+				TCrc crc = i;
+				for (int bit = 0; bit < 8; bit++)
+					crc = (crc & 1) ? ((crc >> 1) ^ CRC32C_POLY) : (crc >> 1);
+				_table[i] = crc;
+			}
+		}
+		TCrc update(TCrc crc, const uint8_t *data, size_t size) const
+		{
+			while (size--)
+				crc = _table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+			return crc;
+		}
+	private:
+		TCrc _table[256];
+	};
+
+	TCrc crc32cSoftware(const TCrc crc, const uint8_t *data, const size_t size)
+	{
+		static const SoftwareTable table;
+		return table.update(crc, data, size);
+	}
+
+#ifdef __x86_64__
+	__attribute__((target("sse4.2")))
+	TCrc crc32cHardware(const TCrc crc, const uint8_t *data, size_t size)
+	{
+		uint64_t crc64 = crc;
+		while (size >= sizeof(uint64_t)) {
+			uint64_t value;
+			memcpy(&value, data, sizeof(value));
+			crc64 = _mm_crc32_u64(crc64, value);
+			data += sizeof(value);
+			size -= sizeof(value);
+		}
+		TCrc res = (TCrc)crc64;
+		while (size--)
+			res = _mm_crc32_u8(res, *data++);
+		return res;
+	}
+#endif
+
+	typedef TCrc (*TCrcUpdate)(const TCrc crc, const uint8_t *data, size_t size);
+	TCrcUpdate chooseUpdate()
+	{
+#ifdef __x86_64__
+		if (__builtin_cpu_supports("sse4.2"))
+			return crc32cHardware;
+#endif
+		return crc32cSoftware;
+	}
+};
+
+TCrc fl::metis::storage::crc32c(const TCrc crc, const void *data, const size_t size)
+{
+	static const TCrcUpdate update = chooseUpdate();
+	return ~update(~crc, (const uint8_t*)data, size);
+}
@@ -0,0 +1,30 @@
+#pragma once
+#ifndef __FL_METIS_STORAGE_CRC32C_HPP
+#define	__FL_METIS_STORAGE_CRC32C_HPP
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: CRC32C (Castagnoli) checksums of stored items
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cstddef>
+#include "../types.hpp"
+
+namespace fl {
+	namespace metis {
+		namespace storage {
+
+		// continues the checksum of the previous data, crc32c(crc32c(0, a), b) is the checksum of a and b together;
+		// SSE4.2 crc32 instruction is used, when the CPU supports it
+		TCrc crc32c(const TCrc crc, const void *data, const size_t size);
+
+		};
+	};
+};
+
+#endif	// __FL_METIS_STORAGE_CRC32C_HPP
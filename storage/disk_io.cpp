@@ -0,0 +1,127 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Metis storage disk I/O threads implementation
+///////////////////////////////////////////////////////////////////////////////
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "disk_io.hpp"
+#include "metis_log.hpp"
+
+using namespace fl::metis;
+
+DiskIOCompletion::DiskIOCompletion()
+	: Event(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+{
+	if (_descr < 0) {
+		log::Error::L("Can't create an eventfd of disk I/O completions\n");
+		_descr = fl::events::INVALID_EVENT;
+	}
+	setWaitRead();
+}
+
+DiskIOCompletion::~DiskIOCompletion()
+{
+	if (isValid())
+		close(_descr);
+}
+
+void DiskIOCompletion::add(const TDiskIOTaskPtr &task)
+{
+	std::unique_lock<std::mutex> autoSync(_sync);
+	_finished.push_back(task);
+	autoSync.unlock();
+	uint64_t value = 1;
+	if (write(_descr, &value, sizeof(value)) != sizeof(value))
+		log::Error::L("Can't wake up a network worker of disk I/O completions\n");
+}
+
+const DiskIOCompletion::ECallResult DiskIOCompletion::call(const TEvents events)
+{
+	uint64_t value;
+	if (read(_descr, &value, sizeof(value)) != sizeof(value))
+		return SKIP;
+	std::vector<TDiskIOTaskPtr> finished;
+	std::unique_lock<std::mutex> autoSync(_sync);
+	std::swap(finished, _finished);
+	autoSync.unlock();
+	for (auto task = finished.begin(); task != finished.end(); task++)
+		(*task)->finish();
+	return SKIP;
+}
+
+DiskIO::DiskIOThread::DiskIOThread(DiskIO *diskIO)
+	: _diskIO(diskIO)
+{
+	static const uint32_t DISK_IO_THREAD_STACK_SIZE = 100000;
+	setStackSize(DISK_IO_THREAD_STACK_SIZE);
+	if (!create()) {
+		log::Fatal::L("Can't create a disk I/O thread\n");
+		throw std::exception();
+	}
+}
+
+void DiskIO::DiskIOThread::run()
+{
+	TDiskIOTaskPtr task;
+	while ((task = _diskIO->_get())) {
+		task->process();
+		if (task->completion())
+			task->completion()->add(task);
+		task.reset();
+	}
+	std::lock_guard<std::mutex> autoSync(_diskIO->_sync);
+	_diskIO->_runningThreads--;
+	_diskIO->_cond.notify_all();
+}
+
+DiskIO::DiskIO(const size_t threadsCount)
+	: _isStopped(false), _runningThreads(0)
+{
+	for (size_t i = 0; i < threadsCount; i++) {
+		_threads.push_back(TDiskIOThreadPtr(new DiskIOThread(this)));
+		std::lock_guard<std::mutex> autoSync(_sync);
+		_runningThreads++;
+	}
+	log::Warning::L("Started %zu disk I/O threads\n", threadsCount);
+}
+
+DiskIO::~DiskIO()
+{
+	std::unique_lock<std::mutex> autoSync(_sync);
+	_isStopped = true;
+	_tasks.clear();
+	_cond.notify_all();
+	while (_runningThreads > 0)
+		_cond.wait(autoSync);
+}
+
+bool DiskIO::add(const TDiskIOTaskPtr &task)
+{
+	if (_threads.empty())
+		return false;
+	std::unique_lock<std::mutex> autoSync(_sync);
+	if (_isStopped)
+		return false;
+	_tasks.push_back(task);
+	autoSync.unlock();
+	_cond.notify_one();
+	return true;
+}
+
+TDiskIOTaskPtr DiskIO::_get()
+{
+	std::unique_lock<std::mutex> autoSync(_sync);
+	while (_tasks.empty() && !_isStopped)
+		_cond.wait(autoSync);
+	if (_isStopped)
+		return TDiskIOTaskPtr();
+	auto task = _tasks.front();
+	_tasks.pop_front();
+	return task;
+}
@@ -0,0 +1,97 @@
+#pragma once
+#ifndef __FL_METIS_STORAGE_DISK_IO_HPP
+#define	__FL_METIS_STORAGE_DISK_IO_HPP
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Metis storage disk I/O threads, which take blocking slice reads and writes out of network workers
+///////////////////////////////////////////////////////////////////////////////
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include "thread.hpp"
+#include "event_thread.hpp"
+
+namespace fl {
+	namespace metis {
+		using fl::threads::Thread;
+		using fl::events::Event;
+		using fl::events::EPollWorkerThread;
+		using fl::events::TEvents;
+		
+		class DiskIOTask
+		{
+		public:
+			DiskIOTask(class DiskIOCompletion *completion = NULL)
+				: _completion(completion)
+			{
+			}
+			virtual ~DiskIOTask() {}
+			virtual void process() = 0; // runs in a disk I/O thread
+			virtual void finish() {} // runs in the network worker of the completion, when process has finished
+			class DiskIOCompletion *completion() const
+			{
+				return _completion;
+			}
+		private:
+			class DiskIOCompletion *_completion;
+		};
+		typedef std::shared_ptr<DiskIOTask> TDiskIOTaskPtr;
+		
+		// Processed tasks are handed back to the network worker, which has added them, through an eventfd, so events
+		// of the worker are changed only by the worker itself
+		class DiskIOCompletion : public Event
+		{
+		public:
+			DiskIOCompletion();
+			virtual ~DiskIOCompletion();
+			bool isValid() const
+			{
+				return _descr != fl::events::INVALID_EVENT;
+			}
+			void add(const TDiskIOTaskPtr &task); // is called by disk I/O threads
+			virtual const ECallResult call(const TEvents events);
+		private:
+			std::mutex _sync;
+			std::vector<TDiskIOTaskPtr> _finished;
+		};
+		
+		class DiskIO
+		{
+		public:
+			DiskIO(const size_t threadsCount);
+			~DiskIO(); // waits for the tasks in process, the queued ones are dropped
+			bool add(const TDiskIOTaskPtr &task);
+		private:
+			class DiskIOThread : public Thread
+			{
+			public:
+				DiskIOThread(DiskIO *diskIO);
+			private:
+				virtual void run();
+				DiskIO *_diskIO;
+			};
+			friend class DiskIOThread;
+			TDiskIOTaskPtr _get(); // NULL - the threads are stopped
+			
+			typedef std::deque<TDiskIOTaskPtr> TDiskIOTaskQueue;
+			TDiskIOTaskQueue _tasks;
+			std::mutex _sync;
+			std::condition_variable _cond;
+			bool _isStopped;
+			size_t _runningThreads;
+			typedef std::unique_ptr<DiskIOThread> TDiskIOThreadPtr;
+			std::vector<TDiskIOThreadPtr> _threads;
+		};
+	};
+};
+
+#endif	// __FL_METIS_STORAGE_DISK_IO_HPP
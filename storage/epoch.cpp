@@ -0,0 +1,123 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Epoch based reclamation implementation
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cstdlib>
+#include <limits>
+#include "epoch.hpp"
+#include "mutex.hpp"
+
+using namespace fl::metis::storage;
+using fl::threads::Mutex;
+using fl::threads::AutoMutex;
+
+Epoch::Slot Epoch::_slots[Epoch::MAX_THREADS];
+std::atomic<size_t> Epoch::_slotsCount(0);
+std::atomic<uint64_t> Epoch::_globalEpoch(1);
+std::atomic<uint32_t> Epoch::_overflowReaders(0);
+thread_local Epoch::ThreadState Epoch::_threadState;
+
+struct RetiredData
+{
+	void *data;
+	Epoch::TReclaimFunc reclaimFunc;
+	uint64_t epoch;
+};
+static Mutex retiredSync;
+static std::vector<RetiredData> retiredData;
+
+Epoch::ThreadState::~ThreadState()
+{
+	if (slot < MAX_THREADS)
+		_slots[slot].isUsed.store(false, std::memory_order_release);
+}
+
+size_t Epoch::_registerThread()
+{
+	size_t slotsCount = _slotsCount.load(std::memory_order_acquire);
+	for (size_t slot = 0; slot < slotsCount; slot++) {
+		bool isUsed = false;
+		if (_slots[slot].isUsed.compare_exchange_strong(isUsed, true))
+			return slot;
+	}
+	while (true) {
+		size_t slot = _slotsCount.load();
+		if (slot >= MAX_THREADS) // too many threads, they will hold reclamation while they are reading
+			return MAX_THREADS;
+		bool isUsed = false;
+		if (!_slots[slot].isUsed.compare_exchange_strong(isUsed, true))
+			continue;
+		_slotsCount.compare_exchange_strong(slot, slot + 1);
+		return slot;
+	}
+}
+
+void Epoch::_enter()
+{
+	ThreadState &state = _threadState;
+	if (state.depth++)
+		return;
+	if (state.slot == ThreadState::NO_SLOT)
+		state.slot = _registerThread();
+	if (state.slot < MAX_THREADS)
+		_slots[state.slot].epoch.store(_globalEpoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	else
+		_overflowReaders.fetch_add(1, std::memory_order_relaxed);
+	// the announcement has to be visible before any protected pointer is read
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void Epoch::_leave()
+{
+	ThreadState &state = _threadState;
+	if (--state.depth)
+		return;
+	if (state.slot < MAX_THREADS)
+		_slots[state.slot].epoch.store(0, std::memory_order_release);
+	else
+		_overflowReaders.fetch_sub(1, std::memory_order_release);
+}
+
+void Epoch::retire(void *data, TReclaimFunc reclaimFunc)
+{
+	AutoMutex autoSync(&retiredSync);
+	RetiredData retired = {data, reclaimFunc, _globalEpoch.fetch_add(1)};
+	retiredData.push_back(retired);
+	_reclaimNoLock();
+}
+
+void Epoch::reclaim()
+{
+	AutoMutex autoSync(&retiredSync);
+	_reclaimNoLock();
+}
+
+void Epoch::_reclaimNoLock()
+{
+	if (retiredData.empty())
+		return;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (_overflowReaders.load(std::memory_order_acquire))
+		return;
+	uint64_t minEpoch = std::numeric_limits<uint64_t>::max();
+	size_t slotsCount = _slotsCount.load(std::memory_order_acquire);
+	for (size_t slot = 0; slot < slotsCount; slot++) {
+		uint64_t epoch = _slots[slot].epoch.load(std::memory_order_acquire);
+		if (epoch && (epoch < minEpoch))
+			minEpoch = epoch;
+	}
+	auto last = retiredData.begin();
+	for (auto retired = retiredData.begin(); retired != retiredData.end(); retired++) {
+		if (retired->epoch < minEpoch)
+			retired->reclaimFunc(retired->data);
+		else
+			*last++ = *retired;
+	}
+	retiredData.erase(last, retiredData.end());
+}
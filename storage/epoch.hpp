@@ -0,0 +1,80 @@
+#pragma once
+#ifndef __FL_METIS_STORAGE_EPOCH_HPP
+#define	__FL_METIS_STORAGE_EPOCH_HPP
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Epoch based reclamation of memory read without locks
+///////////////////////////////////////////////////////////////////////////////
+
+#include <atomic>
+#include <cstdlib>
+#include "../types.hpp"
+
+namespace fl {
+	namespace metis {
+		namespace storage {
+
+		// Readers announce the global epoch they started at in their own slot, memory unlinked by a writer is
+		// retired with the current epoch and freed only after all readers, which could still see it, have left
+		class Epoch
+		{
+		public:
+			class Guard
+			{
+			public:
+				Guard()
+				{
+					Epoch::_enter();
+				}
+				~Guard()
+				{
+					Epoch::_leave();
+				}
+			};
+			typedef void (*TReclaimFunc)(void *data);
+			// data must be already unreachable for new readers, it's released by reclaimFunc
+			static void retire(void *data, TReclaimFunc reclaimFunc = ::free);
+			// frees everything retired before the oldest active reader has started
+			static void reclaim();
+		private:
+			static const size_t MAX_THREADS = 1024;
+			struct Slot
+			{
+				std::atomic<uint64_t> epoch;
+				std::atomic<bool> isUsed;
+			} __attribute__((aligned(64)));
+			struct ThreadState
+			{
+				ThreadState()
+					: slot(NO_SLOT), depth(0)
+				{
+				}
+				~ThreadState();
+				static const size_t NO_SLOT = (size_t)-1;
+				size_t slot;
+				uint32_t depth;
+			};
+
+			static void _enter();
+			static void _leave();
+			static size_t _registerThread();
+			static void _reclaimNoLock();
+
+			static Slot _slots[MAX_THREADS];
+			static std::atomic<size_t> _slotsCount;
+			static std::atomic<uint64_t> _globalEpoch;
+			static std::atomic<uint32_t> _overflowReaders;
+			static thread_local ThreadState _threadState;
+		};
+
+		};
+	};
+};
+
+#endif	// __FL_METIS_STORAGE_EPOCH_HPP
@@ -0,0 +1,155 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Storage index checkpoint implementation
+///////////////////////////////////////////////////////////////////////////////
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "index_checkpoint.hpp"
+#include "metis_log.hpp"
+
+using namespace fl::metis;
+
+IndexCheckpoint::IndexCheckpoint(const std::string &fileName)
+	: _fileName(fileName)
+{
+}
+
+bool IndexCheckpoint::save(Index &index, const SliceManager::TIndexPositionVector &positions)
+{
+	std::string tmpFileName = _fileName + ".tmp";
+	File fd;
+	if (!fd.open(tmpFileName.c_str(), O_CREAT | O_WRONLY | O_TRUNC)) {
+		log::Error::L("Can't open index checkpoint %s\n", tmpFileName.c_str());
+		return false;
+	}
+	Index::TRangeVector ranges;
+	index.getRanges(ranges);
+	
+	BString buf;
+	CheckpointHeader header;
+	header.version = CheckpointHeader::CURRENT_VERSION;
+	header.positionsCount = positions.size();
+	header.rangesCount = ranges.size();
+	buf.add((char*)&header, sizeof(header));
+	buf.add((char*)positions.data(), positions.size() * sizeof(SliceManager::IndexPosition));
+	
+	static const size_t MAX_BUFFERED_SIZE = 1024 * 1024;
+	Range::TCheckpointEntryVector entries;
+	uint64_t itemsCount = 0;
+	for (auto range = ranges.begin(); range != ranges.end(); range++) {
+		range->second->getCheckpointEntries(entries);
+		RangeHeader rangeHeader;
+		rangeHeader.rangeID = range->first;
+		rangeHeader.count = entries.size();
+		buf.add((char*)&rangeHeader, sizeof(rangeHeader));
+		buf.add((char*)entries.data(), entries.size() * sizeof(Range::CheckpointEntry));
+		itemsCount += entries.size();
+		if (buf.size() >= MAX_BUFFERED_SIZE) {
+			if (fd.write(buf.c_str(), buf.size()) != (ssize_t)buf.size()) {
+				log::Error::L("Can't write index checkpoint %s\n", tmpFileName.c_str());
+				return false;
+			}
+			buf.clear();
+		}
+	}
+	uint32_t endMarker = END_MARKER;
+	buf.add((char*)&endMarker, sizeof(endMarker));
+	if (fd.write(buf.c_str(), buf.size()) != (ssize_t)buf.size()) {
+		log::Error::L("Can't write index checkpoint %s\n", tmpFileName.c_str());
+		return false;
+	}
+	if (fdatasync(fd.descr())) {
+		log::Error::L("Can't sync index checkpoint %s (%d)\n", tmpFileName.c_str(), errno);
+		return false;
+	}
+	fd.close();
+	if (rename(tmpFileName.c_str(), _fileName.c_str())) {
+		log::Error::L("Can't rename index checkpoint %s (%d)\n", tmpFileName.c_str(), errno);
+		return false;
+	}
+	log::Info::L("Index checkpoint of %u ranges and %llu items has been saved\n", header.rangesCount, 
+		(unsigned long long)itemsCount);
+	return true;
+}
+
+bool IndexCheckpoint::_check(const char *data, const size_t size)
+{
+	if (size < sizeof(CheckpointHeader) + sizeof(END_MARKER))
+		return false;
+	const CheckpointHeader &header = *(const CheckpointHeader*)data;
+	if (header.version != CheckpointHeader::CURRENT_VERSION)
+		return false;
+	size_t seek = sizeof(header) + header.positionsCount * sizeof(SliceManager::IndexPosition);
+	for (uint32_t rangeNum = 0; rangeNum < header.rangesCount; rangeNum++) {
+		if (seek + sizeof(RangeHeader) > size)
+			return false;
+		const RangeHeader &rangeHeader = *(const RangeHeader*)(data + seek);
+		seek += sizeof(rangeHeader) + (size_t)rangeHeader.count * sizeof(Range::CheckpointEntry);
+	}
+	if (seek + sizeof(END_MARKER) != size)
+		return false;
+	return *(const uint32_t*)(data + seek) == END_MARKER;
+}
+
+bool IndexCheckpoint::load(Index &index, SliceManager &sliceManager, SliceManager::TIndexPositionVector &positions)
+{
+	File fd;
+	if (access(_fileName.c_str(), F_OK))
+		return false;
+	if (!fd.open(_fileName.c_str(), O_RDONLY)) {
+		log::Error::L("Can't open index checkpoint %s\n", _fileName.c_str());
+		return false;
+	}
+	size_t size = fd.fileSize();
+	void *checkpointMap = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd.descr(), 0);
+	if (checkpointMap == MAP_FAILED) {
+		log::Error::L("Can't map index checkpoint %s (%d)\n", _fileName.c_str(), errno);
+		return false;
+	}
+	madvise(checkpointMap, size, MADV_SEQUENTIAL);
+	const char *data = (const char*)checkpointMap;
+	if (!_check(data, size)) {
+		log::Error::L("Index checkpoint %s is broken, the full index will be loaded\n", _fileName.c_str());
+		munmap(checkpointMap, size);
+		return false;
+	}
+	
+	const CheckpointHeader &header = *(const CheckpointHeader*)data;
+	const SliceManager::IndexPosition *position = (const SliceManager::IndexPosition*)(data + sizeof(header));
+	std::vector<bool> validSlices;
+	for (uint32_t positionNum = 0; positionNum < header.positionsCount; positionNum++, position++) {
+		if (!sliceManager.isSameIndex(*position))
+			continue;
+		positions.push_back(*position);
+		if (position->sliceID >= validSlices.size())
+			validSlices.resize(position->sliceID + 1, false);
+		validSlices[position->sliceID] = true;
+	}
+	
+	// entries of slices removed after the checkpoint are skipped, their moved copies are in the tails of other slices
+	const char *rangeData = (const char*)position;
+	for (uint32_t rangeNum = 0; rangeNum < header.rangesCount; rangeNum++) {
+		const RangeHeader &rangeHeader = *(const RangeHeader*)rangeData;
+		Range &range = index.getRangeNoLock(rangeHeader.rangeID);
+		const Range::CheckpointEntry *entry = (const Range::CheckpointEntry*)(rangeData + sizeof(rangeHeader));
+		const Range::CheckpointEntry *endEntry = entry + rangeHeader.count;
+		for (; entry < endEntry; entry++) {
+			if ((entry->pointer.sliceID < validSlices.size()) && validSlices[entry->pointer.sliceID])
+				range.addCheckpointEntryNoLock(*entry);
+		}
+		rangeData = (const char*)endEntry;
+	}
+	log::Warning::L("Index checkpoint of %u ranges has been loaded, %u of %u slices are continued from it\n", 
+		header.rangesCount, (uint32_t)positions.size(), header.positionsCount);
+	munmap(checkpointMap, size);
+	return true;
+}
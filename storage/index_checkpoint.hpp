@@ -0,0 +1,49 @@
+#pragma once
+#ifndef __FL_METIS_STORAGE_INDEX_CHECKPOINT_HPP
+#define	__FL_METIS_STORAGE_INDEX_CHECKPOINT_HPP
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Storage index checkpoint, which allows to replay only tails of slice indexes on startup
+///////////////////////////////////////////////////////////////////////////////
+
+#include <string>
+#include "slice.hpp"
+#include "range_index.hpp"
+
+namespace fl {
+	namespace metis {
+		class IndexCheckpoint
+		{
+		public:
+			IndexCheckpoint(const std::string &fileName);
+			bool save(Index &index, const SliceManager::TIndexPositionVector &positions);
+			// loads checkpointed entries of still existing slices and fills positions to continue slice index loading from
+			bool load(Index &index, SliceManager &sliceManager, SliceManager::TIndexPositionVector &positions);
+		private:
+			struct CheckpointHeader
+			{
+				static const uint32_t CURRENT_VERSION = 4;
+				uint32_t version;
+				uint32_t positionsCount;
+				uint32_t rangesCount;
+			} __attribute__((packed));
+			struct RangeHeader
+			{
+				TRangeID rangeID;
+				uint32_t count;
+			} __attribute__((packed));
+			static const uint32_t END_MARKER = 0x4B484345; // "ECHK"
+			
+			bool _check(const char *data, const size_t size);
+			std::string _fileName;
+		};
+	};
+};
+
+#endif	// __FL_METIS_STORAGE_INDEX_CHECKPOINT_HPP
@@ -0,0 +1,323 @@
+#pragma once
+#ifndef __FL_METIS_STORAGE_ITEM_TABLE_HPP
+#define	__FL_METIS_STORAGE_ITEM_TABLE_HPP
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Compact open addressing hash table of range items
+///////////////////////////////////////////////////////////////////////////////
+
+#include <vector>
+#include <utility>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <atomic>
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+#include "../types.hpp"
+#include "epoch.hpp"
+
+namespace fl {
+	namespace metis {
+		namespace storage {
+
+		// Items are kept packed inline in one array, a separate array of control bytes keeps 7 bits of the hash of
+		// every slot, so a group of 16 slots is probed at once without touching the items. Items are never erased.
+		// Both arrays live in one block, which is replaced as a whole on a rehash, so read() can run without locks
+		// against one writer: the old block is freed by Epoch and the caller validates the copied entry.
+		template <typename TEntry>
+		class ItemTable
+		{
+		public:
+			struct Item
+			{
+				Item()
+				{
+				}
+				Item(const TItemKey itemKey, const TEntry &entry)
+					: first(itemKey), second(entry)
+				{
+				}
+				TItemKey first;
+				TEntry second;
+			} __attribute__((packed));
+			typedef Item value_type;
+
+			class iterator
+			{
+			public:
+				iterator(ItemTable *table, const size_t pos)
+					: _table(table), _pos(pos)
+				{
+					_skipEmpty();
+				}
+				Item *operator->() const
+				{
+					return &_table->_writeBlock()->items()[_pos];
+				}
+				Item &operator*() const
+				{
+					return _table->_writeBlock()->items()[_pos];
+				}
+				iterator &operator++()
+				{
+					_pos++;
+					_skipEmpty();
+					return *this;
+				}
+				iterator operator++(int)
+				{
+					iterator prev(*this);
+					++(*this);
+					return prev;
+				}
+				bool operator==(const iterator &other) const
+				{
+					return _pos == other._pos;
+				}
+				bool operator!=(const iterator &other) const
+				{
+					return _pos != other._pos;
+				}
+			private:
+				void _skipEmpty()
+				{
+					const Block *block = _table->_writeBlock();
+					while ((_pos < _capacity(block)) && (block->controls()[_pos] & CONTROL_EMPTY))
+						_pos++;
+				}
+				ItemTable *_table;
+				size_t _pos;
+			};
+			typedef iterator const_iterator;
+
+			ItemTable()
+				: _block(NULL), _size(0)
+			{
+			}
+			~ItemTable()
+			{
+				free(_writeBlock());
+			}
+			ItemTable(const ItemTable &) = delete;
+			ItemTable &operator=(const ItemTable &) = delete;
+			size_t size() const
+			{
+				return _size;
+			}
+			bool empty() const
+			{
+				return _size == 0;
+			}
+			size_t memoryUsage() const
+			{
+				return _blockSize(_capacity(_writeBlock())) + sizeof(*this);
+			}
+			iterator begin() const
+			{
+				return iterator(const_cast<ItemTable*>(this), 0);
+			}
+			iterator end() const
+			{
+				return iterator(const_cast<ItemTable*>(this), _capacity(_writeBlock()));
+			}
+			iterator find(const TItemKey itemKey) const
+			{
+				if (!_size)
+					return end();
+				size_t pos;
+				if (_find(_writeBlock(), itemKey, _hash(itemKey), pos))
+					return iterator(const_cast<ItemTable*>(this), pos);
+				return end();
+			}
+			// can run concurrently with a writer, the entry can be torn and must be validated by the caller
+			bool read(const TItemKey itemKey, TEntry &entry) const
+			{
+				const Block *block = _block.load(std::memory_order_acquire);
+				if (!block)
+					return false;
+				size_t pos;
+				if (!_find(block, itemKey, _hash(itemKey), pos))
+					return false;
+				memcpy(&entry, &block->items()[pos].second, sizeof(entry));
+				return true;
+			}
+			std::pair<iterator, bool> insert(const Item &item)
+			{
+				const uint64_t hash = _hash(item.first);
+				size_t pos;
+				if (_size && _find(_writeBlock(), item.first, hash, pos))
+					return std::pair<iterator, bool>(iterator(this, pos), false);
+				if ((_size + 1) * MAX_LOAD_DIVIDER > _capacity(_writeBlock()) * MAX_LOAD_MULTIPLIER)
+					_grow();
+				pos = _insertNew(_writeBlock(), item, hash);
+				_size++;
+				return std::pair<iterator, bool>(iterator(this, pos), true);
+			}
+			void reserve(const size_t count)
+			{
+				size_t capacity = (count * MAX_LOAD_DIVIDER / MAX_LOAD_MULTIPLIER + GROUP_SIZE) & ~(GROUP_SIZE - 1);
+				if (capacity > _capacity(_writeBlock()))
+					_rehash(capacity);
+			}
+			// drops all items, readers can still be reading the old block
+			void clear()
+			{
+				Block *block = _writeBlock();
+				if (!block)
+					return;
+				_block.store(NULL, std::memory_order_release);
+				Epoch::retire(block);
+				_size = 0;
+			}
+		private:
+			static const uint8_t CONTROL_EMPTY = 0x80;
+			static const size_t GROUP_SIZE = 16;
+			// the table grows when it is 7/8 full
+			static const size_t MAX_LOAD_MULTIPLIER = 7;
+			static const size_t MAX_LOAD_DIVIDER = 8;
+
+			struct Block
+			{
+				size_t capacity;
+				uint8_t *controls()
+				{
+					return reinterpret_cast<uint8_t*>(this + 1);
+				}
+				const uint8_t *controls() const
+				{
+					return reinterpret_cast<const uint8_t*>(this + 1);
+				}
+				Item *items()
+				{
+					return reinterpret_cast<Item*>(controls() + capacity);
+				}
+				const Item *items() const
+				{
+					return reinterpret_cast<const Item*>(controls() + capacity);
+				}
+			};
+			static size_t _blockSize(const size_t capacity)
+			{
+				return capacity ? (sizeof(Block) + capacity * (1 + sizeof(Item))) : 0;
+			}
+			static size_t _capacity(const Block *block)
+			{
+				return block ? block->capacity : 0;
+			}
+			// only the writer, which is serialized by the caller, changes the block pointer
+			Block *_writeBlock() const
+			{
+				return _block.load(std::memory_order_relaxed);
+			}
+			static uint64_t _hash(const TItemKey itemKey)
+			{
+				return (uint64_t)itemKey * 0x9E3779B97F4A7C15ULL;
+			}
+			static uint8_t _control(const uint64_t hash)
+			{
+				return hash >> 57;
+			}
+			static size_t _firstGroup(const Block *block, const uint64_t hash)
+			{
+				// the number of groups isn't a power of two, so the hash is scaled instead of masked
+				return ((hash >> 32) * (block->capacity / GROUP_SIZE)) >> 32;
+			}
+			static size_t _nextGroup(const Block *block, const size_t group)
+			{
+				size_t nextGroup = group + 1;
+				return (nextGroup < (block->capacity / GROUP_SIZE)) ? nextGroup : 0;
+			}
+			static uint32_t _matchMask(const Block *block, const size_t group, const uint8_t control)
+			{
+				const uint8_t *controls = block->controls() + group * GROUP_SIZE;
+#ifdef __SSE2__
+				__m128i groupControls = _mm_loadu_si128((const __m128i*)controls);
+				return _mm_movemask_epi8(_mm_cmpeq_epi8(groupControls, _mm_set1_epi8(control)));
+#else
+				uint32_t mask = 0;
+				for (size_t i = 0; i < GROUP_SIZE; i++) {
+					if (controls[i] == control)
+						mask |= (1 << i);
+				}
+				return mask;
+#endif
+			}
+			static uint32_t _emptyMask(const Block *block, const size_t group)
+			{
+				return _matchMask(block, group, CONTROL_EMPTY);
+			}
+			static bool _find(const Block *block, const TItemKey itemKey, const uint64_t hash, size_t &pos)
+			{
+				const uint8_t control = _control(hash);
+				const size_t firstGroup = _firstGroup(block, hash);
+				size_t group = firstGroup;
+				do {
+					uint32_t mask = _matchMask(block, group, control);
+					while (mask) {
+						size_t slot = group * GROUP_SIZE + __builtin_ctz(mask);
+						if (block->items()[slot].first == itemKey) {
+							pos = slot;
+							return true;
+						}
+						mask &= mask - 1;
+					}
+					if (_emptyMask(block, group))
+						return false;
+					group = _nextGroup(block, group);
+				} while (group != firstGroup); // a concurrent reader can't rely on seeing an empty slot
+				return false;
+			}
+			static size_t _insertNew(Block *block, const Item &item, const uint64_t hash)
+			{
+				size_t group = _firstGroup(block, hash);
+				while (true) {
+					uint32_t mask = _emptyMask(block, group);
+					if (mask) {
+						size_t slot = group * GROUP_SIZE + __builtin_ctz(mask);
+						block->items()[slot] = item;
+						std::atomic_thread_fence(std::memory_order_release);
+						block->controls()[slot] = _control(hash);
+						return slot;
+					}
+					group = _nextGroup(block, group);
+				}
+			}
+			void _grow()
+			{
+				// growing by a half instead of doubling keeps the table from being half empty after a rehash
+				size_t capacity = _capacity(_writeBlock());
+				capacity += capacity / 2;
+				capacity = (capacity + GROUP_SIZE - 1) & ~(GROUP_SIZE - 1);
+				_rehash((capacity > GROUP_SIZE) ? capacity : GROUP_SIZE);
+			}
+			void _rehash(const size_t capacity)
+			{
+				Block *block = static_cast<Block*>(malloc(_blockSize(capacity)));
+				block->capacity = capacity;
+				memset(block->controls(), CONTROL_EMPTY, capacity);
+				Block *oldBlock = _writeBlock();
+				for (size_t pos = 0; pos < _capacity(oldBlock); pos++) {
+					if (!(oldBlock->controls()[pos] & CONTROL_EMPTY))
+						_insertNew(block, oldBlock->items()[pos], _hash(oldBlock->items()[pos].first));
+				}
+				_block.store(block, std::memory_order_release);
+				if (oldBlock)
+					Epoch::retire(oldBlock);
+			}
+			std::atomic<Block*> _block;
+			size_t _size;
+		};
+
+		};
+	};
+};
+
+#endif	// __FL_METIS_STORAGE_ITEM_TABLE_HPP
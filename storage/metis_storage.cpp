@@ -20,6 +20,11 @@
 #include "storage_event.hpp"
 #include "storage.hpp"
 #include "sync_thread.hpp"
+#include "disk_io.hpp"
+#include "shard_queue.hpp"
+#include "compaction_thread.hpp"
+#include "checkpoint_thread.hpp"
+#include "scrub_thread.hpp"
 
 using fl::network::Socket;
 using fl::chrono::Time;
@@ -48,6 +53,11 @@ int main(int argc, char *argv[])
 	std::unique_ptr<Storage> storage;
 	std::unique_ptr<EPollWorkerGroup> workerGroup;
 	std::unique_ptr<SyncThread> syncThread;
+	std::unique_ptr<DiskIO> diskIO;
+	std::unique_ptr<ShardQueues> shardQueues;
+	std::unique_ptr<CompactionThread> compactionThread;
+	std::unique_ptr<CheckpointThread> checkpointThread;
+	std::unique_ptr<ScrubThread> scrubThread;
 	try
 	{
 		config.reset(new Config(argc, argv));
@@ -65,10 +75,29 @@ int main(int argc, char *argv[])
 			EPOLL_WORKER_STACK_SIZE));
 		AcceptThread cmdThread(workerGroup.get(), &config->listenSocket(), factory);
 
-		storage.reset(new Storage(config->dataPath().c_str(), config->minDiskFree(), config->maxSliceSize()));
-		syncThread.reset(new SyncThread(storage.get(), config.get()));
+		storage.reset(new Storage(config->dataPath().c_str(), config->minDiskFree(), config->maxSliceSize(), 
+			config->storageOptions()));
+		syncThread.reset(new SyncThread(storage.get(), config->syncThreads(), config->syncThreadsPerServer(), 
+			config->maxMemmoryChunk()));
 		
-		StorageEvent::setInited(storage.get(), config.get(), syncThread.get());
+		if (config->diskThreads())
+			diskIO.reset(new DiskIO(config->diskThreads()));
+		if (config->shardPerCore()) {
+			shardQueues.reset(new ShardQueues(config->workers()));
+			if (!shardQueues->start(workerGroup.get())) {
+				log::Fatal::L("Can't start the shard per core mode\n");
+				return -1;
+			}
+		}
+		if (config->compactionThreshold() > 0)
+			compactionThread.reset(new CompactionThread(storage.get(), config->compactionThreshold(), 
+				config->compactionRate()));
+		if (config->checkpointInterval())
+			checkpointThread.reset(new CheckpointThread(storage.get(), config->checkpointInterval()));
+		if (config->scrubInterval())
+			scrubThread.reset(new ScrubThread(storage.get(), config->scrubInterval(), config->scrubRate()));
+		
+		StorageEvent::setInited(storage.get(), config.get(), syncThread.get(), diskIO.get(), shardQueues.get());
 		setSignals();
 		workerGroup->waitThreads();
 	}
@@ -0,0 +1,163 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Storage's cache of small hot objects implementation
+///////////////////////////////////////////////////////////////////////////////
+
+#include <strings.h>
+#include "object_cache.hpp"
+
+using namespace fl::metis;
+
+ObjectCache::ObjectCache(const uint64_t maxMemory, const TItemSize maxItemSize, const uint32_t minHits)
+	: _maxShardMemory(maxMemory / SHARDS_COUNT), _maxItemSize(maxItemSize),
+		_minHits((minHits > MAX_FREQUENCY) ? MAX_FREQUENCY : minHits)
+{
+	// about a counter for every 512 bytes of the cache, the size is a power of two to mask the hashes
+	size_t frequenciesSize = 1024;
+	while ((frequenciesSize < (_maxShardMemory / 512)) && (frequenciesSize < (1 << 24)))
+		frequenciesSize *= 2;
+	for (size_t i = 0; i < SHARDS_COUNT; i++)
+		_shards[i].frequencies.resize(frequenciesSize, 0);
+}
+
+uint8_t ObjectCache::_frequency(const Shard &shard, const TKey key)
+{
+	const size_t mask = shard.frequencies.size() - 1;
+	uint8_t first = shard.frequencies[((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask];
+	uint8_t second = shard.frequencies[((key * 0xC2B2AE3D27D4EB4FULL) >> 32) & mask];
+	return (first < second) ? first : second;
+}
+
+void ObjectCache::_incFrequency(Shard &shard, const TKey key)
+{
+	const size_t mask = shard.frequencies.size() - 1;
+	uint8_t &first = shard.frequencies[((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask];
+	uint8_t &second = shard.frequencies[((key * 0xC2B2AE3D27D4EB4FULL) >> 32) & mask];
+	if (first < MAX_FREQUENCY)
+		first++;
+	if (second < MAX_FREQUENCY)
+		second++;
+	// the frequencies are halved from time to time, so objects, which aren't asked anymore, lose their weight
+	if (++shard.increments >= shard.frequencies.size() * 8) {
+		for (auto frequency = shard.frequencies.begin(); frequency != shard.frequencies.end(); frequency++)
+			*frequency /= 2;
+		shard.increments = 0;
+	}
+}
+
+void ObjectCache::_removeNoLock(Shard &shard, TItemHash::iterator item)
+{
+	shard.usedMemory -= item->second.data.size() + ITEM_OVERHEAD;
+	shard.lru.erase(item->second.lruItem);
+	shard.items.erase(item);
+}
+
+bool ObjectCache::get(const TRangeID rangeID, const TItemKey itemKey, const ModTimeTag &timeTag, const TItemSize seek,
+	const TItemSize size, BString &data)
+{
+	const TKey key = _key(rangeID, itemKey);
+	Shard &shard = _shard(key);
+	AutoMutex autoSync(&shard.sync);
+	_incFrequency(shard, key);
+	auto f = shard.items.find(key);
+	if ((f == shard.items.end()) || (f->second.timeTag.tag != timeTag.tag)
+		|| (((uint64_t)seek + size) > f->second.data.size())) {
+		shard.misses++;
+		return false;
+	}
+	shard.hits++;
+	shard.lru.splice(shard.lru.begin(), shard.lru, f->second.lruItem);
+	data.add(f->second.data.c_str() + seek, size);
+	return true;
+}
+
+bool ObjectCache::get(const TRangeID rangeID, const TItemKey itemKey, const ModTimeTag &timeTag, BString &data)
+{
+	const TKey key = _key(rangeID, itemKey);
+	Shard &shard = _shard(key);
+	AutoMutex autoSync(&shard.sync);
+	_incFrequency(shard, key);
+	auto f = shard.items.find(key);
+	if ((f == shard.items.end()) || (f->second.timeTag.tag != timeTag.tag)) {
+		shard.misses++;
+		return false;
+	}
+	shard.hits++;
+	shard.lru.splice(shard.lru.begin(), shard.lru, f->second.lruItem);
+	data.add(f->second.data.c_str(), f->second.data.size());
+	return true;
+}
+
+bool ObjectCache::isWorthCaching(const TRangeID rangeID, const TItemKey itemKey, const TItemSize size)
+{
+	if ((size > _maxItemSize) || ((size + ITEM_OVERHEAD) > _maxShardMemory))
+		return false;
+	const TKey key = _key(rangeID, itemKey);
+	Shard &shard = _shard(key);
+	AutoMutex autoSync(&shard.sync);
+	return _frequency(shard, key) >= _minHits;
+}
+
+void ObjectCache::add(const TRangeID rangeID, const TItemKey itemKey, const ModTimeTag &timeTag, const char *data,
+	const TItemSize size)
+{
+	const uint64_t itemMemory = size + ITEM_OVERHEAD;
+	if ((size > _maxItemSize) || (itemMemory > _maxShardMemory))
+		return;
+	const TKey key = _key(rangeID, itemKey);
+	Shard &shard = _shard(key);
+	AutoMutex autoSync(&shard.sync);
+	auto f = shard.items.find(key);
+	if (f != shard.items.end())
+		_removeNoLock(shard, f);
+	const uint8_t frequency = _frequency(shard, key);
+	if (frequency < _minHits) {
+		shard.rejected++;
+		return;
+	}
+	while ((shard.usedMemory + itemMemory) > _maxShardMemory) {
+		auto victim = shard.items.find(shard.lru.back());
+		if (_frequency(shard, victim->first) > frequency) { // the cache keeps the more popular object
+			shard.rejected++;
+			return;
+		}
+		_removeNoLock(shard, victim);
+	}
+	shard.lru.push_front(key);
+	Item &item = shard.items[key];
+	item.timeTag = timeTag;
+	item.data.assign(data, size);
+	item.lruItem = shard.lru.begin();
+	shard.usedMemory += itemMemory;
+	shard.admitted++;
+}
+
+void ObjectCache::remove(const TRangeID rangeID, const TItemKey itemKey)
+{
+	const TKey key = _key(rangeID, itemKey);
+	Shard &shard = _shard(key);
+	AutoMutex autoSync(&shard.sync);
+	auto f = shard.items.find(key);
+	if (f != shard.items.end())
+		_removeNoLock(shard, f);
+}
+
+void ObjectCache::getStats(ObjectCacheStats &stats)
+{
+	bzero(&stats, sizeof(stats));
+	for (size_t i = 0; i < SHARDS_COUNT; i++) {
+		Shard &shard = _shards[i];
+		AutoMutex autoSync(&shard.sync);
+		stats.hits += shard.hits;
+		stats.misses += shard.misses;
+		stats.admitted += shard.admitted;
+		stats.rejected += shard.rejected;
+		stats.usedMemory += shard.usedMemory;
+		stats.items += shard.items.size();
+	}
+}
@@ -0,0 +1,116 @@
+#pragma once
+#ifndef __FL_METIS_STORAGE_OBJECT_CACHE_HPP
+#define	__FL_METIS_STORAGE_OBJECT_CACHE_HPP
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Storage's cache of small hot objects
+///////////////////////////////////////////////////////////////////////////////
+
+#include "config.h"
+#ifdef HAVE_CXX11
+	#include <unordered_map>
+	using std::unordered_map;
+#else
+	#include <boost/unordered_map.hpp>
+	using boost::unordered_map;
+#endif
+
+#include <list>
+#include <string>
+#include <vector>
+#include <memory>
+#include "mutex.hpp"
+#include "bstring.hpp"
+#include "../types.hpp"
+
+namespace fl {
+	namespace metis {
+		using fl::threads::Mutex;
+		using fl::threads::AutoMutex;
+		using fl::strings::BString;
+
+		struct ObjectCacheStats
+		{
+			uint64_t hits;
+			uint64_t misses;
+			uint64_t admitted;
+			uint64_t rejected;
+			uint64_t usedMemory;
+			uint64_t items;
+		};
+
+		// Objects are cached by rangeID/itemKey together with their time tag, so a stale copy never matches the index.
+		// An object is admitted only after it has been missed minHits times and is asked more often than the least
+		// recently used object, which it would evict. The frequencies are counted in a small aging sketch.
+		class ObjectCache
+		{
+		public:
+			ObjectCache(const uint64_t maxMemory, const TItemSize maxItemSize, const uint32_t minHits);
+			// copies the chunk of a cached object and counts a hit or a miss
+			bool get(const TRangeID rangeID, const TItemKey itemKey, const ModTimeTag &timeTag, const TItemSize seek,
+				const TItemSize size, BString &data);
+			// copies a whole cached object
+			bool get(const TRangeID rangeID, const TItemKey itemKey, const ModTimeTag &timeTag, BString &data);
+			// checks whether a missed object will be admitted, so it's worth reading it as a whole
+			bool isWorthCaching(const TRangeID rangeID, const TItemKey itemKey, const TItemSize size);
+			void add(const TRangeID rangeID, const TItemKey itemKey, const ModTimeTag &timeTag, const char *data,
+				const TItemSize size);
+			void remove(const TRangeID rangeID, const TItemKey itemKey);
+			void getStats(ObjectCacheStats &stats);
+		private:
+			static const size_t SHARDS_COUNT = 16;
+			static const size_t ITEM_OVERHEAD = 96; // the hash node, the list node and the string header
+			static const uint8_t MAX_FREQUENCY = 15;
+			typedef uint64_t TKey;
+			static TKey _key(const TRangeID rangeID, const TItemKey itemKey)
+			{
+				return ((uint64_t)rangeID << 32) | itemKey;
+			}
+			typedef std::list<TKey> TKeyList;
+			struct Item
+			{
+				ModTimeTag timeTag;
+				std::string data;
+				TKeyList::iterator lruItem;
+			};
+			typedef unordered_map<TKey, Item> TItemHash;
+			struct Shard
+			{
+				Shard()
+					: usedMemory(0), increments(0), hits(0), misses(0), admitted(0), rejected(0)
+				{
+				}
+				Mutex sync;
+				TItemHash items;
+				TKeyList lru; // the most recently used objects are in front
+				uint64_t usedMemory;
+				std::vector<uint8_t> frequencies;
+				size_t increments;
+				uint64_t hits;
+				uint64_t misses;
+				uint64_t admitted;
+				uint64_t rejected;
+			};
+			Shard &_shard(const TKey key)
+			{
+				return _shards[(key * 0x9E3779B97F4A7C15ULL) >> 60];
+			}
+			static uint8_t _frequency(const Shard &shard, const TKey key);
+			static void _incFrequency(Shard &shard, const TKey key);
+			static void _removeNoLock(Shard &shard, TItemHash::iterator item);
+			uint64_t _maxShardMemory;
+			TItemSize _maxItemSize;
+			uint32_t _minHits;
+			Shard _shards[SHARDS_COUNT];
+		};
+		typedef std::unique_ptr<ObjectCache> TObjectCachePtr;
+	};
+};
+
+#endif	// __FL_METIS_STORAGE_OBJECT_CACHE_HPP
@@ -0,0 +1,87 @@
+#pragma once
+#ifndef __FL_METIS_STORAGE_RANGE_DIGEST_HPP
+#define	__FL_METIS_STORAGE_RANGE_DIGEST_HPP
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Range digest tree, which is compared by managers instead of the range items
+///////////////////////////////////////////////////////////////////////////////
+
+#include <cstring>
+#include "../types.hpp"
+#include "bstring.hpp"
+
+namespace fl {
+	namespace metis {
+		namespace storage {
+		using fl::strings::BString;
+
+		// The nodes are XORs of item hashes, so an item is added and removed by the same toggle of its bucket,
+		// subtree and root without rereading the range
+		class RangeDigest
+		{
+		public:
+			RangeDigest()
+			{
+				bzero(&_nodes, sizeof(_nodes));
+			}
+			void toggle(const TItemKey itemKey, const TSize size, const ModTimeTag &timeTag, const TCrc crc)
+			{
+				const TRangeDigest hash = _hash(itemKey, size, timeTag, crc);
+				const uint32_t bucket = rangeDigestBucket(itemKey);
+				_nodes[0] ^= hash;
+				_nodes[1 + bucket / RANGE_DIGEST_FANOUT] ^= hash;
+				_nodes[BUCKETS_START + bucket] ^= hash;
+			}
+			TRangeDigest root() const
+			{
+				return _nodes[0];
+			}
+			TRangeDigest subtree(const uint32_t subtree) const
+			{
+				return _nodes[1 + subtree];
+			}
+			TRangeDigest bucket(const uint32_t bucket) const
+			{
+				return _nodes[BUCKETS_START + bucket];
+			}
+			// adds the digests of the root subtrees or of the buckets of the subtrees as RangeDigestRequest describes
+			void get(const uint16_t subtrees, BString &data) const
+			{
+				if (!subtrees) {
+					data.add((char*)&_nodes[1], sizeof(TRangeDigest) * RANGE_DIGEST_FANOUT);
+					return;
+				}
+				for (uint32_t subtree = 0; subtree < RANGE_DIGEST_FANOUT; subtree++) {
+					if (subtrees & (1 << subtree))
+						data.add((char*)&_nodes[BUCKETS_START + subtree * RANGE_DIGEST_FANOUT],
+							sizeof(TRangeDigest) * RANGE_DIGEST_FANOUT);
+				}
+			}
+		private:
+			static const uint32_t BUCKETS_START = 1 + RANGE_DIGEST_FANOUT;
+			static uint64_t _mix(uint64_t value) // splitmix64 finalizer
+			{
+				value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+				value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+				return value ^ (value >> 31);
+			}
+			// the checksum is unknown (0) for items written before checksums, so such copies match the others
+			static TRangeDigest _hash(const TItemKey itemKey, const TSize size, const ModTimeTag &timeTag, const TCrc crc)
+			{
+				TRangeDigest hash = _mix(_mix(((uint64_t)itemKey << 32) | size) ^ timeTag.tag);
+				return crc ? _mix(hash ^ crc) : hash;
+			}
+			TRangeDigest _nodes[BUCKETS_START + RANGE_DIGEST_BUCKETS];
+		};
+
+		};
+	};
+};
+
+#endif	// __FL_METIS_STORAGE_RANGE_DIGEST_HPP
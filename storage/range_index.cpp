@@ -9,6 +9,8 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #include <limits>
+#include <algorithm>
+#include <sched.h>
 #include "range_index.hpp"
 #include "bstring.hpp"
 
@@ -16,27 +18,94 @@ using namespace fl::metis;
 using namespace fl::metis::storage;
 
 Range::Range()
-	: _minID(std::numeric_limits<decltype(_minID)>::max()), _maxID(0)
+	: _minID(std::numeric_limits<decltype(_minID)>::max()), _maxID(0), _version(0)
 {
 }
 
-bool Range::getItems(const TRangeID rangeID, BString &data)
+bool Range::getItems(const RangeItemsRequest &request, BString &data)
 {
-	AutoMutex autoSync(&_sync);
-	RangeItemsHeader &header = *(RangeItemsHeader*)data.reserveBuffer(sizeof(RangeItemsHeader));
-	header.rangeID = rangeID;
-	header.count = _items.size();
+	const uint32_t maxCount = ((request.maxCount == 0) || (request.maxCount > MAX_ITEMS_PAGE)) ? MAX_ITEMS_PAGE 
+		: request.maxCount;
+	// the items are walked in the order of keys from fromKey, so only a page is passed under the lock
+	std::vector<RangeItemEntry> page;
+	page.reserve(maxCount);
+	bool hasMore = false;
 	RangeItemEntry itemEntry;
-	for (auto item = _items.begin(); item != _items.end(); item++) {
-		itemEntry.itemKey = item->first;
-		itemEntry.size = item->second.size;
-		itemEntry.timeTag = item->second.timeTag;
+	AutoMutex autoSync(&_sync);
+	_items.forEachFrom(request.fromKey, [&](const TItemKey itemKey, const Entry &entry) {
+		if (entry.isCorrupted())
+			return true;
+		if ((request.flags & RANGE_ITEMS_BUCKETS) && !request.hasBucket(rangeDigestBucket(itemKey)))
+			return true;
+		if (request.changedSince.tag && (entry.timeTag <= request.changedSince))
+			return true;
+		if (page.size() == maxCount) {
+			hasMore = true;
+			return false;
+		}
+		itemEntry.itemKey = itemKey;
+		itemEntry.size = entry.size;
+		itemEntry.timeTag = entry.timeTag;
+		itemEntry.crc = entry.crc;
+		page.push_back(itemEntry);
+		return true;
+	});
+	autoSync.unLock();
+	
+	RangeItemsHeader header;
+	header.rangeID = request.rangeID;
+	header.count = page.size();
+	header.nextKey = 0;
+	header.flags = 0;
+	if (hasMore && (page.back().itemKey < std::numeric_limits<TItemKey>::max()))
+		header.nextKey = page.back().itemKey + 1;
+	else
+		header.flags |= RANGE_ITEMS_LAST;
+	data.add((char*)&header, sizeof(header));
+	if (!page.empty())
+		data.add((char*)&page[0], sizeof(RangeItemEntry) * page.size());
+	return true;
+}
+
+bool Range::getItems(const RangeItemsRequestV1 &request, BString &data)
+{
+	AutoMutex autoSync(&_sync);
+	const size_t headerSeek = data.size();
+	data.reserveBuffer(sizeof(RangeItemsHeaderV1));
+	uint32_t count = 0;
+	RangeItemEntryV1 itemEntry;
+	_items.forEachFrom(0, [&](const TItemKey itemKey, const Entry &entry) {
+		if (entry.isCorrupted())
+			return true;
+		itemEntry.itemKey = itemKey;
+		itemEntry.size = entry.size;
+		itemEntry.timeTag = entry.timeTag;
 		data.add((char*)&itemEntry, sizeof(itemEntry));
-	}
+		count++;
+		return true;
+	});
+	RangeItemsHeaderV1 &header = *(RangeItemsHeaderV1*)(data.c_str() + headerSeek);
+	header.rangeID = request.rangeID;
+	header.count = count;
 	return true;
 }
 
-bool Range::remove(const ItemHeader &itemHeader)
+void Range::getDigest(const RangeDigestRequest &request, BString &data)
+{
+	RangeDigestHeader header;
+	header.rangeID = request.rangeID;
+	header.subtrees = request.subtrees;
+	data.add((char*)&header, sizeof(header));
+	AutoMutex autoSync(&_sync);
+	_digest.get(request.subtrees, data);
+}
+
+static inline bool isSamePointer(const ItemPointer &first, const ItemPointer &second)
+{
+	return (first.sliceID == second.sliceID) && (first.seek == second.seek);
+}
+
+bool Range::remove(const ItemHeader &itemHeader, const ItemPointer *pointer)
 {
 	const TItemKey itemKey = itemHeader.itemKey;
 	if ((itemKey < _minID) || (itemKey > _maxID))
@@ -45,93 +114,412 @@ bool Range::remove(const ItemHeader &itemHeader)
 	auto f = _items.find(itemKey);
 	if (f == _items.end())
 		return false;
-	if (f->second.timeTag <= itemHeader.timeTag)
+	if (pointer && !isSamePointer(f->second.pointer, *pointer)) // the item has been moved by compaction
+		return false;
+	if (f->second.timeTag <= itemHeader.timeTag) {
+		WriteSection writeSection(this);
+		_toggleDigest(itemKey, f->second);
 		f->second.size = 0;
+		f->second.crc = 0;
+		f->second.compressed = 0;
+	}
 	return true;
 }
 
-bool Range::find(const TItemKey itemKey, Entry &ie)
+bool Range::replacePointer(const TItemKey itemKey, const ItemPointer &oldPointer, const ItemPointer &newPointer, 
+	const bool isTombstone)
 {
-	if ((itemKey < _minID) || (itemKey > _maxID))
-		return false;
 	AutoMutex autoSync(&_sync);
 	auto f = _items.find(itemKey);
 	if (f == _items.end())
 		return false;
-	ie = f->second;
+	if (!isSamePointer(f->second.pointer, oldPointer) || ((f->second.size == 0) != isTombstone))
+		return false;
+	WriteSection writeSection(this);
+	Entry entry = f->second;
+	entry.pointer = newPointer;
+	_replaceEntry(itemKey, f->second, entry);
 	return true;
 }
 
-void Range::addNoLock(const IndexEntry &ie)
+void Range::addLiveSizes(TLiveSizeVector &liveSizes)
+{
+	AutoMutex autoSync(&_sync);
+	for (auto item = _items.begin(); item != _items.end(); item++) {
+		const Entry &entry = item->second;
+		if ((entry.size == 0) || entry.isCorrupted())
+			continue;
+		if (entry.pointer.sliceID >= liveSizes.size())
+			liveSizes.resize(entry.pointer.sliceID + 1);
+		LiveSize &liveSize = liveSizes[entry.pointer.sliceID];
+		liveSize.size += entry.size; // the original size of a compressed item only delays the compaction a bit
+		liveSize.items++;
+	}
+}
+
+void Range::getTombstones(const TRangeID rangeID, const TSliceID sliceID, TIndexEntryVector &tombstones)
+{
+	AutoMutex autoSync(&_sync);
+	IndexEntry ie;
+	bzero(&ie, sizeof(ie));
+	ie.header.status = ST_ITEM_DELETED;
+	ie.header.rangeID = rangeID;
+	for (auto item = _items.begin(); item != _items.end(); item++) {
+		const Entry &entry = item->second;
+		if ((entry.size != 0) || (entry.pointer.sliceID != sliceID))
+			continue;
+		ie.header.itemKey = item->first;
+		ie.header.timeTag = entry.timeTag;
+		ie.pointer = entry.pointer;
+		tombstones.push_back(ie);
+	}
+}
+
+bool Range::find(const TItemKey itemKey, Entry &ie)
+{
+	Epoch::Guard guard;
+	while (true) {
+		uint32_t version = _version.load(std::memory_order_acquire);
+		if (version & 1) { // a writer is changing the items
+			sched_yield();
+			continue;
+		}
+		bool isFound = (itemKey >= _minID) && (itemKey <= _maxID) && _items.read(itemKey, ie);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (_version.load(std::memory_order_relaxed) == version)
+			return isFound;
+	}
+}
+
+bool Range::_isReplacing(const Entry &curEntry, const Entry &entry)
+{
+	if (entry.size == 0) // tombstone
+		return curEntry.timeTag <= entry.timeTag;
+	// the same version can be copied again from another storage after the scrubber has marked it
+	if (entry.isCorrupted() && !curEntry.isCorrupted() && (curEntry.timeTag.tag == entry.timeTag.tag) 
+		&& (curEntry.pointer.sliceID != entry.pointer.sliceID))
+		return false;
+	// a tombstone wins over an item with the same time tag, so a compacted copy of a deleted item can't revive it
+	bool isNewer = !(entry.timeTag <= curEntry.timeTag);
+	return isNewer || ((curEntry.timeTag.tag == entry.timeTag.tag) && (curEntry.size != 0));
+}
+
+void Range::getCheckpointEntries(TCheckpointEntryVector &entries)
+{
+	AutoMutex autoSync(&_sync);
+	entries.resize(_items.size());
+	auto checkpointEntry = entries.begin();
+	for (auto item = _items.begin(); item != _items.end(); item++, checkpointEntry++) {
+		checkpointEntry->itemKey = item->first;
+		checkpointEntry->pointer = item->second.pointer;
+		checkpointEntry->size = item->second.size;
+		checkpointEntry->timeTag = item->second.timeTag;
+		checkpointEntry->crc = item->second.crc;
+		checkpointEntry->status = item->second.isCompressed() ? ST_ITEM_COMPRESSED : 0;
+	}
+	autoSync.unLock();
+	std::sort(entries.begin(), entries.end(), [](const CheckpointEntry &a, const CheckpointEntry &b) {
+		return a.itemKey < b.itemKey;
+	});
+}
+
+void Range::addCheckpointEntryNoLock(const CheckpointEntry &checkpointEntry)
+{
+	const TItemKey itemKey = checkpointEntry.itemKey;
+	WriteSection writeSection(this);
+	_updateBounds(itemKey);
+	Entry entry;
+	entry.pointer = checkpointEntry.pointer;
+	entry.size = checkpointEntry.size;
+	entry.timeTag = checkpointEntry.timeTag;
+	entry.crc = checkpointEntry.crc;
+	entry.compressed = (checkpointEntry.status & ST_ITEM_COMPRESSED) != 0;
+	auto res = _items.insert(TItemHash::value_type(itemKey, entry));
+	if (res.second)
+		_toggleDigest(itemKey, entry);
+	else if (_isReplacing(res.first->second, entry))
+		_replaceEntry(itemKey, res.first->second, entry);
+}
+
+bool Range::addNoLock(const IndexEntry &ie, Entry &deadEntry)
 {
 	const TItemKey itemKey = ie.header.itemKey;
-	if (_minID > itemKey)
-		_minID = itemKey;
-	if (_maxID < itemKey)
-		_maxID = itemKey;
+	WriteSection writeSection(this);
+	_updateBounds(itemKey);
 	
 	Entry entry(ie);
+	deadEntry.size = 0;
 	auto res = _items.insert(TItemHash::value_type(itemKey, entry));
-	if (!res.second) {
-		if (res.first->second.timeTag <= entry.timeTag)
-			res.first->second = entry;
+	if (res.second)
+		_toggleDigest(itemKey, entry);
+	else {
+		Entry &curEntry = res.first->second;
+		if (_isReplacing(curEntry, entry)) {
+			deadEntry = curEntry;
+			_replaceEntry(itemKey, curEntry, entry);
+		} else {
+			deadEntry = entry;
+			return false;
+		}
 	}
+	return true;
 }
 
-bool Index::remove(const ItemHeader &itemHeader)
+void Range::mergeNoLock(const Range &range)
 {
-	AutoMutex autoSync(&_sync);
-	auto f = _ranges.find(itemHeader.rangeID);
-	if (f == _ranges.end())
+	WriteSection writeSection(this);
+	if (_minID > range._minID)
+		_minID = range._minID;
+	if (_maxID < range._maxID)
+		_maxID = range._maxID;
+	for (auto item = range._items.begin(); item != range._items.end(); item++) {
+		auto res = _items.insert(TItemHash::value_type(item->first, item->second));
+		if (res.second)
+			_toggleDigest(item->first, item->second);
+		else if (_isReplacing(res.first->second, item->second))
+			_replaceEntry(item->first, res.first->second, item->second);
+	}
+}
+
+void Range::addTombstoneNoLock(const IndexEntry &ie)
+{
+	const TItemKey itemKey = ie.header.itemKey;
+	WriteSection writeSection(this);
+	_updateBounds(itemKey);
+	
+	Entry entry(ie);
+	entry.size = 0;
+	entry.crc = 0;
+	entry.compressed = 0;
+	auto res = _items.insert(TItemHash::value_type(itemKey, entry));
+	if (!res.second && _isReplacing(res.first->second, entry))
+		_replaceEntry(itemKey, res.first->second, entry);
+}
+
+RangeTable::RangeTable()
+	: _block(NULL), _size(0)
+{
+}
+
+RangeTable::~RangeTable()
+{
+	free(_block.load(std::memory_order_relaxed));
+}
+
+RangeTable::Block *RangeTable::_newBlock(const size_t capacity)
+{
+	Block *block = static_cast<Block*>(calloc(1, sizeof(Block) + (capacity - 1) * sizeof(Slot)));
+	block->mask = capacity - 1;
+	return block;
+}
+
+void RangeTable::_insert(Block *block, const TRangeID rangeID, Range *range)
+{
+	size_t pos = _hash(rangeID) & block->mask;
+	while (block->slots[pos].range)
+		pos = (pos + 1) & block->mask;
+	block->slots[pos].rangeID = rangeID;
+	__atomic_store_n(&block->slots[pos].range, range, __ATOMIC_RELEASE);
+}
+
+Range *RangeTable::find(const TRangeID rangeID) const
+{
+	Epoch::Guard guard;
+	const Block *block = _block.load(std::memory_order_acquire);
+	if (!block)
+		return NULL;
+	// the table is at most half full, so there is always an empty slot to stop at
+	for (size_t pos = _hash(rangeID) & block->mask; ; pos = (pos + 1) & block->mask) {
+		const Slot &slot = block->slots[pos];
+		Range *range = __atomic_load_n(&slot.range, __ATOMIC_ACQUIRE);
+		if (!range)
+			return NULL;
+		if (slot.rangeID == rangeID)
+			return range;
+	}
+}
+
+void RangeTable::insert(const TRangeID rangeID, Range *range)
+{
+	static const size_t MIN_CAPACITY = 64;
+	Block *block = _block.load(std::memory_order_relaxed);
+	if (!block || ((_size + 1) * 2 > block->mask + 1)) {
+		Block *newBlock = _newBlock(block ? (block->mask + 1) * 2 : MIN_CAPACITY);
+		if (block) {
+			for (size_t pos = 0; pos <= block->mask; pos++) {
+				if (block->slots[pos].range)
+					_insert(newBlock, block->slots[pos].rangeID, block->slots[pos].range);
+			}
+		}
+		_block.store(newBlock, std::memory_order_release);
+		if (block)
+			Epoch::retire(block);
+		block = newBlock;
+	}
+	_insert(block, rangeID, range);
+	_size++;
+}
+
+Index::Index(const size_t shards)
+{
+	for (size_t i = 0; i < std::max(shards, (size_t)1); i++)
+		_shards.emplace_back(new Shard());
+}
+
+Range *Index::_addRangeNoLock(const TRangeID rangeID)
+{
+	static TRangePtr nullRange;
+	Shard &shard = _shard(rangeID);
+	auto res = shard.ranges.insert(TRangeHash::value_type(rangeID, nullRange));
+	if (res.second) {
+		res.first->second.reset(new Range());
+		shard.rangeTable.insert(rangeID, res.first->second.get());
+	}
+	return res.first->second.get();
+}
+
+Range &Index::getRangeNoLock(const TRangeID rangeID)
+{
+	return *_addRangeNoLock(rangeID);
+}
+
+void Index::getRanges(TRangeVector &ranges)
+{
+	for (auto shard = _shards.begin(); shard != _shards.end(); shard++) {
+		AutoMutex autoSync(&(*shard)->sync);
+		ranges.insert(ranges.end(), (*shard)->ranges.begin(), (*shard)->ranges.end());
+	}
+}
+
+bool Index::remove(const ItemHeader &itemHeader, const ItemPointer *pointer)
+{
+	Range *range = _find(itemHeader.rangeID);
+	if (!range)
 		return false;
-	TRangePtr rangePtr  = f->second;
-	autoSync.unLock();
-	return rangePtr->remove(itemHeader);
+	return range->remove(itemHeader, pointer);
+}
+
+bool Index::replacePointer(const TRangeID rangeID, const TItemKey itemKey, const ItemPointer &oldPointer, 
+	const ItemPointer &newPointer, const bool isTombstone)
+{
+	Range *range = _find(rangeID);
+	if (!range)
+		return false;
+	return range->replacePointer(itemKey, oldPointer, newPointer, isTombstone);
+}
+
+void Index::getLiveSizes(Range::TLiveSizeVector &liveSizes)
+{
+	TRangeVector ranges;
+	getRanges(ranges);
+	for (auto range = ranges.begin(); range != ranges.end(); range++)
+		range->second->addLiveSizes(liveSizes);
+}
+
+void Index::getTombstones(const TSliceID sliceID, Range::TIndexEntryVector &tombstones)
+{
+	TRangeVector ranges;
+	getRanges(ranges);
+	for (auto range = ranges.begin(); range != ranges.end(); range++)
+		range->second->getTombstones(range->first, sliceID, tombstones);
 }
 
 bool Index::find(const TRangeID rangeID, const TItemKey itemKey, Range::Entry &ie)
 {
-	AutoMutex autoSync(&_sync);
-	auto f = _ranges.find(rangeID);
-	if (f == _ranges.end())
+	Range *range = _find(rangeID);
+	if (!range)
 		return false;
-	TRangePtr rangePtr  = f->second;
-	autoSync.unLock();
-	return rangePtr->find(itemKey, ie);
+	return range->find(itemKey, ie);
 }
 
-void Index::add(const IndexEntry &ie)
+bool Index::add(const IndexEntry &ie, Range::Entry &deadEntry)
 {
-	TRangePtr rangePtr;
-	AutoMutex autoSync(&_sync);
-	auto res = _ranges.insert(TRangeHash::value_type(ie.header.rangeID, rangePtr));
-	if (res.second) {
-		rangePtr.reset(new Range());
-		res.first->second = rangePtr;
+	Range *range = _find(ie.header.rangeID);
+	if (!range) {
+		AutoMutex autoSync(&_shard(ie.header.rangeID).sync);
+		range = _addRangeNoLock(ie.header.rangeID);
 	}
-	else
-		rangePtr = res.first->second;
-	autoSync.unLock();
-	
-	rangePtr->add(ie);
+	return range->add(ie, deadEntry);
 }
 
 void Index::addNoLock(const IndexEntry &ie)
 {
-	static TRangePtr nullRange;
-	auto res = _ranges.insert(TRangeHash::value_type(ie.header.rangeID, nullRange));
+	Range::Entry deadEntry;
+	_addRangeNoLock(ie.header.rangeID)->addNoLock(ie, deadEntry);
+}
+
+void Index::addTombstoneNoLock(const IndexEntry &ie)
+{
+	_addRangeNoLock(ie.header.rangeID)->addTombstoneNoLock(ie);
+}
+
+void Index::getRangeIDsNoLock(std::vector<TRangeID> &rangeIDs)
+{
+	for (auto shard = _shards.begin(); shard != _shards.end(); shard++) {
+		for (auto range = (*shard)->ranges.begin(); range != (*shard)->ranges.end(); range++)
+			rangeIDs.push_back(range->first);
+	}
+}
+
+void Index::mergeRange(const TRangeID rangeID, TIndexVector &parts)
+{
+	std::vector<TRangePtr> ranges;
+	TRangePtr baseRange;
+	for (auto part = parts.begin(); part != parts.end(); part++) {
+		TRangeHash &partRanges = (*part)->_shard(rangeID).ranges;
+		auto f = partRanges.find(rangeID);
+		if (f == partRanges.end())
+			continue;
+		// the biggest part becomes the base, so the most items aren't copied at all
+		if (!baseRange || (f->second->sizeNoLock() > baseRange->sizeNoLock())) {
+			if (baseRange)
+				ranges.push_back(baseRange);
+			baseRange = f->second;
+		}
+		else
+			ranges.push_back(f->second);
+		f->second.reset();
+	}
+	if (!baseRange)
+		return;
+	for (auto range = ranges.begin(); range != ranges.end(); range++) {
+		baseRange->mergeNoLock(**range);
+		range->reset();
+	}
+	
+	Shard &shard = _shard(rangeID);
+	AutoMutex autoSync(&shard.sync);
+	auto res = shard.ranges.insert(TRangeHash::value_type(rangeID, baseRange));
 	if (res.second)
-		res.first->second.reset(new Range());
-	res.first->second->addNoLock(ie);
+		shard.rangeTable.insert(rangeID, baseRange.get());
+	else {
+		TRangePtr curRange = res.first->second;
+		autoSync.unLock();
+		curRange->merge(*baseRange);
+	}
 }
 
-bool Index::getRangeItems(const TRangeID rangeID, BString &data)
+bool Index::getRangeDigest(const RangeDigestRequest &request, BString &data)
 {
-	AutoMutex autoSync(&_sync);
-	auto f = _ranges.find(rangeID);
-	if (f == _ranges.end())
+	Range *range = _find(request.rangeID);
+	if (!range)
 		return false;
-	TRangePtr rangePtr  = f->second;
-	autoSync.unLock();
-	return rangePtr->getItems(rangeID, data);
+	range->getDigest(request, data);
+	return true;
+}
+
+bool Index::getRangeItems(const RangeItemsRequest &request, BString &data)
+{
+	Range *range = _find(request.rangeID);
+	if (!range)
+		return false;
+	return range->getItems(request, data);
+}
+
+bool Index::getRangeItems(const RangeItemsRequestV1 &request, BString &data)
+{
+	Range *range = _find(request.rangeID);
+	if (!range)
+		return false;
+	return range->getItems(request, data);
 }
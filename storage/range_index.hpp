@@ -22,10 +22,14 @@
 #endif
 
 #include <memory>
+#include <vector>
+#include <atomic>
 	
 #include "../types.hpp"
 #include "mutex.hpp"
 #include "bstring.hpp"
+#include "range_items.hpp"
+#include "range_digest.hpp"
 
 namespace fl {
 	namespace metis {
@@ -35,6 +39,8 @@ namespace fl {
 		using fl::strings::BString;
 		
 		
+		// Range items are read without locks: writers are serialized by _sync and bump _version to an odd value
+		// while they change the items, readers copy an entry and retry if the version was odd or has changed
 		class Range
 		{
 		public:
@@ -42,45 +48,214 @@ namespace fl {
 			{
 				Entry() = default;
 				Entry(const IndexEntry &ie)
-					: pointer(ie.pointer), size(ie.header.size), timeTag(ie.header.timeTag)
+					: pointer(ie.pointer), size(ie.header.size), compressed((ie.header.status & ST_ITEM_COMPRESSED) != 0), 
+						timeTag(ie.header.timeTag), crc(ie.crc)
 				{
 				}
+				static const TSize MAX_SIZE = (1U << 31) - 1;
+				// the scrubber has found the data broken, such an item is hidden from readers and range items, so
+				// managers make a new copy of it
+				bool isCorrupted() const
+				{
+					return (size != 0) && (pointer.seek == 0);
+				}
+				// size and crc are of the original data, the slice keeps the gzip stream of it
+				bool isCompressed() const
+				{
+					return compressed;
+				}
 				ItemPointer pointer;
-				TSize size;
+				TSize size : 31; // the flag takes the top bit, so the entry keeps its size, see MAX_SIZE
+				TSize compressed : 1;
 				ModTimeTag timeTag;
-			};
+				TCrc crc;
+			} __attribute__((packed));
 
 			Range();
 			bool find(const TItemKey itemKey, Entry &ie);
-			void add(const IndexEntry &ie)
+			bool add(const IndexEntry &ie, Entry &deadEntry)
 			{
 				AutoMutex autoSync(&_sync);
-				addNoLock(ie);
+				return addNoLock(ie, deadEntry);
+			}
+			bool addNoLock(const IndexEntry &ie, Entry &deadEntry);
+			void addTombstoneNoLock(const IndexEntry &ie);
+			bool remove(const ItemHeader &itemHeader, const ItemPointer *pointer = NULL);
+			bool replacePointer(const TItemKey itemKey, const ItemPointer &oldPointer, const ItemPointer &newPointer, 
+				const bool isTombstone);
+			// a page of the items is RangeItemsHeader followed by RangeItemEntry records in the order of keys
+			static const uint32_t MAX_ITEMS_PAGE = 65536;
+			bool getItems(const RangeItemsRequest &request, BString &data);
+			// the whole range as RangeItemsHeaderV1 followed by RangeItemEntryV1 records for not upgraded managers
+			bool getItems(const RangeItemsRequestV1 &request, BString &data);
+			void getDigest(const RangeDigestRequest &request, BString &data);
+			struct LiveSize
+			{
+				LiveSize()
+					: size(0), items(0)
+				{
+				}
+				uint64_t size; // data sizes only, the item header size depends on the slice version
+				uint64_t items;
+			};
+			typedef std::vector<LiveSize> TLiveSizeVector;
+			void addLiveSizes(TLiveSizeVector &liveSizes);
+			typedef std::vector<IndexEntry> TIndexEntryVector;
+			void getTombstones(const TRangeID rangeID, const TSliceID sliceID, TIndexEntryVector &tombstones);
+			void merge(const Range &range)
+			{
+				AutoMutex autoSync(&_sync);
+				mergeNoLock(range);
+			}
+			void mergeNoLock(const Range &range);
+			
+			struct CheckpointEntry
+			{
+				TItemKey itemKey;
+				ItemPointer pointer;
+				TSize size;
+				ModTimeTag timeTag;
+				TCrc crc;
+				TItemStatus status;
+			} __attribute__((packed));
+			typedef std::vector<CheckpointEntry> TCheckpointEntryVector;
+			void getCheckpointEntries(TCheckpointEntryVector &entries);
+			void addCheckpointEntryNoLock(const CheckpointEntry &checkpointEntry);
+			size_t sizeNoLock() const
+			{
+				return _items.size();
 			}
-			void addNoLock(const IndexEntry &ie);
-			bool remove(const ItemHeader &itemHeader);
-			bool getItems(const TRangeID rangeID, BString &data);
 		private:
+			static bool _isReplacing(const Entry &curEntry, const Entry &entry);
+			// the digest counts only the items, which are listed to managers
+			void _toggleDigest(const TItemKey itemKey, const Entry &entry)
+			{
+				if ((entry.size != 0) && !entry.isCorrupted())
+					_digest.toggle(itemKey, entry.size, entry.timeTag, entry.crc);
+			}
+			void _replaceEntry(const TItemKey itemKey, Entry &curEntry, const Entry &entry)
+			{
+				_toggleDigest(itemKey, curEntry);
+				curEntry = entry;
+				_toggleDigest(itemKey, curEntry);
+			}
+			class WriteSection
+			{
+			public:
+				WriteSection(Range *range)
+					: _range(range)
+				{
+					_range->_version.store(_range->_version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+					std::atomic_thread_fence(std::memory_order_release);
+				}
+				~WriteSection()
+				{
+					_range->_version.store(_range->_version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+				}
+			private:
+				Range *_range;
+			};
+			void _updateBounds(const TItemKey itemKey)
+			{
+				if (_minID > itemKey)
+					_minID = itemKey;
+				if (_maxID < itemKey)
+					_maxID = itemKey;
+			}
 			TItemKey _minID;
 			TItemKey _maxID;
-			typedef unordered_map<TItemKey, Entry> TItemHash;
+			typedef RangeItems<Entry> TItemHash;
 			TItemHash _items;
+			RangeDigest _digest;
+			std::atomic<uint32_t> _version;
 			Mutex _sync;
 		};
 		typedef std::shared_ptr<Range> TRangePtr;
 		
+		// Insert only open addressing table of range pointers, which is read without locks. Ranges are never
+		// removed from an index, the table is grown into a new block and the old one is freed by Epoch.
+		class RangeTable
+		{
+		public:
+			RangeTable();
+			~RangeTable();
+			RangeTable(const RangeTable &) = delete;
+			RangeTable &operator=(const RangeTable &) = delete;
+			Range *find(const TRangeID rangeID) const;
+			// writers must be serialized by the caller
+			void insert(const TRangeID rangeID, Range *range);
+		private:
+			struct Slot
+			{
+				Range *range;
+				TRangeID rangeID;
+			};
+			struct Block
+			{
+				size_t mask;
+				Slot slots[1];
+			};
+			static Block *_newBlock(const size_t capacity);
+			static void _insert(Block *block, const TRangeID rangeID, Range *range);
+			static size_t _hash(const TRangeID rangeID)
+			{
+				return ((uint64_t)rangeID * 0x9E3779B97F4A7C15ULL) >> 32;
+			}
+			std::atomic<Block*> _block;
+			size_t _size;
+		};
+		
+		// Ranges are spread over shards by their ids. Every shard has its own ranges, range table and lock, so in the
+		// shard per core mode a shard is changed only by the worker, which owns its ranges
 		class Index
 		{
 		public:
+			Index(const size_t shards = 1);
+			size_t shard(const TRangeID rangeID) const
+			{
+				return rangeID % _shards.size();
+			}
+			size_t shardsCount() const
+			{
+				return _shards.size();
+			}
 			bool find(const TRangeID rangeID, const TItemKey itemKey, Range::Entry &ie);
-			void add(const IndexEntry &ie);
+			bool add(const IndexEntry &ie, Range::Entry &deadEntry);
 			void addNoLock(const IndexEntry &ie);
-			bool remove(const ItemHeader &itemHeader);
-			bool getRangeItems(const TRangeID rangeID, BString &data);
+			void addTombstoneNoLock(const IndexEntry &ie);
+			bool remove(const ItemHeader &itemHeader, const ItemPointer *pointer = NULL);
+			bool replacePointer(const TRangeID rangeID, const TItemKey itemKey, const ItemPointer &oldPointer, 
+				const ItemPointer &newPointer, const bool isTombstone);
+			bool getRangeItems(const RangeItemsRequest &request, BString &data);
+			bool getRangeItems(const RangeItemsRequestV1 &request, BString &data);
+			bool getRangeDigest(const RangeDigestRequest &request, BString &data);
+			void getLiveSizes(Range::TLiveSizeVector &liveSizes);
+			void getTombstones(const TSliceID sliceID, Range::TIndexEntryVector &tombstones);
+			typedef std::vector<std::unique_ptr<Index>> TIndexVector;
+			void getRangeIDsNoLock(std::vector<TRangeID> &rangeIDs);
+			void mergeRange(const TRangeID rangeID, TIndexVector &parts);
+			typedef std::vector<std::pair<TRangeID, TRangePtr>> TRangeVector;
+			void getRanges(TRangeVector &ranges);
+			Range &getRangeNoLock(const TRangeID rangeID);
 		private:
 			typedef unordered_map<TRangeID, TRangePtr> TRangeHash;
-			TRangeHash _ranges;
-			Mutex _sync;
+			struct Shard
+			{
+				TRangeHash ranges;
+				RangeTable rangeTable;
+				Mutex sync;
+			};
+			Shard &_shard(const TRangeID rangeID)
+			{
+				return *_shards[shard(rangeID)];
+			}
+			Range *_find(const TRangeID rangeID)
+			{
+				return _shard(rangeID).rangeTable.find(rangeID);
+			}
+			Range *_addRangeNoLock(const TRangeID rangeID);
+			typedef std::unique_ptr<Shard> TShardPtr;
+			std::vector<TShardPtr> _shards;
 		};
 	};
 	};
@@ -0,0 +1,405 @@
+#pragma once
+#ifndef __FL_METIS_STORAGE_RANGE_ITEMS_HPP
+#define	__FL_METIS_STORAGE_RANGE_ITEMS_HPP
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Range items container, which switches between a hash table and a dense array
+///////////////////////////////////////////////////////////////////////////////
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <cstdlib>
+#include "item_table.hpp"
+
+namespace fl {
+	namespace metis {
+		namespace storage {
+
+		// Sparse ranges keep items in an ItemTable, well populated ones are switched to an array indexed by
+		// itemKey - baseKey with an occupancy bitmap, which costs only the entry size per item. As in ItemTable
+		// the array is one block replaced as a whole, so read() can run without locks against one writer.
+		template <typename TEntry>
+		class RangeItems
+		{
+		public:
+			typedef typename ItemTable<TEntry>::Item value_type;
+			struct ItemRef
+			{
+				ItemRef(const TItemKey itemKey, TEntry &entry)
+					: first(itemKey), second(entry)
+				{
+				}
+				TItemKey first;
+				TEntry &second;
+			};
+			class ItemRefPointer
+			{
+			public:
+				ItemRefPointer(const TItemKey itemKey, TEntry &entry)
+					: _ref(itemKey, entry)
+				{
+				}
+				ItemRef *operator->()
+				{
+					return &_ref;
+				}
+			private:
+				ItemRef _ref;
+			};
+
+			class iterator
+			{
+			public:
+				iterator(RangeItems *items, const typename ItemTable<TEntry>::iterator &tableItem, const size_t pos)
+					: _items(items), _tableItem(tableItem), _pos(pos)
+				{
+					_skipEmpty();
+				}
+				ItemRefPointer operator->() const
+				{
+					return ItemRefPointer(_key(), _entry());
+				}
+				ItemRef operator*() const
+				{
+					return ItemRef(_key(), _entry());
+				}
+				iterator &operator++()
+				{
+					if (_items->_writeDense()) {
+						_pos++;
+						_skipEmpty();
+					}
+					else
+						++_tableItem;
+					return *this;
+				}
+				iterator operator++(int)
+				{
+					iterator prev(*this);
+					++(*this);
+					return prev;
+				}
+				bool operator==(const iterator &other) const
+				{
+					return (_pos == other._pos) && (_tableItem == other._tableItem);
+				}
+				bool operator!=(const iterator &other) const
+				{
+					return !(*this == other);
+				}
+			private:
+				TItemKey _key() const
+				{
+					DenseBlock *dense = _items->_writeDense();
+					return dense ? (dense->baseKey + _pos) : _tableItem->first;
+				}
+				TEntry &_entry() const
+				{
+					DenseBlock *dense = _items->_writeDense();
+					return dense ? dense->entries()[_pos] : _tableItem->second;
+				}
+				void _skipEmpty()
+				{
+					const DenseBlock *dense = _items->_writeDense();
+					if (!dense)
+						return;
+					while ((_pos < dense->capacity) && !dense->isSet(_pos))
+						_pos++;
+				}
+				RangeItems *_items;
+				typename ItemTable<TEntry>::iterator _tableItem;
+				size_t _pos;
+			};
+
+			RangeItems()
+				: _dense(NULL), _size(0), _minKey(0), _maxKey(0)
+			{
+			}
+			~RangeItems()
+			{
+				free(_writeDense());
+			}
+			RangeItems(const RangeItems &) = delete;
+			RangeItems &operator=(const RangeItems &) = delete;
+			size_t size() const
+			{
+				return _writeDense() ? _size : _table.size();
+			}
+			bool isDense() const
+			{
+				return _writeDense() != NULL;
+			}
+			size_t memoryUsage() const
+			{
+				const DenseBlock *dense = _writeDense();
+				if (dense)
+					return _denseBlockSize(dense->capacity) + sizeof(*this);
+				else
+					return _table.memoryUsage() + sizeof(*this) - sizeof(_table);
+			}
+			iterator begin() const
+			{
+				RangeItems *items = const_cast<RangeItems*>(this);
+				if (_writeDense())
+					return iterator(items, _table.end(), 0);
+				else
+					return iterator(items, _table.begin(), 0);
+			}
+			iterator end() const
+			{
+				RangeItems *items = const_cast<RangeItems*>(this);
+				const DenseBlock *dense = _writeDense();
+				return iterator(items, _table.end(), dense ? dense->capacity : 0);
+			}
+			iterator find(const TItemKey itemKey) const
+			{
+				RangeItems *items = const_cast<RangeItems*>(this);
+				const DenseBlock *dense = _writeDense();
+				if (!dense)
+					return iterator(items, _table.find(itemKey), 0);
+				size_t pos;
+				if (!dense->find(itemKey, pos))
+					return end();
+				return iterator(items, _table.end(), pos);
+			}
+			// can run concurrently with a writer, the entry can be torn and must be validated by the caller
+			bool read(const TItemKey itemKey, TEntry &entry) const
+			{
+				const DenseBlock *dense = _dense.load(std::memory_order_acquire);
+				if (!dense)
+					return _table.read(itemKey, entry);
+				size_t pos;
+				if (!dense->find(itemKey, pos))
+					return false;
+				memcpy(&entry, &dense->entries()[pos], sizeof(entry));
+				return true;
+			}
+			// calls func(itemKey, entry) for the items from fromKey in the order of keys, while it returns true. 
+			// The array is walked from fromKey, the keys of a table are sorted once and kept, while new keys are 
+			// appended in order, as items are never erased.
+			template <typename TFunc>
+			void forEachFrom(const TItemKey fromKey, TFunc func)
+			{
+				DenseBlock *dense = _writeDense();
+				if (dense) {
+					size_t pos = (fromKey > dense->baseKey) ? ((size_t)fromKey - dense->baseKey) : 0;
+					for (; pos < dense->capacity; pos++) {
+						if (dense->isSet(pos) && !func(dense->baseKey + pos, dense->entries()[pos]))
+							return;
+					}
+					return;
+				}
+				if (_sortedKeys.size() != _table.size()) {
+					_sortedKeys.clear();
+					_sortedKeys.reserve(_table.size());
+					for (auto item = _table.begin(); item != _table.end(); item++)
+						_sortedKeys.push_back(item->first);
+					std::sort(_sortedKeys.begin(), _sortedKeys.end());
+				}
+				for (auto key = std::lower_bound(_sortedKeys.begin(), _sortedKeys.end(), fromKey); 
+					key != _sortedKeys.end(); key++) {
+					if (!func(*key, _table.find(*key)->second))
+						return;
+				}
+			}
+			std::pair<iterator, bool> insert(const value_type &item)
+			{
+				const TItemKey itemKey = item.first;
+				if (_writeDense()) {
+					if (!_insertDense(item))
+						_toHash();
+					else {
+						DenseBlock *dense = _writeDense();
+						size_t pos = itemKey - dense->baseKey;
+						if (dense->isSet(pos))
+							return std::pair<iterator, bool>(iterator(this, _table.end(), pos), false);
+						dense->entries()[pos] = item.second;
+						std::atomic_thread_fence(std::memory_order_release);
+						dense->set(pos);
+						_size++;
+						_updateBounds(itemKey);
+						return std::pair<iterator, bool>(iterator(this, _table.end(), pos), true);
+					}
+				}
+				auto res = _table.insert(item);
+				if (!res.second)
+					return std::pair<iterator, bool>(iterator(this, res.first, 0), false);
+				_updateSortedKeys(itemKey);
+				_updateBounds(itemKey);
+				if (_isDenseEnough(_table.size(), _maxKey - _minKey + 1)) {
+					_toDense();
+					return std::pair<iterator, bool>(find(itemKey), true);
+				}
+				return std::pair<iterator, bool>(iterator(this, res.first, 0), true);
+			}
+		private:
+			// an array slot costs sizeof(TEntry), a table item costs about 1.5 times more with its key and free slots
+			static const size_t DENSE_MIN_ITEMS = 64;
+			static const size_t DENSE_MIN_PERCENT = 60;
+			static const size_t SPARSE_MAX_PERCENT = 30;
+
+			struct DenseBlock
+			{
+				TItemKey baseKey;
+				size_t capacity;
+				uint64_t *bitmap()
+				{
+					return reinterpret_cast<uint64_t*>(this + 1);
+				}
+				const uint64_t *bitmap() const
+				{
+					return reinterpret_cast<const uint64_t*>(this + 1);
+				}
+				TEntry *entries()
+				{
+					return reinterpret_cast<TEntry*>(bitmap() + _bitmapSize(capacity));
+				}
+				const TEntry *entries() const
+				{
+					return reinterpret_cast<const TEntry*>(bitmap() + _bitmapSize(capacity));
+				}
+				bool isSet(const size_t pos) const
+				{
+					return bitmap()[pos / 64] & (1ULL << (pos % 64));
+				}
+				void set(const size_t pos)
+				{
+					bitmap()[pos / 64] |= (1ULL << (pos % 64));
+				}
+				bool find(const TItemKey itemKey, size_t &pos) const
+				{
+					pos = (size_t)itemKey - baseKey;
+					return (itemKey >= baseKey) && (pos < capacity) && isSet(pos);
+				}
+			};
+			static size_t _bitmapSize(const size_t capacity)
+			{
+				return (capacity + 63) / 64;
+			}
+			static size_t _denseBlockSize(const size_t capacity)
+			{
+				return sizeof(DenseBlock) + _bitmapSize(capacity) * sizeof(uint64_t) + capacity * sizeof(TEntry);
+			}
+			static DenseBlock *_newDenseBlock(const TItemKey baseKey, const size_t capacity)
+			{
+				DenseBlock *dense = static_cast<DenseBlock*>(malloc(_denseBlockSize(capacity)));
+				dense->baseKey = baseKey;
+				dense->capacity = capacity;
+				memset(dense->bitmap(), 0, _bitmapSize(capacity) * sizeof(uint64_t));
+				return dense;
+			}
+			// only the writer, which is serialized by the caller, changes the block pointer
+			DenseBlock *_writeDense() const
+			{
+				return _dense.load(std::memory_order_relaxed);
+			}
+			static bool _isDenseEnough(const size_t count, const size_t span)
+			{
+				return (count >= DENSE_MIN_ITEMS) && (count * 100 >= span * DENSE_MIN_PERCENT);
+			}
+			void _updateBounds(const TItemKey itemKey)
+			{
+				if (size() == 1) {
+					_minKey = _maxKey = itemKey;
+					return;
+				}
+				if (itemKey < _minKey)
+					_minKey = itemKey;
+				if (itemKey > _maxKey)
+					_maxKey = itemKey;
+			}
+			// makes room for itemKey in the array, returns false when the range becomes too sparse for it
+			bool _insertDense(const value_type &item)
+			{
+				const TItemKey itemKey = item.first;
+				const DenseBlock *dense = _writeDense();
+				if ((itemKey >= dense->baseKey) && ((size_t)(itemKey - dense->baseKey) < dense->capacity))
+					return true;
+				TItemKey minKey = (itemKey < _minKey) ? itemKey : _minKey;
+				TItemKey maxKey = (itemKey > _maxKey) ? itemKey : _maxKey;
+				size_t span = (size_t)maxKey - minKey + 1;
+				if ((_size + 1) * 100 < span * SPARSE_MAX_PERCENT)
+					return false;
+				// leave some room in the growing direction, keys are usually added one after another
+				size_t slack = span / 8;
+				TItemKey baseKey = dense->baseKey;
+				if (itemKey < dense->baseKey)
+					baseKey = (minKey > slack) ? (minKey - slack) : 0;
+				size_t capacity = (size_t)maxKey - baseKey + 1;
+				if (itemKey >= dense->baseKey)
+					capacity += slack;
+				_resize(baseKey, capacity);
+				return true;
+			}
+			void _updateSortedKeys(const TItemKey itemKey)
+			{
+				if (_sortedKeys.empty())
+					return;
+				if (((_sortedKeys.size() + 1) == _table.size()) && (itemKey > _sortedKeys.back()))
+					_sortedKeys.push_back(itemKey);
+				else // the keys are sorted again by the next walk, only the ranges being walked keep them
+					std::vector<TItemKey>().swap(_sortedKeys);
+			}
+			void _resize(const TItemKey baseKey, const size_t capacity)
+			{
+				DenseBlock *dense = _newDenseBlock(baseKey, capacity);
+				DenseBlock *oldDense = _writeDense();
+				for (size_t pos = 0; pos < oldDense->capacity; pos++) {
+					if (oldDense->isSet(pos)) {
+						size_t newPos = oldDense->baseKey + pos - baseKey;
+						dense->entries()[newPos] = oldDense->entries()[pos];
+						dense->set(newPos);
+					}
+				}
+				_dense.store(dense, std::memory_order_release);
+				Epoch::retire(oldDense);
+			}
+			void _toDense()
+			{
+				size_t capacity = (size_t)_maxKey - _minKey + 1;
+				DenseBlock *dense = _newDenseBlock(_minKey, capacity);
+				for (auto item = _table.begin(); item != _table.end(); item++) {
+					size_t pos = item->first - _minKey;
+					dense->entries()[pos] = item->second;
+					dense->set(pos);
+				}
+				_size = _table.size();
+				_dense.store(dense, std::memory_order_release);
+				_table.clear();
+				std::vector<TItemKey>().swap(_sortedKeys);
+			}
+			void _toHash()
+			{
+				DenseBlock *dense = _writeDense();
+				_table.reserve(_size + 1);
+				for (size_t pos = 0; pos < dense->capacity; pos++) {
+					if (dense->isSet(pos))
+						_table.insert(value_type(dense->baseKey + pos, dense->entries()[pos]));
+				}
+				_dense.store(NULL, std::memory_order_release);
+				Epoch::retire(dense);
+				_size = 0;
+			}
+
+			std::atomic<DenseBlock*> _dense;
+			ItemTable<TEntry> _table;
+			std::vector<TItemKey> _sortedKeys;
+			size_t _size;
+			TItemKey _minKey;
+			TItemKey _maxKey;
+		};
+
+		};
+	};
+};
+
+#endif	// __FL_METIS_STORAGE_RANGE_ITEMS_HPP
@@ -0,0 +1,94 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Splitting of the byte stream of a storage connection into requests implementation
+///////////////////////////////////////////////////////////////////////////////
+
+#include <strings.h>
+#include "request_reader.hpp"
+
+using namespace fl::metis;
+
+RequestReader::RequestReader()
+	: _hasHeader(false), _hasRequestID(false), _requestID(0)
+{
+	bzero(&_cmd, sizeof(_cmd));
+}
+
+bool RequestReader::parseHeader(BString &buffer)
+{
+	if ((size_t)buffer.size() < sizeof(StorageCmd))
+		return false;
+	StorageCmd &cmd = *(StorageCmd*)buffer.c_str();
+	if (cmd.cmd & STORAGE_CMD_REQUEST_ID) {
+		static const size_t TAGGED_CMD_SIZE = sizeof(StorageCmd) + sizeof(TStorageRequestID);
+		if ((size_t)buffer.size() < TAGGED_CMD_SIZE) // wait for the rest of the header
+			return false;
+		// the id is cut out of the buffer, so the command is parsed the same way as an untagged one
+		char *data = (char*)buffer.c_str();
+		_requestID = *(TStorageRequestID*)(data + sizeof(StorageCmd));
+		_hasRequestID = true;
+		cmd.cmd = (EStorageCMD)(cmd.cmd & ~STORAGE_CMD_REQUEST_ID);
+		memmove(data + sizeof(StorageCmd), data + TAGGED_CMD_SIZE, buffer.size() - TAGGED_CMD_SIZE);
+		buffer.trimLast(sizeof(TStorageRequestID));
+	}
+	_cmd = cmd;
+	_hasHeader = true;
+	return true;
+}
+
+bool RequestReader::takeRequest(BString &buffer)
+{
+	const size_t requestSize = _cmd.size + sizeof(StorageCmd);
+	if ((size_t)buffer.size() < requestSize)
+		return false;
+	_request.clear();
+	_request.add(buffer.c_str() + sizeof(StorageCmd), _cmd.size);
+	// the next pipelined requests are kept until the answer to this one has been sent
+	if ((size_t)buffer.size() > requestSize) {
+		split(buffer.c_str() + requestSize, buffer.size() - requestSize, 0);
+		buffer.trimLast(buffer.size() - requestSize);
+	}
+	return true;
+}
+
+size_t RequestReader::split(const char *data, const size_t size, const size_t left)
+{
+	if (size <= left)
+		return size;
+	_received.add(data + left, size - left);
+	return left;
+}
+
+void RequestReader::takePipelined(BString &buffer)
+{
+	buffer.add(_received.c_str(), _received.size());
+	_received.clear();
+}
+
+StorageAnswer &RequestReader::addAnswerHeader(BString &buffer) const
+{
+	StorageAnswer &sa = *(StorageAnswer*)buffer.reserveBuffer(answerHeaderSize());
+	if (_hasRequestID)
+		*(TStorageRequestID*)((char*)&sa + sizeof(StorageAnswer)) = _requestID;
+	return sa;
+}
+
+void RequestReader::reset()
+{
+	bzero(&_cmd, sizeof(_cmd));
+	_hasHeader = false;
+	_hasRequestID = false;
+	_requestID = 0;
+	_request.clear();
+}
+
+void RequestReader::clear()
+{
+	reset();
+	_received.clear();
+}
@@ -0,0 +1,83 @@
+#pragma once
+#ifndef __FL_METIS_STORAGE_REQUEST_READER_HPP
+#define	__FL_METIS_STORAGE_REQUEST_READER_HPP
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Splitting of the byte stream of a storage connection into requests
+///////////////////////////////////////////////////////////////////////////////
+
+#include "bstring.hpp"
+#include "../types.hpp"
+
+namespace fl {
+	namespace metis {
+		using fl::strings::BString;
+
+		// Requests can come pipelined, so the bytes after the current request are kept until it has been answered.
+		// A command with STORAGE_CMD_REQUEST_ID is followed by its id, which is cut out of the request and put after the
+		// header of its answer
+		class RequestReader
+		{
+		public:
+			RequestReader();
+			// parses the header at the beginning of the buffer and cuts the request id out of it, the header itself is
+			// left in the buffer. false - the header hasn't come completely yet
+			bool parseHeader(BString &buffer);
+			bool hasHeader() const
+			{
+				return _hasHeader;
+			}
+			const StorageCmd &cmd() const
+			{
+				return _cmd;
+			}
+			bool hasRequestID() const
+			{
+				return _hasRequestID;
+			}
+			TStorageRequestID requestID() const
+			{
+				return _requestID;
+			}
+			// copies the request out of the buffer, so it stays valid while the answer is built in the buffer, the
+			// pipelined requests after it are kept. false - the request hasn't come completely yet
+			bool takeRequest(BString &buffer);
+			const char *request() const
+			{
+				return _request.c_str();
+			}
+			// the first left bytes of data belong to the current request, the rest is kept for the next requests,
+			// returns the size of the current request's part
+			size_t split(const char *data, const size_t size, const size_t left);
+			bool hasPipelined() const
+			{
+				return !_received.empty();
+			}
+			// adds the kept bytes of the next requests to the buffer
+			void takePipelined(BString &buffer);
+			// adds the header of the answer to the current request, the request id is put after it
+			StorageAnswer &addAnswerHeader(BString &buffer) const;
+			size_t answerHeaderSize() const
+			{
+				return sizeof(StorageAnswer) + (_hasRequestID ? sizeof(TStorageRequestID) : 0);
+			}
+			void reset(); // the current request has been answered
+			void clear(); // the connection has been closed
+		private:
+			StorageCmd _cmd;
+			bool _hasHeader;
+			bool _hasRequestID;
+			TStorageRequestID _requestID;
+			BString _request;
+			BString _received; // pipelined requests, which have come after the current one
+		};
+	};
+};
+
+#endif	// __FL_METIS_STORAGE_REQUEST_READER_HPP
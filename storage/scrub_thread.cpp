@@ -0,0 +1,41 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Metis' storage slice scrubbing thread implementation
+///////////////////////////////////////////////////////////////////////////////
+
+#include <unistd.h>
+#include "scrub_thread.hpp"
+#include "../metis_log.hpp"
+#include "storage.hpp"
+
+using namespace fl::metis;
+
+ScrubThread::ScrubThread(class Storage *storage, const uint32_t interval, const uint32_t maxRate)
+	: _storage(storage), _interval(interval), _maxRate(maxRate)
+{
+	static const uint32_t SCRUB_THREAD_STACK_SIZE = 100000;
+	setStackSize(SCRUB_THREAD_STACK_SIZE);
+	if (!create()) {
+		log::Fatal::L("Can't create a scrub thread\n");
+		throw std::exception();
+	}
+}
+
+ScrubThread::~ScrubThread()
+{
+}
+
+void ScrubThread::run()
+{
+	while (true) {
+		sleep(_interval);
+		uint32_t corruptedItems = 0;
+		if (!_storage->scrub(_maxRate, corruptedItems))
+			log::Error::L("Can't scrub slices\n");
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+#ifndef __FL_METIS_STORAGE_SCRUB_THREAD_HPP
+#define	__FL_METIS_STORAGE_SCRUB_THREAD_HPP
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Metis' storage slice scrubbing thread
+///////////////////////////////////////////////////////////////////////////////
+
+#include "../types.hpp"
+#include "thread.hpp"
+
+namespace fl {
+	namespace metis {
+		using fl::threads::Thread;
+		
+		class ScrubThread : public Thread
+		{
+		public:
+			ScrubThread(class Storage *storage, const uint32_t interval, const uint32_t maxRate);
+			virtual ~ScrubThread();
+		private:
+			virtual void run();
+			class Storage *_storage;
+			uint32_t _interval;
+			uint32_t _maxRate;
+		};
+	};
+};
+
+#endif	// __FL_METIS_STORAGE_SCRUB_THREAD_HPP
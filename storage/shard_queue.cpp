@@ -0,0 +1,156 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Lock-free queues of the shard per core mode implementation
+///////////////////////////////////////////////////////////////////////////////
+
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "shard_queue.hpp"
+#include "slice.hpp"
+#include "metis_log.hpp"
+
+using namespace fl::metis;
+
+ShardQueue::ShardQueue(const size_t shard)
+	: Event(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), _head(NULL), _shard(shard), _thread(NULL)
+{
+	if (_descr < 0) {
+		log::Error::L("Can't create an eventfd of shard %zu\n", shard);
+		_descr = fl::events::INVALID_EVENT;
+	}
+	setWaitRead();
+}
+
+ShardQueue::~ShardQueue()
+{
+	Node *node = _head.exchange(NULL);
+	while (node) {
+		Node *next = node->next;
+		delete node;
+		node = next;
+	}
+	if (isValid())
+		close(_descr);
+}
+
+bool ShardQueue::start(EPollWorkerThread *thread)
+{
+	if (!isValid() || !thread->ctrl(this)) {
+		log::Error::L("Can't add the queue of shard %zu to its worker\n", _shard);
+		return false;
+	}
+	_thread = thread;
+	return true;
+}
+
+void ShardQueue::forward(const TDiskIOTaskPtr &task, ShardQueue *origin)
+{
+	Node *node = new Node();
+	node->task = task;
+	node->origin = origin;
+	node->isProcessed = false;
+	_push(node);
+}
+
+void ShardQueue::_push(Node *node)
+{
+	Node *head = _head.load(std::memory_order_relaxed);
+	do {
+		node->next = head;
+	} while (!_head.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+	if (head) // the worker hasn't taken the tasks, which are ahead of this one, so it's already woken up
+		return;
+	uint64_t value = 1;
+	if (write(_descr, &value, sizeof(value)) != sizeof(value))
+		log::Error::L("Can't wake up the worker of shard %zu\n", _shard);
+}
+
+const ShardQueue::ECallResult ShardQueue::call(const TEvents events)
+{
+	// the eventfd is read before the tasks are taken, so a push after that wakes the worker up again
+	uint64_t value;
+	if (read(_descr, &value, sizeof(value)) != sizeof(value))
+		return SKIP;
+	Node *node = _head.exchange(NULL, std::memory_order_acquire);
+	Node *first = NULL;
+	while (node) { // the tasks are pushed in front, so they are reversed to be done in the order they have come
+		Node *next = node->next;
+		node->next = first;
+		first = node;
+		node = next;
+	}
+	while (first) {
+		node = first;
+		first = first->next;
+		if (node->isProcessed) {
+			node->task->finish();
+			delete node;
+		} else {
+			node->task->process();
+			node->isProcessed = true;
+			if (node->origin)
+				node->origin->_push(node);
+			else
+				delete node;
+		}
+	}
+	return SKIP;
+}
+
+namespace {
+	// binds the worker, which runs it, to the write slice and the CPU of its shard
+	class BindShardTask : public fl::metis::DiskIOTask
+	{
+	public:
+		BindShardTask(const size_t shard)
+			: _shard(shard)
+		{
+		}
+		virtual void process()
+		{
+			SliceManager::setWriteShard(_shard);
+			long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+			if (cpus <= 0)
+				return;
+			cpu_set_t cpuSet;
+			CPU_ZERO(&cpuSet);
+			CPU_SET(_shard % cpus, &cpuSet);
+			if (pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet))
+				log::Warning::L("Can't pin worker %zu to CPU %zu\n", _shard, _shard % cpus);
+		}
+	private:
+		size_t _shard;
+	};
+};
+
+ShardQueues::ShardQueues(const size_t count)
+{
+	for (size_t shard = 0; shard < count; shard++)
+		_queues.push_back(new ShardQueue(shard));
+}
+
+bool ShardQueues::start(EPollWorkerGroup *workerGroup)
+{
+	for (auto queue = _queues.begin(); queue != _queues.end(); queue++) {
+		if (!(*queue)->start(workerGroup->getThread((*queue)->shard())))
+			return false;
+		(*queue)->forward(TDiskIOTaskPtr(new BindShardTask((*queue)->shard())), NULL);
+	}
+	return true;
+}
+
+ShardQueue *ShardQueues::find(const EPollWorkerThread *thread) const
+{
+	for (auto queue = _queues.begin(); queue != _queues.end(); queue++) {
+		if ((*queue)->thread() == thread)
+			return *queue;
+	}
+	return NULL;
+}
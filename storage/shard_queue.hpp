@@ -0,0 +1,86 @@
+#pragma once
+#ifndef __FL_METIS_STORAGE_SHARD_QUEUE_HPP
+#define	__FL_METIS_STORAGE_SHARD_QUEUE_HPP
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Lock-free queues, which forward commands of the shard per core mode to the workers owning their ranges
+///////////////////////////////////////////////////////////////////////////////
+
+#include <atomic>
+#include <vector>
+#include "disk_io.hpp"
+
+namespace fl {
+	namespace metis {
+		using fl::events::EPollWorkerGroup;
+
+		// Every worker has a queue of tasks forwarded to it by other workers. A task is processed in the worker of
+		// the queue and is handed back through the queue of the worker, which has forwarded it, to be finished there.
+		// Producers push tasks with a compare and swap, the worker takes all of them at once, when its eventfd is
+		// signaled. The eventfd is signaled only by a push into an empty queue.
+		class ShardQueue : public Event
+		{
+		public:
+			ShardQueue(const size_t shard);
+			virtual ~ShardQueue();
+			bool isValid() const
+			{
+				return _descr != fl::events::INVALID_EVENT;
+			}
+			size_t shard() const
+			{
+				return _shard;
+			}
+			// adds the queue to its worker, the worker can't be changed later
+			bool start(EPollWorkerThread *thread);
+			EPollWorkerThread *thread() const
+			{
+				return _thread;
+			}
+			// is called by any thread, origin - the queue, which the task is finished in, NULL - the task isn't finished
+			void forward(const TDiskIOTaskPtr &task, ShardQueue *origin);
+			virtual const ECallResult call(const TEvents events);
+		private:
+			struct Node
+			{
+				TDiskIOTaskPtr task;
+				ShardQueue *origin;
+				bool isProcessed;
+				Node *next;
+			};
+			void _push(Node *node);
+			std::atomic<Node*> _head;
+			size_t _shard;
+			EPollWorkerThread *_thread;
+		};
+
+		class ShardQueues
+		{
+		public:
+			ShardQueues(const size_t count);
+			// adds the queue of every shard to the worker with the same number and binds the worker to its write slice
+			// and CPU
+			bool start(EPollWorkerGroup *workerGroup);
+			size_t size() const
+			{
+				return _queues.size();
+			}
+			ShardQueue *get(const size_t shard) const
+			{
+				return _queues[shard];
+			}
+			// NULL - the thread has no queue
+			ShardQueue *find(const EPollWorkerThread *thread) const;
+		private:
+			std::vector<ShardQueue*> _queues; // they are events of the workers, so they live as long as the workers
+		};
+	};
+};
+
+#endif	// __FL_METIS_STORAGE_SHARD_QUEUE_HPP
@@ -8,11 +8,26 @@
 // Description: Storage slice management class
 ///////////////////////////////////////////////////////////////////////////////
 
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <random>
 #include "slice.hpp"
 #include "metis_log.hpp"
 #include "dir.hpp"
 #include "config.hpp"
 #include "range_index.hpp"
+#include "crc32c.hpp"
+#include "compression.hpp"
+#include "epoch.hpp"
 
 
 
@@ -36,6 +51,7 @@ void Slice::_openDataFile(BString &dataFileName)
 			throw SliceError("Can't write slice dataFile header");
 		}
 		_size = sizeof(sh);
+		_version = sh.version;
 	}	else {
 		_dataFd.seek(0, SEEK_SET);
 		SliceDataHeader sh;
@@ -47,20 +63,35 @@ void Slice::_openDataFile(BString &dataFileName)
 			log::Fatal::L("SliceID mismatch in %s, %u != %u\n", dataFileName.c_str(), _sliceID, sh.sliceID);
 			throw SliceError("SliceID mismatch");
 		}
+		if (sh.version > SliceDataHeader::CURRENT_VERSION) {
+			log::Fatal::L("Unsupported version %u of slice dataFile %s\n", sh.version, dataFileName.c_str());
+			throw SliceError("Unsupported slice dataFile version");
+		}
+		_version = sh.version;
 		_size = _dataFd.seek(0, SEEK_END);
 	}
 }
 
-void Slice::_rebuildIndexFromData(BString &indexFileName)
+void Slice::_writeIndexHeader(File &indexFd, const char *indexFileName)
 {
-	_indexFd.truncate(0);
+	// inodes and slice IDs are reused, so a checkpoint recognizes the index file by a random generation
+	static std::random_device randomDevice;
 	SliceIndexHeader sh;
 	sh.version = SliceIndexHeader::CURRENT_VERSION;
 	sh.sliceID = _sliceID;
-	if (_indexFd.write(&sh, sizeof(sh)) != sizeof(sh)) {
-		log::Fatal::L("Can't write slice indexFile header %s\n", indexFileName.c_str());
+	sh.generation = ((uint64_t)randomDevice() << 32) ^ randomDevice() 
+		^ std::chrono::steady_clock::now().time_since_epoch().count();
+	if (indexFd.write(&sh, sizeof(sh)) != sizeof(sh)) {
+		log::Fatal::L("Can't write slice indexFile header %s\n", indexFileName);
 		throw SliceError("Can't write slice indexFile header");
 	}
+	_indexGeneration = sh.generation;
+}
+
+void Slice::_rebuildIndexFromData(BString &indexFileName)
+{
+	_indexFd.truncate(0);
+	_writeIndexHeader(_indexFd, indexFileName.c_str());
 	if (_size <= sizeof(SliceDataHeader))
 		return;
 	
@@ -75,20 +106,35 @@ void Slice::_rebuildIndexFromData(BString &indexFileName)
 			log::Fatal::L("Can't read an item header from slice dataFile while rebuilding %s\n", indexFileName.c_str());
 			throw SliceError("Can't read an item header from slice dataFile");
 		}
+		ie.crc = 0;
+		if ((_version >= SliceDataHeader::CRC_VERSION) && (_dataFd.read(&ie.crc, sizeof(ie.crc)) != sizeof(ie.crc))) {
+			log::Fatal::L("Can't read an item checksum from slice dataFile while rebuilding %s\n", indexFileName.c_str());
+			throw SliceError("Can't read an item checksum from slice dataFile");
+		}
+		ie.pointer.sliceID = _sliceID;
+		ie.pointer.seek = curSeek;
+		const TItemSize storedSize = ie.header.size;
+		if ((ie.header.status & ST_ITEM_COMPRESSED) && !(ie.header.status & ST_ITEM_DELETED)) {
+			char sizeField[GZIP_SIZE_FIELD];
+			TSeek sizeFieldSeek = curSeek + itemHeaderSize() + storedSize - GZIP_SIZE_FIELD;
+			if ((storedSize < GZIP_SIZE_FIELD) 
+				|| (_dataFd.pread(sizeField, sizeof(sizeField), sizeFieldSeek) != sizeof(sizeField))) {
+				log::Fatal::L("Can't read an item original size from slice dataFile while rebuilding %s\n", 
+					indexFileName.c_str());
+				throw SliceError("Can't read an item original size from slice dataFile");
+			}
+			ie.header.size = gzipOriginalSize(sizeField); // the index keeps the original size of compressed items
+		}
 
-		auto resSeek = _dataFd.seek(ie.header.size, SEEK_CUR);
+		auto resSeek = _dataFd.seek(storedSize, SEEK_CUR);
 		if (resSeek <= 0) {
 			log::Fatal::L("Can't seek slice dataFile while rebuilding %s\n", indexFileName.c_str());
 			throw SliceError("Can't seek slice dataFile\n");
 		}
 		curSeek = resSeek;
 		
-		if (ie.header.status & ST_ITEM_DELETED) {
+		if (ie.header.status & ST_ITEM_DELETED)
 			buf.truncate(buf.writtenSize() - sizeof(IndexEntry));
-		} else {
-			ie.pointer.seek = curSeek;
-			ie.pointer.sliceID = _sliceID;
-		}
 		if ((buf.writtenSize() >= MAX_BUF_SIZE) || (curSeek >= _size)) {
 			if (_indexFd.write(buf.begin(), buf.writtenSize()) != (ssize_t)buf.writtenSize()) {
 				log::Fatal::L("Can't write data to slice indexFile header %s\n", indexFileName.c_str());
@@ -99,6 +145,64 @@ void Slice::_rebuildIndexFromData(BString &indexFileName)
 	}
 }
 
+void Slice::_upgradeIndexFile(BString &indexFileName, const uint8_t version)
+{
+	log::Warning::L("Upgrade slice indexFile %s to version %u\n", indexFileName.c_str(), 
+		SliceIndexHeader::CURRENT_VERSION);
+	std::string tmpFileName = std::string(indexFileName.c_str()) + ".tmp";
+	File tmpFd;
+	if (!tmpFd.open(tmpFileName.c_str(), O_CREAT | O_WRONLY | O_TRUNC)) {
+		log::Fatal::L("Can't open slice indexFile %s\n", tmpFileName.c_str());
+		throw SliceError("Can't open slice indexFile");
+	}
+	_writeIndexHeader(tmpFd, tmpFileName.c_str());
+	
+	// the checksums of version 1 items are unknown, so they are just not verified
+	const size_t oldEntrySize = (version < 2) ? sizeof(IndexEntryV1) : sizeof(IndexEntry);
+	std::vector<IndexEntryV1> oldEntries(MAX_BUF_SIZE / sizeof(IndexEntryV1));
+	std::vector<IndexEntry> entries(oldEntries.size());
+	TSeek seek = sizeof(SliceIndexHeaderV2);
+	while (true) {
+		char *readBuf = (version < 2) ? (char*)oldEntries.data() : (char*)entries.data();
+		ssize_t readSize = _indexFd.pread(readBuf, oldEntries.size() * oldEntrySize, seek);
+		if (readSize < 0) {
+			log::Fatal::L("Can't read slice indexFile %s\n", indexFileName.c_str());
+			throw SliceError("Can't read slice indexFile");
+		}
+		size_t count = readSize / oldEntrySize;
+		if (count == 0)
+			break;
+		if (version < 2) {
+			for (size_t i = 0; i < count; i++) {
+				entries[i].header = oldEntries[i].header;
+				entries[i].pointer = oldEntries[i].pointer;
+				entries[i].crc = 0;
+			}
+		}
+		ssize_t writeSize = count * sizeof(IndexEntry);
+		if (tmpFd.write(entries.data(), writeSize) != writeSize) {
+			log::Fatal::L("Can't write slice indexFile %s\n", tmpFileName.c_str());
+			throw SliceError("Can't write slice indexFile");
+		}
+		seek += count * oldEntrySize;
+	}
+	if (fdatasync(tmpFd.descr())) {
+		log::Fatal::L("Can't sync slice indexFile %s (%d)\n", tmpFileName.c_str(), errno);
+		throw SliceError("Can't sync slice indexFile");
+	}
+	tmpFd.close();
+	if (rename(tmpFileName.c_str(), indexFileName.c_str())) {
+		log::Fatal::L("Can't rename slice indexFile %s (%d)\n", tmpFileName.c_str(), errno);
+		throw SliceError("Can't rename slice indexFile");
+	}
+	_indexFd.close();
+	if (!_indexFd.open(indexFileName.c_str(), O_RDWR)) {
+		log::Fatal::L("Can't open slice indexFile %s\n", indexFileName.c_str());
+		throw SliceError("Can't open slice indexFile");
+	}
+	_indexFd.seek(0, SEEK_END);
+}
+
 void Slice::_openIndexFile(BString &indexFileName)
 {
 	if (!_indexFd.open(indexFileName.c_str(), O_CREAT | O_RDWR)) {
@@ -113,7 +217,9 @@ void Slice::_openIndexFile(BString &indexFileName)
 		try
 		{
 			SliceIndexHeader sh;
-			if (_indexFd.read(&sh, sizeof(sh)) != sizeof(sh)) {
+			if ((_indexFd.read(&sh, sizeof(SliceIndexHeaderV2)) != sizeof(SliceIndexHeaderV2)) 
+				|| ((sh.version >= SliceIndexHeader::GENERATION_VERSION) 
+					&& (_indexFd.read(&sh.generation, sizeof(sh.generation)) != sizeof(sh.generation)))) {
 				log::Fatal::L("Can't read slice indexFile header %s\n", indexFileName.c_str());
 				throw SliceError("Can't read slice indexFile header");
 			}
@@ -121,7 +227,12 @@ void Slice::_openIndexFile(BString &indexFileName)
 				log::Fatal::L("SliceID mismatch in %s, %u != %u\n", indexFileName.c_str(), _sliceID, sh.sliceID);
 				throw SliceError("SliceID mismatch");
 			}
-			_indexFd.seek(0, SEEK_END);
+			if (sh.version < SliceIndexHeader::CURRENT_VERSION) {
+				_upgradeIndexFile(indexFileName, sh.version);
+			} else {
+				_indexGeneration = sh.generation;
+				_indexFd.seek(0, SEEK_END);
+			}
 		}
 		catch (SliceError &er)
 		{
@@ -130,40 +241,138 @@ void Slice::_openIndexFile(BString &indexFileName)
 	}
 }
 
-Slice::Slice(const TSliceID sliceID, BString &dataFileName, BString &indexFileName)
-	: _sliceID(sliceID)
+Slice::Slice(const TSliceID sliceID, BString &dataFileName, BString &indexFileName, const uint32_t dirID)
+	: _sliceID(sliceID), _dirID(dirID), _dataFileName(dataFileName.c_str()), _indexFileName(indexFileName.c_str()), 
+		_size(0), _version(SliceDataHeader::CURRENT_VERSION), _indexGeneration(0), _deadSize(0), _punchedSize(0), _isCompacting(false), 
+		_activeWriters(0), _activeReaders(0), _holesCount(0), _writeSeq(0), _syncedSeq(0)
 {
 	_openDataFile(dataFileName);
 	_openIndexFile(indexFileName);
 }
 
-bool Slice::_writeItem(const char *data, IndexEntry &ie)
+bool Slice::_writeVector(struct iovec *iov, const size_t count, TSeek seek)
 {
-	if (_dataFd.seek(_size, SEEK_SET) != (off_t)_size) {
-		log::Fatal::L("Can't seek slice dataFile %u\n", _sliceID);
-		return false;
+	for (size_t i = 0; i < count; ) {
+		size_t iovCount = count - i;
+		if (iovCount > IOV_MAX)
+			iovCount = IOV_MAX;
+		ssize_t writeSize = 0;
+		for (size_t j = i; j < (i + iovCount); j++)
+			writeSize += iov[j].iov_len;
+		if (pwritev(_dataFd.descr(), iov + i, iovCount, seek) != writeSize)
+			return false;
+		seek += writeSize;
+		i += iovCount;
 	}
-	const ItemHeader &itemHeader = ie.header;
-	if (_dataFd.write(&itemHeader, sizeof(itemHeader)) != sizeof(itemHeader)) {
-		log::Fatal::L("Can't write header to slice dataFile %u\n", _sliceID);
-		return false;
+	return true;
+}
+
+void Slice::_writeBatch()
+{
+	AutoMutex autoSync(&_pendingSync);
+	TPendingWriteVector batch;
+	batch.swap(_pendingWrites);
+	autoSync.unLock();
+	
+	const bool hasCrc = (_version >= SliceDataHeader::CRC_VERSION);
+	std::vector<struct iovec> iov;
+	iov.reserve(batch.size() * 3);
+	std::vector<IndexEntry> indexEntries;
+	indexEntries.reserve(batch.size());
+	TSeek seek = _size;
+	size_t itemsCount = 0;
+	for (auto pw = batch.begin(); pw != batch.end(); pw++) {
+		IndexEntry &ie = (*pw)->ie;
+		ItemHeader &diskHeader = (*pw)->diskHeader;
+		struct iovec headerVec[2] = {{&diskHeader, sizeof(diskHeader)}, {&ie.crc, sizeof(ie.crc)}};
+		if ((*pw)->isCommit) {
+			if (!_writeVector(headerVec, hasCrc ? 2 : 1, ie.pointer.seek)) {
+				log::Fatal::L("Can't write committed header to slice dataFile %u\n", _sliceID);
+				(*pw)->done = true;
+				continue;
+			}
+		} else {
+			ie.pointer.sliceID = _sliceID;
+			ie.pointer.seek = seek;
+			struct iovec dataVec = {(void*)(*pw)->data, diskHeader.size};
+			iov.push_back(headerVec[0]);
+			if (hasCrc)
+				iov.push_back(headerVec[1]);
+			iov.push_back(dataVec);
+			seek += itemHeaderSize() + diskHeader.size;
+			itemsCount++;
+		}
+		indexEntries.push_back(ie);
 	}
-	if (_dataFd.write(data, itemHeader.size) != (ssize_t)itemHeader.size) {
-		log::Fatal::L("Can't write data to slice dataFile %u\n", _sliceID);
-		return false;
+	
+	bool dataWritten = _writeVector(iov.data(), iov.size(), _size);
+	if (!dataWritten) {
+		log::Fatal::L("Can't write %zu items to slice dataFile %u\n", itemsCount, _sliceID);
+		_dataFd.truncate(_size);
+		indexEntries.clear();
+		for (auto pw = batch.begin(); pw != batch.end(); pw++) {
+			if ((*pw)->isCommit && !(*pw)->done)
+				indexEntries.push_back((*pw)->ie);
+		}
 	}
+	
+	bool indexWritten = true;
+	if (!indexEntries.empty()) {
+		TSeek curIndexSeek = _indexFd.seek(0, SEEK_CUR);
+		ssize_t indexSize = sizeof(IndexEntry) * indexEntries.size();
+		if (_indexFd.write(indexEntries.data(), indexSize) != indexSize) {
+			log::Fatal::L("Can't write %zu index entries to slice indexFile %u\n", indexEntries.size(), _sliceID);
+			_indexFd.truncate(curIndexSeek);
+			_indexFd.seek(curIndexSeek, SEEK_SET);
+			_dataFd.truncate(_size);
+			indexWritten = false;
+		}
+	}
+	if (dataWritten && indexWritten)
+		_size = seek;
+	
+	for (auto pw = batch.begin(); pw != batch.end(); pw++) {
+		if (!(*pw)->done) {
+			(*pw)->result = indexWritten && ((*pw)->isCommit || dataWritten);
+			(*pw)->done = true;
+		}
+	}
+	__sync_add_and_fetch(&_writeSeq, 1);
+}
 
-	ie.pointer.sliceID = _sliceID;
-	ie.pointer.seek = _size;
-		
-	if (_indexFd.write(&ie, sizeof(ie)) != sizeof(ie))	{
-		log::Fatal::L("Can't write index entry to slice indexFile %u\n", _sliceID);
+bool Slice::_queueAndWrite(PendingWrite &pendingWrite)
+{
+	AutoMutex autoSync(&_pendingSync);
+	_pendingWrites.push_back(&pendingWrite);
+	autoSync.unLock();
+	
+	AutoReadWriteLockWrite autoSyncWrite(&_sync);
+	if (!pendingWrite.done) // the write hasn't been taken by a previous batch, so this thread writes the current one
+		_writeBatch();
+	return pendingWrite.result;
+}
+
+bool Slice::sync()
+{
+	uint64_t writeSeq = __sync_add_and_fetch(&_writeSeq, 0); // the caller's writes are already counted
+	AutoMutex autoSync(&_fsyncSync);
+	if (_syncedSeq >= writeSeq) // a concurrent fdatasync has covered the caller's writes
+		return true;
+	writeSeq = __sync_add_and_fetch(&_writeSeq, 0);
+	if (fdatasync(_dataFd.descr()) || fdatasync(_indexFd.descr())) {
+		log::Fatal::L("Can't flush slice %u\n", _sliceID);
 		return false;
 	}
-	_size = _dataFd.seek(0, SEEK_CUR);
+	_syncedSeq = writeSeq;
 	return true;
 }
 
+bool Slice::isSynced()
+{
+	AutoMutex autoSync(&_fsyncSync);
+	return _syncedSeq >= __sync_add_and_fetch(&_writeSeq, 0);
+}
+
 bool Slice::_writeItem(File &putTmpFile, BString &buf, IndexEntry &ie)
 {
 	if (_dataFd.seek(_size, SEEK_SET) != (off_t)_size) {
@@ -175,6 +384,13 @@ bool Slice::_writeItem(File &putTmpFile, BString &buf, IndexEntry &ie)
 		log::Fatal::L("Can't write header to slice dataFile %u\n", _sliceID);
 		return false;
 	}
+	const bool hasCrc = (_version >= SliceDataHeader::CRC_VERSION);
+	const TSeek crcSeek = _size + sizeof(itemHeader);
+	ie.crc = 0;
+	if (hasCrc && (_dataFd.seek(sizeof(ie.crc), SEEK_CUR) != (off_t)(crcSeek + sizeof(ie.crc)))) {
+		log::Fatal::L("Can't seek slice dataFile %u\n", _sliceID);
+		return false;
+	}
 	auto leftSize = ie.header.size;
 	while (leftSize > 0) {
 		TItemSize chunkSize = MAX_BUF_SIZE;
@@ -189,8 +405,14 @@ bool Slice::_writeItem(File &putTmpFile, BString &buf, IndexEntry &ie)
 			log::Fatal::L("Can't write data to slice dataFile %u\n", _sliceID);
 			return false;
 		}
+		ie.crc = crc32c(ie.crc, buf.c_str(), buf.size());
 		leftSize -= chunkSize;
 	}
+	// the checksum is known only after the data has been copied
+	if (hasCrc && (_dataFd.pwrite(&ie.crc, sizeof(ie.crc), crcSeek) != sizeof(ie.crc))) {
+		log::Fatal::L("Can't write checksum to slice dataFile %u\n", _sliceID);
+		return false;
+	}
 	ie.pointer.sliceID = _sliceID;
 	ie.pointer.seek = _size;
 		
@@ -209,25 +431,121 @@ bool Slice::add(File &putTmpFile, BString &buf, IndexEntry &ie)
 	if (!_writeItem(putTmpFile, buf, ie)) {
 		_dataFd.truncate(_size);
 		_indexFd.truncate(curIndexSeek);
+		_indexFd.seek(curIndexSeek, SEEK_SET);
 		return false;
 	}
+	__sync_add_and_fetch(&_writeSeq, 1);
 	return true;
 }
 
 bool Slice::add(const char *data, IndexEntry &ie)
+{
+	ie.crc = crc32c(0, data, ie.header.size); // out of the write lock
+	PendingWrite pendingWrite(ie, data, ie.header.size, false);
+	return _queueAndWrite(pendingWrite);
+}
+
+bool Slice::addCompressed(const char *data, const TItemSize compressedSize, IndexEntry &ie)
+{
+	PendingWrite pendingWrite(ie, data, compressedSize, false);
+	return _queueAndWrite(pendingWrite);
+}
+
+bool Slice::reserve(IndexEntry &ie)
 {
 	AutoReadWriteLockWrite autoSyncWrite(&_sync);
-	TSeek curIndexSeek = _indexFd.seek(0, SEEK_CUR);
-	if (!_writeItem(data, ie)) {
+	ItemHeader reservedHeader = ie.header;
+	reservedHeader.status |= ST_ITEM_DELETED; // the item is invisible for index rebuilding until it is committed
+	TSeek endSeek = _size + itemHeaderSize() + reservedHeader.size;
+	if (fallocate(_dataFd.descr(), 0, _size, endSeek - _size) && !_dataFd.truncate(endSeek)) {
+		log::Fatal::L("Can't reserve %u bytes in slice dataFile %u\n", endSeek - _size, _sliceID);
+		return false;
+	}
+	if (_dataFd.pwrite(&reservedHeader, sizeof(reservedHeader), _size) != sizeof(reservedHeader)) {
+		log::Fatal::L("Can't write reserved header to slice dataFile %u\n", _sliceID);
 		_dataFd.truncate(_size);
-		_indexFd.truncate(curIndexSeek);
 		return false;
 	}
+	ie.pointer.sliceID = _sliceID;
+	ie.pointer.seek = _size;
+	_size = endSeek;
+	return true;
+}
+
+bool Slice::writeReserved(IndexEntry &ie, const TItemSize seek, const char *data, const TItemSize size)
+{
+	TSeek dataSeek = ie.pointer.seek + itemHeaderSize() + seek;
+	if (_dataFd.pwrite(data, size, dataSeek) != (ssize_t)size) {
+		log::Fatal::L("Can't write reserved data to slice dataFile %u, seek %u\n", _sliceID, dataSeek);
+		return false;
+	}
+	ie.crc = crc32c(seek ? ie.crc : 0, data, size);
 	return true;
 }
 
-bool Slice::remove(const ItemHeader &ih, const ItemPointer &pointer)
+bool Slice::commitReserved(IndexEntry &ie)
 {
+	PendingWrite pendingWrite(ie, NULL, ie.header.size, true);
+	return _queueAndWrite(pendingWrite);
+}
+
+static const TSeek PUNCH_HOLE_ALIGN = 4096;
+
+TSeek Slice::holeSize(const TSeek seek, const TItemSize size) const
+{
+	TSeek startSeek = seek + itemHeaderSize();
+	TSeek endSeek = (startSeek + size) & ~(PUNCH_HOLE_ALIGN - 1);
+	startSeek = (startSeek + PUNCH_HOLE_ALIGN - 1) & ~(PUNCH_HOLE_ALIGN - 1);
+	return (endSeek > startSeek) ? (endSeek - startSeek) : 0;
+}
+
+TSeek Slice::_punchHole(const TSeek seek, const TItemSize size)
+{
+	TSeek startSeek = seek + itemHeaderSize(); // the header is kept for index rebuilding
+	TSeek endSeek = startSeek + size;
+	startSeek = (startSeek + PUNCH_HOLE_ALIGN - 1) & ~(PUNCH_HOLE_ALIGN - 1);
+	endSeek &= ~(PUNCH_HOLE_ALIGN - 1);
+	if (endSeek <= startSeek)
+		return 0;
+	if (fallocate(_dataFd.descr(), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, startSeek, endSeek - startSeek)) {
+		log::Warning::L("Can't punch a hole in slice dataFile %u, seek %u (%d)\n", _sliceID, startSeek, errno);
+		return 0;
+	}
+	__sync_add_and_fetch(&_punchedSize, endSeek - startSeek);
+	return endSeek - startSeek;
+}
+
+void Slice::_punchHolesNoLock()
+{
+	for (auto hole = _holes.begin(); hole != _holes.end(); hole++)
+		_punchHole(hole->first, hole->second);
+	_holes.clear();
+	_holesCount = 0;
+}
+
+void Slice::addHole(const TSeek seek, const TItemSize size)
+{
+	AutoMutex autoSync(&_holesSync);
+	_holes.push_back(std::make_pair(seek, size));
+	__sync_add_and_fetch(&_holesCount, 1);
+	// the readers pinned later have found other items, as this one has left the index before
+	if (__sync_add_and_fetch(&_activeReaders, 0) == 0)
+		_punchHolesNoLock();
+}
+
+void Slice::endRead()
+{
+	if (__sync_sub_and_fetch(&_activeReaders, 1) || !__sync_add_and_fetch(&_holesCount, 0))
+		return;
+	AutoMutex autoSync(&_holesSync);
+	if (__sync_add_and_fetch(&_activeReaders, 0) == 0)
+		_punchHolesNoLock();
+}
+
+bool Slice::remove(const ItemHeader &ih, const ItemPointer &pointer, const TItemSize punchHoleMinSize, 
+	TItemSize &holeSize)
+{
+	holeSize = 0;
 	AutoReadWriteLockWrite autoSyncRead(&_sync);
 	if (pointer.seek >= _size) {
 		log::Fatal::L("Can't remove out of range seek sliceID %u, seek %u\n", _sliceID, pointer.seek);
@@ -257,12 +575,15 @@ bool Slice::remove(const ItemHeader &ih, const ItemPointer &pointer)
 		diskItemHeader.timeTag = ih.timeTag;
 		ie.header = diskItemHeader;
 		ie.pointer = pointer;
+		ie.crc = 0;
 
 		if (_indexFd.write(&ie, sizeof(ie)) != sizeof(ie))	{
 			log::Fatal::L("Can't write remove index entry to slice indexFile %u\n", _sliceID);
 			return false;
 		}
-	
+		__sync_add_and_fetch(&_writeSeq, 1);
+		if (punchHoleMinSize && (diskItemHeader.size >= punchHoleMinSize))
+			holeSize = diskItemHeader.size;
 		return true;
 	} else {
 		log::Fatal::L("Can't delete the newer item\n", _sliceID, pointer.seek);
@@ -270,10 +591,108 @@ bool Slice::remove(const ItemHeader &ih, const ItemPointer &pointer)
 	}
 }
 
+bool Slice::addTombstone(IndexEntry &ie)
+{
+	AutoReadWriteLockWrite autoSyncWrite(&_sync);
+	ie.header.status |= ST_ITEM_DELETED;
+	ie.pointer.sliceID = _sliceID;
+	ie.pointer.seek = 0;
+	ie.crc = 0;
+	if (_indexFd.write(&ie, sizeof(ie)) != sizeof(ie))	{
+		log::Fatal::L("Can't write tombstone index entry to slice indexFile %u\n", _sliceID);
+		return false;
+	}
+	__sync_add_and_fetch(&_writeSeq, 1);
+	return true;
+}
+
+bool Slice::markCorrupted(IndexEntry &ie)
+{
+	AutoReadWriteLockWrite autoSyncWrite(&_sync);
+	ie.pointer.sliceID = _sliceID;
+	ie.pointer.seek = 0;
+	if (_indexFd.write(&ie, sizeof(ie)) != sizeof(ie))	{
+		log::Fatal::L("Can't write corrupted item index entry to slice indexFile %u\n", _sliceID);
+		return false;
+	}
+	__sync_add_and_fetch(&_writeSeq, 1);
+	return true;
+}
+
+void Slice::setLiveSize(const TSeek liveSize, const uint64_t liveItems)
+{
+	TSeek usedSize = _size - sizeof(SliceDataHeader);
+	TSeek liveDiskSize = liveSize + liveItems * itemHeaderSize();
+	_deadSize = (liveDiskSize < usedSize) ? (usedSize - liveDiskSize) : 0;
+	struct stat fileStat;
+	if (fstat(_dataFd.descr(), &fileStat) == 0) {
+		off_t allocatedSize = fileStat.st_blocks * 512;
+		_punchedSize = (allocatedSize < _size) ? (_size - allocatedSize) : 0;
+		if (_punchedSize > _deadSize)
+			_punchedSize = _deadSize;
+	}
+}
+
+double Slice::deadRatio() const
+{
+	// punched holes don't take disk space, so there is nothing to win by copying around them
+	TSeek deadSize = _deadSize;
+	TSeek punchedSize = _punchedSize;
+	if (deadSize <= punchedSize)
+		return 0;
+	TSeek usedSize = _size - sizeof(SliceDataHeader) - punchedSize;
+	return (double)(deadSize - punchedSize) / usedSize;
+}
+
+bool Slice::beginWrite()
+{
+	__sync_add_and_fetch(&_activeWriters, 1);
+	__sync_synchronize();
+	if (_isCompacting) {
+		endWrite();
+		return false;
+	}
+	return true;
+}
+
+bool Slice::setCompacting()
+{
+	_isCompacting = true;
+	__sync_synchronize();
+	if (_activeWriters) { // somebody is still writing to the slice, which has been just replaced in a write slot
+		_isCompacting = false;
+		return false;
+	}
+	return true;
+}
+
+bool Slice::openData(File &dataFd)
+{
+	if (!dataFd.open(_dataFileName.c_str(), O_RDONLY)) {
+		log::Error::L("Can't open slice dataFile %s\n", _dataFileName.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool Slice::unlinkFiles()
+{
+	bool res = true;
+	if (unlink(_dataFileName.c_str())) {
+		log::Error::L("Can't unlink slice dataFile %s\n", _dataFileName.c_str());
+		res = false;
+	}
+	if (unlink(_indexFileName.c_str())) {
+		log::Error::L("Can't unlink slice indexFile %s\n", _indexFileName.c_str());
+		res = false;
+	}
+	return res;
+}
+
 bool Slice::get(BString &data, const TItemSize dataSeek, const TItemSize requestSeek, const TItemSize requestSize)
 {
 	AutoReadWriteLockRead autoSyncRead(&_sync);
-	TSeek seek = dataSeek + requestSeek + sizeof(ItemHeader);
+	TSeek seek = dataSeek + requestSeek + itemHeaderSize();
 	if ((seek +  requestSize) > _size) {
 		log::Fatal::L("Can't get out of range sliceID %u, seek %u\n", _sliceID, (dataSeek +  requestSeek +  requestSize));
 		return false;
@@ -286,6 +705,49 @@ bool Slice::get(BString &data, const TItemSize dataSeek, const TItemSize request
 
 }
 
+bool Slice::getFileChunk(const TItemSize dataSeek, const TItemSize requestSeek, const TItemSize requestSize, 
+	off_t &fileSeek)
+{
+	AutoReadWriteLockRead autoSyncRead(&_sync);
+	TSeek seek = dataSeek + requestSeek + itemHeaderSize();
+	if ((seek +  requestSize) > _size) {
+		log::Fatal::L("Can't get out of range sliceID %u, seek %u\n", _sliceID, (dataSeek +  requestSeek +  requestSize));
+		return false;
+	}
+	fileSeek = seek;
+	return true;
+}
+
+bool Slice::getStoredSize(const TSeek itemSeek, TItemSize &storedSize)
+{
+	AutoReadWriteLockRead autoSyncRead(&_sync);
+	ItemHeader diskHeader;
+	if ((itemSeek >= _size) || (_dataFd.pread(&diskHeader, sizeof(diskHeader), itemSeek) != sizeof(diskHeader))) {
+		log::Fatal::L("Can't read an item header from sliceID %u, seek %u\n", _sliceID, itemSeek);
+		return false;
+	}
+	storedSize = diskHeader.size;
+	return true;
+}
+
+bool Slice::getStored(BString &data, const TSeek itemSeek)
+{
+	TItemSize storedSize = 0;
+	if (!getStoredSize(itemSeek, storedSize))
+		return false;
+	AutoReadWriteLockRead autoSyncRead(&_sync);
+	TSeek seek = itemSeek + itemHeaderSize();
+	if ((seek + storedSize) > _size) {
+		log::Fatal::L("Can't get out of range sliceID %u, seek %u\n", _sliceID, seek + storedSize);
+		return false;
+	}
+	if (_dataFd.pread(data.reserveBuffer(storedSize), storedSize, seek) != (ssize_t)storedSize) {
+		log::Fatal::L("Can't read data file from seek sliceID %u, seek %u\n", _sliceID, seek);
+		return false;
+	}
+	return true;
+}
+
 bool Slice::get(BString &data, const ItemRequest &item)
 {
 	AutoReadWriteLockRead autoSyncRead(&_sync);
@@ -293,69 +755,106 @@ bool Slice::get(BString &data, const ItemRequest &item)
 		log::Fatal::L("Can't get out of range sliceID %u, seek %u\n", _sliceID, item.pointer.seek);
 		return false;
 	}
-	ssize_t readSize = item.size + sizeof(ItemHeader);
-	if (_dataFd.pread(data.reserveBuffer(readSize), readSize, item.pointer.seek) != readSize) {
+	if ((_dataFd.pread(data.reserveBuffer(sizeof(ItemHeader)), sizeof(ItemHeader), item.pointer.seek) 
+		!= sizeof(ItemHeader)) || (_dataFd.pread(data.reserveBuffer(item.size), item.size, 
+		item.pointer.seek + itemHeaderSize()) != (ssize_t)item.size)) {
 		log::Fatal::L("Can't read data file from seek sliceID %u, seek %u\n", _sliceID, item.pointer.seek);
 		return false;
 	}
 	return true;
 }
 
-bool Slice::loadIndex(Index &index, Buffer &buf)
+void Slice::getIndexPosition(uint64_t &generation, uint64_t &seek)
 {
-	auto leftSize = _indexFd.fileSize();
-	_indexFd.seek(sizeof(SliceIndexHeader), SEEK_SET);
-	leftSize -= sizeof(SliceIndexHeader);
-	while (leftSize > 0) {
-		static uint32_t CHUNK_SIZE = sizeof(IndexEntry) * 100000;
-		
-		ssize_t readSize = CHUNK_SIZE;
-		if (readSize > leftSize)
-			readSize = leftSize;
-		buf.clear();
-		if (_indexFd.read(buf.reserveBuffer(readSize), readSize) != readSize) {
-			log::Fatal::L("Can't read data index from sliceID %u\n", _sliceID);
-			return false;
-		}
-		leftSize -= readSize;
-		while (buf.readPos() < buf.writtenSize()) {
-			IndexEntry &ie = *(IndexEntry*)buf.mapBuffer(sizeof(IndexEntry));
-			if (ie.header.status & ST_ITEM_DELETED)
-				index.remove(ie.header);
-			else
-				index.addNoLock(ie);
-		}
+	AutoReadWriteLockWrite autoSyncWrite(&_sync);
+	generation = _indexGeneration;
+	seek = _indexFd.fileSize();
+}
+
+bool Slice::isIndexPosition(const uint64_t generation, const uint64_t seek)
+{
+	if ((generation != _indexGeneration) || (seek < sizeof(SliceIndexHeader)) 
+		|| ((uint64_t)_indexFd.fileSize() < seek))
+		return false;
+	if ((seek - sizeof(SliceIndexHeader)) % sizeof(IndexEntry)) {
+		log::Error::L("Checkpoint position %llu of sliceID %u isn't on an index entry boundary\n", 
+			(unsigned long long)seek, _sliceID);
+		return false;
 	}
 	return true;
 }
 
-SliceManager::SliceManager(const char *path, const double minFree, const TSize maxSliceSize)
-	: _path(path), _minFree(minFree), _leftSpace(0), _maxSliceSize(maxSliceSize)
+bool Slice::loadIndex(Index &index, const off_t fromSeek)
 {
+	off_t fileSize = _indexFd.fileSize();
+	off_t startSeek = (fromSeek > (off_t)sizeof(SliceIndexHeader)) ? fromSeek : sizeof(SliceIndexHeader);
+	if (fileSize <= startSeek)
+		return true;
+	void *indexMap = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, _indexFd.descr(), 0);
+	if (indexMap == MAP_FAILED) {
+		log::Fatal::L("Can't map data index of sliceID %u (%d)\n", _sliceID, errno);
+		return false;
+	}
+	madvise(indexMap, fileSize, MADV_SEQUENTIAL);
+	size_t entriesCount = (fileSize - startSeek) / sizeof(IndexEntry);
+	if ((fileSize - startSeek) % sizeof(IndexEntry))
+		log::Error::L("Data index of sliceID %u has a truncated entry at the end\n", _sliceID);
+	
+	const IndexEntry *ie = (const IndexEntry *)((const char*)indexMap + startSeek);
+	const IndexEntry *endIE = ie + entriesCount;
+	for (; ie < endIE; ie++) {
+		if (ie->header.status & ST_ITEM_DELETED)
+			index.addTombstoneNoLock(*ie);
+		else
+			index.addNoLock(*ie);
+	}
+	munmap(indexMap, fileSize);
+	return true;
+}
+
+SliceManager::SliceManager(const char *path, const double minFree, const TSize maxSliceSize, 
+	const StorageOptions &options)
+	: _minFree(minFree), _maxSliceSize(maxSliceSize), _options(options), 
+		_writeSlices(options.writeSlices ? options.writeSlices : 1), _nextWriteSlice(0)
+{
+	std::string paths(path);
+	std::string::size_type start = 0;
+	while (start <= paths.size()) {
+		auto end = paths.find(',', start);
+		if (end == std::string::npos)
+			end = paths.size();
+		if (end > start)
+			_dirs.push_back(DataDir(paths.substr(start, end - start)));
+		start = end + 1;
+	}
+	if (_dirs.empty())
+		throw SliceError("Data path is empty");
+	
 	if (!_recalcSpace())
 		throw SliceError("Can't recalculate disk space");
-	_init();
+	for (uint32_t dirID = 0; dirID < _dirs.size(); dirID++)
+		_init(dirID);
 }
 
 
-void SliceManager::_formDataPath(BString &path)
+void SliceManager::_formDataPath(BString &path, const uint32_t dirID)
 {
-	path.sprintfSet("%s/data", _path.c_str());
+	path.sprintfSet("%s/data", _dirs[dirID].path.c_str());
 }
 
-void SliceManager::_formIndexPath(BString &path)
+void SliceManager::_formIndexPath(BString &path, const uint32_t dirID)
 {
-	path.sprintfSet("%s/index", _path.c_str());
+	path.sprintfSet("%s/index", _dirs[dirID].path.c_str());
 }
 
-void SliceManager::_init()
+void SliceManager::_init(const uint32_t dirID)
 {
 	BString dataPath;
-	_formDataPath(dataPath);
+	_formDataPath(dataPath, dirID);
 	Directory::makeDirRecursive(dataPath.c_str());
 	
 	BString indexPath;
-	_formIndexPath(indexPath);
+	_formIndexPath(indexPath, dirID);
 	Directory::makeDirRecursive(indexPath.c_str());
 	
 	try
@@ -367,9 +866,14 @@ void SliceManager::_init()
 			if (dir.name()[0] == '.')
 				continue;
 			TSliceID sliceID = strtoul(dir.name(), NULL, 10);
+			if ((sliceID < _slices.size()) && _slices[sliceID].get()) {
+				log::Fatal::L("Slice %u is found in %s and %s\n", sliceID, _dirs[_slices[sliceID]->dirID()].path.c_str(), 
+					_dirs[dirID].path.c_str());
+				throw SliceError("Slice is duplicated in data paths");
+			}
 			dataFileName.sprintfSet("%s/%u", dataPath.c_str(), sliceID);
 			indexFileName.sprintfSet("%s/%u", indexPath.c_str(), sliceID);
-			TSlicePtr slice(new Slice(sliceID, dataFileName, indexFileName));
+			TSlicePtr slice(new Slice(sliceID, dataFileName, indexFileName, dirID));
 			if (sliceID >= _slices.size())
 				_slices.resize(sliceID + 1);
 			_slices[sliceID] = slice;
@@ -383,65 +887,175 @@ void SliceManager::_init()
 	throw SliceError("Can't initialize sliceManager");
 }
 
-bool SliceManager::findWriteSlice(const TItemSize size)
-{
-	if ((int64_t)size > _leftSpace)
-		return false;
-	
-	AutoMutex autoSync(&_sync);
+thread_local size_t SliceManager::_writeShard = SliceManager::NO_WRITE_SHARD;
 
-	if ((_writeSlice.get() == NULL) || ((_writeSlice->size() + size) > _maxSliceSize))	{
-		if (!_addWriteSlice(size))
-			return false;
+bool SliceManager::findWriteSlice(const TItemSize size, TSlicePtr &slice)
+{
+	static const int MAX_FIND_ATTEMPTS = 3;
+	for (int attempt = 0; attempt < MAX_FIND_ATTEMPTS; attempt++) {
+		size_t slot;
+		if (_writeShard != NO_WRITE_SHARD) // the next slots are only tried, when the own one is being compacted
+			slot = (_writeShard + attempt) % _writeSlices.size();
+		else
+			slot = __sync_fetch_and_add(&_nextWriteSlice, 1) % _writeSlices.size();
+		slice = std::atomic_load(&_writeSlices[slot]);
+		if ((slice.get() == NULL) || ((slice->size() + size) > _maxSliceSize) 
+			|| ((int64_t)size > _dirs[slice->dirID()].leftSpace))	{
+			AutoMutex autoSync(&_sync);
+			slice = _writeSlices[slot];
+			if ((slice.get() == NULL) || ((slice->size() + size) > _maxSliceSize) 
+				|| ((int64_t)size > _dirs[slice->dirID()].leftSpace))	{
+				if (!_addWriteSlice(size, slot))
+					return false;
+				slice = _writeSlices[slot];
+			}
+		}
+		// each successful call has to be finished with Slice::endWrite, it keeps the compactor away from the slice
+		if (slice->beginWrite())
+			return true;
 	}
-	return true;
+	return false;
 }
 
 bool SliceManager::add(File &putTmpFile, BString &buf, IndexEntry &ie)
 {
-	if (!findWriteSlice(ie.header.size))
+	TSlicePtr slice;
+	if (!findWriteSlice(ie.header.size, slice))
 		return false;
-	if (_writeSlice->add(putTmpFile, buf, ie))
+	DataDir &dataDir = _dirs[slice->dirID()];
+	__sync_add_and_fetch(&dataDir.pendingWrites, 1);
+	bool res = slice->add(putTmpFile, buf, ie);
+	__sync_sub_and_fetch(&dataDir.pendingWrites, 1);
+	slice->endWrite();
+	if (res)
 	{
-		__sync_sub_and_fetch(&_leftSpace, ie.header.size);
-		return true;
+		__sync_sub_and_fetch(&dataDir.leftSpace, ie.header.size);
+		return _syncSlice(slice);
 	} else {
 		return false;
 	}		
 }
 
-bool SliceManager::add(const char *data, IndexEntry &ie)
+bool SliceManager::reserve(IndexEntry &ie, TSlicePtr &slice)
 {
-	if (!findWriteSlice(ie.header.size))
+	if (!findWriteSlice(ie.header.size, slice))
 		return false;
-
-	if (_writeSlice->add(data, ie))
+	if (slice->reserve(ie))
 	{
-		__sync_sub_and_fetch(&_leftSpace, ie.header.size);
+		__sync_sub_and_fetch(&_dirs[slice->dirID()].leftSpace, ie.header.size);
 		return true;
+	} else {
+		slice->endWrite();
+		return false;
+	}
+}
+
+bool SliceManager::add(const char *data, IndexEntry &ie)
+{
+	return _add(data, ie.header.size, ie);
+}
+
+bool SliceManager::addCompressed(const char *data, const TItemSize compressedSize, IndexEntry &ie)
+{
+	ie.header.status |= ST_ITEM_COMPRESSED;
+	return _add(data, compressedSize, ie);
+}
+
+bool SliceManager::_add(const char *data, const TItemSize storedSize, IndexEntry &ie)
+{
+	TSlicePtr slice;
+	if (!findWriteSlice(storedSize, slice))
+		return false;
+	DataDir &dataDir = _dirs[slice->dirID()];
+	__sync_add_and_fetch(&dataDir.pendingWrites, 1);
+	bool res = (ie.header.status & ST_ITEM_COMPRESSED) ? slice->addCompressed(data, storedSize, ie) 
+		: slice->add(data, ie);
+	__sync_sub_and_fetch(&dataDir.pendingWrites, 1);
+	slice->endWrite();
+	if (res)
+	{
+		__sync_sub_and_fetch(&dataDir.leftSpace, storedSize);
+		return _syncSlice(slice);
 	} else {
 		return false;
 	}
 }
 
-bool SliceManager::remove(const ItemHeader &ih, const ItemPointer &pointer)
+bool SliceManager::commitReserved(const TSlicePtr &slice, IndexEntry &ie)
+{
+	bool res = slice->commitReserved(ie);
+	slice->endWrite();
+	if (!res) {
+		slice->addDeadSize(slice->itemHeaderSize() + ie.header.size);
+		return false;
+	}
+	return _syncSlice(slice);
+}
+
+void SliceManager::abortReserved(const TSlicePtr &slice, const IndexEntry &ie)
+{
+	slice->addDeadSize(slice->itemHeaderSize() + ie.header.size);
+	slice->endWrite();
+}
+
+bool SliceManager::_syncSlice(const TSlicePtr &slice)
+{
+	if (_options.fsyncPolicy != FSYNC_BATCH)
+		return true;
+	return slice->sync();
+}
+
+bool SliceManager::flush()
 {
 	AutoMutex autoSync(&_sync);
-	if (pointer.sliceID >= _slices.size())
+	TSliceVector slices(_slices);
+	autoSync.unLock();
+	bool res = true;
+	for (auto slice = slices.begin(); slice != slices.end(); slice++) {
+		if (slice->get() && !(*slice)->isSynced()) {
+			if (!(*slice)->sync())
+				res = false;
+		}
+	}
+	return res;
+}
+
+bool SliceManager::remove(const ItemHeader &ih, const ItemPointer &pointer, TItemSize &holeSize)
+{
+	AutoMutex autoSync(&_sync);
+	if ((pointer.sliceID >= _slices.size()) || (_slices[pointer.sliceID].get() == NULL))
 	{
 		log::Error::L("Can't get slice %u\n", pointer.sliceID);
 		return false;
 	}
 	TSlicePtr slice = _slices[pointer.sliceID];
 	autoSync.unLock();
-	return slice->remove(ih, pointer);
-	
+	if (!slice->remove(ih, pointer, _options.punchHoleMinSize, holeSize))
+		return false;
+	return _syncSlice(slice);
+}
+
+void SliceManager::_punchRetiredHole(void *data)
+{
+	RetiredHole *hole = (RetiredHole*)data;
+	hole->slice->addHole(hole->seek, hole->size);
+	delete hole;
+}
+
+void SliceManager::punchHole(const ItemPointer &pointer, const TItemSize holeSize)
+{
+	TSlicePtr slice = _getSlice(pointer.sliceID);
+	if (!slice)
+		return;
+	// a reader could have found the item in the index just before it was removed, so the hole waits for it
+	__sync_add_and_fetch(&_dirs[slice->dirID()].leftSpace, slice->holeSize(pointer.seek, holeSize));
+	Epoch::retire(new RetiredHole{slice, pointer.seek, holeSize}, &SliceManager::_punchRetiredHole);
 }
 
 bool SliceManager::get(BString &data, const ItemPointer &pointer, const TItemSize seek, const TItemSize size)
 {
 	AutoMutex autoSync(&_sync);
-	if (pointer.sliceID >= _slices.size())
+	if ((pointer.sliceID >= _slices.size()) || (_slices[pointer.sliceID].get() == NULL))
 	{
 		log::Error::L("Can't get slice %u\n", pointer.sliceID);
 		return false;
@@ -452,10 +1066,49 @@ bool SliceManager::get(BString &data, const ItemPointer &pointer, const TItemSiz
 
 }
 
+bool SliceManager::getFileChunk(const ItemPointer &pointer, const TItemSize seek, const TItemSize size, 
+	TSlicePtr &slice, off_t &fileSeek)
+{
+	AutoMutex autoSync(&_sync);
+	if ((pointer.sliceID >= _slices.size()) || (_slices[pointer.sliceID].get() == NULL))
+	{
+		log::Error::L("Can't get slice %u\n", pointer.sliceID);
+		return false;
+	}
+	TSlicePtr readSlice = _slices[pointer.sliceID];
+	autoSync.unLock();
+	if (!readSlice->getFileChunk(pointer.seek, seek, size, fileSeek))
+		return false;
+	// the slice stays pinned for the read, until the caller releases it
+	readSlice->beginRead();
+	slice.reset(readSlice.get(), [readSlice](Slice *) { readSlice->endRead(); });
+	return true;
+}
+
+bool SliceManager::getStored(BString &data, const ItemPointer &pointer)
+{
+	TSlicePtr slice = _getSlice(pointer.sliceID);
+	if (!slice) {
+		log::Error::L("Can't get slice %u\n", pointer.sliceID);
+		return false;
+	}
+	return slice->getStored(data, pointer.seek);
+}
+
+bool SliceManager::getStoredSize(const ItemPointer &pointer, TItemSize &storedSize)
+{
+	TSlicePtr slice = _getSlice(pointer.sliceID);
+	if (!slice) {
+		log::Error::L("Can't get slice %u\n", pointer.sliceID);
+		return false;
+	}
+	return slice->getStoredSize(pointer.seek, storedSize);
+}
+
 bool SliceManager::get(BString &data, const ItemRequest &item)
 {
 	AutoMutex autoSync(&_sync);
-	if (item.pointer.sliceID >= _slices.size())
+	if ((item.pointer.sliceID >= _slices.size()) || (_slices[item.pointer.sliceID].get() == NULL))
 	{
 		log::Error::L("Can't get slice %u\n", item.pointer.sliceID);
 		return false;
@@ -465,61 +1118,321 @@ bool SliceManager::get(BString &data, const ItemRequest &item)
 	return slice->get(data, item);
 }
 
-bool SliceManager::loadIndex(class Index &index)
+void SliceManager::getIndexPositions(TIndexPositionVector &positions)
+{
+	AutoMutex autoSync(&_sync);
+	TSliceVector slices(_slices);
+	autoSync.unLock();
+	IndexPosition position;
+	uint64_t generation, seek;
+	for (auto slice = slices.begin(); slice != slices.end(); slice++) {
+		if (slice->get() == NULL)
+			continue;
+		position.sliceID = (*slice)->sliceID();
+		(*slice)->getIndexPosition(generation, seek);
+		position.generation = generation;
+		position.seek = seek;
+		positions.push_back(position);
+	}
+}
+
+bool SliceManager::isSameIndex(const IndexPosition &position)
+{
+	TSlicePtr slice = _getSlice(position.sliceID);
+	if (!slice)
+		return false;
+	// slice IDs are reused after compaction, so the index file itself has to be the same
+	return slice->isIndexPosition(position.generation, position.seek);
+}
+
+std::string SliceManager::checkpointFileName() const
 {
-	Buffer buf;
-	for (auto slice = _slices.begin(); slice != _slices.end(); slice++)
+	return _dirs[0].path + "/index.checkpoint";
+}
+
+bool SliceManager::loadIndex(class Index &index, const TIndexPositionVector &positions)
+{
+	std::vector<off_t> startSeeks(_slices.size(), 0);
+	for (auto position = positions.begin(); position != positions.end(); position++) {
+		if (position->sliceID < startSeeks.size())
+			startSeeks[position->sliceID] = position->seek;
+	}
+	TSliceVector slices;
+	uint64_t totalSize = 0;
+	for (auto slice = _slices.begin(); slice != _slices.end(); slice++) {
+		if (slice->get() == NULL) // the slice has been removed by compaction
+			continue;
+		slices.push_back(*slice);
+		totalSize += (*slice)->indexFileSize() - startSeeks[(*slice)->sliceID()];
+	}
+	
+	size_t threadsCount = _options.indexLoadThreads ? _options.indexLoadThreads : std::thread::hardware_concurrency();
+	if (threadsCount > slices.size())
+		threadsCount = slices.size();
+	if (threadsCount <= 1) {
+		for (auto slice = slices.begin(); slice != slices.end(); slice++) {
+			if (!(*slice)->loadIndex(index, startSeeks[(*slice)->sliceID()]))
+				return false;
+		}
+		return true;
+	}
+	
+	// every thread fills its own index without locks, then the parts are merged range by range
+	auto startTime = std::chrono::steady_clock::now();
+	Index::TIndexVector parts;
+	for (size_t i = 0; i < threadsCount; i++)
+		parts.emplace_back(new Index());
+	std::atomic<size_t> nextSlice(0);
+	std::atomic<uint64_t> loadedSize(0);
+	std::atomic<bool> isFailed(false);
+	std::mutex finishSync;
+	std::condition_variable finishCond;
+	size_t finishedThreads = 0;
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < threadsCount; i++) {
+		Index *part = parts[i].get();
+		threads.push_back(std::thread([&, part]() {
+			size_t sliceNum;
+			while (!isFailed && ((sliceNum = nextSlice++) < slices.size())) {
+				const TSlicePtr &slice = slices[sliceNum];
+				if (!slice->loadIndex(*part, startSeeks[slice->sliceID()]))
+					isFailed = true;
+				loadedSize += slice->indexFileSize() - startSeeks[slice->sliceID()];
+			}
+			std::lock_guard<std::mutex> autoSync(finishSync);
+			finishedThreads++;
+			finishCond.notify_one();
+		}));
+	}
 	{
-		if (!(*slice)->loadIndex(index, buf))
-			return false;
+		static const std::chrono::seconds PROGRESS_LOG_INTERVAL(5);
+		std::unique_lock<std::mutex> autoSync(finishSync);
+		while (!finishCond.wait_for(autoSync, PROGRESS_LOG_INTERVAL, [&] { return finishedThreads == threadsCount; })) {
+			log::Warning::L("Loading index: %u of %u slices, %llu of %llu MB\n", (uint32_t)std::min(nextSlice.load(), 
+				slices.size()), (uint32_t)slices.size(), (unsigned long long)(loadedSize >> 20), 
+				(unsigned long long)(totalSize >> 20));
+		}
 	}
+	for (auto thread = threads.begin(); thread != threads.end(); thread++)
+		thread->join();
+	if (isFailed)
+		return false;
+	
+	std::vector<TRangeID> rangeIDs;
+	for (auto part = parts.begin(); part != parts.end(); part++)
+		(*part)->getRangeIDsNoLock(rangeIDs);
+	std::sort(rangeIDs.begin(), rangeIDs.end());
+	rangeIDs.erase(std::unique(rangeIDs.begin(), rangeIDs.end()), rangeIDs.end());
+	std::atomic<size_t> nextRange(0);
+	threads.clear();
+	for (size_t i = 0; i < threadsCount; i++) {
+		threads.push_back(std::thread([&]() {
+			size_t rangeNum;
+			while ((rangeNum = nextRange++) < rangeIDs.size())
+				index.mergeRange(rangeIDs[rangeNum], parts);
+		}));
+	}
+	for (auto thread = threads.begin(); thread != threads.end(); thread++)
+		thread->join();
+	
+	std::chrono::duration<double> loadTime = std::chrono::steady_clock::now() - startTime;
+	log::Warning::L("Index of %u slices (%llu MB, %u ranges) has been loaded by %u threads in %.1f seconds\n", 
+		(uint32_t)slices.size(), (unsigned long long)(totalSize >> 20), (uint32_t)rangeIDs.size(), (uint32_t)threadsCount, 
+		loadTime.count());
 	return true;
 }
 
-bool SliceManager::_addWriteSlice(const TSize size)
+TSlicePtr SliceManager::_getSlice(const TSliceID sliceID)
 {
-	TSliceID sliceID = 0;
-	for (auto slice = _slices.begin(); slice != _slices.end(); slice++, sliceID++) {
+	AutoMutex autoSync(&_sync);
+	if (sliceID >= _slices.size())
+		return TSlicePtr();
+	return _slices[sliceID];
+}
+
+void SliceManager::addDeadSize(const ItemPointer &pointer, const TSize size)
+{
+	TSlicePtr slice = _getSlice(pointer.sliceID);
+	if (slice)
+		slice->addDeadSize(size + slice->itemHeaderSize());
+}
+
+void SliceManager::setLiveSizes(const Range::TLiveSizeVector &liveSizes)
+{
+	AutoMutex autoSync(&_sync);
+	for (auto slice = _slices.begin(); slice != _slices.end(); slice++) {
 		if (slice->get() == NULL)
-			break;
-		if ((slice->get()->size() + size) < _maxSliceSize) {
-			_writeSlice = *slice;
+			continue;
+		TSliceID sliceID = (*slice)->sliceID();
+		if (sliceID < liveSizes.size())
+			(*slice)->setLiveSize(liveSizes[sliceID].size, liveSizes[sliceID].items);
+		else
+			(*slice)->setLiveSize(0, 0);
+	}
+}
+
+bool SliceManager::addTombstone(IndexEntry &ie)
+{
+	TSlicePtr slice;
+	if (!findWriteSlice(0, slice))
+		return false;
+	bool res = slice->addTombstone(ie);
+	slice->endWrite();
+	if (!res)
+		return false;
+	return _syncSlice(slice);
+}
+
+bool SliceManager::markCorrupted(IndexEntry &ie)
+{
+	TSlicePtr slice = _getSlice(ie.pointer.sliceID);
+	if (!slice)
+		return false;
+	if (!slice->markCorrupted(ie))
+		return false;
+	return _syncSlice(slice);
+}
+
+void SliceManager::getSlices(TSliceVector &slices)
+{
+	AutoMutex autoSync(&_sync);
+	for (auto slice = _slices.begin(); slice != _slices.end(); slice++) {
+		if (slice->get())
+			slices.push_back(*slice);
+	}
+}
+
+bool SliceManager::startCompaction(const double minDeadRatio, TSlicePtr &slice)
+{
+	AutoMutex autoSync(&_sync);
+	double maxDeadRatio = minDeadRatio;
+	slice.reset();
+	for (auto curSlice = _slices.begin(); curSlice != _slices.end(); curSlice++) {
+		if ((curSlice->get() == NULL) || (*curSlice)->isCompacting() || _isWriteSlice(*curSlice))
+			continue;
+		double deadRatio = (*curSlice)->deadRatio();
+		if ((deadRatio >= maxDeadRatio) && (deadRatio > 0)) {
+			maxDeadRatio = deadRatio;
+			slice = *curSlice;
+		}
+	}
+	if (slice.get() == NULL)
+		return false;
+	return slice->setCompacting();
+}
+
+void SliceManager::dropSlice(const TSlicePtr &slice)
+{
+	AutoMutex autoSync(&_sync);
+	if ((slice->sliceID() < _slices.size()) && (_slices[slice->sliceID()] == slice))
+		_slices[slice->sliceID()].reset();
+	autoSync.unLock();
+	slice->unlinkFiles();
+	if (!_recalcSpace())
+		log::Error::L("Can't recalculate disk space after slice %u dropping\n", slice->sliceID());
+}
+
+bool SliceManager::_isWriteSlice(const TSlicePtr &slice)
+{
+	for (auto writeSlice = _writeSlices.begin(); writeSlice != _writeSlices.end(); writeSlice++) {
+		if (writeSlice->get() == slice.get())
+			return true;
+	}
+	return false;
+}
+
+bool SliceManager::_chooseDir(const TSize size, uint32_t &dirID)
+{
+	bool found = false;
+	int32_t bestLoad = 0;
+	for (uint32_t curDirID = 0; curDirID < _dirs.size(); curDirID++) {
+		DataDir &dataDir = _dirs[curDirID];
+		if ((int64_t)size > dataDir.leftSpace)
+			continue;
+		int32_t load = dataDir.pendingWrites;
+		for (auto writeSlice = _writeSlices.begin(); writeSlice != _writeSlices.end(); writeSlice++) {
+			if (writeSlice->get() && ((*writeSlice)->dirID() == curDirID))
+				load++;
+		}
+		if (!found || (load < bestLoad) || ((load == bestLoad) && (dataDir.leftSpace > _dirs[dirID].leftSpace))) {
+			found = true;
+			bestLoad = load;
+			dirID = curDirID;
+		}
+	}
+	return found;
+}
+
+bool SliceManager::_addWriteSlice(const TSize size, const size_t slot)
+{
+	std::atomic_store(&_writeSlices[slot], TSlicePtr()); // the slot's slice mustn't count in the directory load
+	uint32_t dirID = 0;
+	if (!_chooseDir(size, dirID)) {
+		log::Error::L("There is no data path with %u free bytes\n", size);
+		return false;
+	}
+	TSliceID sliceID = 0;
+	bool foundFreeID = false;
+	for (auto slice = _slices.begin(); slice != _slices.end(); slice++) {
+		if (slice->get() == NULL) {
+			if (!foundFreeID) {
+				foundFreeID = true;
+				sliceID = slice - _slices.begin();
+			}
+			continue;
+		}
+		if (((*slice)->dirID() == dirID) && (((*slice)->size() + size) < _maxSliceSize) && !(*slice)->isCompacting() 
+			&& !_isWriteSlice(*slice)) {
+			std::atomic_store(&_writeSlices[slot], *slice);
 			return true;
 		}
 	}
+	if (!foundFreeID)
+		sliceID = _slices.size();
+	if (sliceID >= std::numeric_limits<TSliceID>::max()) {
+		log::Fatal::L("The storage has reached the maximum number of slices\n");
+		return false;
+	}
+	
 	BString dataFileName;
-	_formDataPath(dataFileName);
+	_formDataPath(dataFileName, dirID);
 	dataFileName.sprintfAdd("/%u", sliceID);
 
 	BString indexFileName;
-	_formIndexPath(indexFileName);
+	_formIndexPath(indexFileName, dirID);
 	indexFileName.sprintfAdd("/%u", sliceID);
 
-	TSlicePtr slicePtr(new Slice(sliceID, dataFileName, indexFileName));
+	TSlicePtr slicePtr(new Slice(sliceID, dataFileName, indexFileName, dirID));
 	if (sliceID >= _slices.size())
 		_slices.resize(sliceID + 1);
 	_slices[sliceID] = slicePtr;
-	_writeSlice = slicePtr;
+	std::atomic_store(&_writeSlices[slot], slicePtr);
 	return true;
 }
 
 bool SliceManager::_recalcSpace()
 {
-	uint64_t totalSpace;
-	uint64_t freeSpace;
-	if (!Directory::getDiskSize(_path.c_str(), totalSpace, freeSpace))
-		return false;
-	
-	uint64_t reserveSpace = (totalSpace * _minFree);
-	if (freeSpace < reserveSpace)
-		_leftSpace = 0;
-	else
-		_leftSpace = freeSpace - reserveSpace;
+	for (auto dataDir = _dirs.begin(); dataDir != _dirs.end(); dataDir++) {
+		uint64_t totalSpace;
+		uint64_t freeSpace;
+		if (!Directory::getDiskSize(dataDir->path.c_str(), totalSpace, freeSpace)) {
+			log::Error::L("Can't get disk size of %s\n", dataDir->path.c_str());
+			return false;
+		}
+		uint64_t reserveSpace = (totalSpace * _minFree);
+		if (freeSpace < reserveSpace)
+			dataDir->leftSpace = 0;
+		else
+			dataDir->leftSpace = freeSpace - reserveSpace;
+	}
 	return true;
 }
 
 bool SliceManager::ping(StoragePingAnswer &storageAnswer)
 {
-	storageAnswer.leftSpace = _leftSpace;
+	storageAnswer.leftSpace = 0;
+	for (auto dataDir = _dirs.begin(); dataDir != _dirs.end(); dataDir++) {
+		storageAnswer.leftSpace += dataDir->leftSpace;
+	}
 	return true;
 }
@@ -24,6 +24,7 @@
 #include "mutex.hpp"
 #include "read_write_lock.hpp"
 #include "range_index.hpp"
+#include "config.hpp"
 
 namespace fl {
 	namespace metis {
@@ -51,71 +52,274 @@ namespace fl {
 		class Slice
 		{
 		public:
-			Slice(const TSliceID sliceID, BString &dataFileName, BString &indexFileName);
+			Slice(const TSliceID sliceID, BString &dataFileName, BString &indexFileName, const uint32_t dirID);
 			TSize size() const
 			{
 				return _size;
 			}
+			TSliceID sliceID() const
+			{
+				return _sliceID;
+			}
+			uint32_t dirID() const
+			{
+				return _dirID;
+			}
+			void addDeadSize(const TSeek deadSize)
+			{
+				__sync_add_and_fetch(&_deadSize, deadSize);
+			}
+			void setLiveSize(const TSeek liveSize, const uint64_t liveItems);
+			double deadRatio() const;
+			bool isCompacting() const
+			{
+				return _isCompacting;
+			}
+			bool setCompacting();
+			bool beginWrite();
+			void endWrite()
+			{
+				__sync_sub_and_fetch(&_activeWriters, 1);
+			}
+			static TSeek firstItemSeek()
+			{
+				return sizeof(SliceDataHeader);
+			}
+			// the data of an item follows its header, the slices since version 2 keep the data checksum in between
+			TSeek itemHeaderSize() const
+			{
+				return sizeof(ItemHeader) + ((_version >= SliceDataHeader::CRC_VERSION) ? sizeof(TCrc) : 0);
+			}
+			bool openData(File &dataFd);
+			bool unlinkFiles();
 			bool add(const char *data, IndexEntry &ie);
+			// the data is the gzip stream of the item, ie already has the original size and the checksum of the item
+			bool addCompressed(const char *data, const TItemSize compressedSize, IndexEntry &ie);
 			bool add(File &putTmpFile, BString &buf, IndexEntry &ie);
+			bool reserve(IndexEntry &ie);
+			// the reserved data has to be written in order, the checksum of the item is counted on the way
+			bool writeReserved(IndexEntry &ie, const TItemSize seek, const char *data, const TItemSize size);
+			bool commitReserved(IndexEntry &ie);
 			bool get(BString &data, const ItemRequest &item);
 			bool get(BString &data, const TItemSize dataSeek, const TItemSize requestSeek, const TItemSize requestSize);
-			bool loadIndex(class Index &index, Buffer &buf);
-			bool remove(const ItemHeader &ih, const ItemPointer &pointer);
+			bool getFileChunk(const TItemSize dataSeek, const TItemSize requestSeek, const TItemSize requestSize, 
+				off_t &fileSeek);
+			// reads the data of an item as it's kept in the slice, its size is taken from the item header
+			bool getStored(BString &data, const TSeek itemSeek);
+			bool getStoredSize(const TSeek itemSeek, TItemSize &storedSize);
+			int dataDescr() const
+			{
+				return _dataFd.descr();
+			}
+			bool loadIndex(class Index &index, const off_t fromSeek = 0);
+			off_t indexFileSize()
+			{
+				return _indexFd.fileSize();
+			}
+			// the generation is renewed each time the index file is created or rewritten
+			uint64_t indexGeneration() const
+			{
+				return _indexGeneration;
+			}
+			// the seek is taken between index writes, so it's always at the end of a whole entry
+			void getIndexPosition(uint64_t &generation, uint64_t &seek);
+			bool isIndexPosition(const uint64_t generation, const uint64_t seek);
+			// holeSize is set to the size of the removed data, which is worth punching, see addHole
+			bool remove(const ItemHeader &ih, const ItemPointer &pointer, const TItemSize punchHoleMinSize, 
+				TItemSize &holeSize);
+			// reads, which outlast the index lookup like sendfile and disk thread reads, pin the slice
+			void beginRead()
+			{
+				__sync_add_and_fetch(&_activeReaders, 1);
+			}
+			void endRead();
+			// the hole is punched, when no pinned reads of the slice are in flight
+			void addHole(const TSeek seek, const TItemSize size);
+			TSeek holeSize(const TSeek seek, const TItemSize size) const;
+			bool addTombstone(IndexEntry &ie);
+			// keeps the item out of the index after restarts, see Range::Entry::isCorrupted
+			bool markCorrupted(IndexEntry &ie);
+			bool sync();
+			bool isSynced();
 		private:
+			TSeek _punchHole(const TSeek seek, const TItemSize size);
+			void _punchHolesNoLock();
 			void _openDataFile(BString &dataFileName);
 			void _openIndexFile(BString &indexFileName);
 			void _rebuildIndexFromData(BString &indexFileName);
-			bool _writeItem(const char *data, IndexEntry &ie);
+			void _upgradeIndexFile(BString &indexFileName, const uint8_t version);
+			void _writeIndexHeader(File &indexFd, const char *indexFileName);
 			bool _writeItem(File &putTmpFile, BString &buf, IndexEntry &ie);
+			
+			struct PendingWrite
+			{
+				PendingWrite(IndexEntry &ie, const char *data, const TItemSize storedSize, const bool isCommit)
+					: ie(ie), diskHeader(ie.header), data(data), isCommit(isCommit), done(false), result(false)
+				{
+					diskHeader.size = storedSize;
+				}
+				IndexEntry &ie;
+				ItemHeader diskHeader; // the header in the dataFile has the size of the stored data
+				const char *data;
+				bool isCommit;
+				bool done;
+				bool result;
+			};
+			bool _queueAndWrite(PendingWrite &pendingWrite);
+			void _writeBatch();
+			bool _writeVector(struct iovec *iov, const size_t count, TSeek seek);
+
 			struct SliceDataHeader
 			{
-				static const uint8_t CURRENT_VERSION = 1;
+				static const uint8_t CURRENT_VERSION = 2;
+				static const uint8_t CRC_VERSION = 2;
 				uint8_t version;
 				TSliceID sliceID;
 			} __attribute__((packed));
 
 			struct SliceIndexHeader
 			{
-				static const uint8_t CURRENT_VERSION = 1;
+				static const uint8_t CURRENT_VERSION = 3;
+				static const uint8_t GENERATION_VERSION = 3;
+				uint8_t version;
+				TSliceID sliceID;
+				uint64_t generation;
+			} __attribute__((packed));
+			
+			// the header of version 1 and 2 index files, which have no generation
+			struct SliceIndexHeaderV2
+			{
 				uint8_t version;
 				TSliceID sliceID;
 			} __attribute__((packed));
 			
+			// index entries of version 1 index files, which have no checksums
+			struct IndexEntryV1
+			{
+				ItemHeader header;
+				ItemPointer pointer;
+			} __attribute__((packed));
+			
 			TSliceID _sliceID;
+			uint32_t _dirID;
+			std::string _dataFileName;
+			std::string _indexFileName;
 			File _dataFd;
 			File _indexFd;
 			TSeek _size;
+			uint8_t _version;
+			uint64_t _indexGeneration;
 			ReadWriteLock _sync;
+			TSeek _deadSize;
+			TSeek _punchedSize;
+			volatile bool _isCompacting;
+			volatile int32_t _activeWriters;
+			volatile int32_t _activeReaders;
+			
+			typedef std::vector<std::pair<TSeek, TItemSize>> THoleVector;
+			THoleVector _holes;
+			volatile uint32_t _holesCount;
+			Mutex _holesSync;
+			
+			typedef std::vector<PendingWrite*> TPendingWriteVector;
+			TPendingWriteVector _pendingWrites;
+			Mutex _pendingSync;
+			
+			uint64_t _writeSeq;
+			uint64_t _syncedSeq;
+			Mutex _fsyncSync;
 		};
 		typedef std::shared_ptr<class Slice> TSlicePtr;
 		
 		class SliceManager
 		{
 		public:
-			SliceManager(const char *path, const double minFree, const TSize maxSliceSize);
+			SliceManager(const char *path, const double minFree, const TSize maxSliceSize, 
+				const StorageOptions &options = StorageOptions());
 			bool add(const char *data, IndexEntry &ie);
+			bool addCompressed(const char *data, const TItemSize compressedSize, IndexEntry &ie);
 			bool add(File &putTmpFile, BString &buf, IndexEntry &ie);
+			bool reserve(IndexEntry &ie, TSlicePtr &slice);
+			bool commitReserved(const TSlicePtr &slice, IndexEntry &ie);
+			void abortReserved(const TSlicePtr &slice, const IndexEntry &ie);
 			bool get(BString &data, const ItemRequest &item);
 			bool get(BString &data, const ItemPointer &pointer, const TItemSize seek, const TItemSize size);
-			bool remove(const ItemHeader &ih, const ItemPointer &pointer);
-			bool loadIndex(class Index &index);
-			bool findWriteSlice(const TItemSize size);
+			bool getFileChunk(const ItemPointer &pointer, const TItemSize seek, const TItemSize size, TSlicePtr &slice, 
+				off_t &fileSeek);
+			bool getStored(BString &data, const ItemPointer &pointer);
+			bool getStoredSize(const ItemPointer &pointer, TItemSize &storedSize);
+			bool remove(const ItemHeader &ih, const ItemPointer &pointer, TItemSize &holeSize);
+			// has to be called, when the removed item is out of the index, the hole is punched after the readers, 
+			// which could have found the item, have left or pinned the slice
+			void punchHole(const ItemPointer &pointer, const TItemSize holeSize);
+			struct IndexPosition
+			{
+				TSliceID sliceID;
+				uint64_t generation;
+				uint64_t seek;
+			} __attribute__((packed));
+			typedef std::vector<IndexPosition> TIndexPositionVector;
+			bool loadIndex(class Index &index, const TIndexPositionVector &positions = TIndexPositionVector());
+			void getIndexPositions(TIndexPositionVector &positions);
+			bool isSameIndex(const IndexPosition &position);
+			std::string checkpointFileName() const;
+			bool findWriteSlice(const TItemSize size, TSlicePtr &slice);
+			static const size_t NO_WRITE_SHARD = (size_t)-1;
+			// the calling thread writes into its own write slice slot instead of a round-robin one
+			static void setWriteShard(const size_t writeShard)
+			{
+				_writeShard = writeShard;
+			}
 			bool ping(StoragePingAnswer &storageAnswer);
+			bool flush();
+			
+			void addDeadSize(const ItemPointer &pointer, const TSize size);
+			void setLiveSizes(const Range::TLiveSizeVector &liveSizes);
+			bool addTombstone(IndexEntry &ie);
+			bool markCorrupted(IndexEntry &ie);
+			typedef std::vector<TSlicePtr> TSliceVector;
+			void getSlices(TSliceVector &slices);
+			bool startCompaction(const double minDeadRatio, TSlicePtr &slice);
+			void dropSlice(const TSlicePtr &slice);
 		private:
-			void _formDataPath(BString &path);
-			void _formIndexPath(BString &path);
-			void _init();
-			bool _addWriteSlice(const TSize size);
+			bool _add(const char *data, const TItemSize storedSize, IndexEntry &ie);
+			struct RetiredHole
+			{
+				TSlicePtr slice;
+				TSeek seek;
+				TItemSize size;
+			};
+			static void _punchRetiredHole(void *data);
+			TSlicePtr _getSlice(const TSliceID sliceID);
+			bool _syncSlice(const TSlicePtr &slice);
+			void _formDataPath(BString &path, const uint32_t dirID);
+			void _formIndexPath(BString &path, const uint32_t dirID);
+			void _init(const uint32_t dirID);
+			bool _addWriteSlice(const TSize size, const size_t slot);
+			bool _isWriteSlice(const TSlicePtr &slice);
+			bool _chooseDir(const TSize size, uint32_t &dirID);
 			bool _recalcSpace();
-			std::string _path;
+			
+			struct DataDir
+			{
+				DataDir(const std::string &path)
+					: path(path), leftSpace(0), pendingWrites(0)
+				{
+				}
+				std::string path;
+				int64_t leftSpace;
+				int32_t pendingWrites;
+			};
+			typedef std::vector<DataDir> TDataDirVector;
+			TDataDirVector _dirs;
 			double _minFree;
-			int64_t _leftSpace;
 			TSize _maxSliceSize;
+			StorageOptions _options;
 			
-			typedef std::vector<TSlicePtr> TSliceVector;
 			TSliceVector _slices;
-			TSlicePtr _writeSlice;
+			TSliceVector _writeSlices; // a slot is replaced with std::atomic_store, so it's read without locking
+			uint32_t _nextWriteSlice;
+			static thread_local size_t _writeShard;
 			Mutex _sync;
 		};
 	};
@@ -8,29 +8,93 @@
 // Description: Metis storage server control class implementation
 ///////////////////////////////////////////////////////////////////////////////
 
+#include <chrono>
+#include <unistd.h>
+#include <fcntl.h>
+#include <strings.h>
 #include "storage.hpp"
+#include "index_checkpoint.hpp"
+#include "crc32c.hpp"
+#include "compression.hpp"
+#include "epoch.hpp"
 #include "metis_log.hpp"
 
 using namespace fl::metis;
 
-Storage::Storage(const char *path, const double minFree, const TSize maxSliceSize)
-	: _sliceManager(path, minFree, maxSliceSize)
+Storage::Storage(const char *path, const double minFree, const TSize maxSliceSize, const StorageOptions &options)
+	: _options(options), _sliceManager(path, minFree, maxSliceSize, options), _index(options.indexShards), 
+	_timeThread(NULL)
 {
-	if (!_sliceManager.loadIndex(_index)) {
+	IndexCheckpoint indexCheckpoint(_sliceManager.checkpointFileName());
+	SliceManager::TIndexPositionVector positions;
+	if (!indexCheckpoint.load(_index, _sliceManager, positions))
+		positions.clear();
+	if (!_sliceManager.loadIndex(_index, positions)) {
 		log::Fatal::L("Can't load index\n");
 		throw std::exception();
 	}
+	Range::TLiveSizeVector liveSizes;
+	_index.getLiveSizes(liveSizes);
+	_sliceManager.setLiveSizes(liveSizes);
+	if (options.objectCacheSize)
+		_objectCache.reset(new ObjectCache(options.objectCacheSize, options.objectCacheMaxItemSize, 
+			options.objectCacheMinHits));
+	if (options.fsyncPolicy == FSYNC_INTERVAL) {
+		_timeThread = new fl::threads::TimeThread(options.fsyncInterval);
+		_timeThread->addEveryTick(new fl::threads::TimeTask<Storage>(this, &Storage::timeTic));
+		if (!_timeThread->create()) {
+			log::Fatal::L("Can't create a storage time thread\n");
+			throw std::exception();
+		}
+	}
+}
+
+bool Storage::timeTic(fl::chrono::ETime &curTime)
+{
+	if (!_sliceManager.flush())
+		log::Error::L("Can't flush slices\n");
+	Epoch::reclaim(); // the retired holes are punched even without index changes
+	return true;
+}
+
+void Storage::_addToIndex(const IndexEntry &ie)
+{
+	Range::Entry deadEntry;
+	_index.add(ie, deadEntry);
+	if (_objectCache)
+		_objectCache->remove(ie.header.rangeID, ie.header.itemKey);
+	if (deadEntry.size && !deadEntry.isCorrupted()) // a corrupted item has been counted, when it was marked
+		_addDeadSize(deadEntry);
+}
+
+void Storage::_addDeadSize(const Range::Entry &entry)
+{
+	TItemSize size = entry.size;
+	// the index keeps the original size of a compressed item, the stored one is in its header
+	if (entry.isCompressed() && !_sliceManager.getStoredSize(entry.pointer, size))
+		return;
+	_sliceManager.addDeadSize(entry.pointer, size);
 }
 
 bool Storage::add(const char *data, const ItemHeader &itemHeader)
 {
 	IndexEntry ie;
 	ie.header = itemHeader;
-	if (!_sliceManager.add(data, ie)) {
+	bool res;
+	BString compressed;
+	if (_options.compressLevel && (itemHeader.size >= _options.compressMinSize) 
+		&& (itemHeader.size <= _options.compressMaxSize) 
+		&& gzipCompress(data, itemHeader.size, _options.compressLevel, compressed)) {
+		ie.crc = crc32c(0, data, itemHeader.size);
+		res = _sliceManager.addCompressed(compressed.c_str(), compressed.size(), ie);
+	} else {
+		res = _sliceManager.add(data, ie);
+	}
+	if (!res) {
 		log::Fatal::L("Can't add an object to the slice manager\n");
 		return false;
 	}
-	_index.add(ie);
+	_addToIndex(ie);
 	return true;
 }
 
@@ -42,34 +106,87 @@ bool Storage::add(const ItemHeader &itemHeader, File &putTmpFile, BString &buf)
 		log::Fatal::L("Can't add an object to the slice manager\n");
 		return false;
 	}
-	_index.add(ie);
+	_addToIndex(ie);
+	return true;
+}
+
+bool Storage::reserve(IndexEntry &ie, TSlicePtr &slice)
+{
+	if (!_sliceManager.reserve(ie, slice)) {
+		log::Fatal::L("Can't reserve space for an object in the slice manager\n");
+		return false;
+	}
+	return true;
+}
+
+bool Storage::writeReserved(const TSlicePtr &slice, IndexEntry &ie, const TItemSize seek, const char *data, 
+	const TItemSize size)
+{
+	return slice->writeReserved(ie, seek, data, size);
+}
+
+void Storage::abortReserved(const TSlicePtr &slice, const IndexEntry &ie)
+{
+	_sliceManager.abortReserved(slice, ie);
+}
+
+bool Storage::commitReserved(const TSlicePtr &slice, IndexEntry &ie)
+{
+	if (!_sliceManager.commitReserved(slice, ie)) {
+		log::Fatal::L("Can't commit an object to the slice manager\n");
+		return false;
+	}
+	_addToIndex(ie);
 	return true;
 }
 
 bool Storage::remove(const ItemHeader &itemHeader)
 {
 	Range::Entry entry;
-	if (!_index.find(itemHeader.rangeID, itemHeader.itemKey, entry))
-		return true;
-	
-	if (entry.timeTag <= itemHeader.timeTag) {
-		if (_sliceManager.remove(itemHeader, entry.pointer)) {
-			_index.remove(itemHeader);
+	while (true) {
+		if (!_index.find(itemHeader.rangeID, itemHeader.itemKey, entry))
 			return true;
-		} else {
+		if (entry.size == 0)
+			return true;
+		
+		if (!(entry.timeTag <= itemHeader.timeTag)) {
+			log::Error::L("Can't delete an newer object\n");
+			return false;
+		}
+		if (entry.isCorrupted()) { // the data is already dead, only the tombstone has to be kept
+			IndexEntry ie;
+			bzero(&ie, sizeof(ie));
+			ie.header = itemHeader;
+			if (!_sliceManager.addTombstone(ie)) {
+				log::Fatal::L("Can't add a tombstone to the slice manager\n");
+				return false;
+			}
+			if (_index.remove(itemHeader, &entry.pointer))
+				return true;
+			continue;
+		}
+		TItemSize holeSize = 0;
+		if (!_sliceManager.remove(itemHeader, entry.pointer, holeSize)) {
 			log::Fatal::L("Can't delete an object from the slice manager\n");
 			return false;
 		}
-	} else {
-		log::Error::L("Can't delete an newer object\n");
-		return false;
+		const bool isRemoved = _index.remove(itemHeader, &entry.pointer);
+		if (holeSize)
+			_sliceManager.punchHole(entry.pointer, holeSize);
+		if (isRemoved) {
+			if (_objectCache)
+				_objectCache->remove(itemHeader.rangeID, itemHeader.itemKey);
+			_addDeadSize(entry);
+			return true;
+		}
+		// the item has been moved to another slice by compaction, remove the new copy as well
 	}
 }
 
 bool Storage::findAndFill(const ItemIndex &itemIndex, ItemInfo &itemInfo)
 {
 	Range::Entry entry;
-	if (!_index.find(itemIndex.rangeID, itemIndex.itemKey, entry))
+	if (!_index.find(itemIndex.rangeID, itemIndex.itemKey, entry) || entry.isCorrupted())
 		return false;	
 	itemInfo.index = itemIndex;
 	itemInfo.size = entry.size;
@@ -79,16 +196,186 @@ bool Storage::findAndFill(const ItemIndex &itemIndex, ItemInfo &itemInfo)
 
 bool Storage::get(const GetItemChunkRequest &itemRequest, BString &data)
 {
+	Epoch::Guard guard; // holes of removed items aren't punched under the read
 	Range::Entry entry;
 	if (!_index.find(itemRequest.rangeID, itemRequest.itemKey, entry))
 		return false;	
-	if (entry.size == 0)
+	if ((entry.size == 0) || entry.isCorrupted())
 		return false;
 	if ((itemRequest.seek + itemRequest.chunkSize) > entry.size) {
 		log::Warning::L("Storage::get: Seek %u out of range %u\n", itemRequest.seek + itemRequest.chunkSize, entry.size);
 		return false;
 	}
-	return _sliceManager.get(data, entry.pointer, itemRequest.seek, itemRequest.chunkSize);
+	return _get(itemRequest.rangeID, itemRequest.itemKey, entry, itemRequest.seek, itemRequest.chunkSize, data);
+}
+
+bool Storage::_get(const TRangeID rangeID, const TItemKey itemKey, const Range::Entry &entry, const TItemSize seek, 
+	const TItemSize size, BString &data)
+{
+	if (entry.isCompressed()) {
+		BString compressed;
+		BString item;
+		if (!_getCompressed(rangeID, itemKey, entry, compressed, &item))
+			return false;
+		data.add(item.c_str() + seek, size);
+		return true;
+	}
+	// cached objects have been verified, when they were read from the disk
+	if (_objectCache) {
+		if (_objectCache->get(rangeID, itemKey, entry.timeTag, seek, size, data))
+			return true;
+		if (_objectCache->isWorthCaching(rangeID, itemKey, entry.size)) {
+			// a hot object is read as a whole, so the next chunks come from the cache
+			BString item;
+			if (!_sliceManager.get(item, entry.pointer, 0, entry.size) 
+				|| !_isValid(rangeID, itemKey, entry, item.c_str()))
+				return false;
+			_objectCache->add(rangeID, itemKey, entry.timeTag, item.c_str(), entry.size);
+			data.add(item.c_str() + seek, size);
+			return true;
+		}
+	}
+	if ((seek != 0) || (size != entry.size)) // only whole items can be verified
+		return _sliceManager.get(data, entry.pointer, seek, size);
+	
+	const BString::TSize dataSize = data.size();
+	if (!_sliceManager.get(data, entry.pointer, 0, size))
+		return false;
+	if (!_isValid(rangeID, itemKey, entry, data.c_str() + dataSize)) {
+		data.trimLast(data.size() - dataSize);
+		return false;
+	}
+	return true;
+}
+
+bool Storage::_getCompressed(const TRangeID rangeID, const TItemKey itemKey, const Range::Entry &entry, 
+	BString &compressed, BString *item)
+{
+	// hot compressed items are cached as gzip streams, they have been verified, when they were read from the disk
+	if (_objectCache && _objectCache->get(rangeID, itemKey, entry.timeTag, compressed))
+		return !item || gzipUncompress(compressed.c_str(), compressed.size(), entry.size, *item);
+	if (!_sliceManager.getStored(compressed, entry.pointer))
+		return false;
+	BString uncompressed;
+	BString &itemData = item ? *item : uncompressed;
+	if (!gzipUncompress(compressed.c_str(), compressed.size(), entry.size, itemData)) {
+		log::Error::L("Item %u:%u in slice %u, seek %u has a broken gzip stream\n", rangeID, itemKey, 
+			entry.pointer.sliceID, entry.pointer.seek);
+		return false;
+	}
+	if (!_isValid(rangeID, itemKey, entry, itemData.c_str()))
+		return false;
+	if (_objectCache && _objectCache->isWorthCaching(rangeID, itemKey, compressed.size()))
+		_objectCache->add(rangeID, itemKey, entry.timeTag, compressed.c_str(), compressed.size());
+	return true;
+}
+
+bool Storage::_isValid(const TRangeID rangeID, const TItemKey itemKey, const Range::Entry &entry, const char *data)
+{
+	if (!entry.crc) // the item has been written before checksums
+		return true;
+	TCrc crc = crc32c(0, data, entry.size);
+	if (crc == entry.crc)
+		return true;
+	log::Error::L("Item %u:%u in slice %u, seek %u has a bad checksum %x, wait for %x\n", rangeID, itemKey, 
+		entry.pointer.sliceID, entry.pointer.seek, crc, entry.crc);
+	return false;
+}
+
+bool Storage::getInfoAndChunk(const GetItemInfoAndChunkRequest &itemRequest, ItemInfo &itemInfo, BString &data)
+{
+	Epoch::Guard guard;
+	Range::Entry entry;
+	if (!_index.find(itemRequest.rangeID, itemRequest.itemKey, entry) || entry.isCorrupted())
+		return false;
+	itemInfo.index = ItemIndex(itemRequest.rangeID, itemRequest.itemKey);
+	itemInfo.size = entry.size;
+	itemInfo.timeTag = entry.timeTag;
+	const bool acceptGzip = itemRequest.flags & GET_ACCEPT_GZIP;
+	TItemEncoding encoding = ITEM_ENCODING_IDENTITY;
+	if ((entry.size == 0) || (itemRequest.ifModifiedSince && (entry.timeTag.modTime == itemRequest.ifModifiedSince))) {
+		if (acceptGzip)
+			data.add((char*)&encoding, sizeof(encoding));
+		return true;
+	}
+	TItemSize chunkSize = (itemRequest.chunkSize < entry.size) ? itemRequest.chunkSize : entry.size;
+	if (!acceptGzip || !entry.isCompressed()) {
+		if (acceptGzip)
+			data.add((char*)&encoding, sizeof(encoding));
+		return _get(itemRequest.rangeID, itemRequest.itemKey, entry, 0, chunkSize, data);
+	}
+	// the stored gzip stream is sent as it is, when the whole of it fits in the chunk
+	BString compressed;
+	if (!_getCompressed(itemRequest.rangeID, itemRequest.itemKey, entry, compressed, NULL))
+		return false;
+	BString item;
+	if (compressed.size() <= itemRequest.chunkSize)
+		encoding = ITEM_ENCODING_GZIP;
+	else if (!gzipUncompress(compressed.c_str(), compressed.size(), entry.size, item))
+		return false;
+	data.add((char*)&encoding, sizeof(encoding));
+	if (encoding == ITEM_ENCODING_GZIP)
+		data.add(compressed.c_str(), compressed.size());
+	else
+		data.add(item.c_str(), chunkSize);
+	return true;
+}
+
+void Storage::getItems(const GetItemsEntry *items, const uint32_t count, const TSize maxSize, BString &data)
+{
+	TSize itemsSize = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		const GetItemsEntry &item = items[i];
+		const BString::TSize answerPos = data.size();
+		data.reserveBuffer(sizeof(StorageAnswer));
+		StorageAnswer answer;
+		answer.status = STORAGE_ANSWER_NOT_FOUND;
+		answer.size = 0;
+		Epoch::Guard guard;
+		Range::Entry entry;
+		if (_index.find(item.rangeID, item.itemKey, entry) && (entry.size > 0) && !entry.isCorrupted() 
+			&& (entry.timeTag.tag == item.timeTag.tag)) {
+			answer.status = STORAGE_ANSWER_ERROR;
+			if ((itemsSize + entry.size) <= maxSize) {
+				if (_get(item.rangeID, item.itemKey, entry, 0, entry.size, data)) {
+					answer.status = STORAGE_ANSWER_OK;
+					answer.size = entry.size;
+					itemsSize += entry.size;
+				} else {
+					data.trimLast(data.size() - answerPos - sizeof(StorageAnswer));
+				}
+			}
+		}
+		memcpy((char*)data.c_str() + answerPos, &answer, sizeof(answer));
+	}
+}
+
+bool Storage::getObjectCacheStats(ObjectCacheStats &stats)
+{
+	if (!_objectCache)
+		return false;
+	_objectCache->getStats(stats);
+	return true;
+}
+
+bool Storage::getFileChunk(const GetItemChunkRequest &itemRequest, TSlicePtr &slice, off_t &fileSeek)
+{
+	Epoch::Guard guard; // until the slice is pinned for the read
+	Range::Entry entry;
+	if (!_index.find(itemRequest.rangeID, itemRequest.itemKey, entry))
+		return false;	
+	if ((entry.size == 0) || entry.isCorrupted())
+		return false;
+	if ((itemRequest.seek + itemRequest.chunkSize) > entry.size) {
+		log::Warning::L("Storage::getFileChunk: Seek %u out of range %u\n", itemRequest.seek + itemRequest.chunkSize, 
+			entry.size);
+		return false;
+	}
+	if (entry.isCompressed()) {
+		slice.reset();
+		return true;
+	}
+	return _sliceManager.getFileChunk(entry.pointer, itemRequest.seek, itemRequest.chunkSize, slice, fileSeek);
 }
 
 bool Storage::ping(StoragePingAnswer &storageAnswer)
@@ -96,7 +383,261 @@ bool Storage::ping(StoragePingAnswer &storageAnswer)
 	return _sliceManager.ping(storageAnswer);
 }
 
-bool Storage::getRangeItems(const TRangeID rangeID, BString &data)
+bool Storage::getRangeItems(const RangeItemsRequest &request, BString &data)
+{
+	return _index.getRangeItems(request, data);
+}
+
+bool Storage::getRangeItems(const RangeItemsRequestV1 &request, BString &data)
+{
+	return _index.getRangeItems(request, data);
+}
+
+bool Storage::getRangeDigest(const RangeDigestRequest &request, BString &data)
+{
+	return _index.getRangeDigest(request, data);
+}
+
+static void throttle(const std::chrono::steady_clock::time_point &startTime, const uint64_t processedSize, 
+	const uint32_t maxRate)
+{
+	if (!maxRate)
+		return;
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+	double expected = (double)processedSize / ((double)maxRate * 1024 * 1024);
+	if (expected > elapsed.count())
+		usleep((expected - elapsed.count()) * 1000000);
+}
+
+bool Storage::compact(const double minDeadRatio, const uint32_t maxRate, const uint32_t gracePeriod)
 {
-	return _index.getRangeItems(rangeID, data);
+	AutoMutex autoSync(&_maintenanceSync);
+	TSlicePtr slice;
+	if (!_sliceManager.startCompaction(minDeadRatio, slice))
+		return false;
+	const TSliceID sliceID = slice->sliceID();
+	log::Warning::L("Compact slice %u (dead ratio %.2f)\n", sliceID, slice->deadRatio());
+	
+	File dataFd;
+	if (!slice->openData(dataFd))
+		return false;
+	
+	auto startTime = std::chrono::steady_clock::now();
+	uint64_t copiedSize = 0;
+	uint32_t movedItems = 0;
+	BString buf;
+	ItemHeader header;
+	const TSeek itemHeaderSize = slice->itemHeaderSize();
+	TSeek seek = Slice::firstItemSeek();
+	// no new items can be appended to the compacting slice, but removes can still change the status of its items
+	while (seek < slice->size()) {
+		if (dataFd.pread(&header, sizeof(header), seek) != sizeof(header)) {
+			log::Error::L("Can't read an item header from slice %u at %u\n", sliceID, seek);
+			return false;
+		}
+		ItemPointer pointer;
+		pointer.sliceID = sliceID;
+		pointer.seek = seek;
+		seek += itemHeaderSize + header.size;
+		
+		Range::Entry entry;
+		if ((header.status & ST_ITEM_DELETED) || !_index.find(header.rangeID, header.itemKey, entry) || (entry.size == 0)
+			|| (entry.pointer.sliceID != sliceID) || (entry.pointer.seek != pointer.seek))
+			continue;
+		
+		IndexEntry ie;
+		ie.header = header;
+		bool isMoved;
+		if (header.status & ST_ITEM_COMPRESSED) {
+			// the gzip stream is moved as it is, it's verified by reads and by the scrubber
+			ie.header.size = entry.size;
+			ie.crc = entry.crc;
+			buf.clear();
+			isMoved = (dataFd.pread(buf.reserveBuffer(header.size), header.size, pointer.seek + itemHeaderSize) 
+				== (ssize_t)header.size) && _sliceManager.addCompressed(buf.c_str(), header.size, ie);
+		} else {
+			isMoved = dataFd.seek(pointer.seek + itemHeaderSize, SEEK_SET) && _sliceManager.add(dataFd, buf, ie);
+		}
+		if (!isMoved) {
+			log::Error::L("Can't move item %u:%u from slice %u\n", header.rangeID, header.itemKey, sliceID);
+			return false;
+		}
+		// the copy keeps the checksum of its real data, so the anti-entropy notices the broken replica
+		if (entry.crc && (entry.crc != ie.crc))
+			log::Error::L("Item %u:%u from slice %u has a bad checksum\n", header.rangeID, header.itemKey, sliceID);
+		if (_index.replacePointer(header.rangeID, header.itemKey, pointer, ie.pointer, false))
+			movedItems++;
+		else // the item has been changed or removed during copying
+			_sliceManager.addDeadSize(ie.pointer, header.size);
+		copiedSize += itemHeaderSize + header.size;
+		throttle(startTime, copiedSize, maxRate);
+	}
+	
+	// tombstones have to survive the slice, otherwise older copies of removed items revive after restart
+	Range::TIndexEntryVector tombstones;
+	_index.getTombstones(sliceID, tombstones);
+	for (auto tombstone = tombstones.begin(); tombstone != tombstones.end(); tombstone++) {
+		IndexEntry ie = *tombstone;
+		if (!_sliceManager.addTombstone(ie)) {
+			log::Error::L("Can't move a tombstone from slice %u\n", sliceID);
+			return false;
+		}
+		_index.replacePointer(ie.header.rangeID, ie.header.itemKey, tombstone->pointer, ie.pointer, true);
+	}
+	
+	// let readers, which have got the old pointers, finish with the slice
+	if (gracePeriod)
+		sleep(gracePeriod);
+	_sliceManager.dropSlice(slice);
+	log::Warning::L("Slice %u has been compacted: %u items (%llu bytes) and %u tombstones have been moved\n", sliceID, 
+		movedItems, (unsigned long long)copiedSize, (uint32_t)tombstones.size());
+	return true;
+}
+
+bool Storage::scrub(const uint32_t maxRate, uint32_t &corruptedItems)
+{
+	corruptedItems = 0;
+	SliceManager::TSliceVector slices;
+	_sliceManager.getSlices(slices);
+	uint64_t scrubbedSize = 0;
+	bool res = true;
+	for (auto slice = slices.begin(); slice != slices.end(); slice++) {
+		if (!_scrubSlice(*slice, maxRate, scrubbedSize, corruptedItems)) // the other slices are still worth checking
+			res = false;
+	}
+	log::Warning::L("Scrub of %u slices (%llu bytes) has found %u corrupted items\n", (uint32_t)slices.size(), 
+		(unsigned long long)scrubbedSize, corruptedItems);
+	return res;
+}
+
+bool Storage::_scrubSlice(const TSlicePtr &slice, const uint32_t maxRate, uint64_t &scrubbedSize, 
+	uint32_t &corruptedItems)
+{
+	// a slower read means the disk is busy with requests, so the scrubber lets them go first
+	static const std::chrono::milliseconds SLOW_READ_TIME(50);
+	static const uint32_t SLOW_READ_PAUSE = 200000; // microseconds
+	const TSliceID sliceID = slice->sliceID();
+	File dataFd;
+	if (!slice->openData(dataFd))
+		return false;
+	posix_fadvise(dataFd.descr(), 0, 0, POSIX_FADV_SEQUENTIAL);
+	
+	auto startTime = std::chrono::steady_clock::now();
+	uint64_t readSize = 0;
+	const TSeek itemHeaderSize = slice->itemHeaderSize();
+	const TSeek sliceSize = slice->size(); // items added later are checked by the next pass
+	struct
+	{
+		ItemHeader header;
+		TCrc crc;
+	} __attribute__((packed)) record;
+	BString buf;
+	TSeek seek = Slice::firstItemSeek();
+	while (seek < sliceSize) {
+		record.crc = 0;
+		if (dataFd.pread(&record, itemHeaderSize, seek) != (ssize_t)itemHeaderSize) {
+			log::Error::L("Can't read an item header from slice %u at %u (%d)\n", sliceID, seek, errno);
+			return false;
+		}
+		const ItemHeader &header = record.header;
+		if ((seek + itemHeaderSize + header.size) > sliceSize) {
+			log::Error::L("Slice %u has a broken item header at %u, the rest of it can't be scrubbed\n", sliceID, seek);
+			return false;
+		}
+		ItemPointer pointer;
+		pointer.sliceID = sliceID;
+		pointer.seek = seek;
+		seek += itemHeaderSize + header.size;
+		readSize += itemHeaderSize;
+		
+		// removed, punched, reserved and overwritten items aren't read anymore
+		Range::Entry entry;
+		if ((header.status & ST_ITEM_DELETED) || !_index.find(header.rangeID, header.itemKey, entry) 
+			|| (entry.size == 0) || entry.isCorrupted() || (entry.pointer.sliceID != sliceID) 
+			|| (entry.pointer.seek != pointer.seek))
+			continue;
+		
+		// a compressed item is collected as a whole and checked after uncompressing
+		const bool isCompressed = header.status & ST_ITEM_COMPRESSED;
+		bool isValid = (isCompressed == entry.isCompressed()) && (isCompressed || (header.size == entry.size)) 
+			&& (header.timeTag.tag == entry.timeTag.tag) 
+			&& ((itemHeaderSize == sizeof(ItemHeader)) || (record.crc == entry.crc));
+		BString compressed;
+		TCrc crc = 0;
+		TSeek dataSeek = pointer.seek + itemHeaderSize;
+		TItemSize leftSize = isValid ? header.size : 0;
+		while (leftSize > 0) {
+			TItemSize chunkSize = (leftSize < MAX_BUF_SIZE) ? leftSize : MAX_BUF_SIZE;
+			buf.clear();
+			auto readStartTime = std::chrono::steady_clock::now();
+			if (dataFd.pread(buf.reserveBuffer(chunkSize), chunkSize, dataSeek) != (ssize_t)chunkSize) {
+				log::Error::L("Can't read item %u:%u from slice %u at %u (%d)\n", header.rangeID, header.itemKey, sliceID, 
+					dataSeek, errno);
+				isValid = false;
+				break;
+			}
+			if ((std::chrono::steady_clock::now() - readStartTime) > SLOW_READ_TIME)
+				usleep(SLOW_READ_PAUSE);
+			if (isCompressed)
+				compressed.add(buf.c_str(), chunkSize);
+			else
+				crc = crc32c(crc, buf.c_str(), chunkSize);
+			dataSeek += chunkSize;
+			leftSize -= chunkSize;
+			readSize += chunkSize;
+			throttle(startTime, readSize, maxRate);
+		}
+		if (isValid && isCompressed) {
+			buf.clear();
+			if (gzipUncompress(compressed.c_str(), compressed.size(), entry.size, buf))
+				crc = crc32c(0, buf.c_str(), buf.size());
+			else
+				isValid = false;
+		}
+		if (isValid && entry.crc && (crc != entry.crc))
+			isValid = false;
+		if (!isValid && _markCorrupted(header.rangeID, header.itemKey, entry))
+			corruptedItems++;
+	}
+	scrubbedSize += readSize;
+	return true;
+}
+
+bool Storage::_markCorrupted(const TRangeID rangeID, const TItemKey itemKey, const Range::Entry &entry)
+{
+	ItemPointer corruptedPointer = entry.pointer;
+	corruptedPointer.seek = 0;
+	if (!_index.replacePointer(rangeID, itemKey, entry.pointer, corruptedPointer, false))
+		return false; // the item has been changed or removed during the check
+	if (_objectCache)
+		_objectCache->remove(rangeID, itemKey);
+	log::Error::L("Item %u:%u in slice %u at %u is corrupted, it's hidden until a new copy comes\n", rangeID, itemKey, 
+		entry.pointer.sliceID, entry.pointer.seek);
+	
+	IndexEntry ie;
+	bzero(&ie, sizeof(ie));
+	ie.header.rangeID = rangeID;
+	ie.header.itemKey = itemKey;
+	ie.header.size = entry.size;
+	ie.header.timeTag = entry.timeTag;
+	ie.pointer = entry.pointer;
+	ie.crc = entry.crc;
+	if (!_sliceManager.markCorrupted(ie))
+		log::Error::L("Can't mark item %u:%u as corrupted in slice %u\n", rangeID, itemKey, entry.pointer.sliceID);
+	_addDeadSize(entry);
+	return true;
+}
+
+bool Storage::checkpoint()
+{
+	AutoMutex autoSync(&_maintenanceSync);
+	// everything before the recorded positions has to be on the disk before the checkpoint refers to it
+	if (!_sliceManager.flush()) {
+		log::Error::L("Can't flush slices before an index checkpoint\n");
+		return false;
+	}
+	SliceManager::TIndexPositionVector positions;
+	_sliceManager.getIndexPositions(positions);
+	IndexCheckpoint indexCheckpoint(_sliceManager.checkpointFileName());
+	return indexCheckpoint.save(_index, positions);
 }
@@ -14,6 +14,8 @@
 
 #include "range_index.hpp"
 #include "slice.hpp"
+#include "object_cache.hpp"
+#include "time_thread.hpp"
 
 namespace fl {
 	namespace metis {
@@ -21,17 +23,58 @@ namespace fl {
 		class Storage
 		{
 		public:
-			Storage(const char *path, const double minFree, const TSize maxSliceSize);
+			Storage(const char *path, const double minFree, const TSize maxSliceSize, 
+				const StorageOptions &options = StorageOptions());
 			bool add(const char *data, const ItemHeader &itemHeader);
 			bool add(const ItemHeader &itemHeader, File &putTmpFile, BString &buf);
+			bool reserve(IndexEntry &ie, TSlicePtr &slice);
+			bool writeReserved(const TSlicePtr &slice, IndexEntry &ie, const TItemSize seek, const char *data, 
+				const TItemSize size);
+			bool commitReserved(const TSlicePtr &slice, IndexEntry &ie);
+			void abortReserved(const TSlicePtr &slice, const IndexEntry &ie);
 			bool remove(const ItemHeader &itemHeader);
 			bool findAndFill(const ItemIndex &itemIndex, ItemInfo &itemInfo);
 			bool get(const GetItemChunkRequest &itemRequest, BString &data);
+			// finds the item once, so its info and the chunk belong to the same version
+			bool getInfoAndChunk(const GetItemInfoAndChunkRequest &itemRequest, ItemInfo &itemInfo, BString &data);
+			// a compressed item has no chunk in a slice file, the slice is left empty then and the chunk has to be got
+			bool getFileChunk(const GetItemChunkRequest &itemRequest, TSlicePtr &slice, off_t &fileSeek);
+			// adds a StorageAnswer and the whole data of every item as GET_ITEMS answers them, maxSize limits the data
+			void getItems(const GetItemsEntry *items, const uint32_t count, const TSize maxSize, BString &data);
 			bool ping(StoragePingAnswer &storageAnswer);
-			bool getRangeItems(const TRangeID rangeID, BString &data);
+			bool getRangeItems(const RangeItemsRequest &request, BString &data);
+			bool getRangeItems(const RangeItemsRequestV1 &request, BString &data);
+			bool getRangeDigest(const RangeDigestRequest &request, BString &data);
+			bool timeTic(fl::chrono::ETime &curTime);
+			bool compact(const double minDeadRatio, const uint32_t maxRate, const uint32_t gracePeriod);
+			// verifies the headers and checksums of all indexed items, broken ones are marked corrupted
+			bool scrub(const uint32_t maxRate, uint32_t &corruptedItems);
+			bool checkpoint();
+			bool getObjectCacheStats(ObjectCacheStats &stats);
+			// the index shard, which the range belongs to
+			size_t shard(const TRangeID rangeID) const
+			{
+				return _index.shard(rangeID);
+			}
 		private:
+			void _addToIndex(const IndexEntry &ie);
+			void _addDeadSize(const Range::Entry &entry);
+			bool _get(const TRangeID rangeID, const TItemKey itemKey, const Range::Entry &entry, const TItemSize seek, 
+				const TItemSize size, BString &data);
+			// reads the gzip stream of a compressed item, item is filled with the original data, if it isn't NULL
+			bool _getCompressed(const TRangeID rangeID, const TItemKey itemKey, const Range::Entry &entry, 
+				BString &compressed, BString *item);
+			static bool _isValid(const TRangeID rangeID, const TItemKey itemKey, const Range::Entry &entry, 
+				const char *data);
+			bool _scrubSlice(const TSlicePtr &slice, const uint32_t maxRate, uint64_t &scrubbedSize, 
+				uint32_t &corruptedItems);
+			bool _markCorrupted(const TRangeID rangeID, const TItemKey itemKey, const Range::Entry &entry);
+			StorageOptions _options;
 			SliceManager _sliceManager;
 			Index _index;
+			TObjectCachePtr _objectCache;
+			fl::threads::TimeThread *_timeThread;
+			Mutex _maintenanceSync; // compaction moves items, which can't be checkpointed in the middle
 		};
 	};
 };
@@ -8,12 +8,21 @@
 // Description: Metis Storage event system implementation classes
 ///////////////////////////////////////////////////////////////////////////////
 
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
 #include "storage_event.hpp"
 #include "slice.hpp"
 #include "config.hpp"
 #include "metis_log.hpp"
 #include "storage.hpp"
 #include "sync_thread.hpp"
+#include "disk_io.hpp"
+#include "shard_queue.hpp"
 
 using namespace fl::metis;
 
@@ -21,22 +30,175 @@ using namespace fl::metis;
 Storage *StorageEvent::_storage = NULL;
 Config *StorageEvent::_config = NULL;
 SyncThread *StorageEvent::_syncThread = NULL;
+DiskIO *StorageEvent::_diskIO = NULL;
+ShardQueues *StorageEvent::_shardQueues = NULL;
 bool StorageEvent::_isReady = false;
 
-void StorageEvent::setInited(Storage *storage, Config *config, SyncThread *syncThread)
+void StorageEvent::setInited(Storage *storage, Config *config, SyncThread *syncThread, DiskIO *diskIO, 
+	ShardQueues *shardQueues)
 {
 	_storage = storage;
 	_config = config;
 	_syncThread = syncThread;
+	_diskIO = diskIO;
+	_shardQueues = shardQueues;
 	_isReady = true;
 }
 
+class StorageEvent::ChunkReadTask : public DiskIOTask
+{
+public:
+	ChunkReadTask(StorageEvent *event, DiskIOCompletion *completion, const GetItemChunkRequest &request, 
+		const bool isSendFile)
+		: DiskIOTask(completion), event(event), request(request), isSendFile(isSendFile), isInfoRequest(false), isItemsRequest(false), 
+		finished(false), found(false), fileSeek(0)
+	{
+		bzero(&infoRequest, sizeof(infoRequest));
+	}
+	ChunkReadTask(StorageEvent *event, DiskIOCompletion *completion, const GetItemInfoAndChunkRequest &infoRequest)
+		: DiskIOTask(completion), event(event), infoRequest(infoRequest), isSendFile(false), isInfoRequest(true), isItemsRequest(false), 
+		finished(false), found(false), fileSeek(0)
+	{
+		bzero(&request, sizeof(request));
+	}
+	ChunkReadTask(StorageEvent *event, DiskIOCompletion *completion, const GetItemsEntry *itemsBegin, 
+		const GetItemsEntry *itemsEnd)
+		: DiskIOTask(completion), event(event), isSendFile(false), isInfoRequest(false), isItemsRequest(true), finished(false), found(false), 
+		items(itemsBegin, itemsEnd), fileSeek(0)
+	{
+		bzero(&request, sizeof(request));
+		bzero(&infoRequest, sizeof(infoRequest));
+	}
+	virtual void process()
+	{
+		std::unique_lock<std::mutex> autoSync(sync);
+		if (!event) // the connection has already been closed
+			return;
+		autoSync.unlock();
+
+		bool res;
+		TSlicePtr readSlice;
+		off_t readFileSeek = 0;
+		if (isInfoRequest) {
+			res = _storage->getInfoAndChunk(infoRequest, info, data);
+		} else if (isItemsRequest) {
+			_storage->getItems(items.data(), items.size(), GET_ITEMS_MAX_SIZE, data);
+			res = true;
+		} else if (isSendFile) {
+			res = _storage->getFileChunk(request, readSlice, readFileSeek);
+			if (res && !readSlice) { // a compressed item is uncompressed into memory
+				isSendFile = false;
+				res = _storage->get(request, data);
+			} else if (res) { // bring the chunk into the page cache, so sendfile in the worker won't block on the disk
+				readahead(readSlice->dataDescr(), readFileSeek, request.chunkSize);
+			}
+		} else {
+			res = _storage->get(request, data); // data isn't touched by the event until the task is finished
+		}
+
+		found = res;
+		slice = readSlice;
+		fileSeek = readFileSeek;
+	}
+	virtual void finish()
+	{
+		// the event is changed and canceled only by its worker, which has called finish
+		finished = true;
+		if (event)
+			event->_diskTaskFinished();
+	}
+	
+	std::mutex sync; // the event is read by a disk I/O thread to skip the canceled task
+	StorageEvent *event;
+	GetItemChunkRequest request;
+	GetItemInfoAndChunkRequest infoRequest;
+	bool isSendFile;
+	bool isInfoRequest;
+	bool isItemsRequest;
+	bool finished;
+	bool found;
+	std::vector<GetItemsEntry> items;
+	ItemInfo info;
+	BString data;
+	TSlicePtr slice;
+	off_t fileSeek;
+};
+
+class StorageEvent::WriteTask : public DiskIOTask
+{
+public:
+	enum EType : uint8_t
+	{
+		ADD,
+		COMMIT,
+		REMOVE,
+	};
+	WriteTask(StorageEvent *event, DiskIOCompletion *completion, const ItemHeader &header, const char *itemData)
+		: DiskIOTask(completion), event(event), type(ADD), finished(false), res(false), okStatus(STORAGE_ANSWER_OK), 
+		failStatus(STORAGE_ANSWER_ERROR)
+	{
+		headers.push_back(header);
+		data.add(itemData, header.size);
+		bzero(&entry, sizeof(entry));
+	}
+	WriteTask(StorageEvent *event, DiskIOCompletion *completion, const TSlicePtr &slice, const IndexEntry &entry)
+		: DiskIOTask(completion), event(event), type(COMMIT), slice(slice), entry(entry), finished(false), res(false), 
+		okStatus(STORAGE_ANSWER_OK), failStatus(STORAGE_ANSWER_ERROR)
+	{
+	}
+	WriteTask(StorageEvent *event, DiskIOCompletion *completion, std::vector<ItemHeader> &removes, 
+		const EStorageAnswerStatus okStatus, const EStorageAnswerStatus failStatus)
+		: DiskIOTask(completion), event(event), type(REMOVE), finished(false), res(false), okStatus(okStatus), 
+		failStatus(failStatus)
+	{
+		std::swap(headers, removes);
+		bzero(&entry, sizeof(entry));
+	}
+	// a write is done even if the connection has been closed, only its answer is skipped
+	virtual void process()
+	{
+		if (type == ADD) {
+			res = _storage->add(data.c_str(), headers.front());
+			if (!res)
+				log::Error::L("Can't put an item into the storage\n");
+		} else if (type == COMMIT) {
+			res = _storage->commitReserved(slice, entry);
+			if (!res)
+				log::Error::L("Can't commit a put item into the storage\n");
+		} else {
+			res = true;
+			for (auto header = headers.begin(); header != headers.end(); header++) {
+				if (!_storage->remove(*header))
+					res = false;
+			}
+		}
+	}
+	virtual void finish()
+	{
+		finished = true;
+		if (event)
+			event->_diskTaskFinished();
+	}
+	
+	StorageEvent *event; // is changed only by the worker of the event
+	EType type;
+	std::vector<ItemHeader> headers;
+	BString data;
+	TSlicePtr slice;
+	IndexEntry entry;
+	bool finished;
+	bool res;
+	EStorageAnswerStatus okStatus;
+	EStorageAnswerStatus failStatus;
+};
+
+
 
 StorageEvent::StorageEvent(const TEventDescriptor descr, const time_t timeOutTime)
-	: WorkEvent(descr, timeOutTime), _networkBuffer(NULL), _curState(ST_WAIT_REQUEST)
+	: WorkEvent(descr, timeOutTime), _networkBuffer(NULL), _curState(ST_WAIT_REQUEST), _putWritten(0), 
+		_sendFileSeek(0), _sendFileLeft(0)
 {
 	setWaitRead();
-	bzero(&_cmd, sizeof(_cmd));
 }
 
 StorageEvent::~StorageEvent()
@@ -44,9 +206,30 @@ StorageEvent::~StorageEvent()
 	_endWork();
 }
 
+void StorageEvent::_cancelDiskTask()
+{
+	if (_readTask.get()) {
+		std::lock_guard<std::mutex> autoSync(_readTask->sync);
+		_readTask->event = NULL;
+	}
+	_readTask.reset();
+	if (_writeTask.get())
+		_writeTask->event = NULL;
+	_writeTask.reset();
+}
+
 void StorageEvent::_endWork()
 {
+	_cancelDiskTask();
 	_curState = ST_FINISHED;
+	if (_putSlice.get()) {
+		log::Warning::L("Put of item %u:%llu has been interrupted, %u of %u bytes were received\n", 
+			_putEntry.header.rangeID, _putEntry.header.itemKey, _putWritten, _putEntry.header.size);
+		_storage->abortReserved(_putSlice, _putEntry);
+		_putSlice.reset();
+	}
+	_sendSlice.reset();
+	_reader.clear();
 	if (_descr != 0)
 		close(_descr);
 	if (_networkBuffer)
@@ -67,8 +250,16 @@ bool StorageEvent::_reset()
 		_networkBuffer = NULL;
 	}
 	setWaitRead();
-	bzero(&_cmd, sizeof(_cmd));
+	_reader.reset();
 	_putTmpFile.close();
+	if (_putSlice.get()) {
+		_storage->abortReserved(_putSlice, _putEntry);
+		_putSlice.reset();
+	}
+	_readTask.reset();
+	_writeTask.reset();
+	_sendSlice.reset();
+	_sendFileLeft = 0;
 	if (_thread->ctrl(this)) {
 		_updateTimeout();
 		return true;
@@ -82,10 +273,15 @@ void StorageEvent::_updateTimeout()
 	_timeOutTime = EPollWorkerGroup::curTime.unix() + _config->cmdTimeout();
 }
 
-StorageEvent::ECallResult StorageEvent::_nopCmd()
+StorageAnswer &StorageEvent::_startAnswer()
 {
 	_networkBuffer->clear();
-	StorageAnswer &sa = *(StorageAnswer*)_networkBuffer->reserveBuffer(sizeof(StorageAnswer));
+	return _reader.addAnswerHeader(*_networkBuffer);
+}
+
+StorageEvent::ECallResult StorageEvent::_nopCmd()
+{
+	StorageAnswer &sa = _startAnswer();
 	sa.status = STORAGE_ANSWER_OK;
 	sa.size = 0;
 	return _send();
@@ -93,45 +289,231 @@ StorageEvent::ECallResult StorageEvent::_nopCmd()
 
 StorageEvent::ECallResult StorageEvent::_sendStatus(const EStorageAnswerStatus status)
 {
-	_networkBuffer->clear();
-	StorageAnswer &sa = *(StorageAnswer*)_networkBuffer->reserveBuffer(sizeof(StorageAnswer));
+	StorageAnswer &sa = _startAnswer();
 	sa.status = status;
 	sa.size = 0;
 	return _send();
 }
 
 
-StorageEvent::ECallResult StorageEvent::_itemGetChunk(const char *data)
+StorageEvent::ECallResult StorageEvent::_sendFileChunk(const TItemSize chunkSize, const bool found)
 {
-	if (_cmd.size < sizeof(GetItemChunkRequest)) {
-		log::Error::L("StorageEvent::_itemInfo has received cmd.size < sizeof(ItemHeader)\n");
-		return FINISHED;
+	StorageAnswer &sa = _startAnswer();
+	if (found) {
+		sa.status = STORAGE_ANSWER_OK;
+		sa.size = chunkSize;
+		_sendFileLeft = chunkSize;
+		return _sendFile();
+	} else {
+		_sendSlice.reset();
+		sa.status = STORAGE_ANSWER_NOT_FOUND;
+		sa.size = 0;
+		return _send();
 	}
-	GetItemChunkRequest itemRequest = *(GetItemChunkRequest*)data;
-	_networkBuffer->clear();
-	_networkBuffer->reserveBuffer(sizeof(StorageAnswer));
-	if (_storage->get(itemRequest, *_networkBuffer)) {
+}
+
+StorageEvent::ECallResult StorageEvent::_sendChunk(const bool found)
+{
+	if (found) {
 		StorageAnswer &sa = *(StorageAnswer*)_networkBuffer->c_str();
 		sa.status = STORAGE_ANSWER_OK;
-		sa.size = _networkBuffer->size() - sizeof(StorageAnswer);
+		sa.size = _networkBuffer->size() - _answerHeaderSize();
 	} else {
-		_networkBuffer->clear();
-		StorageAnswer &sa = *(StorageAnswer*)_networkBuffer->reserveBuffer(sizeof(StorageAnswer));
+		StorageAnswer &sa = _startAnswer();
 		sa.status = STORAGE_ANSWER_NOT_FOUND;
 		sa.size = 0;
 	}
 	return _send();
 }
 
+StorageEvent::ECallResult StorageEvent::_itemGetChunk(const char *data)
+{
+	if (_reader.cmd().size < sizeof(GetItemChunkRequest)) {
+		log::Error::L("StorageEvent::_itemInfo has received cmd.size < sizeof(ItemHeader)\n");
+		return FINISHED;
+	}
+	GetItemChunkRequest itemRequest = *(GetItemChunkRequest*)data;
+	bool isSendFile = _config->sendFileMinSize() && (itemRequest.chunkSize >= _config->sendFileMinSize());
+	if (_isTaskNeeded(itemRequest.rangeID)) {
+		_readTask.reset(new ChunkReadTask(this, _diskIOCompletion(), itemRequest, isSendFile));
+		if (_addTask(_readTask, itemRequest.rangeID))
+			return _waitDisk();
+		_readTask.reset();
+	}
+	
+	if (isSendFile) {
+		bool found = _storage->getFileChunk(itemRequest, _sendSlice, _sendFileSeek);
+		if (!found || _sendSlice)
+			return _sendFileChunk(itemRequest.chunkSize, found);
+	}
+	
+	_startAnswer();
+	return _sendChunk(_storage->get(itemRequest, *_networkBuffer));
+}
+
+DiskIOCompletion *StorageEvent::_diskIOCompletion()
+{
+	if (!_diskIO)
+		return NULL;
+	auto threadSpecData = static_cast<StorageThreadSpecificData*>(_thread->threadSpecificData());
+	return threadSpecData->diskIOCompletion(_thread);
+}
+
+ShardQueue *StorageEvent::_shardQueue()
+{
+	auto threadSpecData = static_cast<StorageThreadSpecificData*>(_thread->threadSpecificData());
+	return threadSpecData->shardQueue(_thread, _shardQueues);
+}
+
+bool StorageEvent::_isTaskNeeded(const TRangeID rangeID)
+{
+	if (_shardQueues) { // the worker does the commands on its own ranges itself
+		ShardQueue *shardQueue = _shardQueue();
+		return shardQueue && (_storage->shard(rangeID) != shardQueue->shard());
+	}
+	return _diskIOCompletion() != NULL;
+}
+
+bool StorageEvent::_addTask(const TDiskIOTaskPtr &task, const TRangeID rangeID)
+{
+	if (_shardQueues) {
+		_shardQueues->get(_storage->shard(rangeID))->forward(task, _shardQueue());
+		return true;
+	}
+	return _diskIO->add(task);
+}
+
+StorageEvent::ECallResult StorageEvent::_waitDisk()
+{
+	_curState = ST_WAIT_DISK; // or for the worker, which owns the range of the command
+	// pipelined requests are left in the socket, they can't be parsed until the answer has been sent
+	_events = E_ERROR | E_HUP;
+	if (!_thread->ctrl(this)) {
+		log::Error::L("StorageEvent: Can't wait for a disk I/O task\n");
+		_endWork();
+		return FINISHED;
+	}
+	_updateTimeout();
+	return CHANGE;
+}
+
+void StorageEvent::_diskTaskFinished()
+{
+	setWaitSend();
+	if (!_thread->ctrl(this))
+		log::Error::L("StorageEvent: Can't wake up after a disk I/O task\n");
+}
+
+StorageEvent::ECallResult StorageEvent::_addWriteTask(WriteTask *task, const TRangeID rangeID)
+{
+	_writeTask.reset(task);
+	if (_addTask(_writeTask, rangeID))
+		return _waitDisk();
+	_writeTask.reset();
+	return SKIP;
+}
+
+StorageEvent::ECallResult StorageEvent::_finishDiskWrite()
+{
+	if (!_writeTask->finished)
+		return SKIP;
+	auto task = std::move(_writeTask);
+	return _sendStatus(task->res ? task->okStatus : task->failStatus);
+}
+
+StorageEvent::ECallResult StorageEvent::_finishDiskRead()
+{
+	if (!_readTask->finished)
+		return SKIP;
+	auto task = std::move(_readTask);
+	if (task->isInfoRequest) {
+		_startAnswer();
+		_networkBuffer->reserveBuffer(sizeof(ItemInfo));
+		_networkBuffer->add(task->data.c_str(), task->data.size());
+		return _sendInfoAndChunk(task->found, task->info);
+	}
+	if (task->isSendFile) {
+		_sendSlice = task->slice;
+		_sendFileSeek = task->fileSeek;
+		return _sendFileChunk(task->request.chunkSize, task->found);
+	}
+	_startAnswer();
+	_networkBuffer->add(task->data.c_str(), task->data.size());
+	return _sendChunk(task->found);
+}
+
+StorageEvent::ECallResult StorageEvent::_sendInfoAndChunk(const bool found, const ItemInfo &itemInfo)
+{
+	if (!found)
+		return _sendStatus(STORAGE_ANSWER_NOT_FOUND);
+	// the buffer already has the answer header, the room for the item info and the chunk
+	char *answer = (char*)_networkBuffer->c_str();
+	StorageAnswer &sa = *(StorageAnswer*)answer;
+	sa.status = STORAGE_ANSWER_OK;
+	sa.size = _networkBuffer->size() - _answerHeaderSize();
+	memcpy(answer + _answerHeaderSize(), &itemInfo, sizeof(itemInfo));
+	return _send();
+}
+
+StorageEvent::ECallResult StorageEvent::_itemInfoAndChunk(const char *data)
+{
+	if (_reader.cmd().size < sizeof(GetItemInfoAndChunkRequest)) {
+		log::Error::L("StorageEvent::_itemInfoAndChunk has received cmd.size < sizeof(GetItemInfoAndChunkRequest)\n");
+		return FINISHED;
+	}
+	GetItemInfoAndChunkRequest itemRequest = *(GetItemInfoAndChunkRequest*)data;
+	if (_isTaskNeeded(itemRequest.rangeID)) {
+		_readTask.reset(new ChunkReadTask(this, _diskIOCompletion(), itemRequest));
+		if (_addTask(_readTask, itemRequest.rangeID))
+			return _waitDisk();
+		_readTask.reset();
+	}
+	
+	_startAnswer();
+	_networkBuffer->reserveBuffer(sizeof(ItemInfo));
+	ItemInfo itemInfo;
+	bool found = _storage->getInfoAndChunk(itemRequest, itemInfo, *_networkBuffer);
+	return _sendInfoAndChunk(found, itemInfo);
+}
+
+StorageEvent::ECallResult StorageEvent::_getItems(const char *data)
+{
+	const uint32_t count = _reader.cmd().size / sizeof(GetItemsEntry);
+	if ((count == 0) || (count > GET_ITEMS_MAX_COUNT) || (_reader.cmd().size % sizeof(GetItemsEntry))) {
+		log::Error::L("StorageEvent::_getItems has received a bad cmd.size %u\n", _reader.cmd().size);
+		return _sendStatus(STORAGE_ANSWER_ERROR);
+	}
+	const GetItemsEntry *items = (const GetItemsEntry*)data;
+	auto completion = _diskIOCompletion();
+	if (completion) {
+		_readTask.reset(new ChunkReadTask(this, completion, items, items + count));
+		if (_diskIO->add(_readTask))
+			return _waitDisk();
+		_readTask.reset();
+	}
+	
+	// the request is in the network buffer, so it is copied before the answer is put there
+	std::vector<GetItemsEntry> request(items, items + count);
+	_startAnswer();
+	_storage->getItems(request.data(), count, GET_ITEMS_MAX_SIZE, *_networkBuffer);
+	return _sendChunk(true);
+}
+
 StorageEvent::ECallResult StorageEvent::_deleteItem(const char *data)
 {
-	if (_cmd.size < sizeof(ItemHeader)) {
+	if (_reader.cmd().size < sizeof(ItemHeader)) {
 		log::Error::L("StorageEvent::_deleteItem has received cmd.size < sizeof(ItemHeader)\n");
 		return FINISHED;
 	}
 	ItemHeader ih = *(ItemHeader*)data;
-	_networkBuffer->clear();
-	StorageAnswer &sa = *(StorageAnswer*)_networkBuffer->reserveBuffer(sizeof(StorageAnswer));
+	if (_isTaskNeeded(ih.rangeID)) {
+		std::vector<ItemHeader> removes(1, ih);
+		auto res = _addWriteTask(new WriteTask(this, _diskIOCompletion(), removes, STORAGE_ANSWER_OK, 
+			STORAGE_ANSWER_NOT_FOUND), ih.rangeID);
+		if (res != SKIP)
+			return res;
+	}
+	StorageAnswer &sa = _startAnswer();
 	sa.size = 0;
 	if (_storage->remove(ih)) {
 		sa.status = STORAGE_ANSWER_OK;
@@ -142,71 +524,74 @@ StorageEvent::ECallResult StorageEvent::_deleteItem(const char *data)
 }
 
 
-bool StorageEvent::_parseSyncRequest()
+bool StorageEvent::_parseSyncRequest(const char *data, std::vector<ItemHeader> &removes)
 {
-	Buffer dataBuffer(std::move(*_networkBuffer));
-	try
-	{
-		dataBuffer.skip(sizeof(StorageCmd));
-		RangeSyncHeader header;
-		dataBuffer.get(&header, sizeof(header));
-		RangeSyncEntry ie;
-		TIndexSyncEntryVector syncs;
-		for (decltype(header.count) i = 0; i < header.count; i++) {
-			dataBuffer.get(&ie, sizeof(ie));
-			if (ie.fromServer == 0) { // delete command
-				_storage->remove(ie.header);
-			}
-			else
-				syncs.push_back(ie);
-		}
-		if (syncs.empty()) {
-			return true;
-		} else {
-			return _syncThread->add(header.managerID, header.rangeID, syncs);
+	const RangeSyncHeader &header = *(const RangeSyncHeader*)data;
+	if (_reader.cmd().size < (sizeof(header) + (size_t)header.count * sizeof(RangeSyncEntry))) {
+		log::Error::L("Receive a bad sync range items answer\n");
+		return false;
+	}
+	const RangeSyncEntry *ie = (const RangeSyncEntry*)(data + sizeof(header));
+	TIndexSyncEntryVector syncs;
+	for (decltype(header.count) i = 0; i < header.count; i++, ie++) {
+		if (ie->fromServer == 0) { // delete command
+			removes.push_back(ie->header);
 		}
+		else
+			syncs.push_back(*ie);
 	}
-	catch (Buffer::Error &er)
-	{
-		log::Error::L("Receive a bad sync range items answer\n");
+	if (syncs.empty()) {
+		return true;
+	} else {
+		return _syncThread->add(header.managerID, header.rangeID, syncs);
 	}
-	return false;
 }
 
 StorageEvent::ECallResult StorageEvent::_sync(const char *data)
 {
-	if (_cmd.size < sizeof(RangeSyncHeader)) {
+	if (_reader.cmd().size < sizeof(RangeSyncHeader)) {
 		log::Error::L("StorageEvent::_sync has received cmd.size < sizeof(RangeSyncHeader)\n");
 		return FINISHED;
 	}
 	
 	EStorageAnswerStatus status = STORAGE_ANSWER_ERROR;
-	if (_parseSyncRequest()) {
+	const TRangeID rangeID = ((const RangeSyncHeader*)data)->rangeID;
+	std::vector<ItemHeader> removes;
+	if (_parseSyncRequest(data, removes)) {
 		status = STORAGE_ANSWER_OK;
 	}
-	_networkBuffer->clear();
-	StorageAnswer &sa = *(StorageAnswer*)_networkBuffer->reserveBuffer(sizeof(StorageAnswer));
+	if (!removes.empty()) { // the status doesn't depend on the deletes, they are repeated by the next range check
+		if (_isTaskNeeded(rangeID)) {
+			auto res = _addWriteTask(new WriteTask(this, _diskIOCompletion(), removes, status, status), rangeID);
+			if (res != SKIP)
+				return res;
+		}
+		for (auto remove = removes.begin(); remove != removes.end(); remove++)
+			_storage->remove(*remove);
+	}
+	StorageAnswer &sa = _startAnswer();
 	sa.status = status;
 	sa.size = 0;
 	return _send();
 }
 
+template <typename TRangeItemsRequest>
 StorageEvent::ECallResult StorageEvent::_getRangeItems(const char *data)
 {
-	if (_cmd.size < sizeof(RangeItemsRequest)) {
-		log::Error::L("StorageEvent::_getRangeItems has received cmd.size < sizeof(RangeItemsRequest)\n");
+	if (_reader.cmd().size < sizeof(TRangeItemsRequest)) {
+		log::Error::L("StorageEvent::_getRangeItems has received cmd.size %u < %zu\n", _reader.cmd().size, 
+			sizeof(TRangeItemsRequest));
 		return FINISHED;
 	}
 	EStorageAnswerStatus status = STORAGE_ANSWER_ERROR;
-	RangeItemsRequest request = *(RangeItemsRequest*)data;
+	TRangeItemsRequest request = *(TRangeItemsRequest*)data;
 	if (!_syncThread->checkActive(request.rangeID))
 	{
 		log::Error::L("Sync thread already has task on range %u\n", request.rangeID);
 	} else if (_config->serverID() == request.serverID) {
-		_networkBuffer->clear();
-		_networkBuffer->reserveBuffer(sizeof(StorageAnswer));
+		_startAnswer();
 		auto currentBufferSize = _networkBuffer->size();
-		if (_storage->getRangeItems(request.rangeID, *_networkBuffer)) {
+		if (_storage->getRangeItems(request, *_networkBuffer)) {
 			StorageAnswer &sa = *(StorageAnswer*)_networkBuffer->c_str();
 			sa.status = STORAGE_ANSWER_OK;
 			sa.size = _networkBuffer->size() - currentBufferSize;
@@ -215,8 +600,36 @@ StorageEvent::ECallResult StorageEvent::_getRangeItems(const char *data)
 			status = STORAGE_ANSWER_NOT_FOUND;
 		}
 	}
-	_networkBuffer->clear();
-	StorageAnswer &sa = *(StorageAnswer*)_networkBuffer->reserveBuffer(sizeof(StorageAnswer));
+	StorageAnswer &sa = _startAnswer();
+	sa.status = status;
+	sa.size = 0;
+	return _send();
+}
+
+StorageEvent::ECallResult StorageEvent::_getRangeDigest(const char *data)
+{
+	if (_reader.cmd().size < sizeof(RangeDigestRequest)) {
+		log::Error::L("StorageEvent::_getRangeDigest has received cmd.size < sizeof(RangeDigestRequest)\n");
+		return FINISHED;
+	}
+	EStorageAnswerStatus status = STORAGE_ANSWER_ERROR;
+	RangeDigestRequest request = *(RangeDigestRequest*)data;
+	if (!_syncThread->checkActive(request.rangeID))
+	{
+		log::Error::L("Sync thread already has task on range %u\n", request.rangeID);
+	} else if (_config->serverID() == request.serverID) {
+		_startAnswer();
+		auto currentBufferSize = _networkBuffer->size();
+		if (_storage->getRangeDigest(request, *_networkBuffer)) {
+			StorageAnswer &sa = *(StorageAnswer*)_networkBuffer->c_str();
+			sa.status = STORAGE_ANSWER_OK;
+			sa.size = _networkBuffer->size() - currentBufferSize;
+			return _send();
+		} else { 
+			status = STORAGE_ANSWER_NOT_FOUND;
+		}
+	}
+	StorageAnswer &sa = _startAnswer();
 	sa.status = status;
 	sa.size = 0;
 	return _send();
@@ -224,13 +637,12 @@ StorageEvent::ECallResult StorageEvent::_getRangeItems(const char *data)
 
 StorageEvent::ECallResult StorageEvent::_ping(const char *data)
 {
-	if (_cmd.size < sizeof(TServerID)) {
+	if (_reader.cmd().size < sizeof(TServerID)) {
 		log::Error::L("StorageEvent::_ping has received cmd.size < sizeof(TServerID)\n");
 		return FINISHED;
 	}
 	TServerID requestServerID = *(TServerID*)data;
-	_networkBuffer->clear();
-	StorageAnswer &sa = *(StorageAnswer*)_networkBuffer->reserveBuffer(sizeof(StorageAnswer));
+	StorageAnswer &sa = _startAnswer();
 	sa.status = STORAGE_ANSWER_ERROR;
 	sa.size = 0;
 
@@ -250,13 +662,12 @@ StorageEvent::ECallResult StorageEvent::_ping(const char *data)
 
 StorageEvent::ECallResult StorageEvent::_itemInfo(const char *data)
 {
-	if (_cmd.size < sizeof(ItemIndex)) {
+	if (_reader.cmd().size < sizeof(ItemIndex)) {
 		log::Error::L("StorageEvent::_itemInfo has received cmd.size < sizeof(ItemIndex)\n");
 		return FINISHED;
 	}
 	ItemIndex itemIndex = *(ItemIndex*)data;
-	_networkBuffer->clear();
-	StorageAnswer &sa = *(StorageAnswer*)_networkBuffer->reserveBuffer(sizeof(StorageAnswer));
+	StorageAnswer &sa = _startAnswer();
 	sa.status = STORAGE_ANSWER_NOT_FOUND;
 	sa.size = 0;
 	ItemInfo itemInfo;
@@ -270,43 +681,94 @@ StorageEvent::ECallResult StorageEvent::_itemInfo(const char *data)
 
 StorageEvent::ECallResult StorageEvent::_parseCmd(const char *data)
 {
-	switch (_cmd.cmd) 
+	switch (_reader.cmd().cmd) 
 	{
 		case EStorageCMD::STORAGE_GET_ITEM_CHUNK:
 			return _itemGetChunk(data);
 		case EStorageCMD::STORAGE_ITEM_INFO:
 			return _itemInfo(data);
+		case EStorageCMD::STORAGE_GET_ITEM_INFO_AND_CHUNK:
+			return _itemInfoAndChunk(data);
+		case EStorageCMD::STORAGE_GET_ITEMS:
+			return _getItems(data);
 		case EStorageCMD::STORAGE_DELETE_ITEM:
 			return _deleteItem(data);
 		case EStorageCMD::STORAGE_PING:
 			return _ping(data);
 		case EStorageCMD::STORAGE_GET_RANGE_ITEMS:
-			return _getRangeItems(data);
+			return _getRangeItems<RangeItemsRequestV1>(data);
+		case EStorageCMD::STORAGE_GET_RANGE_ITEMS_V2:
+			return _getRangeItems<RangeItemsRequest>(data);
+		case EStorageCMD::STORAGE_GET_RANGE_DIGEST:
+			return _getRangeDigest(data);
 		case EStorageCMD::STORAGE_SYNC:
 			return _sync(data);
 		case EStorageCMD::STORAGE_NO_CMD:
 			return _nopCmd();
 		case EStorageCMD::STORAGE_PUT: // never come here
-			log::Error::L("Should not come here %u\n", _cmd.cmd);
+			log::Error::L("Should not come here %u\n", _reader.cmd().cmd);
 		break;
 	};
-	log::Error::L("Unsupported command %u\n", _cmd.cmd);
+	log::Error::L("Unsupported command %u\n", _reader.cmd().cmd);
 	_endWork();
 	return FINISHED;
 }
 
+StorageEvent::ECallResult StorageEvent::_waitSend()
+{
+	setWaitSend();
+	if (_thread->ctrl(this)) {
+		_updateTimeout();
+		return CHANGE;
+	}
+	else
+		return FINISHED;
+}
+
+StorageEvent::ECallResult StorageEvent::_sendFile()
+{
+	_curState = ST_WAIT_SEND_FILE;
+	// the answer header is corked with MSG_MORE, so it leaves in the same packet as the beginning of the payload
+	while (_networkBuffer->sended() < _networkBuffer->size()) {
+		auto res = ::send(_descr, _networkBuffer->c_str() + _networkBuffer->sended(), 
+			_networkBuffer->size() - _networkBuffer->sended(), MSG_MORE | MSG_NOSIGNAL);
+		if (res > 0) {
+			_networkBuffer->setSended(_networkBuffer->sended() + res);
+		} else if ((res < 0) && (errno == EINTR)) {
+			continue;
+		} else if ((res < 0) && (errno == EAGAIN)) {
+			return _waitSend();
+		} else {
+			_endWork();
+			return FINISHED;
+		}
+	}
+	while (_sendFileLeft > 0) {
+		auto res = sendfile(_descr, _sendSlice->dataDescr(), &_sendFileSeek, _sendFileLeft);
+		if (res > 0) {
+			_sendFileLeft -= res;
+		} else if ((res < 0) && (errno == EINTR)) {
+			continue;
+		} else if ((res < 0) && (errno == EAGAIN)) {
+			return _waitSend();
+		} else {
+			if (res == 0)
+				log::Error::L("StorageEvent::_sendFile: unexpected end of slice data file, %u bytes left\n", _sendFileLeft);
+			_endWork();
+			return FINISHED;
+		}
+	}
+	if (_reset())
+		return CHANGE;
+	return FINISHED;
+}
+
 StorageEvent::ECallResult  StorageEvent::_send()
 {
 	_curState = ST_WAIT_SEND;
 	auto res = _networkBuffer->send(_descr);
 	if (res == NetworkBuffer::IN_PROGRESS) {
-		setWaitSend();
-		if (_thread->ctrl(this)) {
-			_updateTimeout();
-			return CHANGE;
-		}
-		else
-			return FINISHED;
+		return _waitSend();
 	} else if (res == NetworkBuffer::OK) {
 		if (_reset())
 			return CHANGE;
@@ -314,34 +776,117 @@ StorageEvent::ECallResult  StorageEvent::_send()
 	return FINISHED;
 }
 
+StorageEvent::ECallResult StorageEvent::_parseDirectPut()
+{
+	const char *data = _networkBuffer->c_str();
+	TItemSize dataSize = _networkBuffer->size();
+	if (_putSlice.get() == NULL) {
+		if (_reader.cmd().size < sizeof(ItemHeader)) {
+			log::Error::L("Put cmd can't have size less than %u, but its size is %u\n", sizeof(ItemHeader), 
+				_reader.cmd().size);
+			return _sendStatus(EStorageAnswerStatus::STORAGE_ANSWER_ERROR);
+		}
+		if (dataSize < (sizeof(StorageCmd) + sizeof(ItemHeader))) { // wait for the rest of the item header
+			_updateTimeout();
+			return CHANGE;
+		}
+		_putEntry.header = *(ItemHeader*)(data + sizeof(StorageCmd));
+		if (_putEntry.header.size != (_reader.cmd().size - sizeof(ItemHeader))) {
+			log::Error::L("Item and cmd's sizes are different %u != %u\n", _putEntry.header.size, 
+				_reader.cmd().size - sizeof(ItemHeader));
+			return _sendStatus(EStorageAnswerStatus::STORAGE_ANSWER_ERROR);
+		}
+		data += sizeof(StorageCmd) + sizeof(ItemHeader);
+		dataSize -= sizeof(StorageCmd) + sizeof(ItemHeader);
+		if (dataSize >= _putEntry.header.size) { // the whole item has come, so it goes through the group commit
+			_reader.split(data, dataSize, _putEntry.header.size);
+			// the group commit and its fsync can block, so they are waited for in a disk thread, when shards are off
+			if (_isTaskNeeded(_putEntry.header.rangeID)) {
+				auto res = _addWriteTask(new WriteTask(this, _diskIOCompletion(), _putEntry.header, data), 
+					_putEntry.header.rangeID);
+				if (res != SKIP)
+					return res;
+			}
+			if (_storage->add(data, _putEntry.header)) {
+				return _sendStatus(EStorageAnswerStatus::STORAGE_ANSWER_OK);
+			} else {
+				log::Error::L("Can't put an item into the storage\n");
+				return _sendStatus(EStorageAnswerStatus::STORAGE_ANSWER_ERROR);
+			}
+		}
+		if (!_storage->reserve(_putEntry, _putSlice)) {
+			_putSlice.reset();
+			return _sendStatus(EStorageAnswerStatus::STORAGE_ANSWER_ERROR);
+		}
+		_putWritten = 0;
+	}
+	
+	dataSize = _reader.split(data, dataSize, _putEntry.header.size - _putWritten);
+	if (dataSize > 0) {
+		if (!_storage->writeReserved(_putSlice, _putEntry, _putWritten, data, dataSize)) {
+			_storage->abortReserved(_putSlice, _putEntry);
+			_putSlice.reset();
+			return _sendStatus(EStorageAnswerStatus::STORAGE_ANSWER_ERROR);
+		}
+		_putWritten += dataSize;
+	}
+	if (_putWritten >= _putEntry.header.size) {
+		if (_isTaskNeeded(_putEntry.header.rangeID)) {
+			auto res = _addWriteTask(new WriteTask(this, _diskIOCompletion(), _putSlice, _putEntry), 
+				_putEntry.header.rangeID);
+			if (res != SKIP) { // the reserved item belongs to the task now
+				_putSlice.reset();
+				return res;
+			}
+		}
+		bool res = _storage->commitReserved(_putSlice, _putEntry);
+		_putSlice.reset();
+		if (res) {
+			return _sendStatus(EStorageAnswerStatus::STORAGE_ANSWER_OK);
+		} else {
+			log::Error::L("Can't commit a put item into the storage\n");
+			return _sendStatus(EStorageAnswerStatus::STORAGE_ANSWER_ERROR);
+		}
+	}
+	_networkBuffer->clear();
+	_updateTimeout();
+	return CHANGE;
+}
+
 StorageEvent::ECallResult StorageEvent::_parsePut()
 {
+	if (_config->directPut())
+		return _parseDirectPut();
+	
 	ssize_t writeSize = _networkBuffer->size();
 	size_t skipSize = 0;
 	if (_putTmpFile.descr() == 0) {
-		if (_cmd.size < sizeof(ItemHeader)) {
-			log::Error::L("Put cmd can't have size less than %u, but its size is %u\n", sizeof(ItemHeader), _cmd.size);
+		if (_reader.cmd().size < sizeof(ItemHeader)) {
+			log::Error::L("Put cmd can't have size less than %u, but its size is %u\n", sizeof(ItemHeader), 
+				_reader.cmd().size);
 			return _sendStatus(EStorageAnswerStatus::STORAGE_ANSWER_ERROR);
 		}
 		_putTmpFile.createUnlinkedTmpFile(_config->getTmpDir());
 		writeSize -= sizeof(StorageCmd);
 		skipSize = sizeof(StorageCmd);
 	}
+	ssize_t leftSize = (ssize_t)_reader.cmd().size - _putTmpFile.seek(0, SEEK_CUR);
+	writeSize = _reader.split(_networkBuffer->c_str() + skipSize, writeSize, leftSize);
 	
 	if (_putTmpFile.write(_networkBuffer->c_str() + skipSize, writeSize) != writeSize) {
 		log::Error::L("Can't write to put temporary file in %s\n", _config->getTmpDir());
 		return _sendStatus(EStorageAnswerStatus::STORAGE_ANSWER_ERROR);
 	}
-	if (_putTmpFile.seek(0, SEEK_CUR) >= _cmd.size) {
+	if (_putTmpFile.seek(0, SEEK_CUR) >= _reader.cmd().size) {
 		ItemHeader itemHeader;
 		_putTmpFile.seek(0, SEEK_SET);
 		if (_putTmpFile.read(&itemHeader, sizeof(itemHeader)) !=  sizeof(itemHeader)) {
 			log::Error::L("Can't read an item header from put temporary file in %s\n", _config->getTmpDir());
 			return _sendStatus(EStorageAnswerStatus::STORAGE_ANSWER_ERROR);
 		}
-		_cmd.size -= sizeof(itemHeader);
-		if (itemHeader.size != _cmd.size) {
-			log::Error::L("Item and cmd's sizes are different %u != %u\n", itemHeader.size != _cmd.size);
+		const TItemSize itemSize = _reader.cmd().size - sizeof(itemHeader);
+		if (itemHeader.size != itemSize) {
+			log::Error::L("Item and cmd's sizes are different %u != %u\n", itemHeader.size, itemSize);
 			return _sendStatus(EStorageAnswerStatus::STORAGE_ANSWER_ERROR);
 		}
 		if (_storage->add(itemHeader, _putTmpFile, *_networkBuffer)) {
@@ -371,19 +916,37 @@ StorageEvent::ECallResult StorageEvent::_read()
 	}
 	else if (res == NetworkBuffer::IN_PROGRESS)
 		return SKIP;
-	if ((size_t)_networkBuffer->size() >= sizeof(StorageCmd)) {
-		if (!_cmd.size)
-			_cmd = *(StorageCmd*)_networkBuffer->c_str();
-		if (_cmd.cmd  == EStorageCMD::STORAGE_PUT)
+	return _parseRequest();
+}
+
+StorageEvent::ECallResult StorageEvent::_parseRequest()
+{
+	if (_reader.hasHeader() || _reader.parseHeader(*_networkBuffer)) {
+		if (_reader.cmd().cmd  == EStorageCMD::STORAGE_PUT)
 		{
 			return _parsePut();
-		} else if ((size_t)_networkBuffer->size() >= (_cmd.size + sizeof(StorageCmd)))
-			return _parseCmd(_networkBuffer->c_str() + sizeof(StorageCmd));
+		} else if (_reader.takeRequest(*_networkBuffer)) {
+			return _parseCmd(_reader.request());
+		}
 	}
 	_updateTimeout();
 	return CHANGE;
 }
 
+StorageEvent::ECallResult StorageEvent::_parseReceived(ECallResult res)
+{
+	// requests are answered one after another in the order they have come, without waiting for a new read event
+	while ((res == CHANGE) && (_curState == ST_WAIT_REQUEST) && _reader.hasPipelined()) {
+		if (!_networkBuffer) {
+			auto threadSpecData = static_cast<StorageThreadSpecificData*>(_thread->threadSpecificData());
+			_networkBuffer = threadSpecData->bufferPool.get();
+		}
+		_reader.takePipelined(*_networkBuffer);
+		res = _parseRequest();
+	}
+	return res;
+}
+
 const StorageEvent::ECallResult StorageEvent::call(const TEvents events)
 {
 	if (_curState == ST_FINISHED)
@@ -398,33 +961,60 @@ const StorageEvent::ECallResult StorageEvent::call(const TEvents events)
 	
 	if (events & E_INPUT) {
 		if (_curState == ST_WAIT_REQUEST) {
-			return _read();
+			return _parseReceived(_read());
 		}
 	}
 	
 	if (events & E_OUTPUT) {
 		if (_curState == ST_WAIT_SEND) {
-			return _send();
+			return _parseReceived(_send());
+		} else if (_curState == ST_WAIT_SEND_FILE) {
+			return _parseReceived(_sendFile());
+		} else if (_curState == ST_WAIT_DISK) {
+			return _parseReceived(_readTask ? _finishDiskRead() : _finishDiskWrite());
 		}
 	}
 	return SKIP;
 }
 
 
-StorageThreadSpecificData::StorageThreadSpecificData(Config *config)
-	: bufferPool(config->bufferSize(), config->maxFreeBuffers())
+StorageThreadSpecificData::StorageThreadSpecificData(Config *config, const size_t workerID)
+	: bufferPool(config->bufferSize(), config->maxFreeBuffers()), _workerID(workerID), _diskIOCompletion(NULL), 
+		_shardQueue(NULL)
 {
 	
 }
 
+DiskIOCompletion *StorageThreadSpecificData::diskIOCompletion(EPollWorkerThread *thread)
+{
+	if (_diskIOCompletion)
+		return _diskIOCompletion;
+	// it is registered by the worker itself and lives as long as the worker
+	DiskIOCompletion *completion = new DiskIOCompletion();
+	if (!completion->isValid() || !thread->ctrl(completion)) {
+		log::Error::L("Can't add disk I/O completions to worker %zu, disk reads are done in the worker\n", _workerID);
+		delete completion;
+		return NULL;
+	}
+	_diskIOCompletion = completion;
+	return _diskIOCompletion;
+}
+
+ShardQueue *StorageThreadSpecificData::shardQueue(EPollWorkerThread *thread, ShardQueues *shardQueues)
+{
+	if (!_shardQueue && shardQueues)
+		_shardQueue = shardQueues->find(thread);
+	return _shardQueue;
+}
+
 StorageThreadSpecificDataFactory::StorageThreadSpecificDataFactory(Config *config)
-	: _config(config)
+	: _config(config), _nextWorkerID(0)
 {
 }
 
 ThreadSpecificData *StorageThreadSpecificDataFactory::create()
 {
-	return new StorageThreadSpecificData(_config);
+	return new StorageThreadSpecificData(_config, __sync_fetch_and_add(&_nextWorkerID, 1));
 }
 
 StorageEventFactory::StorageEventFactory(Config *config)
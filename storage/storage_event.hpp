@@ -12,10 +12,13 @@
 // Description: Metis Storage event system implementation classes
 ///////////////////////////////////////////////////////////////////////////////
 
+#include <vector>
 #include "event_thread.hpp"
 #include "config.hpp"
 #include "network_buffer.hpp"
 #include "file.hpp"
+#include "slice.hpp"
+#include "request_reader.hpp"
 
 namespace fl {
 	namespace metis {
@@ -30,49 +33,102 @@ namespace fl {
 				ER_PARSE = 1,
 				ST_WAIT_REQUEST,
 				ST_WAIT_SEND,
+				ST_WAIT_SEND_FILE,
+				ST_WAIT_DISK,
 				ST_FINISHED,
 			};
 
 			StorageEvent(const TEventDescriptor descr, const time_t timeOutTime);
 			virtual ~StorageEvent();
 			virtual const ECallResult call(const TEvents events);
-			static void setInited(class Storage *storage, class Config *config, class SyncThread *syncThread);
+			static void setInited(class Storage *storage, class Config *config, class SyncThread *syncThread, 
+				class DiskIO *diskIO, class ShardQueues *shardQueues);
 			static void exitFlush();
 		private:
 			void _endWork();
 			ECallResult _read();
+			ECallResult _parseRequest();
+			ECallResult _parseReceived(ECallResult res);
 			ECallResult _send();
+			ECallResult _sendFile();
+			ECallResult _waitSend();
+			ECallResult _sendChunk(const bool found);
+			ECallResult _sendFileChunk(const TItemSize chunkSize, const bool found);
+			ECallResult _sendInfoAndChunk(const bool found, const ItemInfo &itemInfo);
+			ECallResult _finishDiskRead();
+			ECallResult _finishDiskWrite();
+			class WriteTask;
+			// SKIP - the task can't be added and the write has to be done in the worker
+			ECallResult _addWriteTask(WriteTask *task, const TRangeID rangeID);
+			class DiskIOCompletion *_diskIOCompletion();
+			class ShardQueue *_shardQueue();
+			// in the shard per core mode a command on a range of another worker is forwarded to it, otherwise slices
+			// are read and written in the disk I/O threads. false - the command is done in this worker
+			bool _isTaskNeeded(const TRangeID rangeID);
+			bool _addTask(const std::shared_ptr<class DiskIOTask> &task, const TRangeID rangeID);
+			ECallResult _waitDisk();
+			void _diskTaskFinished();
+			void _cancelDiskTask();
 			ECallResult _sendStatus(const EStorageAnswerStatus status);
+			// clears the buffer and reserves the header of an answer, the request id is put after it when it was sent
+			StorageAnswer &_startAnswer();
+			size_t _answerHeaderSize() const
+			{
+				return _reader.answerHeaderSize();
+			}
 			bool _reset();
 			void _updateTimeout();
 			ECallResult _parseCmd(const char *data);
 			ECallResult _parsePut();
+			ECallResult _parseDirectPut();
 			
 			ECallResult _nopCmd();
 			ECallResult _itemInfo(const char *data);
 			ECallResult _itemGetChunk(const char *data);
+			ECallResult _itemInfoAndChunk(const char *data);
+			ECallResult _getItems(const char *data);
 			ECallResult _deleteItem(const char *data);
 			ECallResult _ping(const char *data);
-			ECallResult _getRangeItems(const char *data);
+			template <typename TRangeItemsRequest> ECallResult _getRangeItems(const char *data);
+			ECallResult _getRangeDigest(const char *data);
 			ECallResult _sync(const char *data);
-			bool _parseSyncRequest();
+			bool _parseSyncRequest(const char *data, std::vector<ItemHeader> &removes);
 			static bool _isReady;
 			static class Storage *_storage;
 			static class Config *_config;
 			static class SyncThread *_syncThread;
+			static class DiskIO *_diskIO;
+			static class ShardQueues *_shardQueues; // NULL - the shard per core mode is off
 			NetworkBuffer *_networkBuffer;
+			RequestReader _reader;
 			EStorageState _curState;
-			StorageCmd _cmd;
 			File _putTmpFile;
+			TSlicePtr _putSlice;
+			IndexEntry _putEntry;
+			TItemSize _putWritten;
+			TSlicePtr _sendSlice;
+			off_t _sendFileSeek;
+			TItemSize _sendFileLeft;
+			class ChunkReadTask;
+			std::shared_ptr<ChunkReadTask> _readTask;
+			std::shared_ptr<WriteTask> _writeTask;
 		};
 
 		
 		class StorageThreadSpecificData : public ThreadSpecificData
 		{
 		public:
-			StorageThreadSpecificData(Config *config);
+			StorageThreadSpecificData(Config *config, const size_t workerID);
 			virtual ~StorageThreadSpecificData() {}
 			NetworkBufferPool bufferPool;
+			// the eventfd, which brings finished disk I/O tasks back to the worker, NULL - it can't be created
+			class DiskIOCompletion *diskIOCompletion(EPollWorkerThread *thread);
+			// the queue of the worker in the shard per core mode
+			class ShardQueue *shardQueue(EPollWorkerThread *thread, class ShardQueues *shardQueues);
+		private:
+			size_t _workerID;
+			class DiskIOCompletion *_diskIOCompletion;
+			class ShardQueue *_shardQueue;
 		};
 		
 		class StorageThreadSpecificDataFactory : public ThreadSpecificDataFactory
@@ -83,6 +139,7 @@ namespace fl {
 			virtual ~StorageThreadSpecificDataFactory() {};
 		private:
 			Config *_config;
+			size_t _nextWorkerID;
 		};
 
 		class StorageEventFactory : public WorkEventFactory 
@@ -5,10 +5,11 @@
 // Distributed under BSD (3-Clause) License (See
 // accompanying file LICENSE)
 //
-// Description: Metis' storage Synchronization thread implementation
+// Description: Metis' storage Synchronization threads implementation
 ///////////////////////////////////////////////////////////////////////////////
 
 
+#include <strings.h>
 #include "sync_thread.hpp"
 #include "../metis_log.hpp"
 #include "storage.hpp"
@@ -17,132 +18,294 @@
 using namespace fl::metis;
 using namespace fl::network;
 
-SyncThread::SyncThread(class Storage *storage, Config *config)
-	: _storage(storage), _config(config)
+SyncThread::SyncWorker::SyncWorker(SyncThread *syncThread)
+	: _syncThread(syncThread)
 {
 	static const uint32_t SYNC_THREAD_STACK_SIZE = 100000;
 	setStackSize(SYNC_THREAD_STACK_SIZE);
 	if (!create()) {
-		log::Fatal::L("Can't create an index thread\n");
+		log::Fatal::L("Can't create a sync thread\n");
 		throw std::exception();
 	}
 }
 
+void SyncThread::SyncWorker::run()
+{
+	SyncTask task;
+	while (_syncThread->_get(task)) {
+		_syncThread->_process(task, _buffer);
+		_syncThread->_finish(task);
+	}
+	std::lock_guard<std::mutex> autoSync(_syncThread->_sync);
+	_syncThread->_runningWorkers--;
+	_syncThread->_cond.notify_all();
+}
+
+SyncThread::SyncThread(class Storage *storage, const size_t threadsCount, const size_t threadsPerServer, 
+	const TItemSize maxChunkSize)
+	: _storage(storage), _threadsPerServer(threadsPerServer), _maxChunkSize(maxChunkSize), _isStopped(false), 
+	_runningWorkers(0)
+{
+	for (size_t i = 0; i < threadsCount; i++) {
+		_workers.push_back(TSyncWorkerPtr(new SyncWorker(this)));
+		std::lock_guard<std::mutex> autoSync(_sync);
+		_runningWorkers++;
+	}
+	log::Warning::L("Started %zu sync threads\n", threadsCount);
+}
+
 SyncThread::~SyncThread()
 {
+	// the workers finish their current tasks, the queued ones are dropped
+	std::unique_lock<std::mutex> autoSync(_sync);
+	_isStopped = true;
+	_cond.notify_all();
+	while (_runningWorkers > 0)
+		_cond.wait(autoSync);
 }
 
 bool SyncThread::checkActive(const TRangeID rangeID)
 {
-	AutoMutex autoSync(&_sync);
-	return _checkActive(rangeID);
+	std::lock_guard<std::mutex> autoSync(_sync);
+	return _rangeTasks.find(rangeID) == _rangeTasks.end();
 }
 
-bool SyncThread::_checkActive(const TRangeID rangeID)
+bool SyncThread::add(const TServerID managerID, const TRangeID rangeID, TIndexSyncEntryVector &syncs)
 {
-	if (_currentTask.rangeID == rangeID) {
+	std::unique_lock<std::mutex> autoSync(_sync);
+	if (_rangeTasks.find(rangeID) != _rangeTasks.end()) {
+		log::Error::L("Sync thread already has task on range %u, from manager %u\n", rangeID, managerID);
 		return false;
 	}
-	for (auto task = _tasks.begin(); task != _tasks.end(); task++) {
-		if (task->rangeID == rangeID) {
-			return false;
-		}
+	std::map<TServerID, SyncTask> serverTasks;
+	for (auto sync = syncs.begin(); sync != syncs.end(); sync++) {
+		auto &task = serverTasks[sync->fromServer];
+		task.syncs.push_back(*sync);
+	}
+	syncs.clear();
+	if (serverTasks.empty())
+		return true;
+	for (auto serverTask = serverTasks.begin(); serverTask != serverTasks.end(); serverTask++) {
+		_tasks.push_back(SyncTask());
+		SyncTask &task = _tasks.back();
+		task.managerID = managerID;
+		task.rangeID = rangeID;
+		task.fromServer = serverTask->first;
+		std::swap(task.syncs, serverTask->second.syncs);
 	}
+	_rangeTasks[rangeID] = serverTasks.size();
+	autoSync.unlock();
+	_cond.notify_all();
 	return true;
 }
 
-bool SyncThread::add(const TServerID managerID, const TRangeID rangeID, TIndexSyncEntryVector &syncs)
+bool SyncThread::_get(SyncTask &task)
 {
-	AutoMutex autoSync(&_sync);
-	if (!_checkActive(rangeID)) {
-		log::Error::L("Sync thread already has task on range %u, from manager %u\n", rangeID, managerID);
-		return false;
+	std::unique_lock<std::mutex> autoSync(_sync);
+	while (!_isStopped) {
+		for (auto queued = _tasks.begin(); queued != _tasks.end(); queued++) {
+			size_t &running = _serverTasks[queued->fromServer];
+			if (running >= _threadsPerServer)
+				continue;
+			running++;
+			std::swap(task, *queued);
+			_tasks.erase(queued);
+			return true;
+		}
+		_cond.wait(autoSync);
 	}
-	_tasks.push_back(SyncTaskGroup(managerID, rangeID, syncs));
-	return true;
+	return false;
 }
 
-bool SyncThread::_syncItem(Socket &conn, const ItemHeader &item, Buffer &fileBuffer)
+void SyncThread::_finish(const SyncTask &task)
 {
-	GetItemChunkRequest getRequest;
-	getRequest.rangeID = item.rangeID;
-	getRequest.itemKey = item.itemKey;
-	getRequest.chunkSize = _config->maxMemmoryChunk();
-	Buffer request(sizeof(getRequest) + sizeof(StorageCmd) + 1);
-	fileBuffer.clear();
-	TItemSize leftSize = item.size;
-	while (leftSize > 0) {	
-		if (getRequest.chunkSize > leftSize)
-			getRequest.chunkSize = leftSize;
-		getRequest.seek = item.size - leftSize;
-
-		request.clear();
-		StorageCmd &storageCmd = *(StorageCmd*)request.reserveBuffer(sizeof(StorageCmd));
-		storageCmd.cmd = EStorageCMD::STORAGE_GET_ITEM_CHUNK;
-		storageCmd.size = sizeof(getRequest);
-		request.add(&getRequest, sizeof(getRequest));
-		if (!conn.pollAndSendAll(request.begin(), request.writtenSize())) {
-			log::Warning::L("SyncThread: Can't send\n");
-			return false;
+	std::unique_lock<std::mutex> autoSync(_sync);
+	auto server = _serverTasks.find(task.fromServer);
+	if (server != _serverTasks.end()) {
+		if (--server->second == 0)
+			_serverTasks.erase(server);
+	}
+	auto range = _rangeTasks.find(task.rangeID);
+	if (range != _rangeTasks.end()) {
+		if (--range->second == 0)
+			_rangeTasks.erase(range);
+	}
+	autoSync.unlock();
+	_cond.notify_all(); // the source storage can have waiting tasks
+}
+
+void SyncThread::_process(SyncTask &task, Buffer &buffer)
+{
+	Socket conn;
+	bool connected = false;
+	auto sync = task.syncs.cbegin();
+	while (sync != task.syncs.cend()) {
+		if (sync->header.size == 0) { // nothing to copy, a delete or a clean-up of an old version is written at once
+			if (!_storage->add(NULL, sync->header))
+				log::Warning::L("SyncThread: Can't sync empty %u/%u\n", sync->header.itemKey, sync->header.rangeID);
+			sync++;
+			continue;
 		}
-		request.clear();
-		StorageAnswer &answer = *(StorageAnswer*)request.reserveBuffer(sizeof(StorageAnswer));
-		if (!conn.pollAndRecvAll(&answer, sizeof(answer))) {
-			log::Warning::L("SyncThread: Can't read answer\n");
-			return false;
+		if (!connected) {
+			conn.reopen();
+			if (!conn.connect(sync->ip, sync->port)) {
+				log::Warning::L("SyncThread: Can't connect to %s:%u (%u)\n", Socket::ip2String(sync->ip).c_str(), sync->port,
+					sync->fromServer);
+				sync++;
+				continue;
+			}
+			connected = true;
 		}
-		if ((answer.status != EStorageAnswerStatus::STORAGE_ANSWER_OK) || (answer.size != getRequest.chunkSize)) {
-			log::Warning::L("SyncThread: Receive bad answer status %u, size %u\n", answer.status, answer.size);
-			return false;
+		// small items are fetched by batches, so their copying isn't bound by the round trips of the requests
+		auto batchEnd = sync;
+		TSize batchSize = 0;
+		while ((batchEnd != task.syncs.cend()) && ((uint32_t)(batchEnd - sync) < GET_ITEMS_MAX_COUNT)
+			&& (batchEnd->header.size > 0) && (batchEnd->header.size <= _maxChunkSize) 
+			&& ((batchSize + batchEnd->header.size) <= GET_ITEMS_MAX_SIZE)) {
+			batchSize += batchEnd->header.size;
+			batchEnd++;
 		}
-		if (!conn.pollAndRecvAll(fileBuffer.reserveBuffer(getRequest.chunkSize), getRequest.chunkSize)) {
-			log::Warning::L("SyncThread: Can't read data\n");
-			return false;
+		if (batchEnd != sync) {
+			if (!_syncItems(conn, sync, batchEnd, buffer))
+				connected = false;
+			sync = batchEnd;
+			continue;
+		}
+		
+		if (_syncItem(conn, sync->header, buffer)) {
+			log::Warning::L("SyncThread: Sync %u/%u from %s:%u (%u)\n", sync->header.itemKey, sync->header.rangeID, 
+				Socket::ip2String(sync->ip).c_str(), sync->port, sync->fromServer);
+		} else {
+			log::Warning::L("SyncThread: Can't sync %u/%u from %s:%u (%u)\n", sync->header.itemKey, sync->header.rangeID, 
+				Socket::ip2String(sync->ip).c_str(), sync->port, sync->fromServer);
+			connected = false;
 		}
-		leftSize -= getRequest.chunkSize;
+		sync++;
 	}
-	return _storage->add((char*)fileBuffer.begin(), item);
 }
 
-void SyncThread::run()
+bool SyncThread::_syncItems(Socket &conn, const TSyncIterator &begin, const TSyncIterator &end, Buffer &buffer)
 {
-	log::Warning::L("Storage %u SyncThread has been started\n", _config->serverID());
-	while (true) {
-		_sync.lock();
-		if (_tasks.empty()) {
-			_sync.unLock();
-			sleep(1);
-			continue;
-		}
-		std::swap(_currentTask, _tasks.front());
-		_tasks.pop_front();
-		_sync.unLock();
-		Socket conn;
-		TServerID lastServerID = 0;
-		Buffer buffer;
-		for (auto sync = _currentTask.syncs.begin(); sync != _currentTask.syncs.end(); sync++) {
-			if (sync->fromServer != lastServerID) {
-				lastServerID = 0;
-				conn.reopen();
-				if (!conn.connect(sync->ip, sync->port)) {
-					log::Warning::L("SyncThread: Can't connect to %s:%u (%u)\n", Socket::ip2String(sync->ip).c_str(), sync->port,
-						sync->fromServer);
-					continue;
-				}
-				lastServerID = sync->fromServer;
-			}
-			if (_syncItem(conn, sync->header, buffer)) {
-				log::Warning::L("SyncThread: Sync %u/%u from %s:%u (%u)\n", sync->header.itemKey, sync->header.rangeID, 
-					Socket::ip2String(sync->ip).c_str(), sync->port, sync->fromServer);
+	const uint32_t count = end - begin;
+	buffer.clear();
+	StorageCmd &storageCmd = *(StorageCmd*)buffer.reserveBuffer(sizeof(StorageCmd));
+	storageCmd.cmd = EStorageCMD::STORAGE_GET_ITEMS;
+	storageCmd.size = count * sizeof(GetItemsEntry);
+	GetItemsEntry *items = (GetItemsEntry*)buffer.reserveBuffer(count * sizeof(GetItemsEntry));
+	for (auto sync = begin; sync != end; sync++, items++) {
+		items->rangeID = sync->header.rangeID;
+		items->itemKey = sync->header.itemKey;
+		items->timeTag = sync->header.timeTag;
+	}
+	if (!conn.pollAndSendAll(buffer.begin(), buffer.writtenSize())) {
+		log::Warning::L("SyncThread: Can't send\n");
+		return false;
+	}
+	StorageAnswer answer;
+	if (!conn.pollAndRecvAll(&answer, sizeof(answer))) {
+		log::Warning::L("SyncThread: Can't read answer\n");
+		return false;
+	}
+	if ((answer.status != EStorageAnswerStatus::STORAGE_ANSWER_OK) 
+		|| (answer.size > (count * sizeof(StorageAnswer) + GET_ITEMS_MAX_SIZE))) {
+		log::Warning::L("SyncThread: Receive bad answer status %u, size %u\n", answer.status, answer.size);
+		return false;
+	}
+	buffer.clear();
+	if (!conn.pollAndRecvAll(buffer.reserveBuffer(answer.size), answer.size)) {
+		log::Warning::L("SyncThread: Can't read data\n");
+		return false;
+	}
+	
+	uint32_t synced = 0;
+	try
+	{
+		for (auto sync = begin; sync != end; sync++) {
+			StorageAnswer itemAnswer;
+			buffer.get(&itemAnswer, sizeof(itemAnswer));
+			const char *data = (const char*)buffer.mapBuffer(itemAnswer.size);
+			if ((itemAnswer.status == EStorageAnswerStatus::STORAGE_ANSWER_OK) && (itemAnswer.size == sync->header.size)
+				&& _storage->add(data, sync->header)) {
+				synced++;
 			} else {
-				log::Warning::L("SyncThread: Can't sync %u/%u from %s:%u (%u)\n", sync->header.itemKey, sync->header.rangeID, 
-					Socket::ip2String(sync->ip).c_str(), sync->port, sync->fromServer);
-				lastServerID = 0;
-				continue;
+				log::Warning::L("SyncThread: Can't sync %u/%u from %s:%u (%u), status %u\n", sync->header.itemKey, 
+					sync->header.rangeID, Socket::ip2String(sync->ip).c_str(), sync->port, sync->fromServer, 
+					itemAnswer.status);
 			}
 		}
-		_currentTask.managerID = 0;
-		_currentTask.rangeID = 0;
-		_currentTask.syncs.clear();
 	}
+	catch (Buffer::Error &er)
+	{
+		log::Error::L("SyncThread: Receive a bad get items answer\n");
+		return false;
+	}
+	log::Warning::L("SyncThread: Sync %u of %u items of range %u from %s:%u (%u)\n", synced, count, begin->header.rangeID,
+		Socket::ip2String(begin->ip).c_str(), begin->port, begin->fromServer);
+	return true;
+}
+
+bool SyncThread::_getChunk(Socket &conn, const ItemHeader &item, const TItemSize seek, const TItemSize chunkSize, 
+	Buffer &buffer)
+{
+	GetItemChunkRequest getRequest;
+	getRequest.rangeID = item.rangeID;
+	getRequest.itemKey = item.itemKey;
+	getRequest.seek = seek;
+	getRequest.chunkSize = chunkSize;
+	
+	buffer.clear();
+	StorageCmd &storageCmd = *(StorageCmd*)buffer.reserveBuffer(sizeof(StorageCmd));
+	storageCmd.cmd = EStorageCMD::STORAGE_GET_ITEM_CHUNK;
+	storageCmd.size = sizeof(getRequest);
+	buffer.add(&getRequest, sizeof(getRequest));
+	if (!conn.pollAndSendAll(buffer.begin(), buffer.writtenSize())) {
+		log::Warning::L("SyncThread: Can't send\n");
+		return false;
+	}
+	StorageAnswer answer;
+	if (!conn.pollAndRecvAll(&answer, sizeof(answer))) {
+		log::Warning::L("SyncThread: Can't read answer\n");
+		return false;
+	}
+	if ((answer.status != EStorageAnswerStatus::STORAGE_ANSWER_OK) || (answer.size != chunkSize)) {
+		log::Warning::L("SyncThread: Receive bad answer status %u, size %u\n", answer.status, answer.size);
+		return false;
+	}
+	buffer.clear();
+	if (!conn.pollAndRecvAll(buffer.reserveBuffer(chunkSize), chunkSize)) {
+		log::Warning::L("SyncThread: Can't read data\n");
+		return false;
+	}
+	return true;
+}
+
+bool SyncThread::_syncItem(Socket &conn, const ItemHeader &item, Buffer &buffer)
+{
+	if (item.size <= _maxChunkSize) { // a small item goes through the group commit and can be compressed
+		buffer.clear();
+		if (!_getChunk(conn, item, 0, item.size, buffer))
+			return false;
+		return _storage->add((char*)buffer.begin(), item);
+	}
+	
+	// a big item is written into the write slice chunk by chunk, so only one chunk is kept in the memory
+	IndexEntry ie;
+	bzero(&ie, sizeof(ie));
+	ie.header = item;
+	TSlicePtr slice;
+	if (!_storage->reserve(ie, slice))
+		return false;
+	TItemSize seek = 0;
+	while (seek < item.size) {
+		TItemSize chunkSize = item.size - seek;
+		if (chunkSize > _maxChunkSize)
+			chunkSize = _maxChunkSize;
+		if (!_getChunk(conn, item, seek, chunkSize, buffer)
+			|| !_storage->writeReserved(slice, ie, seek, (char*)buffer.begin(), chunkSize)) {
+			_storage->abortReserved(slice, ie);
+			return false;
+		}
+		seek += chunkSize;
+	}
+	return _storage->commitReserved(slice, ie);
 }
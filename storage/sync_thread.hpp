@@ -9,57 +9,87 @@
 // Distributed under BSD (3-Clause) License (See
 // accompanying file LICENSE)
 //
-// Description: Metis' storage Synchronization thread
+// Description: Metis' storage Synchronization threads
 ///////////////////////////////////////////////////////////////////////////////
 
 #include <list>
+#include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
 #include "../types.hpp"
 #include "thread.hpp"
-#include "mutex.hpp"
 #include "socket.hpp"
 #include "buffer.hpp"
-#include "config.hpp"
 
 namespace fl {
 	namespace metis {
 		using fl::threads::Thread;
-		using fl::threads::Mutex;
-		using fl::threads::AutoMutex;
 		using fl::network::Socket;
 		using fl::utils::Buffer;
 		
-		class SyncThread : public Thread
+		// A pool of threads, which copy items of ranges from other storages. The syncs of a range are split by
+		// their source storages, so the sources are read in parallel and no more than threadsPerServer threads
+		// load the same source. Syncs of empty items (deletes and clean-ups of old versions) are applied locally
+		class SyncThread
 		{
 		public:
-			SyncThread(class Storage *storage, Config *config);
-			virtual ~SyncThread();
+			SyncThread(class Storage *storage, const size_t threadsCount, const size_t threadsPerServer, 
+				const TItemSize maxChunkSize);
+			~SyncThread();
 			bool add(const TServerID managerID, const TRangeID rangeID, TIndexSyncEntryVector &syncs);
 			bool checkActive(const TRangeID rangeID);
 		private:
-			bool _syncItem(Socket &conn, const ItemHeader &header, Buffer &buffer);
-			virtual void run();
-			class Storage *_storage;
-			Config *_config;
-			struct SyncTaskGroup
+			class SyncWorker : public Thread
 			{
-				SyncTaskGroup()
-					: managerID(0), rangeID(0)
-				{
-				}
-				SyncTaskGroup(const TServerID managerID, const TRangeID rangeID, TIndexSyncEntryVector &syncs)
-					: managerID(managerID), rangeID(rangeID), syncs(std::move(syncs))
+			public:
+				SyncWorker(SyncThread *syncThread);
+			private:
+				virtual void run();
+				SyncThread *_syncThread;
+				Buffer _buffer;
+			};
+			friend class SyncWorker;
+			typedef std::unique_ptr<SyncWorker> TSyncWorkerPtr;
+			typedef std::vector<TSyncWorkerPtr> TSyncWorkerVector;
+			
+			struct SyncTask
+			{
+				SyncTask()
+					: managerID(0), rangeID(0), fromServer(0)
 				{
 				}
 				TServerID managerID;
 				TRangeID rangeID;
+				TServerID fromServer;
 				TIndexSyncEntryVector syncs;
 			};
-			typedef std::list<SyncTaskGroup> TSyncTaskGroupList;
-			TSyncTaskGroupList _tasks;
-			SyncTaskGroup _currentTask;
-			Mutex _sync;
+			typedef std::list<SyncTask> TSyncTaskList;
+			typedef std::map<TRangeID, size_t> TRangeTasksMap;
+			typedef std::map<TServerID, size_t> TServerTasksMap;
 			
-			bool _checkActive(const TRangeID rangeID);
+			bool _get(SyncTask &task); // false - the pool is stopped
+			void _finish(const SyncTask &task);
+			void _process(SyncTask &task, Buffer &buffer);
+			typedef TIndexSyncEntryVector::const_iterator TSyncIterator;
+			// fetches the small items of the syncs by one GET_ITEMS request, false - the connection has to be reopened
+			bool _syncItems(Socket &conn, const TSyncIterator &begin, const TSyncIterator &end, Buffer &buffer);
+			bool _syncItem(Socket &conn, const ItemHeader &item, Buffer &buffer);
+			bool _getChunk(Socket &conn, const ItemHeader &item, const TItemSize seek, const TItemSize chunkSize, 
+				Buffer &buffer);
+			
+			class Storage *_storage;
+			size_t _threadsPerServer;
+			TItemSize _maxChunkSize;
+			bool _isStopped;
+			size_t _runningWorkers;
+			TSyncTaskList _tasks;
+			TRangeTasksMap _rangeTasks; // queued and running tasks of the ranges
+			TServerTasksMap _serverTasks; // running tasks of the source storages
+			std::mutex _sync;
+			std::condition_variable _cond;
+			TSyncWorkerVector _workers;
 		};
 	};
 };
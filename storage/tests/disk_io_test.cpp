@@ -0,0 +1,136 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Disk I/O threads unit tests
+///////////////////////////////////////////////////////////////////////////////
+
+#include <boost/test/unit_test.hpp>
+#include <poll.h>
+#include <unistd.h>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include "disk_io.hpp"
+
+using namespace fl::metis;
+
+BOOST_AUTO_TEST_SUITE( metis )
+
+class TestDiskIOTask : public DiskIOTask
+{
+public:
+	TestDiskIOTask(DiskIOCompletion *completion, std::atomic<size_t> &processed, const useconds_t delay = 0)
+		: DiskIOTask(completion), isStarted(false), processedIn(std::this_thread::get_id()), 
+		finishedIn(std::this_thread::get_id()), finishCount(0), _processed(processed), _delay(delay)
+	{
+	}
+	virtual void process()
+	{
+		isStarted = true;
+		if (_delay)
+			usleep(_delay);
+		processedIn = std::this_thread::get_id();
+		_processed++;
+	}
+	virtual void finish()
+	{
+		finishedIn = std::this_thread::get_id();
+		finishCount++;
+	}
+	std::atomic<bool> isStarted;
+	std::thread::id processedIn;
+	std::thread::id finishedIn;
+	size_t finishCount;
+private:
+	std::atomic<size_t> &_processed;
+	useconds_t _delay;
+};
+typedef std::shared_ptr<TestDiskIOTask> TTestDiskIOTaskPtr;
+
+// waits for the eventfd of the completion and runs the finished tasks as the network worker does
+static void waitCompletion(DiskIOCompletion &completion)
+{
+	struct pollfd pfd;
+	pfd.fd = completion.descr();
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	BOOST_REQUIRE(poll(&pfd, 1, 10000) == 1);
+	completion.call(fl::events::E_INPUT);
+}
+
+BOOST_AUTO_TEST_CASE (testDiskIO)
+{
+	const size_t THREADS_COUNT = 4;
+	const size_t TASKS_COUNT = 1000;
+	std::atomic<size_t> processed(0);
+	DiskIOCompletion completion;
+	BOOST_REQUIRE(completion.isValid());
+	std::vector<TTestDiskIOTaskPtr> tasks;
+	{
+		DiskIO diskIO(THREADS_COUNT);
+		for (size_t i = 0; i < TASKS_COUNT; i++) {
+			tasks.push_back(TTestDiskIOTaskPtr(new TestDiskIOTask(&completion, processed)));
+			BOOST_REQUIRE(diskIO.add(tasks.back()));
+		}
+		for (int i = 0; (i < 1000) && (processed < TASKS_COUNT); i++)
+			usleep(10000);
+		BOOST_REQUIRE(processed == TASKS_COUNT);
+	}
+
+	// every task is processed in a disk I/O thread and finished once in the thread of its completion
+	size_t finished = 0;
+	for (int i = 0; (i < 100) && (finished < TASKS_COUNT); i++) {
+		waitCompletion(completion);
+		finished = 0;
+		for (auto task = tasks.begin(); task != tasks.end(); task++)
+			finished += (*task)->finishCount;
+	}
+	BOOST_CHECK(finished == TASKS_COUNT);
+	for (auto task = tasks.begin(); task != tasks.end(); task++) {
+		BOOST_CHECK((*task)->processedIn != std::this_thread::get_id());
+		BOOST_CHECK((*task)->finishedIn == std::this_thread::get_id());
+		BOOST_CHECK((*task)->finishCount == 1);
+	}
+
+	// an empty wake up is skipped
+	completion.call(fl::events::E_INPUT);
+	for (auto task = tasks.begin(); task != tasks.end(); task++)
+		BOOST_CHECK((*task)->finishCount == 1);
+}
+
+BOOST_AUTO_TEST_CASE (testDiskIOWithoutThreads)
+{
+	// without disk I/O threads the tasks have to be processed synchronously by the caller
+	std::atomic<size_t> processed(0);
+	DiskIOCompletion completion;
+	DiskIO diskIO(0);
+	BOOST_CHECK(!diskIO.add(TTestDiskIOTaskPtr(new TestDiskIOTask(&completion, processed))));
+	BOOST_CHECK(processed == 0);
+}
+
+BOOST_AUTO_TEST_CASE (testDiskIOStop)
+{
+	const useconds_t DELAY = 100000;
+	std::atomic<size_t> processed(0);
+	TTestDiskIOTaskPtr running(new TestDiskIOTask(NULL, processed, DELAY));
+	TTestDiskIOTaskPtr queued(new TestDiskIOTask(NULL, processed));
+	{
+		DiskIO diskIO(1);
+		BOOST_REQUIRE(diskIO.add(running));
+		for (int i = 0; (i < 1000) && !running->isStarted; i++)
+			usleep(1000);
+		BOOST_REQUIRE(running->isStarted);
+		BOOST_REQUIRE(diskIO.add(queued));
+	}
+	// the destructor waits for the task in process and drops the queued one
+	BOOST_CHECK(processed == 1);
+	BOOST_CHECK(running->processedIn != std::this_thread::get_id());
+	BOOST_CHECK(queued->processedIn == std::this_thread::get_id());
+	BOOST_CHECK(queued.use_count() == 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
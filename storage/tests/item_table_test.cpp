@@ -0,0 +1,301 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Range item table unit tests
+///////////////////////////////////////////////////////////////////////////////
+
+#include <boost/test/unit_test.hpp>
+#include <unordered_map>
+#include <cstdlib>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include "range_index.hpp"
+#include "range_items.hpp"
+
+using namespace fl::metis;
+using namespace fl::metis::storage;
+
+BOOST_AUTO_TEST_SUITE( metis )
+
+BOOST_AUTO_TEST_CASE (testItemTable)
+{
+	const size_t ITEMS_COUNT = 100000;
+	ItemTable<Range::Entry> table;
+	std::unordered_map<TItemKey, TSize> control;
+	Range::Entry entry;
+	entry.pointer.sliceID = 1;
+	entry.pointer.seek = 0;
+	entry.timeTag.tag = 0;
+	for (size_t i = 0; i < ITEMS_COUNT; i++) {
+		TItemKey itemKey = (i % 3) ? rand() : i; // random keys and a sequential run
+		entry.size = i + 1;
+		bool isNew = control.insert(std::make_pair(itemKey, (TSize)entry.size)).second;
+		auto res = table.insert(ItemTable<Range::Entry>::value_type(itemKey, entry));
+		BOOST_REQUIRE(res.second == isNew);
+		BOOST_REQUIRE(res.first->first == itemKey);
+	}
+	BOOST_REQUIRE(table.size() == control.size());
+	for (auto item = control.begin(); item != control.end(); item++) {
+		auto f = table.find(item->first);
+		BOOST_REQUIRE(f != table.end());
+		BOOST_CHECK(f->second.size == item->second);
+	}
+	size_t count = 0;
+	for (auto item = table.begin(); item != table.end(); item++) {
+		auto f = control.find(item->first);
+		BOOST_REQUIRE(f != control.end());
+		BOOST_CHECK(item->second.size == f->second);
+		count++;
+	}
+	BOOST_CHECK(count == control.size());
+	for (TItemKey itemKey = 1; itemKey < 1000; itemKey++) {
+		TItemKey missedKey = itemKey + RAND_MAX / 2;
+		if (control.find(missedKey) == control.end())
+			BOOST_CHECK(table.find(missedKey) == table.end());
+	}
+}
+
+static size_t allocatedSize = 0;
+
+template <typename T>
+struct CountingAllocator : public std::allocator<T>
+{
+	template <typename U>
+	struct rebind
+	{
+		typedef CountingAllocator<U> other;
+	};
+	CountingAllocator()
+	{
+	}
+	template <typename U>
+	CountingAllocator(const CountingAllocator<U> &)
+	{
+	}
+	T *allocate(const size_t count)
+	{
+		allocatedSize += count * sizeof(T);
+		return std::allocator<T>::allocate(count);
+	}
+	void deallocate(T *p, const size_t count)
+	{
+		allocatedSize -= count * sizeof(T);
+		std::allocator<T>::deallocate(p, count);
+	}
+};
+
+BOOST_AUTO_TEST_CASE (testItemTableMemory)
+{
+	const TItemKey ITEMS_COUNT = 1000000;
+	Range::Entry entry;
+	bzero(&entry, sizeof(entry));
+
+	typedef std::unordered_map<TItemKey, Range::Entry, std::hash<TItemKey>, std::equal_to<TItemKey>,
+		CountingAllocator<std::pair<const TItemKey, Range::Entry>>> TOldItemHash;
+	double oldBytesPerItem = 0;
+	{
+		TOldItemHash oldItems;
+		for (TItemKey itemKey = 0; itemKey < ITEMS_COUNT; itemKey++)
+			oldItems.insert(TOldItemHash::value_type(itemKey, entry));
+		// malloc adds at least 8 bytes of its own header to every node
+		oldBytesPerItem = (double)(allocatedSize + oldItems.size() * sizeof(void*)) / oldItems.size();
+	}
+
+	ItemTable<Range::Entry> items;
+	for (TItemKey itemKey = 0; itemKey < ITEMS_COUNT; itemKey++)
+		items.insert(ItemTable<Range::Entry>::value_type(itemKey, entry));
+	double bytesPerItem = (double)items.memoryUsage() / items.size();
+	BOOST_TEST_MESSAGE("Index memory per item: unordered_map " << oldBytesPerItem << ", item table " << bytesPerItem);
+	// a slot is a control byte and an item, the table grows by a half when it is 7/8 full, so it is at least 7/12 full
+	BOOST_CHECK(bytesPerItem < (1 + sizeof(ItemTable<Range::Entry>::value_type)) * 12 / 7.0);
+}
+
+BOOST_AUTO_TEST_CASE (testRangeItems)
+{
+	const TItemKey RANGE_SIZE = 131072;
+	const TItemKey BASE_KEY = RANGE_SIZE * 5;
+	RangeItems<Range::Entry> items;
+	std::unordered_map<TItemKey, TSize> control;
+	Range::Entry entry;
+	bzero(&entry, sizeof(entry));
+	// a well populated range starting from the middle and growing in both directions
+	for (TItemKey i = 0; i < RANGE_SIZE; i++) {
+		TItemKey itemKey = BASE_KEY + ((i % 2) ? (RANGE_SIZE / 2 + i / 2) : (RANGE_SIZE / 2 - i / 2 - 1));
+		if (rand() % 10 == 0)
+			continue;
+		entry.size = itemKey;
+		control[itemKey] = itemKey;
+		BOOST_REQUIRE(items.insert(RangeItems<Range::Entry>::value_type(itemKey, entry)).second);
+	}
+	BOOST_CHECK(items.isDense());
+	BOOST_REQUIRE(items.size() == control.size());
+	double bytesPerItem = (double)items.memoryUsage() / items.size();
+	BOOST_TEST_MESSAGE("Dense range memory per item: " << bytesPerItem);
+	// a slot is an entry and a bit of the bitmap, the array leaves at most 1/8 of the span free at each end
+	BOOST_CHECK(bytesPerItem < (sizeof(Range::Entry) + 1 / 8.0) * (RANGE_SIZE + RANGE_SIZE / 4) / items.size());
+	
+	entry.size = 1;
+	BOOST_CHECK(!items.insert(RangeItems<Range::Entry>::value_type(control.begin()->first, entry)).second);
+	for (auto item = control.begin(); item != control.end(); item++) {
+		auto f = items.find(item->first);
+		BOOST_REQUIRE(f != items.end());
+		BOOST_CHECK(f->second.size == item->second);
+	}
+	BOOST_CHECK(items.find(BASE_KEY - 1) == items.end());
+	BOOST_CHECK(items.find(BASE_KEY + RANGE_SIZE) == items.end());
+	size_t count = 0;
+	for (auto item = items.begin(); item != items.end(); item++) {
+		BOOST_REQUIRE(control.find(item->first) != control.end());
+		count++;
+	}
+	BOOST_CHECK(count == control.size());
+	
+	// a far key makes the range sparse again
+	entry.size = 7;
+	BOOST_REQUIRE(items.insert(RangeItems<Range::Entry>::value_type(BASE_KEY * 100, entry)).second);
+	control[BASE_KEY * 100] = 7;
+	BOOST_CHECK(!items.isDense());
+	BOOST_REQUIRE(items.size() == control.size());
+	for (auto item = control.begin(); item != control.end(); item++) {
+		auto f = items.find(item->first);
+		BOOST_REQUIRE(f != items.end());
+		BOOST_CHECK(f->second.size == item->second);
+	}
+	
+	// the keys come in order from fromKey, also after keys are added between the walks
+	auto checkWalk = [&](const TItemKey fromKey) {
+		std::vector<TItemKey> walked;
+		items.forEachFrom(fromKey, [&](const TItemKey itemKey, const Range::Entry &) {
+			walked.push_back(itemKey);
+			return true;
+		});
+		std::vector<TItemKey> expected;
+		for (auto item = control.begin(); item != control.end(); item++) {
+			if (item->first >= fromKey)
+				expected.push_back(item->first);
+		}
+		std::sort(expected.begin(), expected.end());
+		BOOST_CHECK(walked == expected);
+	};
+	const TItemKey keys[] = {BASE_KEY * 101, BASE_KEY + RANGE_SIZE + 3};
+	for (auto key : keys) {
+		checkWalk(BASE_KEY + RANGE_SIZE / 2);
+		BOOST_REQUIRE(items.insert(RangeItems<Range::Entry>::value_type(key, entry)).second);
+		control[key] = entry.size;
+		checkWalk(BASE_KEY + RANGE_SIZE / 2);
+	}
+}
+
+BOOST_AUTO_TEST_CASE (testLockFreeIndexFind)
+{
+	const TRangeID RANGES_COUNT = 200;
+	const TItemKey ITEMS_COUNT = 5000;
+	const size_t READERS_COUNT = 4;
+	Index index;
+	std::atomic<bool> isFinished(false);
+	std::atomic<size_t> badReads(0);
+	std::atomic<size_t> foundCount(0);
+	// every version of an item is self-consistent, so a torn read is noticed
+	auto reader = [&]() {
+		Range::Entry entry;
+		while (!isFinished) {
+			for (TRangeID rangeID = 1; rangeID <= RANGES_COUNT; rangeID++) {
+				TItemKey itemKey = rand() % (ITEMS_COUNT * 2);
+				if (!index.find(rangeID, itemKey, entry))
+					continue;
+				foundCount++;
+				if ((entry.size != (itemKey ^ entry.pointer.seek)) || (entry.timeTag.tag != entry.pointer.seek))
+					badReads++;
+			}
+		}
+	};
+	std::vector<std::thread> readers;
+	for (size_t i = 0; i < READERS_COUNT; i++)
+		readers.push_back(std::thread(reader));
+	
+	IndexEntry ie;
+	bzero(&ie, sizeof(ie));
+	Range::Entry deadEntry;
+	for (TItemKey i = 0; i < ITEMS_COUNT; i++) {
+		for (TRangeID rangeID = 1; rangeID <= RANGES_COUNT; rangeID++) {
+			// odd ranges are sparse and stay in the hash table, even ones become dense
+			ie.header.rangeID = rangeID;
+			ie.header.itemKey = (rangeID % 2) ? (i * 7919) % (ITEMS_COUNT * 2) : i;
+			for (uint32_t version = 1; version <= 2; version++) {
+				ie.pointer.seek = i * 2 + version;
+				ie.header.timeTag.tag = ie.pointer.seek;
+				ie.header.size = ie.header.itemKey ^ ie.pointer.seek;
+				index.add(ie, deadEntry);
+			}
+		}
+	}
+	isFinished = true;
+	for (auto thread = readers.begin(); thread != readers.end(); thread++)
+		thread->join();
+	BOOST_TEST_MESSAGE("Concurrent lookups found " << foundCount);
+	BOOST_CHECK(badReads == 0);
+	
+	Range::Entry entry;
+	for (TRangeID rangeID = 1; rangeID <= RANGES_COUNT; rangeID++) {
+		BOOST_REQUIRE(index.find(rangeID, (rangeID % 2) ? 0 : ITEMS_COUNT - 1, entry));
+		BOOST_CHECK(entry.pointer.seek % 2 == 0);
+	}
+	BOOST_CHECK(!index.find(RANGES_COUNT + 1, 0, entry));
+}
+
+BOOST_AUTO_TEST_CASE (testIndexShards)
+{
+	const size_t SHARDS_COUNT = 4;
+	const TRangeID RANGES_COUNT = 100;
+	const TItemKey ITEMS_COUNT = 10;
+	Index index(SHARDS_COUNT);
+	BOOST_REQUIRE(index.shardsCount() == SHARDS_COUNT);
+	IndexEntry ie;
+	bzero(&ie, sizeof(ie));
+	Range::Entry deadEntry;
+	for (TRangeID rangeID = 1; rangeID <= RANGES_COUNT; rangeID++) {
+		BOOST_CHECK(index.shard(rangeID) == rangeID % SHARDS_COUNT);
+		ie.header.rangeID = rangeID;
+		for (TItemKey itemKey = 0; itemKey < ITEMS_COUNT; itemKey++) {
+			ie.header.itemKey = itemKey;
+			ie.header.size = rangeID * 100 + itemKey;
+			index.add(ie, deadEntry);
+		}
+	}
+	
+	// ranges of every shard are found and listed
+	Range::Entry entry;
+	for (TRangeID rangeID = 1; rangeID <= RANGES_COUNT; rangeID++) {
+		BOOST_REQUIRE(index.find(rangeID, ITEMS_COUNT - 1, entry));
+		BOOST_CHECK(entry.size == rangeID * 100 + ITEMS_COUNT - 1);
+	}
+	BOOST_CHECK(!index.find(RANGES_COUNT + 1, 0, entry));
+	Index::TRangeVector ranges;
+	index.getRanges(ranges);
+	BOOST_CHECK(ranges.size() == RANGES_COUNT);
+	std::vector<TRangeID> rangeIDs;
+	index.getRangeIDsNoLock(rangeIDs);
+	std::sort(rangeIDs.begin(), rangeIDs.end());
+	BOOST_REQUIRE(rangeIDs.size() == RANGES_COUNT);
+	BOOST_CHECK((rangeIDs.front() == 1) && (rangeIDs.back() == RANGES_COUNT));
+	
+	// parts of a loaded index have one shard, they are merged into the shard of the range
+	Index::TIndexVector parts;
+	for (TItemKey itemKey = 0; itemKey < 2; itemKey++) {
+		parts.emplace_back(new Index());
+		ie.header.rangeID = RANGES_COUNT + 2;
+		ie.header.itemKey = itemKey;
+		ie.header.size = itemKey + 1;
+		parts.back()->addNoLock(ie);
+	}
+	index.mergeRange(RANGES_COUNT + 2, parts);
+	BOOST_CHECK(index.find(RANGES_COUNT + 2, 0, entry) && (entry.size == 1));
+	BOOST_CHECK(index.find(RANGES_COUNT + 2, 1, entry) && (entry.size == 2));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,237 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Storage request stream unit tests
+///////////////////////////////////////////////////////////////////////////////
+
+#include <boost/test/unit_test.hpp>
+#include <strings.h>
+#include "request_reader.hpp"
+
+using namespace fl::metis;
+
+BOOST_AUTO_TEST_SUITE( metis )
+
+static void addCmd(BString &stream, const EStorageCMD cmd, const void *data, const TSize size)
+{
+	StorageCmd storageCmd;
+	storageCmd.cmd = cmd;
+	storageCmd.size = size;
+	stream.add((char*)&storageCmd, sizeof(storageCmd));
+	stream.add((const char*)data, size);
+}
+
+// answers the current request as a storage event does and brings the next pipelined one into the buffer
+static void answer(RequestReader &reader, BString &buffer)
+{
+	buffer.clear();
+	StorageAnswer &sa = reader.addAnswerHeader(buffer);
+	sa.status = STORAGE_ANSWER_OK;
+	sa.size = 0;
+	reader.reset();
+	buffer.clear();
+	if (reader.hasPipelined())
+		reader.takePipelined(buffer);
+}
+
+BOOST_AUTO_TEST_CASE (testPipelinedRequests)
+{
+	const TServerID SERVER_ID = 7;
+	ItemIndex itemIndex;
+	itemIndex.rangeID = 10;
+	itemIndex.itemKey = 20;
+	BString buffer;
+	addCmd(buffer, STORAGE_PING, &SERVER_ID, sizeof(SERVER_ID));
+	addCmd(buffer, STORAGE_ITEM_INFO, &itemIndex, sizeof(itemIndex));
+	addCmd(buffer, STORAGE_NO_CMD, NULL, 0);
+
+	// all the commands have come by one read, they are parsed one after another
+	RequestReader reader;
+	BOOST_REQUIRE(reader.parseHeader(buffer));
+	BOOST_CHECK(reader.cmd().cmd == STORAGE_PING);
+	BOOST_CHECK(!reader.hasRequestID());
+	BOOST_REQUIRE(reader.takeRequest(buffer));
+	BOOST_CHECK(*(const TServerID*)reader.request() == SERVER_ID);
+	BOOST_CHECK(buffer.size() == sizeof(StorageCmd) + sizeof(SERVER_ID));
+	BOOST_CHECK(reader.hasPipelined());
+	answer(reader, buffer);
+
+	BOOST_REQUIRE(reader.parseHeader(buffer));
+	BOOST_CHECK(reader.cmd().cmd == STORAGE_ITEM_INFO);
+	BOOST_REQUIRE(reader.takeRequest(buffer));
+	const ItemIndex &request = *(const ItemIndex*)reader.request();
+	BOOST_CHECK((request.rangeID == itemIndex.rangeID) && (request.itemKey == itemIndex.itemKey));
+	answer(reader, buffer);
+
+	BOOST_REQUIRE(reader.parseHeader(buffer));
+	BOOST_CHECK(reader.cmd().cmd == STORAGE_NO_CMD);
+	BOOST_REQUIRE(reader.takeRequest(buffer));
+	BOOST_CHECK(!reader.hasPipelined());
+	answer(reader, buffer);
+	BOOST_CHECK(buffer.empty());
+	BOOST_CHECK(!reader.parseHeader(buffer));
+}
+
+BOOST_AUTO_TEST_CASE (testSplitRequest)
+{
+	GetItemChunkRequest chunkRequest;
+	bzero(&chunkRequest, sizeof(chunkRequest));
+	chunkRequest.rangeID = 10;
+	chunkRequest.itemKey = 20;
+	chunkRequest.chunkSize = 1000;
+	BString stream;
+	addCmd(stream, STORAGE_GET_ITEM_CHUNK, &chunkRequest, sizeof(chunkRequest));
+	const TServerID SERVER_ID = 7;
+	addCmd(stream, STORAGE_PING, &SERVER_ID, sizeof(SERVER_ID));
+
+	// the command comes byte by byte, the second one starts in the last read of the first one
+	const size_t firstSize = sizeof(StorageCmd) + sizeof(chunkRequest);
+	RequestReader reader;
+	BString buffer;
+	for (size_t i = 0; i < firstSize - 1; i++) {
+		buffer.add(stream.c_str() + i, 1);
+		BOOST_REQUIRE(reader.hasHeader() || (reader.parseHeader(buffer) == (buffer.size() >= sizeof(StorageCmd))));
+		BOOST_CHECK(!reader.hasHeader() || !reader.takeRequest(buffer));
+	}
+	BOOST_REQUIRE(reader.hasHeader());
+	BOOST_CHECK(reader.cmd().cmd == STORAGE_GET_ITEM_CHUNK);
+	BOOST_CHECK(reader.cmd().size == sizeof(chunkRequest));
+	buffer.add(stream.c_str() + firstSize - 1, 3);
+	BOOST_REQUIRE(reader.takeRequest(buffer));
+	const GetItemChunkRequest &request = *(const GetItemChunkRequest*)reader.request();
+	BOOST_CHECK(request.itemKey == chunkRequest.itemKey);
+	BOOST_CHECK(request.chunkSize == chunkRequest.chunkSize);
+	BOOST_REQUIRE(reader.hasPipelined());
+	answer(reader, buffer);
+
+	// the rest of the second one comes by the next read
+	BOOST_CHECK(buffer.size() == 2);
+	BOOST_CHECK(!reader.parseHeader(buffer));
+	buffer.add(stream.c_str() + firstSize + 2, stream.size() - firstSize - 2);
+	BOOST_REQUIRE(reader.parseHeader(buffer));
+	BOOST_CHECK(reader.cmd().cmd == STORAGE_PING);
+	BOOST_REQUIRE(reader.takeRequest(buffer));
+	BOOST_CHECK(*(const TServerID*)reader.request() == SERVER_ID);
+}
+
+BOOST_AUTO_TEST_CASE (testPutLeftovers)
+{
+	const TItemSize ITEM_SIZE = 1000;
+	const TServerID SERVER_ID = 7;
+	BString item;
+	for (TItemSize i = 0; i < ITEM_SIZE; i++)
+		item << (char)('a' + i % 20);
+	ItemHeader ih;
+	bzero(&ih, sizeof(ih));
+	ih.rangeID = 10;
+	ih.itemKey = 20;
+	ih.size = ITEM_SIZE;
+	BString stream;
+	StorageCmd storageCmd;
+	storageCmd.cmd = STORAGE_PUT;
+	storageCmd.size = sizeof(ih) + ITEM_SIZE;
+	stream.add((char*)&storageCmd, sizeof(storageCmd));
+	stream.add((char*)&ih, sizeof(ih));
+	stream.add(item.c_str(), item.size());
+	addCmd(stream, STORAGE_PING, &SERVER_ID, sizeof(SERVER_ID));
+	addCmd(stream, STORAGE_NO_CMD, NULL, 0);
+
+	// a put body is written by parts as it comes, as the direct put does
+	const size_t READ_SIZE = 300;
+	RequestReader reader;
+	BString buffer;
+	BString written;
+	size_t seek = 0;
+	while (written.size() < ITEM_SIZE) {
+		BOOST_REQUIRE(seek < stream.size());
+		size_t readSize = std::min(READ_SIZE, stream.size() - seek);
+		buffer.add(stream.c_str() + seek, readSize);
+		seek += readSize;
+		const char *data = buffer.c_str();
+		size_t dataSize = buffer.size();
+		if (!reader.hasHeader()) {
+			BOOST_REQUIRE(reader.parseHeader(buffer));
+			BOOST_REQUIRE(reader.cmd().cmd == STORAGE_PUT);
+			data += sizeof(StorageCmd) + sizeof(ItemHeader);
+			dataSize -= sizeof(StorageCmd) + sizeof(ItemHeader);
+		}
+		dataSize = reader.split(data, dataSize, ITEM_SIZE - written.size());
+		written.add(data, dataSize);
+		buffer.clear();
+	}
+	BOOST_CHECK(written == item);
+
+	// the bytes of the last read after the body are the next requests
+	BOOST_REQUIRE(reader.hasPipelined());
+	answer(reader, buffer);
+	BOOST_CHECK(buffer.size() == seek - sizeof(StorageCmd) - sizeof(ItemHeader) - ITEM_SIZE);
+	buffer.add(stream.c_str() + seek, stream.size() - seek);
+	BOOST_REQUIRE(reader.parseHeader(buffer));
+	BOOST_CHECK(reader.cmd().cmd == STORAGE_PING);
+	BOOST_REQUIRE(reader.takeRequest(buffer));
+	BOOST_CHECK(*(const TServerID*)reader.request() == SERVER_ID);
+	answer(reader, buffer);
+	BOOST_REQUIRE(reader.parseHeader(buffer));
+	BOOST_CHECK(reader.cmd().cmd == STORAGE_NO_CMD);
+	BOOST_REQUIRE(reader.takeRequest(buffer));
+	BOOST_CHECK(!reader.hasPipelined());
+}
+
+BOOST_AUTO_TEST_CASE (testTaggedRequest)
+{
+	const TStorageRequestID REQUEST_ID = 0x12345678;
+	GetItemChunkRequest chunkRequest;
+	bzero(&chunkRequest, sizeof(chunkRequest));
+	chunkRequest.rangeID = 10;
+	chunkRequest.itemKey = 20;
+	chunkRequest.seek = 30;
+	chunkRequest.chunkSize = 1000;
+	BString stream;
+	StorageCmd storageCmd;
+	storageCmd.cmd = (EStorageCMD)(STORAGE_GET_ITEM_CHUNK | STORAGE_CMD_REQUEST_ID);
+	storageCmd.size = sizeof(chunkRequest);
+	stream.add((char*)&storageCmd, sizeof(storageCmd));
+	stream.add((char*)&REQUEST_ID, sizeof(REQUEST_ID));
+	stream.add((char*)&chunkRequest, sizeof(chunkRequest));
+	addCmd(stream, STORAGE_NO_CMD, NULL, 0);
+
+	// the read ends in the middle of the id
+	RequestReader reader;
+	BString buffer;
+	buffer.add(stream.c_str(), sizeof(StorageCmd) + 2);
+	BOOST_CHECK(!reader.parseHeader(buffer));
+	BOOST_CHECK(!reader.hasHeader());
+	buffer.add(stream.c_str() + buffer.size(), stream.size() - buffer.size());
+	BOOST_REQUIRE(reader.parseHeader(buffer));
+	BOOST_CHECK(reader.cmd().cmd == STORAGE_GET_ITEM_CHUNK);
+	BOOST_REQUIRE(reader.hasRequestID());
+	BOOST_CHECK(reader.requestID() == REQUEST_ID);
+	BOOST_REQUIRE(reader.takeRequest(buffer));
+
+	// the answer is built in the buffer, which the request has come by, and the request stays intact
+	buffer.clear();
+	StorageAnswer &sa = reader.addAnswerHeader(buffer);
+	sa.status = STORAGE_ANSWER_OK;
+	sa.size = 0;
+	BOOST_CHECK(reader.answerHeaderSize() == sizeof(StorageAnswer) + sizeof(TStorageRequestID));
+	BOOST_REQUIRE((size_t)buffer.size() == reader.answerHeaderSize());
+	BOOST_CHECK(*(const TStorageRequestID*)(buffer.c_str() + sizeof(StorageAnswer)) == REQUEST_ID);
+	const GetItemChunkRequest &request = *(const GetItemChunkRequest*)reader.request();
+	BOOST_CHECK((request.rangeID == chunkRequest.rangeID) && (request.itemKey == chunkRequest.itemKey));
+	BOOST_CHECK((request.seek == chunkRequest.seek) && (request.chunkSize == chunkRequest.chunkSize));
+
+	// the next untagged request is answered without an id
+	reader.reset();
+	buffer.clear();
+	reader.takePipelined(buffer);
+	BOOST_REQUIRE(reader.parseHeader(buffer));
+	BOOST_CHECK(reader.cmd().cmd == STORAGE_NO_CMD);
+	BOOST_CHECK(!reader.hasRequestID());
+	BOOST_CHECK(reader.answerHeaderSize() == sizeof(StorageAnswer));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,172 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Shard queues unit tests
+///////////////////////////////////////////////////////////////////////////////
+
+#include <boost/test/unit_test.hpp>
+#include <poll.h>
+#include <unistd.h>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include "shard_queue.hpp"
+
+using namespace fl::metis;
+
+BOOST_AUTO_TEST_SUITE( metis )
+
+class TestShardTask : public DiskIOTask
+{
+public:
+	TestShardTask(const size_t producer, const size_t number, size_t &processed, std::atomic<size_t> &finished)
+		: producer(producer), number(number), processedIn(std::this_thread::get_id()),
+		finishedIn(std::this_thread::get_id()), processedAt(0), finishCount(0), _processed(processed),
+		_finished(finished)
+	{
+	}
+	virtual void process()
+	{
+		processedIn = std::this_thread::get_id();
+		processedAt = _processed++;
+	}
+	virtual void finish()
+	{
+		finishedIn = std::this_thread::get_id();
+		finishCount++;
+		_finished++;
+	}
+	size_t producer;
+	size_t number;
+	std::thread::id processedIn;
+	std::thread::id finishedIn;
+	size_t processedAt;
+	size_t finishCount;
+private:
+	size_t &_processed; // tasks are processed by the owner only
+	std::atomic<size_t> &_finished;
+};
+typedef std::shared_ptr<TestShardTask> TTestShardTaskPtr;
+
+// the loop of a worker, which waits for its eventfd and takes the queued tasks
+class TestShardWorker
+{
+public:
+	TestShardWorker(ShardQueue &queue)
+		: _isStopped(false), _thread(&TestShardWorker::_run, this, std::ref(queue))
+	{
+	}
+	~TestShardWorker()
+	{
+		_isStopped = true;
+		_thread.join();
+	}
+	std::thread::id id() const
+	{
+		return _thread.get_id();
+	}
+private:
+	void _run(ShardQueue &queue)
+	{
+		struct pollfd pfd;
+		pfd.fd = queue.descr();
+		pfd.events = POLLIN;
+		while (!_isStopped) {
+			pfd.revents = 0;
+			if (poll(&pfd, 1, 10) == 1)
+				queue.call(fl::events::E_INPUT);
+		}
+	}
+	std::atomic<bool> _isStopped;
+	std::thread _thread;
+};
+
+class TestOrderTask : public DiskIOTask
+{
+public:
+	TestOrderTask(std::vector<size_t> &order, const size_t number)
+		: _order(order), _number(number)
+	{
+	}
+	virtual void process()
+	{
+		_order.push_back(_number);
+	}
+	virtual void finish()
+	{
+		BOOST_ERROR("A task without an origin has been finished");
+	}
+private:
+	std::vector<size_t> &_order;
+	size_t _number;
+};
+
+BOOST_AUTO_TEST_CASE (testShardQueueForward)
+{
+	const size_t PRODUCERS_COUNT = 4;
+	const size_t TASKS_COUNT = 10000;
+	ShardQueue origin(0);
+	ShardQueue owner(1);
+	BOOST_REQUIRE(origin.isValid() && owner.isValid());
+	size_t processed = 0;
+	std::atomic<size_t> finished(0);
+	std::vector<TTestShardTaskPtr> tasks;
+	for (size_t producer = 0; producer < PRODUCERS_COUNT; producer++) {
+		for (size_t i = 0; i < TASKS_COUNT; i++)
+			tasks.push_back(TTestShardTaskPtr(new TestShardTask(producer, i, processed, finished)));
+	}
+	{
+		TestShardWorker originWorker(origin);
+		TestShardWorker ownerWorker(owner);
+
+		// the tasks are forwarded by several threads at once
+		std::vector<std::thread> producers;
+		for (size_t producer = 0; producer < PRODUCERS_COUNT; producer++) {
+			producers.push_back(std::thread([&, producer]() {
+				for (size_t i = 0; i < TASKS_COUNT; i++)
+					owner.forward(tasks[producer * TASKS_COUNT + i], &origin);
+			}));
+		}
+		for (auto producer = producers.begin(); producer != producers.end(); producer++)
+			producer->join();
+		for (int i = 0; (i < 1000) && (finished < tasks.size()); i++)
+			usleep(10000);
+		BOOST_REQUIRE(finished == tasks.size());
+
+		// every task is processed in the worker of the owner and finished once in the worker of the origin
+		for (auto task = tasks.begin(); task != tasks.end(); task++) {
+			BOOST_CHECK((*task)->processedIn == ownerWorker.id());
+			BOOST_CHECK((*task)->finishedIn == originWorker.id());
+			BOOST_CHECK((*task)->finishCount == 1);
+		}
+		// the tasks of one producer are processed in the order they have been forwarded
+		for (auto task = tasks.begin() + 1; task != tasks.end(); task++) {
+			if ((*task)->producer == (*(task - 1))->producer)
+				BOOST_CHECK((*task)->processedAt > (*(task - 1))->processedAt);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE (testShardQueueOrder)
+{
+	// tasks are processed in the order they have come, and a task without an origin isn't handed back
+	const size_t TASKS_COUNT = 100;
+	ShardQueue owner(1);
+	std::vector<size_t> order;
+	for (size_t i = 0; i < TASKS_COUNT; i++)
+		owner.forward(TDiskIOTaskPtr(new TestOrderTask(order, i)), NULL);
+	owner.call(fl::events::E_INPUT);
+	BOOST_REQUIRE(order.size() == TASKS_COUNT);
+	for (size_t i = 0; i < TASKS_COUNT; i++)
+		BOOST_CHECK(order[i] == i);
+
+	// the eventfd has been read, so an empty wake up is skipped
+	owner.call(fl::events::E_INPUT);
+	BOOST_CHECK(order.size() == TASKS_COUNT);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -13,7 +13,14 @@
 #include "slice.hpp"
 #include "storage.hpp"
 #include "range_index.hpp"
+#include "crc32c.hpp"
+#include "compression.hpp"
+#include "sync_thread.hpp"
 #include "dir.hpp"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
 
 using namespace fl::metis;
 using fl::tests::TestPath;
@@ -21,6 +28,14 @@ using fl::fs::Directory;
 
 BOOST_AUTO_TEST_SUITE( metis )
 
+static RangeItemsRequest allRangeItems(const TRangeID rangeID)
+{
+	RangeItemsRequest request;
+	bzero(&request, sizeof(request));
+	request.rangeID = rangeID;
+	return request;
+}
+
 BOOST_AUTO_TEST_CASE (testSliceCreation)
 {
 	TestPath testPath("metis_slice");
@@ -77,7 +92,8 @@ BOOST_AUTO_TEST_CASE (testSliceIndexLoad)
 		BOOST_REQUIRE(sliceManager.add(testData.c_str(), ie));
 		ih.itemKey = 2;
 		BOOST_REQUIRE(sliceManager.add(testData.c_str(), ie));
-		BOOST_REQUIRE(sliceManager.remove(ih, ie.pointer));
+		TItemSize holeSize;
+		BOOST_REQUIRE(sliceManager.remove(ih, ie.pointer, holeSize));
 		
 		ih.status = ST_ITEM_DELETED;
 		ih.itemKey = 1;
@@ -201,7 +217,8 @@ BOOST_AUTO_TEST_CASE (testSliceIndexRebuildFromData)
 		BOOST_REQUIRE(sliceManager.add(testData.c_str(), ie));
 		ih.itemKey = 2;
 		BOOST_REQUIRE(sliceManager.add(testData.c_str(), ie));
-		BOOST_REQUIRE(sliceManager.remove(ih, ie.pointer));
+		TItemSize holeSize;
+		BOOST_REQUIRE(sliceManager.remove(ih, ie.pointer, holeSize));
 	
 		BString indexFile;
 		indexFile.sprintfSet("%s/index/%u", levelPath.c_str(), ie.pointer.sliceID);
@@ -221,14 +238,156 @@ BOOST_AUTO_TEST_CASE (testSliceIndexRebuildFromData)
 
 		Range::Entry ie;
 		BOOST_CHECK(index.find(RANGE_ID, 2, ie) == false);
-		BOOST_CHECK(index.find(RANGE_ID, 1, ie) == true);
+		BOOST_REQUIRE(index.find(RANGE_ID, 1, ie) == true);
 		BOOST_CHECK(ie.timeTag.modTime == MOD_TIME);
+		BOOST_CHECK(ie.pointer.seek == Slice::firstItemSeek());
+		BOOST_CHECK(ie.crc == crc32c(0, "test", 4));
+		BString data;
+		BOOST_REQUIRE(sliceManager.get(data, ie.pointer, 0, ie.size));
+		BOOST_CHECK((data.size() == 4) && (memcmp(data.c_str(), "test", 4) == 0));
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+		
+}
+
+BOOST_AUTO_TEST_CASE (testItemChecksum)
+{
+	BOOST_CHECK(crc32c(0, "123456789", 9) == 0xE3069283);
+	BString data;
+	for (int i = 0; i < 1000; i++)
+		data << (char)('a' + i % 26);
+	BOOST_CHECK(crc32c(crc32c(0, data.c_str(), 333), data.c_str() + 333, data.size() - 333) 
+		== crc32c(0, data.c_str(), data.size()));
+	
+	TestPath testPath("metis_slice");
+	const TRangeID RANGE_ID = 10;
+	ItemHeader ih;
+	bzero(&ih, sizeof(ih));
+	ih.rangeID = RANGE_ID;
+	ih.level = 1;
+	ih.itemKey = 1;
+	ih.timeTag.modTime = 2;
+	ih.size = data.size();
+	StorageOptions options;
+	options.objectCacheSize = 0; // a hot object would be read and verified as a whole
+	try
+	{
+		Storage storage(testPath.path(), 0.05, 10000, options);
+		BOOST_REQUIRE(storage.add(data.c_str(), ih));
+		GetItemChunkRequest request;
+		request.rangeID = RANGE_ID;
+		request.itemKey = 1;
+		request.seek = 0;
+		request.chunkSize = data.size();
+		BString chunk;
+		BOOST_REQUIRE(storage.get(request, chunk));
+		BOOST_CHECK((chunk.size() == data.size()) && (memcmp(chunk.c_str(), data.c_str(), data.size()) == 0));
+		
+		// a flipped bit on the disk is noticed by a whole item read, but not by a chunk one
+		TSlicePtr slice;
+		off_t fileSeek = 0;
+		BOOST_REQUIRE(storage.getFileChunk(request, slice, fileSeek));
+		char byte = data.c_str()[10] ^ 1;
+		BOOST_REQUIRE(pwrite(slice->dataDescr(), &byte, 1, fileSeek + 10) == 1);
+		chunk.clear();
+		BOOST_CHECK(!storage.get(request, chunk));
+		BOOST_CHECK(chunk.size() == 0);
+		request.chunkSize = 100;
+		BOOST_CHECK(storage.get(request, chunk));
 	}
 	catch (...)
 	{
 		BOOST_CHECK_NO_THROW(throw);
 	}
+}
+
+BOOST_AUTO_TEST_CASE (testScrub)
+{
+	TestPath testPath("metis_slice");
+	const TRangeID RANGE_ID = 10;
+	const TItemKey ITEMS_COUNT = 10;
+	BString data;
+	for (int i = 0; i < 1000; i++)
+		data << (char)('a' + i % 26);
+	ItemHeader ih;
+	bzero(&ih, sizeof(ih));
+	ih.rangeID = RANGE_ID;
+	ih.level = 1;
+	ih.timeTag.modTime = 2;
+	ih.size = data.size();
+	try
+	{
+		Storage storage(testPath.path(), 0.05, 10000000);
+		for (ih.itemKey = 1; ih.itemKey <= ITEMS_COUNT; ih.itemKey++)
+			BOOST_REQUIRE(storage.add(data.c_str(), ih));
+		uint32_t corruptedItems = 0;
+		BOOST_REQUIRE(storage.scrub(0, corruptedItems));
+		BOOST_CHECK(corruptedItems == 0);
+		
+		// a removed item isn't checked, even if its data is broken
+		GetItemChunkRequest request;
+		request.rangeID = RANGE_ID;
+		request.seek = 0;
+		request.chunkSize = 100;
+		TSlicePtr slice;
+		off_t fileSeek = 0;
+		char byte = 0;
+		for (TItemKey itemKey = 3; itemKey <= 5; itemKey++) {
+			request.itemKey = itemKey;
+			BOOST_REQUIRE(storage.getFileChunk(request, slice, fileSeek));
+			BOOST_REQUIRE(pwrite(slice->dataDescr(), &byte, 1, fileSeek + 10) == 1);
+		}
+		ih.itemKey = 4;
+		ih.timeTag.op = 1;
+		BOOST_REQUIRE(storage.remove(ih));
+		BOOST_REQUIRE(storage.scrub(0, corruptedItems));
+		BOOST_CHECK(corruptedItems == 2);
 		
+		// the corrupted item is hidden, so managers make a new copy of it
+		BString chunk;
+		request.itemKey = 3;
+		BOOST_CHECK(!storage.get(request, chunk));
+		ItemInfo itemInfo;
+		BOOST_CHECK(!storage.findAndFill(ItemIndex(RANGE_ID, 3), itemInfo));
+		BString items;
+		BOOST_REQUIRE(storage.getRangeItems(allRangeItems(RANGE_ID), items));
+		const RangeItemsHeader &header = *(const RangeItemsHeader*)items.c_str();
+		BOOST_CHECK(header.count == ITEMS_COUNT - 2);
+		
+		// the new copy replaces it
+		ih.itemKey = 3;
+		ih.timeTag.op = 0;
+		BOOST_REQUIRE(storage.add(data.c_str(), ih));
+		BOOST_REQUIRE(storage.get(request, chunk));
+		BOOST_REQUIRE(storage.scrub(0, corruptedItems));
+		BOOST_CHECK(corruptedItems == 0);
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+	
+	// the mark survives a restart
+	try
+	{
+		Storage storage(testPath.path(), 0.05, 10000000);
+		GetItemChunkRequest request;
+		request.rangeID = RANGE_ID;
+		request.itemKey = 3;
+		request.seek = 0;
+		request.chunkSize = 100;
+		BString chunk;
+		BOOST_CHECK(storage.get(request, chunk));
+		request.itemKey = 5;
+		BOOST_CHECK(!storage.get(request, chunk));
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
 }
 
 BOOST_AUTO_TEST_CASE (testGetRangeItems)
@@ -264,7 +423,7 @@ BOOST_AUTO_TEST_CASE (testGetRangeItems)
 		BOOST_REQUIRE(storage.add(ih, tmpFile, buf));
 		BOOST_REQUIRE(storage.remove(ih));
 		BString rangeDataStr;
-		BOOST_REQUIRE(storage.getRangeItems(RANGE_ID, rangeDataStr));
+		BOOST_REQUIRE(storage.getRangeItems(allRangeItems(RANGE_ID), rangeDataStr));
 		Buffer rangeData(std::move(rangeDataStr));
 		RangeItemsHeader header;
 		rangeData.get(&header, sizeof(header));
@@ -287,4 +446,1280 @@ BOOST_AUTO_TEST_CASE (testGetRangeItems)
 	}		
 }
 
+BOOST_AUTO_TEST_CASE (testGetRangeItemsPages)
+{
+	TestPath testPath("metis_slice");
+	const TItemModTime MOD_TIME = 2;
+	const TRangeID DENSE_RANGE_ID = 10;
+	const TRangeID SPARSE_RANGE_ID = 11;
+	const TItemKey ITEMS_COUNT = 250;
+	const uint32_t PAGE_SIZE = 100;
+	BString data;
+	for (int i = 0; i < 100; i++)
+		data << (char)('0' + i % 20);
+	ItemHeader ih;
+	bzero(&ih, sizeof(ih));
+	ih.level = 1;
+	ih.subLevel = 1;
+	ih.timeTag.modTime = MOD_TIME;
+	ih.size = data.size();
+	try
+	{
+		Storage storage(testPath.path(), 0.05, 10000);
+		for (TItemKey i = 0; i < ITEMS_COUNT; i++) {
+			ih.rangeID = DENSE_RANGE_ID;
+			ih.itemKey = ITEMS_COUNT - i;
+			BOOST_REQUIRE(storage.add(data.c_str(), ih));
+			ih.rangeID = SPARSE_RANGE_ID;
+			ih.itemKey = (ITEMS_COUNT - i) * 1000;
+			BOOST_REQUIRE(storage.add(data.c_str(), ih));
+		}
+		
+		// the pages of both the dense array and the hash table come in the order of keys
+		const TRangeID rangeIDs[] = {DENSE_RANGE_ID, SPARSE_RANGE_ID};
+		for (auto rangeID : rangeIDs) {
+			RangeItemsRequest request = allRangeItems(rangeID);
+			request.maxCount = PAGE_SIZE;
+			TItemKey lastKey = 0;
+			uint32_t pages = 0;
+			uint32_t count = 0;
+			while (true) {
+				BString page;
+				BOOST_REQUIRE(storage.getRangeItems(request, page));
+				const RangeItemsHeader &header = *(const RangeItemsHeader*)page.c_str();
+				BOOST_REQUIRE(header.rangeID == rangeID);
+				BOOST_REQUIRE(header.count <= PAGE_SIZE);
+				BOOST_REQUIRE((size_t)page.size() == sizeof(header) + header.count * sizeof(RangeItemEntry));
+				const RangeItemEntry *itemEntry = (const RangeItemEntry*)(page.c_str() + sizeof(header));
+				for (uint32_t i = 0; i < header.count; i++, itemEntry++) {
+					BOOST_CHECK(itemEntry->itemKey > lastKey);
+					lastKey = itemEntry->itemKey;
+				}
+				count += header.count;
+				pages++;
+				if (header.flags & RANGE_ITEMS_LAST)
+					break;
+				BOOST_REQUIRE(header.nextKey == lastKey + 1);
+				request.fromKey = header.nextKey;
+			}
+			BOOST_CHECK(pages == (ITEMS_COUNT + PAGE_SIZE - 1) / PAGE_SIZE);
+			BOOST_CHECK(count == ITEMS_COUNT);
+		}
+		
+		// only the changed items are listed
+		ih.rangeID = SPARSE_RANGE_ID;
+		ih.timeTag.modTime = MOD_TIME + 1;
+		ih.itemKey = 7000;
+		BOOST_REQUIRE(storage.add(data.c_str(), ih));
+		ih.itemKey = 9000;
+		ih.timeTag.op = 1;
+		BOOST_REQUIRE(storage.remove(ih));
+		RangeItemsRequest request = allRangeItems(SPARSE_RANGE_ID);
+		request.changedSince.modTime = MOD_TIME;
+		BString page;
+		BOOST_REQUIRE(storage.getRangeItems(request, page));
+		const RangeItemsHeader &header = *(const RangeItemsHeader*)page.c_str();
+		BOOST_REQUIRE(header.count == 1);
+		BOOST_CHECK(header.flags & RANGE_ITEMS_LAST);
+		const RangeItemEntry *itemEntry = (const RangeItemEntry*)(page.c_str() + sizeof(header));
+		BOOST_CHECK(itemEntry->itemKey == 7000);
+		BOOST_CHECK(itemEntry->timeTag.modTime == MOD_TIME + 1);
+		
+		// STORAGE_GET_RANGE_ITEMS keeps listing the whole range in the first version of the layout
+		RangeItemsRequestV1 requestV1;
+		requestV1.serverID = 0;
+		requestV1.rangeID = SPARSE_RANGE_ID;
+		BString itemsV1;
+		BOOST_REQUIRE(storage.getRangeItems(requestV1, itemsV1));
+		const RangeItemsHeaderV1 &headerV1 = *(const RangeItemsHeaderV1*)itemsV1.c_str();
+		BOOST_CHECK(headerV1.rangeID == SPARSE_RANGE_ID);
+		BOOST_REQUIRE((size_t)itemsV1.size() == sizeof(headerV1) + headerV1.count * sizeof(RangeItemEntryV1));
+		BOOST_REQUIRE(headerV1.count == ITEMS_COUNT);
+		const RangeItemEntryV1 *entryV1 = (const RangeItemEntryV1*)(itemsV1.c_str() + sizeof(headerV1));
+		BOOST_CHECK(entryV1[6].itemKey == 7000);
+		BOOST_CHECK(entryV1[6].timeTag.modTime == MOD_TIME + 1);
+		BOOST_CHECK(entryV1[7].itemKey == 8000);
+		BOOST_CHECK(entryV1[7].size == data.size());
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+}
+
+BOOST_AUTO_TEST_CASE (testRangeDigest)
+{
+	TestPath firstPath("metis_slice");
+	TestPath secondPath("metis_slice");
+	const TRangeID RANGE_ID = 10;
+	const TItemKey ITEMS_COUNT = 1000;
+	const TItemKey CHANGED_KEY = 517;
+	BString data;
+	for (int i = 0; i < 100; i++)
+		data << (char)('0' + i % 20);
+	ItemHeader ih;
+	bzero(&ih, sizeof(ih));
+	ih.rangeID = RANGE_ID;
+	ih.level = 1;
+	ih.subLevel = 1;
+	ih.timeTag.modTime = 2;
+	ih.size = data.size();
+	RangeDigestRequest rootRequest;
+	bzero(&rootRequest, sizeof(rootRequest));
+	rootRequest.rangeID = RANGE_ID;
+	BString firstDigests;
+	BString secondDigests;
+	try
+	{
+		Storage first(firstPath.path(), 0.05, 10000);
+		Storage second(secondPath.path(), 0.05, 10000);
+		for (TItemKey i = 0; i < ITEMS_COUNT; i++) {
+			ih.itemKey = i;
+			BOOST_REQUIRE(first.add(data.c_str(), ih));
+			ih.itemKey = ITEMS_COUNT - 1 - i;
+			BOOST_REQUIRE(second.add(data.c_str(), ih));
+		}
+		// a deleted item, which the second storage has never had, doesn't change the digest
+		ih.itemKey = ITEMS_COUNT;
+		BOOST_REQUIRE(first.add(data.c_str(), ih));
+		ih.timeTag.op = 1;
+		BOOST_REQUIRE(first.remove(ih));
+		
+		// the same items in any order give the same digests
+		BOOST_REQUIRE(first.getRangeDigest(rootRequest, firstDigests));
+		BOOST_REQUIRE(second.getRangeDigest(rootRequest, secondDigests));
+		BOOST_REQUIRE((size_t)firstDigests.size() == sizeof(RangeDigestHeader) 
+			+ RANGE_DIGEST_FANOUT * sizeof(TRangeDigest));
+		BOOST_CHECK(firstDigests == secondDigests);
+		
+		// a newer version of an item changes only its subtree and bucket
+		ih.itemKey = CHANGED_KEY;
+		ih.timeTag.modTime = 3;
+		BOOST_REQUIRE(second.add(data.c_str(), ih));
+		secondDigests.clear();
+		BOOST_REQUIRE(second.getRangeDigest(rootRequest, secondDigests));
+		const uint32_t changedBucket = rangeDigestBucket(CHANGED_KEY);
+		const uint32_t changedSubtree = changedBucket / RANGE_DIGEST_FANOUT;
+		const TRangeDigest *firstSubtrees = (const TRangeDigest*)(firstDigests.c_str() + sizeof(RangeDigestHeader));
+		const TRangeDigest *secondSubtrees = (const TRangeDigest*)(secondDigests.c_str() + sizeof(RangeDigestHeader));
+		for (uint32_t subtree = 0; subtree < RANGE_DIGEST_FANOUT; subtree++)
+			BOOST_CHECK((firstSubtrees[subtree] == secondSubtrees[subtree]) == (subtree != changedSubtree));
+		
+		RangeDigestRequest subtreeRequest = rootRequest;
+		subtreeRequest.subtrees = 1 << changedSubtree;
+		firstDigests.clear();
+		secondDigests.clear();
+		BOOST_REQUIRE(first.getRangeDigest(subtreeRequest, firstDigests));
+		BOOST_REQUIRE(second.getRangeDigest(subtreeRequest, secondDigests));
+		const TRangeDigest *firstBuckets = (const TRangeDigest*)(firstDigests.c_str() + sizeof(RangeDigestHeader));
+		const TRangeDigest *secondBuckets = (const TRangeDigest*)(secondDigests.c_str() + sizeof(RangeDigestHeader));
+		for (uint32_t bucket = 0; bucket < RANGE_DIGEST_FANOUT; bucket++) {
+			bool isChanged = (changedSubtree * RANGE_DIGEST_FANOUT + bucket) == changedBucket;
+			BOOST_CHECK((firstBuckets[bucket] == secondBuckets[bucket]) == !isChanged);
+		}
+		
+		// only the items of the changed bucket are listed
+		RangeItemsRequest itemsRequest = allRangeItems(RANGE_ID);
+		itemsRequest.flags = RANGE_ITEMS_BUCKETS;
+		itemsRequest.buckets[changedBucket / 8] |= 1 << (changedBucket % 8);
+		BString items;
+		BOOST_REQUIRE(second.getRangeItems(itemsRequest, items));
+		const RangeItemsHeader &header = *(const RangeItemsHeader*)items.c_str();
+		BOOST_CHECK(header.count == ITEMS_COUNT / RANGE_DIGEST_BUCKETS + 1);
+		const RangeItemEntry *itemEntry = (const RangeItemEntry*)(items.c_str() + sizeof(header));
+		for (uint32_t i = 0; i < header.count; i++, itemEntry++)
+			BOOST_CHECK(rangeDigestBucket(itemEntry->itemKey) == changedBucket);
+		secondDigests.clear();
+		BOOST_REQUIRE(second.getRangeDigest(rootRequest, secondDigests));
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+	
+	// the digest is restored with the index
+	try
+	{
+		Storage second(secondPath.path(), 0.05, 10000);
+		BString digests;
+		BOOST_REQUIRE(second.getRangeDigest(rootRequest, digests));
+		BOOST_CHECK(digests == secondDigests);
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+	
+	// copies with the same time tag and size, but other data have other digests
+	RangeDigest digest;
+	RangeDigest otherDigest;
+	digest.toggle(CHANGED_KEY, data.size(), ih.timeTag, crc32c(0, data.c_str(), data.size()));
+	otherDigest.toggle(CHANGED_KEY, data.size(), ih.timeTag, crc32c(0, data.c_str(), data.size() - 1));
+	BOOST_CHECK(digest.root() != otherDigest.root());
+}
+
+BOOST_AUTO_TEST_CASE (testGetFileChunk)
+{
+	TestPath testPath("metis_slice");
+	const TRangeID RANGE_ID = 10;
+	BString data;
+	for (int i = 0; i < 1024; i++)
+		data << (char)('0' + i % 20);
+	ItemHeader ih;
+	ih.status = 0;
+	ih.rangeID = RANGE_ID;
+	ih.level = 1;
+	ih.subLevel = 1;
+	ih.itemKey = 1;
+	ih.timeTag.modTime = 2;
+	ih.timeTag.op = 2;
+	ih.size = data.size();
+
+	try
+	{
+		Storage storage(testPath.path(), 0.05, 10000);
+		BOOST_REQUIRE(storage.add(data.c_str(), ih));
+		
+		GetItemChunkRequest request;
+		request.rangeID = RANGE_ID;
+		request.itemKey = 1;
+		request.seek = 100;
+		request.chunkSize = 500;
+		TSlicePtr slice;
+		off_t fileSeek = 0;
+		BOOST_REQUIRE(storage.getFileChunk(request, slice, fileSeek));
+		BOOST_REQUIRE(slice.get() != NULL);
+		BString fileChunk;
+		BOOST_REQUIRE(pread(slice->dataDescr(), fileChunk.reserveBuffer(request.chunkSize), request.chunkSize, fileSeek) 
+			== request.chunkSize);
+		BString chunk;
+		BOOST_REQUIRE(storage.get(request, chunk));
+		BOOST_REQUIRE(chunk.size() == fileChunk.size());
+		BOOST_CHECK(memcmp(chunk.c_str(), fileChunk.c_str(), chunk.size()) == 0);
+		BOOST_CHECK(memcmp(fileChunk.c_str(), data.c_str() + request.seek, request.chunkSize) == 0);
+		
+		request.seek = 1000;
+		BOOST_CHECK(!storage.getFileChunk(request, slice, fileSeek));
+		request.itemKey = 2;
+		request.seek = 0;
+		BOOST_CHECK(!storage.getFileChunk(request, slice, fileSeek));
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}		
+}
+
+BOOST_AUTO_TEST_CASE (testGetInfoAndChunk)
+{
+	TestPath testPath("metis_slice");
+	const TRangeID RANGE_ID = 10;
+	BString data;
+	for (int i = 0; i < 1024; i++)
+		data << (char)('0' + i % 20);
+	ItemHeader ih;
+	bzero(&ih, sizeof(ih));
+	ih.rangeID = RANGE_ID;
+	ih.level = 1;
+	ih.itemKey = 1;
+	ih.timeTag.modTime = 2;
+	ih.size = data.size();
+
+	try
+	{
+		Storage storage(testPath.path(), 0.05, 10000);
+		BOOST_REQUIRE(storage.add(data.c_str(), ih));
+		
+		GetItemInfoAndChunkRequest request;
+		request.rangeID = RANGE_ID;
+		request.itemKey = 1;
+		request.chunkSize = 500;
+		request.ifModifiedSince = 0;
+		request.flags = 0;
+		ItemInfo itemInfo;
+		BString chunk;
+		BOOST_REQUIRE(storage.getInfoAndChunk(request, itemInfo, chunk));
+		BOOST_CHECK(itemInfo.size == ih.size);
+		BOOST_CHECK(itemInfo.timeTag.tag == ih.timeTag.tag);
+		BOOST_REQUIRE(chunk.size() == request.chunkSize);
+		BOOST_CHECK(memcmp(chunk.c_str(), data.c_str(), request.chunkSize) == 0);
+		
+		// a small item comes as a whole
+		request.chunkSize = 4096;
+		chunk.clear();
+		BOOST_REQUIRE(storage.getInfoAndChunk(request, itemInfo, chunk));
+		BOOST_REQUIRE(chunk.size() == data.size());
+		BOOST_CHECK(memcmp(chunk.c_str(), data.c_str(), data.size()) == 0);
+		
+		// the client already has this version
+		request.ifModifiedSince = ih.timeTag.modTime;
+		chunk.clear();
+		BOOST_REQUIRE(storage.getInfoAndChunk(request, itemInfo, chunk));
+		BOOST_CHECK(itemInfo.size == ih.size);
+		BOOST_CHECK(chunk.size() == 0);
+		
+		request.itemKey = 2;
+		BOOST_CHECK(!storage.getInfoAndChunk(request, itemInfo, chunk));
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}		
+}
+
+BOOST_AUTO_TEST_CASE (testGetItems)
+{
+	TestPath testPath("metis_slice");
+	const TRangeID RANGE_ID = 10;
+	const TItemKey ITEMS_COUNT = 4;
+	BString data;
+	for (int i = 0; i < 1000; i++)
+		data << (char)('a' + i % 20);
+	ItemHeader ih;
+	bzero(&ih, sizeof(ih));
+	ih.rangeID = RANGE_ID;
+	ih.level = 1;
+	ih.timeTag.modTime = 2;
+
+	try
+	{
+		Storage storage(testPath.path(), 0.05, 10000);
+		GetItemsEntry items[ITEMS_COUNT + 2];
+		for (TItemKey i = 0; i < ITEMS_COUNT; i++) {
+			ih.itemKey = i + 1;
+			ih.size = 100 * (i + 1);
+			BOOST_REQUIRE(storage.add(data.c_str(), ih));
+			items[i].rangeID = RANGE_ID;
+			items[i].itemKey = ih.itemKey;
+			items[i].timeTag = ih.timeTag;
+		}
+		items[ITEMS_COUNT] = items[0];
+		items[ITEMS_COUNT].itemKey = 100; // a missing item
+		items[ITEMS_COUNT + 1] = items[1];
+		items[ITEMS_COUNT + 1].timeTag.modTime = 3; // the storage has another version
+		
+		BString answer;
+		storage.getItems(items, ITEMS_COUNT + 2, GET_ITEMS_MAX_SIZE, answer);
+		const char *pos = answer.c_str();
+		for (TItemKey i = 0; i < ITEMS_COUNT + 2; i++) {
+			const StorageAnswer &itemAnswer = *(StorageAnswer*)pos;
+			pos += sizeof(StorageAnswer);
+			if (i >= ITEMS_COUNT) {
+				BOOST_CHECK(itemAnswer.status == STORAGE_ANSWER_NOT_FOUND);
+				BOOST_CHECK(itemAnswer.size == 0);
+				continue;
+			}
+			BOOST_CHECK(itemAnswer.status == STORAGE_ANSWER_OK);
+			BOOST_REQUIRE(itemAnswer.size == 100 * (i + 1));
+			BOOST_CHECK(memcmp(pos, data.c_str(), itemAnswer.size) == 0);
+			pos += itemAnswer.size;
+		}
+		BOOST_CHECK(pos == (answer.c_str() + answer.size()));
+		
+		// the items, which don't fit in the answer, have to be asked again
+		answer.clear();
+		storage.getItems(items, ITEMS_COUNT, 350, answer);
+		BOOST_REQUIRE(answer.size() == (ITEMS_COUNT * sizeof(StorageAnswer) + 300));
+		pos = answer.c_str();
+		const EStorageAnswerStatus statuses[ITEMS_COUNT] = {STORAGE_ANSWER_OK, STORAGE_ANSWER_OK, STORAGE_ANSWER_ERROR, 
+			STORAGE_ANSWER_ERROR};
+		for (TItemKey i = 0; i < ITEMS_COUNT; i++) {
+			const StorageAnswer &itemAnswer = *(StorageAnswer*)pos;
+			BOOST_CHECK(itemAnswer.status == statuses[i]);
+			pos += sizeof(StorageAnswer) + itemAnswer.size;
+		}
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}		
+}
+
+BOOST_AUTO_TEST_CASE (testSyncDeletes)
+{
+	TestPath testPath("metis_slice");
+	const TRangeID RANGE_ID = 10;
+	BString data;
+	for (int i = 0; i < 1000; i++)
+		data << (char)('a' + i % 20);
+	ItemHeader ih;
+	bzero(&ih, sizeof(ih));
+	ih.rangeID = RANGE_ID;
+	ih.level = 1;
+	ih.timeTag.modTime = 2;
+	ih.size = data.size();
+
+	try
+	{
+		Storage storage(testPath.path(), 0.05, 10000);
+		ih.itemKey = 1;
+		BOOST_REQUIRE(storage.add(data.c_str(), ih));
+		ih.itemKey = 2;
+		BOOST_REQUIRE(storage.add(data.c_str(), ih));
+		
+		// a range check, which has only deletes, has no source storage to connect to
+		TIndexSyncEntryVector syncs;
+		RangeSyncEntry syncEntry;
+		bzero(&syncEntry, sizeof(syncEntry));
+		syncEntry.header = ih;
+		syncEntry.header.size = 0;
+		syncEntry.header.itemKey = 1;
+		syncEntry.header.timeTag.modTime = 3; // the item has been deleted
+		syncs.push_back(syncEntry);
+		syncEntry.header.itemKey = 2;
+		syncEntry.header.timeTag = ih.timeTag;
+		syncEntry.header.timeTag.op++; // the old version is cleaned up
+		syncs.push_back(syncEntry);
+		{
+			SyncThread syncThread(&storage, 2, 1, 64 * 1024);
+			BOOST_REQUIRE(syncThread.add(1, RANGE_ID, syncs));
+			for (int i = 0; (i < 1000) && !syncThread.checkActive(RANGE_ID); i++)
+				usleep(10000);
+			BOOST_REQUIRE(syncThread.checkActive(RANGE_ID));
+		}
+		for (TItemKey itemKey = 1; itemKey <= 2; itemKey++) {
+			ItemInfo itemInfo;
+			BOOST_CHECK(!storage.findAndFill(ItemIndex(RANGE_ID, itemKey), itemInfo) || (itemInfo.size == 0));
+		}
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}		
+}
+
+BOOST_AUTO_TEST_CASE (testItemCompression)
+{
+	TestPath testPath("metis_slice");
+	const TRangeID RANGE_ID = 10;
+	const TItemKey TEXT_KEY = 1;
+	const TItemKey RANDOM_KEY = 2;
+	BString text;
+	for (int i = 0; i < 500; i++)
+		text.sprintfAdd("function f%d() { return document.getElementById('item%d'); }\n", i % 50, i);
+	BString random;
+	for (int i = 0; i < 5000; i++)
+		random << (char)(rand() % 256);
+	ItemHeader ih;
+	bzero(&ih, sizeof(ih));
+	ih.rangeID = RANGE_ID;
+	ih.level = 1;
+	ih.timeTag.modTime = 2;
+	StorageOptions options;
+	options.compressLevel = 6;
+	options.objectCacheSize = 0;
+	
+	GetItemChunkRequest request;
+	request.rangeID = RANGE_ID;
+	request.itemKey = TEXT_KEY;
+	request.seek = 100;
+	request.chunkSize = 200;
+	GetItemInfoAndChunkRequest infoRequest;
+	infoRequest.rangeID = RANGE_ID;
+	infoRequest.itemKey = TEXT_KEY;
+	infoRequest.chunkSize = 65536;
+	infoRequest.ifModifiedSince = 0;
+	infoRequest.flags = GET_ACCEPT_GZIP;
+	try
+	{
+		Storage storage(testPath.path(), 0.05, 10000000, options);
+		ih.itemKey = TEXT_KEY;
+		ih.size = text.size();
+		BOOST_REQUIRE(storage.add(text.c_str(), ih));
+		ih.itemKey = RANDOM_KEY;
+		ih.size = random.size();
+		BOOST_REQUIRE(storage.add(random.c_str(), ih));
+		
+		// the index keeps the original size and checksum
+		ItemInfo itemInfo;
+		BOOST_REQUIRE(storage.findAndFill(ItemIndex(RANGE_ID, TEXT_KEY), itemInfo));
+		BOOST_CHECK(itemInfo.size == text.size());
+		BString items;
+		BOOST_REQUIRE(storage.getRangeItems(allRangeItems(RANGE_ID), items));
+		const RangeItemEntry *itemEntry = (const RangeItemEntry*)(items.c_str() + sizeof(RangeItemsHeader));
+		if (itemEntry->itemKey != TEXT_KEY)
+			itemEntry++;
+		BOOST_CHECK(itemEntry->size == text.size());
+		BOOST_CHECK(itemEntry->crc == crc32c(0, text.c_str(), text.size()));
+		
+		BString chunk;
+		BOOST_REQUIRE(storage.get(request, chunk));
+		BOOST_REQUIRE(chunk.size() == request.chunkSize);
+		BOOST_CHECK(memcmp(chunk.c_str(), text.c_str() + request.seek, request.chunkSize) == 0);
+		TSlicePtr slice;
+		off_t fileSeek = 0;
+		BOOST_REQUIRE(storage.getFileChunk(request, slice, fileSeek));
+		BOOST_CHECK(!slice);
+		
+		// a client, which accepts gzip, gets the stored stream
+		chunk.clear();
+		BOOST_REQUIRE(storage.getInfoAndChunk(infoRequest, itemInfo, chunk));
+		BOOST_CHECK(itemInfo.size == text.size());
+		BOOST_REQUIRE(chunk.size() > sizeof(TItemEncoding));
+		BOOST_CHECK(*(const TItemEncoding*)chunk.c_str() == ITEM_ENCODING_GZIP);
+		BOOST_CHECK(chunk.size() < text.size() / 3);
+		BString uncompressed;
+		BOOST_REQUIRE(gzipUncompress(chunk.c_str() + sizeof(TItemEncoding), chunk.size() - sizeof(TItemEncoding), 
+			text.size(), uncompressed));
+		BOOST_CHECK(memcmp(uncompressed.c_str(), text.c_str(), text.size()) == 0);
+		
+		// the stream doesn't fit in the chunk
+		infoRequest.chunkSize = 100;
+		chunk.clear();
+		BOOST_REQUIRE(storage.getInfoAndChunk(infoRequest, itemInfo, chunk));
+		BOOST_REQUIRE(chunk.size() == sizeof(TItemEncoding) + infoRequest.chunkSize);
+		BOOST_CHECK(*(const TItemEncoding*)chunk.c_str() == ITEM_ENCODING_IDENTITY);
+		BOOST_CHECK(memcmp(chunk.c_str() + sizeof(TItemEncoding), text.c_str(), infoRequest.chunkSize) == 0);
+		infoRequest.chunkSize = 65536;
+		
+		// incompressible data is kept as it is
+		request.itemKey = RANDOM_KEY;
+		BOOST_REQUIRE(storage.getFileChunk(request, slice, fileSeek));
+		BOOST_CHECK(slice);
+		infoRequest.itemKey = RANDOM_KEY;
+		chunk.clear();
+		BOOST_REQUIRE(storage.getInfoAndChunk(infoRequest, itemInfo, chunk));
+		BOOST_REQUIRE(chunk.size() == sizeof(TItemEncoding) + random.size());
+		BOOST_CHECK(*(const TItemEncoding*)chunk.c_str() == ITEM_ENCODING_IDENTITY);
+		infoRequest.itemKey = TEXT_KEY;
+		request.itemKey = TEXT_KEY;
+		
+		uint32_t corruptedItems = 0;
+		BOOST_REQUIRE(storage.scrub(0, corruptedItems));
+		BOOST_CHECK(corruptedItems == 0);
+		
+		BString indexFile;
+		indexFile.sprintfSet("%s/index/0", testPath.path());
+		BOOST_REQUIRE(unlink(indexFile.c_str()) == 0);
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+	
+	// the original size of a compressed item is restored by an index rebuild from the gzip stream
+	try
+	{
+		Storage storage(testPath.path(), 0.05, 10000000, options);
+		ItemInfo itemInfo;
+		BOOST_REQUIRE(storage.findAndFill(ItemIndex(RANGE_ID, TEXT_KEY), itemInfo));
+		BOOST_CHECK(itemInfo.size == text.size());
+		BString chunk;
+		BOOST_REQUIRE(storage.get(request, chunk));
+		BOOST_CHECK(memcmp(chunk.c_str(), text.c_str() + request.seek, request.chunkSize) == 0);
+		
+		// the same version without gzip support
+		infoRequest.flags = 0;
+		chunk.clear();
+		BOOST_REQUIRE(storage.getInfoAndChunk(infoRequest, itemInfo, chunk));
+		BOOST_REQUIRE(chunk.size() == text.size());
+		BOOST_CHECK(memcmp(chunk.c_str(), text.c_str(), text.size()) == 0);
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+}
+
+BOOST_AUTO_TEST_CASE (testObjectCache)
+{
+	TestPath testPath("metis_slice");
+	const TRangeID RANGE_ID = 10;
+	BString data;
+	for (int i = 0; i < 1024; i++)
+		data << (char)('a' + i % 20);
+	ItemHeader ih;
+	bzero(&ih, sizeof(ih));
+	ih.rangeID = RANGE_ID;
+	ih.level = 1;
+	ih.itemKey = 1;
+	ih.timeTag.modTime = 2;
+	ih.size = data.size();
+	StorageOptions options;
+	options.objectCacheMinHits = 2;
+
+	try
+	{
+		Storage storage(testPath.path(), 0.05, 10000, options);
+		BOOST_REQUIRE(storage.add(data.c_str(), ih));
+		
+		GetItemChunkRequest request;
+		request.rangeID = RANGE_ID;
+		request.itemKey = 1;
+		request.seek = 100;
+		request.chunkSize = 500;
+		for (int i = 0; i < 3; i++) { // the object is admitted on the second miss
+			BString chunk;
+			BOOST_REQUIRE(storage.get(request, chunk));
+			BOOST_REQUIRE(chunk.size() == request.chunkSize);
+			BOOST_CHECK(memcmp(chunk.c_str(), data.c_str() + request.seek, request.chunkSize) == 0);
+		}
+		ObjectCacheStats stats;
+		BOOST_REQUIRE(storage.getObjectCacheStats(stats));
+		BOOST_CHECK(stats.hits == 1);
+		BOOST_CHECK(stats.misses == 2);
+		BOOST_CHECK(stats.items == 1);
+		
+		// a new version of the object isn't served from the cache
+		data.clear();
+		for (int i = 0; i < 1024; i++)
+			data << (char)('A' + i % 20);
+		ih.timeTag.modTime = 3;
+		BOOST_REQUIRE(storage.add(data.c_str(), ih));
+		BString chunk;
+		BOOST_REQUIRE(storage.get(request, chunk));
+		BOOST_CHECK(memcmp(chunk.c_str(), data.c_str() + request.seek, request.chunkSize) == 0);
+		
+		ih.timeTag.modTime = 4;
+		BOOST_REQUIRE(storage.remove(ih));
+		chunk.clear();
+		BOOST_CHECK(!storage.get(request, chunk));
+		BOOST_REQUIRE(storage.getObjectCacheStats(stats));
+		BOOST_CHECK(stats.items == 0);
+		BOOST_CHECK(stats.usedMemory == 0);
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}		
+}
+
+BOOST_AUTO_TEST_CASE (testDirectPut)
+{
+	TestPath testPath("metis_slice");
+	BString levelPath;
+	levelPath.sprintfSet("%s/1", testPath.path());
+	Directory::makeDirRecursive(levelPath.c_str());
+	const TRangeID RANGE_ID = 10;
+	BString data;
+	for (int i = 0; i < 1024; i++)
+		data << (char)('0' + i % 20);
+	IndexEntry ie;
+	ItemHeader &ih = ie.header;
+	ih.status = 0;
+	ih.rangeID = RANGE_ID;
+	ih.level = 1;
+	ih.subLevel = 1;
+	ih.itemKey = 1;
+	ih.timeTag.modTime = 2;
+	ih.timeTag.op = 2;
+	ih.size = data.size();
+	try
+	{
+		Storage storage(levelPath.c_str(), 0.05, 100000);
+		TSlicePtr slice;
+		BOOST_REQUIRE(storage.reserve(ie, slice));
+		
+		IndexEntry abortedEntry = ie;
+		abortedEntry.header.itemKey = 2;
+		TSlicePtr abortedSlice;
+		BOOST_REQUIRE(storage.reserve(abortedEntry, abortedSlice));
+		BOOST_REQUIRE(storage.writeReserved(abortedSlice, abortedEntry, 0, data.c_str(), 100));
+		
+		BOOST_REQUIRE(storage.writeReserved(slice, ie, 0, data.c_str(), 500));
+		BOOST_REQUIRE(storage.writeReserved(slice, ie, 500, data.c_str() + 500, data.size() - 500));
+		BOOST_REQUIRE(storage.commitReserved(slice, ie));
+		
+		ih.itemKey = 3;
+		BOOST_REQUIRE(storage.add(data.c_str(), ih));
+		
+		GetItemChunkRequest request;
+		request.rangeID = RANGE_ID;
+		request.itemKey = 1;
+		request.seek = 0;
+		request.chunkSize = data.size();
+		BString chunk;
+		BOOST_REQUIRE(storage.get(request, chunk));
+		BOOST_REQUIRE(chunk.size() == data.size());
+		BOOST_CHECK(memcmp(chunk.c_str(), data.c_str(), data.size()) == 0);
+		request.itemKey = 2;
+		BOOST_CHECK(!storage.get(request, chunk));
+		storage.abortReserved(abortedSlice, abortedEntry);
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+	
+	try
+	{
+		SliceManager sliceManager(levelPath.c_str(), 0.05, 100000);
+		Index index;
+		BOOST_REQUIRE(sliceManager.loadIndex(index));
+		Range::Entry entry;
+		BOOST_CHECK(index.find(RANGE_ID, 1, entry) == true);
+		BOOST_CHECK(index.find(RANGE_ID, 2, entry) == false);
+		BOOST_CHECK(index.find(RANGE_ID, 3, entry) == true);
+		
+		BString indexFile;
+		indexFile.sprintfSet("%s/index/%u", levelPath.c_str(), entry.pointer.sliceID);
+		BOOST_REQUIRE(unlink(indexFile.c_str()) == 0);
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+	
+	try
+	{
+		SliceManager sliceManager(levelPath.c_str(), 0.05, 100000);
+		Index index;
+		BOOST_REQUIRE(sliceManager.loadIndex(index));
+		Range::Entry entry;
+		BOOST_CHECK(index.find(RANGE_ID, 2, entry) == false);
+		BOOST_CHECK(index.find(RANGE_ID, 3, entry) == true);
+		BOOST_REQUIRE(index.find(RANGE_ID, 1, entry) == true);
+		BOOST_CHECK(entry.crc == crc32c(0, data.c_str(), data.size()));
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+}
+
+BOOST_AUTO_TEST_CASE (testGroupCommit)
+{
+	TestPath testPath("metis_slice");
+	const TRangeID RANGE_ID = 10;
+	const int THREADS_COUNT = 8;
+	const int ITEMS_PER_THREAD = 200;
+	StorageOptions options;
+	options.fsyncPolicy = FSYNC_BATCH;
+	options.writeSlices = 4;
+	try
+	{
+		Storage storage(testPath.path(), 0.05, 10000000, options);
+		std::vector<std::thread> threads;
+		for (int t = 0; t < THREADS_COUNT; t++) {
+			threads.push_back(std::thread([&storage, t]() {
+				for (int i = 0; i < ITEMS_PER_THREAD; i++) {
+					TItemKey itemKey = t * ITEMS_PER_THREAD + i + 1;
+					std::string data(itemKey % 100 + 1, (char)('a' + itemKey % 26));
+					ItemHeader ih;
+					ih.status = 0;
+					ih.rangeID = RANGE_ID;
+					ih.level = 1;
+					ih.subLevel = 1;
+					ih.itemKey = itemKey;
+					ih.timeTag.modTime = 2;
+					ih.timeTag.op = 2;
+					ih.size = data.size();
+					BOOST_REQUIRE(storage.add(data.c_str(), ih));
+				}
+			}));
+		}
+		for (auto thread = threads.begin(); thread != threads.end(); thread++)
+			thread->join();
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+	
+	try
+	{
+		Storage storage(testPath.path(), 0.05, 10000000);
+		for (TItemKey itemKey = 1; itemKey <= THREADS_COUNT * ITEMS_PER_THREAD; itemKey++) {
+			std::string data(itemKey % 100 + 1, (char)('a' + itemKey % 26));
+			GetItemChunkRequest request;
+			request.rangeID = RANGE_ID;
+			request.itemKey = itemKey;
+			request.seek = 0;
+			request.chunkSize = data.size();
+			BString chunk;
+			BOOST_REQUIRE(storage.get(request, chunk));
+			BOOST_REQUIRE(chunk.size() == data.size());
+			BOOST_REQUIRE(memcmp(chunk.c_str(), data.c_str(), data.size()) == 0);
+		}
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+}
+
+BOOST_AUTO_TEST_CASE (testMultipleWriteSlices)
+{
+	TestPath testPath("metis_slice");
+	StorageOptions options;
+	options.writeSlices = 3;
+	try
+	{
+		SliceManager sliceManager(testPath.path(), 0.05, 10000, options);
+		IndexEntry ie;
+		ItemHeader &ih = ie.header;
+		std::string testData("test");
+		ih.status = 0;
+		ih.level = 1;
+		ih.rangeID = 1;
+		ih.size = testData.size();
+		std::vector<TSliceID> sliceIDs;
+		for (int i = 0; i < 6; i++) {
+			ih.itemKey = i + 1;
+			BOOST_REQUIRE(sliceManager.add(testData.c_str(), ie));
+			sliceIDs.push_back(ie.pointer.sliceID);
+		}
+		BOOST_CHECK(testPath.countFiles("data") == 3);
+		BOOST_CHECK(sliceIDs[0] != sliceIDs[1]);
+		BOOST_CHECK(sliceIDs[1] != sliceIDs[2]);
+		BOOST_CHECK(sliceIDs[0] == sliceIDs[3]);
+		
+		Index index;
+		BOOST_REQUIRE(sliceManager.loadIndex(index));
+		Range::Entry entry;
+		for (TItemKey itemKey = 1; itemKey <= 6; itemKey++)
+			BOOST_CHECK(index.find(1, itemKey, entry));
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+}
+
+BOOST_AUTO_TEST_CASE (testWriteShards)
+{
+	TestPath testPath("metis_slice");
+	StorageOptions options;
+	options.writeSlices = 3;
+	try
+	{
+		SliceManager sliceManager(testPath.path(), 0.05, 10000, options);
+		std::string testData("test");
+		std::vector<TSliceID> sliceIDs(options.writeSlices * 2);
+		std::vector<std::thread> threads;
+		for (size_t shard = 0; shard < sliceIDs.size(); shard++) {
+			threads.push_back(std::thread([&, shard]() {
+				SliceManager::setWriteShard(shard);
+				IndexEntry ie;
+				bzero(&ie, sizeof(ie));
+				ie.header.rangeID = 1;
+				ie.header.size = testData.size();
+				for (TItemKey i = 0; i < 10; i++) {
+					ie.header.itemKey = shard * 100 + i;
+					BOOST_REQUIRE(sliceManager.add(testData.c_str(), ie));
+					if (i == 0)
+						sliceIDs[shard] = ie.pointer.sliceID;
+					else
+						BOOST_CHECK(sliceIDs[shard] == ie.pointer.sliceID); // a shard sticks to its write slice
+				}
+			}));
+		}
+		for (auto thread = threads.begin(); thread != threads.end(); thread++)
+			thread->join();
+		BOOST_CHECK((size_t)testPath.countFiles("data") == options.writeSlices);
+		BOOST_CHECK(sliceIDs[0] != sliceIDs[1]);
+		BOOST_CHECK(sliceIDs[1] != sliceIDs[2]);
+		BOOST_CHECK(sliceIDs[0] == sliceIDs[options.writeSlices]);
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+}
+
+BOOST_AUTO_TEST_CASE (testSeveralDataPaths)
+{
+	TestPath testPath("metis_slice");
+	BString firstPath;
+	firstPath.sprintfSet("%s/1", testPath.path());
+	Directory::makeDirRecursive(firstPath.c_str());
+	BString secondPath;
+	secondPath.sprintfSet("%s/2", testPath.path());
+	Directory::makeDirRecursive(secondPath.c_str());
+	BString dataPaths;
+	dataPaths.sprintfSet("%s,%s", firstPath.c_str(), secondPath.c_str());
+	
+	StorageOptions options;
+	options.writeSlices = 2;
+	std::string testData("test");
+	IndexEntry ie;
+	ItemHeader &ih = ie.header;
+	ih.status = 0;
+	ih.level = 1;
+	ih.rangeID = 1;
+	ih.size = testData.size();
+	try
+	{
+		SliceManager sliceManager(dataPaths.c_str(), 0.05, 10000, options);
+		for (int i = 0; i < 4; i++) {
+			ih.itemKey = i + 1;
+			BOOST_REQUIRE(sliceManager.add(testData.c_str(), ie));
+		}
+		BOOST_CHECK(testPath.countFiles("1/data") == 1);
+		BOOST_CHECK(testPath.countFiles("2/data") == 1);
+		StoragePingAnswer pingAnswer;
+		BOOST_REQUIRE(sliceManager.ping(pingAnswer));
+		BOOST_CHECK(pingAnswer.leftSpace > 0);
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+	
+	try
+	{
+		SliceManager sliceManager(dataPaths.c_str(), 0.05, 10000, options);
+		Index index;
+		BOOST_REQUIRE(sliceManager.loadIndex(index));
+		Range::Entry entry;
+		for (TItemKey itemKey = 1; itemKey <= 4; itemKey++) {
+			BOOST_REQUIRE(index.find(1, itemKey, entry));
+			BString data;
+			BOOST_REQUIRE(sliceManager.get(data, entry.pointer, 0, entry.size));
+			BOOST_CHECK(testData == data.c_str());
+		}
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+}
+
+BOOST_AUTO_TEST_CASE (testCompaction)
+{
+	TestPath testPath("metis_slice");
+	BString levelPath;
+	levelPath.sprintfSet("%s/1", testPath.path());
+	Directory::makeDirRecursive(levelPath.c_str());
+	const TRangeID RANGE_ID = 10;
+	const TItemKey ITEMS_COUNT = 20;
+	const TItemKey REMOVED_ITEM = 3;
+	BString data;
+	for (int i = 0; i < 100; i++)
+		data << (char)('a' + i % 20);
+	ItemHeader ih;
+	ih.status = 0;
+	ih.rangeID = RANGE_ID;
+	ih.level = 1;
+	ih.subLevel = 1;
+	ih.timeTag.modTime = 1;
+	ih.timeTag.op = 1;
+	ih.size = data.size();
+	TSliceID firstSliceID = 0;
+	try
+	{
+		Storage storage(levelPath.c_str(), 0.05, 1000);
+		for (TItemKey itemKey = 1; itemKey <= ITEMS_COUNT; itemKey++) {
+			ih.itemKey = itemKey;
+			BOOST_REQUIRE(storage.add(data.c_str(), ih));
+		}
+		BOOST_CHECK(!storage.compact(0.3, 0, 0));
+		
+		ItemIndex itemIndex;
+		itemIndex.rangeID = RANGE_ID;
+		itemIndex.itemKey = 1;
+		ItemInfo itemInfo;
+		BOOST_REQUIRE(storage.findAndFill(itemIndex, itemInfo));
+		
+		// overwrite most of the items of the first slice and remove one of them
+		ih.timeTag.modTime = 2;
+		data.sprintfSet("%s", "updated");
+		ih.size = data.size();
+		for (TItemKey itemKey = 1; itemKey <= 6; itemKey++) {
+			if (itemKey == REMOVED_ITEM)
+				continue;
+			ih.itemKey = itemKey;
+			BOOST_REQUIRE(storage.add(data.c_str(), ih));
+		}
+		ih.itemKey = REMOVED_ITEM;
+		BOOST_REQUIRE(storage.remove(ih));
+		
+		GetItemChunkRequest request;
+		request.rangeID = RANGE_ID;
+		request.itemKey = 8;
+		request.seek = 0;
+		request.chunkSize = 100;
+		BString chunk;
+		BOOST_REQUIRE(storage.get(request, chunk));
+		
+		BOOST_REQUIRE(storage.compact(0.3, 0, 0));
+		BOOST_CHECK(!storage.compact(0.3, 0, 0));
+		
+		BString chunkAfter;
+		BOOST_REQUIRE(storage.get(request, chunkAfter));
+		BOOST_REQUIRE(chunkAfter.size() == chunk.size());
+		BOOST_CHECK(memcmp(chunk.c_str(), chunkAfter.c_str(), chunk.size()) == 0);
+		request.itemKey = REMOVED_ITEM;
+		BOOST_CHECK(!storage.get(request, chunkAfter));
+		
+		BString dataFile;
+		dataFile.sprintfSet("%s/data/%u", levelPath.c_str(), firstSliceID);
+		BOOST_CHECK(access(dataFile.c_str(), F_OK) != 0);
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+	
+	try
+	{
+		Storage storage(levelPath.c_str(), 0.05, 1000);
+		GetItemChunkRequest request;
+		request.rangeID = RANGE_ID;
+		request.seek = 0;
+		request.chunkSize = data.size();
+		for (TItemKey itemKey = 1; itemKey <= 6; itemKey++) {
+			request.itemKey = itemKey;
+			BString chunk;
+			if (itemKey == REMOVED_ITEM) {
+				BOOST_CHECK(!storage.get(request, chunk));
+				continue;
+			}
+			BOOST_REQUIRE(storage.get(request, chunk));
+			BOOST_REQUIRE(chunk.size() == data.size());
+			BOOST_CHECK(memcmp(chunk.c_str(), data.c_str(), data.size()) == 0);
+		}
+		request.chunkSize = 100;
+		for (TItemKey itemKey = 7; itemKey <= ITEMS_COUNT; itemKey++) {
+			request.itemKey = itemKey;
+			BString chunk;
+			BOOST_CHECK(storage.get(request, chunk));
+		}
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+}
+
+BOOST_AUTO_TEST_CASE (testPunchHole)
+{
+	TestPath testPath("metis_slice");
+	BString levelPath;
+	levelPath.sprintfSet("%s/1", testPath.path());
+	Directory::makeDirRecursive(levelPath.c_str());
+	StorageOptions options;
+	options.punchHoleMinSize = 16 * 1024;
+	BString data;
+	for (int i = 0; i < 256 * 1024; i++)
+		data << (char)('a' + i % 20);
+	IndexEntry ie;
+	ItemHeader &ih = ie.header;
+	ih.status = 0;
+	ih.rangeID = 1;
+	ih.level = 1;
+	ih.subLevel = 1;
+	ih.itemKey = 1;
+	ih.timeTag.modTime = 1;
+	ih.timeTag.op = 1;
+	ih.size = data.size();
+	try
+	{
+		SliceManager sliceManager(levelPath.c_str(), 0.05, 1000000, options);
+		BOOST_REQUIRE(sliceManager.add(data.c_str(), ie));
+		BString dataFile;
+		dataFile.sprintfSet("%s/data/%u", levelPath.c_str(), ie.pointer.sliceID);
+		struct stat fileStat;
+		BOOST_REQUIRE(stat(dataFile.c_str(), &fileStat) == 0);
+		auto allocatedBlocks = fileStat.st_blocks;
+		auto fileSize = fileStat.st_size;
+		StoragePingAnswer pingBefore;
+		BOOST_REQUIRE(sliceManager.ping(pingBefore));
+		
+		// a pinned read of the slice holds the hole back
+		TSlicePtr readSlice;
+		off_t fileSeek;
+		BOOST_REQUIRE(sliceManager.getFileChunk(ie.pointer, 0, data.size(), readSlice, fileSeek));
+		TItemSize holeSize = 0;
+		BOOST_REQUIRE(sliceManager.remove(ih, ie.pointer, holeSize));
+		BOOST_CHECK(holeSize == data.size());
+		sliceManager.punchHole(ie.pointer, holeSize);
+		Epoch::reclaim();
+		BOOST_REQUIRE(stat(dataFile.c_str(), &fileStat) == 0);
+		BOOST_CHECK(fileStat.st_blocks == allocatedBlocks);
+		BString readData;
+		readData.reserveBuffer(data.size());
+		BOOST_REQUIRE(pread(readSlice->dataDescr(), (char*)readData.c_str(), data.size(), fileSeek) 
+			== (ssize_t)data.size());
+		BOOST_CHECK(memcmp(readData.c_str(), data.c_str(), data.size()) == 0);
+		readSlice.reset();
+		
+		BOOST_REQUIRE(stat(dataFile.c_str(), &fileStat) == 0);
+		BOOST_CHECK(fileStat.st_size == fileSize);
+		BOOST_CHECK((allocatedBlocks - fileStat.st_blocks) * 512 >= (decltype(allocatedBlocks))data.size() - 8192);
+		StoragePingAnswer pingAfter;
+		BOOST_REQUIRE(sliceManager.ping(pingAfter));
+		BOOST_CHECK(pingAfter.leftSpace >= pingBefore.leftSpace + data.size() - 8192);
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+	
+	try
+	{
+		SliceManager sliceManager(levelPath.c_str(), 0.05, 1000000, options);
+		Index index;
+		BOOST_REQUIRE(sliceManager.loadIndex(index));
+		Range::Entry entry;
+		BOOST_REQUIRE(index.find(1, 1, entry));
+		BOOST_CHECK(entry.size == 0);
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+}
+
+BOOST_AUTO_TEST_CASE (testParallelIndexLoad)
+{
+	TestPath testPath("metis_slice");
+	BString levelPath;
+	levelPath.sprintfSet("%s/1", testPath.path());
+	Directory::makeDirRecursive(levelPath.c_str());
+	const TRangeID RANGES_COUNT = 5;
+	const TItemKey ITEMS_COUNT = 100;
+	StorageOptions options;
+	options.writeSlices = 3;
+	std::string testData("parallel");
+	IndexEntry ie;
+	ItemHeader &ih = ie.header;
+	ih.status = 0;
+	ih.level = 1;
+	ih.subLevel = 1;
+	ih.size = testData.size();
+	try
+	{
+		SliceManager sliceManager(levelPath.c_str(), 0.05, 1000, options);
+		for (int version = 1; version <= 3; version++) {
+			ih.timeTag.modTime = version;
+			ih.timeTag.op = 1;
+			for (TRangeID rangeID = 1; rangeID <= RANGES_COUNT; rangeID++) {
+				ih.rangeID = rangeID;
+				for (TItemKey itemKey = 1; itemKey <= ITEMS_COUNT; itemKey++) {
+					if ((version == 3) && (itemKey % 2)) // odd items keep the second version
+						continue;
+					ih.itemKey = itemKey;
+					BOOST_REQUIRE(sliceManager.add(testData.c_str(), ie));
+				}
+			}
+		}
+		ih.timeTag.modTime = 4;
+		ih.rangeID = 1;
+		ih.itemKey = 10;
+		Index index;
+		BOOST_REQUIRE(sliceManager.loadIndex(index));
+		Range::Entry entry;
+		BOOST_REQUIRE(index.find(1, 10, entry));
+		TItemSize holeSize;
+		BOOST_REQUIRE(sliceManager.remove(ih, entry.pointer, holeSize));
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+	
+	for (size_t threadsCount = 1; threadsCount <= 4; threadsCount += 3) {
+		try
+		{
+			options.indexLoadThreads = threadsCount;
+			SliceManager sliceManager(levelPath.c_str(), 0.05, 1000, options);
+			Index index;
+			BOOST_REQUIRE(sliceManager.loadIndex(index));
+			for (TRangeID rangeID = 1; rangeID <= RANGES_COUNT; rangeID++) {
+				for (TItemKey itemKey = 1; itemKey <= ITEMS_COUNT; itemKey++) {
+					Range::Entry entry;
+					BOOST_REQUIRE(index.find(rangeID, itemKey, entry));
+					if ((rangeID == 1) && (itemKey == 10)) {
+						BOOST_CHECK(entry.size == 0);
+						continue;
+					}
+					BOOST_CHECK(entry.size == testData.size());
+					BOOST_CHECK(entry.timeTag.modTime == ((itemKey % 2) ? 2U : 3U));
+					BString data;
+					BOOST_REQUIRE(sliceManager.get(data, entry.pointer, 0, entry.size));
+					BOOST_CHECK(testData == data.c_str());
+				}
+			}
+		}
+		catch (...)
+		{
+			BOOST_CHECK_NO_THROW(throw);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE (testIndexCheckpoint)
+{
+	TestPath testPath("metis_slice");
+	BString levelPath;
+	levelPath.sprintfSet("%s/1", testPath.path());
+	Directory::makeDirRecursive(levelPath.c_str());
+	const TRangeID RANGE_ID = 7;
+	std::string testData("checkpoint");
+	ItemHeader ih;
+	ih.status = 0;
+	ih.rangeID = RANGE_ID;
+	ih.level = 1;
+	ih.subLevel = 1;
+	ih.timeTag.modTime = 1;
+	ih.timeTag.op = 1;
+	ih.size = testData.size();
+	BString indexFile;
+	indexFile.sprintfSet("%s/index/0", levelPath.c_str());
+	struct stat fileStat;
+	try
+	{
+		Storage storage(levelPath.c_str(), 0.05, 1000000);
+		for (TItemKey itemKey = 1; itemKey <= 50; itemKey++) {
+			ih.itemKey = itemKey;
+			BOOST_REQUIRE(storage.add(testData.c_str(), ih));
+		}
+		BOOST_REQUIRE(storage.checkpoint());
+		BOOST_REQUIRE(stat(indexFile.c_str(), &fileStat) == 0);
+		
+		ih.timeTag.modTime = 2;
+		for (TItemKey itemKey = 1; itemKey <= 60; itemKey++) {
+			if ((itemKey > 10) && (itemKey <= 50))
+				continue;
+			ih.itemKey = itemKey;
+			BOOST_REQUIRE(storage.add(testData.c_str(), ih));
+		}
+		ih.itemKey = 20;
+		BOOST_REQUIRE(storage.remove(ih));
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+	
+	// spoil the checkpointed head of the slice index after its header (version, sliceID, generation), 
+	// it mustn't be read anymore
+	static const size_t INDEX_HEADER_SIZE = sizeof(uint8_t) + sizeof(TSliceID) + sizeof(uint64_t);
+	File fd;
+	BOOST_REQUIRE(fd.open(indexFile.c_str(), O_RDWR));
+	std::vector<char> zeros(fileStat.st_size, 0);
+	BOOST_REQUIRE(fd.pwrite(zeros.data(), zeros.size() - INDEX_HEADER_SIZE, INDEX_HEADER_SIZE) 
+		== (ssize_t)(zeros.size() - INDEX_HEADER_SIZE));
+	fd.close();
+	
+	for (int pass = 0; pass < 2; pass++) {
+		try
+		{
+			Storage storage(levelPath.c_str(), 0.05, 1000000);
+			ItemIndex itemIndex;
+			itemIndex.rangeID = RANGE_ID;
+			ItemInfo itemInfo;
+			for (TItemKey itemKey = 1; itemKey <= 60; itemKey++) {
+				itemIndex.itemKey = itemKey;
+				BOOST_REQUIRE(storage.findAndFill(itemIndex, itemInfo));
+				if (itemKey == 20) {
+					BOOST_CHECK(itemInfo.size == 0);
+					continue;
+				}
+				BOOST_CHECK(itemInfo.size == testData.size());
+				BOOST_CHECK(itemInfo.timeTag.modTime == (((itemKey <= 10) || (itemKey > 50)) ? 2U : 1U));
+			}
+			itemIndex.rangeID = 0;
+			itemIndex.itemKey = 0;
+			BOOST_CHECK(!storage.findAndFill(itemIndex, itemInfo));
+			BOOST_REQUIRE(storage.checkpoint());
+		}
+		catch (...)
+		{
+			BOOST_CHECK_NO_THROW(throw);
+		}
+	}
+}
+
 BOOST_AUTO_TEST_SUITE_END()
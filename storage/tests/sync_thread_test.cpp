@@ -0,0 +1,308 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2014 Final Level
+// Author: Denys Misko <gdraal@gmail.com>
+// Distributed under BSD (3-Clause) License (See
+// accompanying file LICENSE)
+//
+// Description: Storage synchronization threads unit tests
+///////////////////////////////////////////////////////////////////////////////
+
+#include <boost/test/unit_test.hpp>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <strings.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "test_path.hpp"
+#include "storage.hpp"
+#include "sync_thread.hpp"
+
+using namespace fl::metis;
+using fl::tests::TestPath;
+using fl::network::Socket;
+
+BOOST_AUTO_TEST_SUITE( metis )
+
+// A source storage of syncs, which answers GET_ITEMS and GET_ITEM_CHUNK requests from its storage
+class TestSyncSource
+{
+public:
+	TestSyncSource(Storage *storage)
+		: isPaused(false), itemsRequests(0), chunkRequests(0), maxChunkSize(0), maxActive(0), _storage(storage),
+		_active(0), _port(0)
+	{
+		_listenFd = socket(AF_INET, SOCK_STREAM, 0);
+		BOOST_REQUIRE(_listenFd >= 0);
+		struct sockaddr_in addr;
+		bzero(&addr, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = Socket::ip2Long("127.0.0.1");
+		addr.sin_port = 0;
+		BOOST_REQUIRE(bind(_listenFd, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+		BOOST_REQUIRE(listen(_listenFd, 16) == 0);
+		socklen_t addrLen = sizeof(addr);
+		BOOST_REQUIRE(getsockname(_listenFd, (struct sockaddr*)&addr, &addrLen) == 0);
+		_port = ntohs(addr.sin_port);
+		_acceptThread = std::thread(&TestSyncSource::_accept, this);
+	}
+	~TestSyncSource()
+	{
+		isPaused = false;
+		shutdown(_listenFd, SHUT_RDWR);
+		_acceptThread.join();
+		close(_listenFd);
+		for (auto thread = _connections.begin(); thread != _connections.end(); thread++)
+			thread->join();
+	}
+	uint32_t port() const
+	{
+		return _port;
+	}
+	std::atomic<bool> isPaused;
+	std::atomic<size_t> itemsRequests;
+	std::atomic<size_t> chunkRequests;
+	std::atomic<TItemSize> maxChunkSize;
+	std::atomic<size_t> maxActive; // the maximum number of requests served at the same time
+private:
+	static bool _recvAll(const int fd, void *data, size_t size)
+	{
+		char *pos = (char*)data;
+		while (size > 0) {
+			ssize_t res = recv(fd, pos, size, 0);
+			if (res <= 0)
+				return false;
+			pos += res;
+			size -= res;
+		}
+		return true;
+	}
+	void _accept()
+	{
+		int fd;
+		while ((fd = accept(_listenFd, NULL, NULL)) >= 0) {
+			std::lock_guard<std::mutex> autoSync(_sync);
+			_connections.push_back(std::thread(&TestSyncSource::_serve, this, fd));
+		}
+	}
+	void _serve(const int fd)
+	{
+		StorageCmd cmd;
+		BString request;
+		BString answer;
+		while (_recvAll(fd, &cmd, sizeof(cmd)) && _recvAll(fd, request.reserveBuffer(cmd.size), cmd.size)) {
+			const size_t active = ++_active;
+			size_t curMaxActive = maxActive;
+			while ((active > curMaxActive) && !maxActive.compare_exchange_weak(curMaxActive, active))
+				;
+			while (isPaused)
+				usleep(1000);
+			usleep(1000); // the requests of other workers have time to come
+
+			answer.clear();
+			answer.reserveBuffer(sizeof(StorageAnswer));
+			StorageAnswer sa;
+			sa.status = STORAGE_ANSWER_OK;
+			if (cmd.cmd == STORAGE_GET_ITEMS) {
+				itemsRequests++;
+				_storage->getItems((const GetItemsEntry*)request.c_str(), cmd.size / sizeof(GetItemsEntry),
+					GET_ITEMS_MAX_SIZE, answer);
+			} else if (cmd.cmd == STORAGE_GET_ITEM_CHUNK) {
+				chunkRequests++;
+				const GetItemChunkRequest &chunkRequest = *(const GetItemChunkRequest*)request.c_str();
+				TItemSize curMaxChunkSize = maxChunkSize;
+				while ((chunkRequest.chunkSize > curMaxChunkSize) 
+					&& !maxChunkSize.compare_exchange_weak(curMaxChunkSize, chunkRequest.chunkSize))
+					;
+				if (!_storage->get(chunkRequest, answer))
+					sa.status = STORAGE_ANSWER_NOT_FOUND;
+			} else {
+				sa.status = STORAGE_ANSWER_ERROR;
+			}
+			sa.size = answer.size() - sizeof(StorageAnswer);
+			memcpy((char*)answer.c_str(), &sa, sizeof(sa));
+			request.clear();
+			_active--; // before the answer, so the next request of the same worker can't overlap with this one
+			if (send(fd, answer.c_str(), answer.size(), MSG_NOSIGNAL) != (ssize_t)answer.size())
+				break;
+		}
+		close(fd);
+	}
+	Storage *_storage;
+	std::atomic<size_t> _active;
+	uint32_t _port;
+	int _listenFd;
+	std::thread _acceptThread;
+	std::mutex _sync;
+	std::vector<std::thread> _connections;
+};
+
+static void addSync(TIndexSyncEntryVector &syncs, const ItemHeader &ih, const TServerID fromServer,
+	const TestSyncSource &source)
+{
+	RangeSyncEntry syncEntry;
+	bzero(&syncEntry, sizeof(syncEntry));
+	syncEntry.header = ih;
+	syncEntry.fromServer = fromServer;
+	syncEntry.ip = Socket::ip2Long("127.0.0.1");
+	syncEntry.port = source.port();
+	syncs.push_back(syncEntry);
+}
+
+static bool waitSync(SyncThread &syncThread, const TRangeID rangeID)
+{
+	for (int i = 0; (i < 1000) && !syncThread.checkActive(rangeID); i++)
+		usleep(10000);
+	return syncThread.checkActive(rangeID);
+}
+
+static bool checkItem(Storage &storage, const ItemHeader &ih, const BString &data)
+{
+	GetItemChunkRequest request;
+	request.rangeID = ih.rangeID;
+	request.itemKey = ih.itemKey;
+	request.seek = 0;
+	request.chunkSize = ih.size;
+	BString chunk;
+	if (!storage.get(request, chunk))
+		return false;
+	return (chunk.size() == data.size()) && (memcmp(chunk.c_str(), data.c_str(), data.size()) == 0);
+}
+
+BOOST_AUTO_TEST_CASE (testSyncThreadPool)
+{
+	TestPath sourcePath("metis_sync_source");
+	TestPath testPath("metis_sync");
+	const TRangeID RANGES_COUNT = 4;
+	const TItemKey ITEMS_COUNT = 100;
+	const TServerID FIRST_SERVER = 1;
+	const TServerID SECOND_SERVER = 2;
+	BString data;
+	for (int i = 0; i < 1000; i++)
+		data << (char)('a' + i % 20);
+	ItemHeader ih;
+	bzero(&ih, sizeof(ih));
+	ih.level = 1;
+	ih.timeTag.modTime = 2;
+	ih.size = data.size();
+
+	try
+	{
+		Storage sourceStorage(sourcePath.path(), 0.05, 10000000);
+		Storage storage(testPath.path(), 0.05, 10000000);
+		std::vector<TIndexSyncEntryVector> rangeSyncs(RANGES_COUNT);
+		{
+			TestSyncSource first(&sourceStorage);
+			TestSyncSource second(&sourceStorage);
+			for (TRangeID rangeID = 1; rangeID <= RANGES_COUNT; rangeID++) {
+				ih.rangeID = rangeID;
+				for (ih.itemKey = 1; ih.itemKey <= ITEMS_COUNT; ih.itemKey++) {
+					BOOST_REQUIRE(sourceStorage.add(data.c_str(), ih));
+					// the syncs of a range are split between the sources
+					addSync(rangeSyncs[rangeID - 1], ih, (ih.itemKey % 2) ? FIRST_SERVER : SECOND_SERVER,
+						(ih.itemKey % 2) ? first : second);
+				}
+			}
+
+			SyncThread syncThread(&storage, 4, 1, 64 * 1024);
+			first.isPaused = true;
+			second.isPaused = true;
+			for (TRangeID rangeID = 1; rangeID <= RANGES_COUNT; rangeID++) {
+				BOOST_REQUIRE(syncThread.add(1, rangeID, rangeSyncs[rangeID - 1]));
+				BOOST_CHECK(rangeSyncs[rangeID - 1].empty());
+			}
+			// a range can't have two syncs at the same time
+			BOOST_CHECK(!syncThread.checkActive(1));
+			TIndexSyncEntryVector syncs;
+			addSync(syncs, ih, FIRST_SERVER, first);
+			BOOST_CHECK(!syncThread.add(1, 1, syncs));
+
+			first.isPaused = false;
+			second.isPaused = false;
+			for (TRangeID rangeID = 1; rangeID <= RANGES_COUNT; rangeID++)
+				BOOST_REQUIRE(waitSync(syncThread, rangeID));
+
+			// small items come by batches and no more than threadsPerServer workers load a source
+			BOOST_CHECK(first.itemsRequests == RANGES_COUNT);
+			BOOST_CHECK(second.itemsRequests == RANGES_COUNT);
+			BOOST_CHECK(first.chunkRequests == 0);
+			BOOST_CHECK(first.maxActive == 1);
+			BOOST_CHECK(second.maxActive == 1);
+		}
+		for (TRangeID rangeID = 1; rangeID <= RANGES_COUNT; rangeID++) {
+			ih.rangeID = rangeID;
+			for (ih.itemKey = 1; ih.itemKey <= ITEMS_COUNT; ih.itemKey++)
+				BOOST_CHECK(checkItem(storage, ih, data));
+		}
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+}
+
+BOOST_AUTO_TEST_CASE (testSyncBigItem)
+{
+	TestPath sourcePath("metis_sync_source");
+	TestPath testPath("metis_sync");
+	const TRangeID RANGE_ID = 10;
+	const TItemSize MAX_CHUNK_SIZE = 4096;
+	const TItemSize BIG_SIZE = MAX_CHUNK_SIZE * 10 + 100;
+	BString small;
+	for (int i = 0; i < 1000; i++)
+		small << (char)('a' + i % 20);
+	BString big;
+	for (TItemSize i = 0; i < BIG_SIZE; i++)
+		big << (char)('0' + (i * 7) % 71);
+	ItemHeader ih;
+	bzero(&ih, sizeof(ih));
+	ih.rangeID = RANGE_ID;
+	ih.level = 1;
+	ih.timeTag.modTime = 2;
+
+	try
+	{
+		Storage sourceStorage(sourcePath.path(), 0.05, 10000000);
+		Storage storage(testPath.path(), 0.05, 10000000);
+		TestSyncSource source(&sourceStorage);
+		TIndexSyncEntryVector syncs;
+		ItemHeader smallHeader = ih;
+		smallHeader.itemKey = 1;
+		smallHeader.size = small.size();
+		BOOST_REQUIRE(sourceStorage.add(small.c_str(), smallHeader));
+		addSync(syncs, smallHeader, 1, source);
+		ItemHeader bigHeader = ih;
+		bigHeader.itemKey = 2;
+		bigHeader.size = big.size();
+		BOOST_REQUIRE(sourceStorage.add(big.c_str(), bigHeader));
+		addSync(syncs, bigHeader, 1, source);
+		// an item, which has gone from the source, is skipped and the connection is reopened
+		ItemHeader lostHeader = ih;
+		lostHeader.itemKey = 3;
+		lostHeader.size = BIG_SIZE;
+		addSync(syncs, lostHeader, 1, source);
+
+		SyncThread syncThread(&storage, 2, 1, MAX_CHUNK_SIZE);
+		BOOST_REQUIRE(syncThread.add(1, RANGE_ID, syncs));
+		BOOST_REQUIRE(waitSync(syncThread, RANGE_ID));
+
+		// a big item is streamed into the write slice by chunks, which are never bigger than maxChunkSize
+		BOOST_CHECK(source.itemsRequests == 1);
+		BOOST_CHECK(source.chunkRequests == (BIG_SIZE + MAX_CHUNK_SIZE - 1) / MAX_CHUNK_SIZE + 1);
+		BOOST_CHECK(source.maxChunkSize == MAX_CHUNK_SIZE);
+		BOOST_CHECK(checkItem(storage, smallHeader, small));
+		BOOST_CHECK(checkItem(storage, bigHeader, big));
+		ItemInfo itemInfo;
+		BOOST_CHECK(!storage.findAndFill(ItemIndex(RANGE_ID, lostHeader.itemKey), itemInfo));
+	}
+	catch (...)
+	{
+		BOOST_CHECK_NO_THROW(throw);
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
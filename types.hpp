@@ -23,6 +23,7 @@ namespace fl {
 		
 		typedef uint8_t TItemStatus;
 		static const TItemStatus ST_ITEM_DELETED = 0x80;
+		static const TItemStatus ST_ITEM_COMPRESSED = 0x40; // the item is kept in a slice as a gzip stream
 		
 		typedef uint8_t TManagerStatus;
 		typedef uint8_t TStorageStatus;
@@ -89,6 +90,7 @@ namespace fl {
 		{
 			ItemHeader header;
 			ItemPointer pointer;
+			TCrc crc; // CRC32C of the item data, 0 - unknown (items written before checksums)
 		} __attribute__((packed));	
 		
 		enum EStorageCMD : uint8_t
@@ -101,8 +103,17 @@ namespace fl {
 			STORAGE_PING,
 			STORAGE_GET_RANGE_ITEMS,
 			STORAGE_SYNC,
+			STORAGE_GET_ITEM_INFO_AND_CHUNK,
+			STORAGE_GET_RANGE_DIGEST,
+			STORAGE_GET_ITEMS,
+			STORAGE_GET_RANGE_ITEMS_V2,
 		};
 		
+		// The second version of the protocol: a command with this bit set is followed by its request id, which the
+		// storage puts after the header of the answer, so many requests can be in flight on the same connection
+		const uint8_t STORAGE_CMD_REQUEST_ID = 0x80;
+		typedef uint32_t TStorageRequestID;
+		
 		struct StorageCmd
 		{
 			EStorageCMD cmd;
@@ -189,22 +200,116 @@ namespace fl {
 			TItemSize seek;
 		} __attribute__((packed));
 		
+		typedef uint8_t TItemEncoding;
+		static const TItemEncoding ITEM_ENCODING_IDENTITY = 0;
+		static const TItemEncoding ITEM_ENCODING_GZIP = 1;
+		
+		static const uint8_t GET_ACCEPT_GZIP = 0x1;
+		// The answer is ItemInfo followed by the first chunkSize bytes of the item. The chunk is skipped, when the item
+		// hasn't been modified since ifModifiedSince (0 - always send it). With GET_ACCEPT_GZIP in flags ItemInfo is
+		// followed by TItemEncoding, a compressed item is sent as its whole gzip stream, when the stream fits in the chunk
+		struct GetItemInfoAndChunkRequest
+		{
+			TRangeID rangeID;
+			TItemKey itemKey;
+			TItemSize chunkSize;
+			TItemModTime ifModifiedSince;
+			uint8_t flags;
+		} __attribute__((packed));
+		
+		// Items are fetched in batches for replication: the request is an array of GetItemsEntry, the answer has
+		// a StorageAnswer followed by the data for every requested item in the same order. An item is answered with
+		// STORAGE_ANSWER_NOT_FOUND, when it is missing or has another time tag, and with STORAGE_ANSWER_ERROR, when
+		// it can't be read or doesn't fit in GET_ITEMS_MAX_SIZE bytes of the answer, so it has to be asked again
+		static const uint32_t GET_ITEMS_MAX_COUNT = 4096;
+		static const TSize GET_ITEMS_MAX_SIZE = 16 * 1024 * 1024;
+		struct GetItemsEntry
+		{
+			TRangeID rangeID;
+			TItemKey itemKey;
+			ModTimeTag timeTag;
+		} __attribute__((packed));
+		
 		struct StoragePingAnswer
 		{
 			TServerID serverID;
 			int64_t leftSpace;
 		} __attribute__((packed));
 		
+		// A digest of a range is a tree: the root has RANGE_DIGEST_FANOUT subtrees of RANGE_DIGEST_FANOUT buckets, an item
+		// belongs to the bucket itemKey % RANGE_DIGEST_BUCKETS. A node is the XOR of the hashes of item keys, sizes, time
+		// tags and checksums under it, deleted and corrupted items aren't counted, so the same items give the same digest
+		typedef uint64_t TRangeDigest;
+		static const uint32_t RANGE_DIGEST_FANOUT = 16;
+		static const uint32_t RANGE_DIGEST_BUCKETS = RANGE_DIGEST_FANOUT * RANGE_DIGEST_FANOUT;
+		inline uint32_t rangeDigestBucket(const TItemKey itemKey)
+		{
+			return itemKey % RANGE_DIGEST_BUCKETS;
+		}
+		
+		// With subtrees = 0 the answer is the digests of the root subtrees, otherwise the digests of the buckets
+		// of every subtree in the subtrees bitmask. The answer is RangeDigestHeader followed by TRangeDigest values
+		struct RangeDigestRequest
+		{
+			TServerID serverID;
+			TRangeID rangeID;
+			uint16_t subtrees;
+		}__attribute__((packed));
+		
+		struct RangeDigestHeader
+		{
+			TRangeID rangeID;
+			uint16_t subtrees;
+		}__attribute__((packed));
+		
+		// STORAGE_GET_RANGE_ITEMS lists the whole range in one answer: RangeItemsHeaderV1 followed by RangeItemEntryV1
+		struct RangeItemsRequestV1
+		{
+			TServerID serverID;
+			TRangeID rangeID;
+		}__attribute__((packed));
+		
+		struct RangeItemsHeaderV1
+		{
+			TRangeID rangeID;
+			uint32_t count;
+		} __attribute__((packed));
+		
+		struct RangeItemEntryV1
+		{
+			TItemKey itemKey;
+			TSize size;
+			ModTimeTag timeTag;
+		} __attribute__((packed));
+		
+		// STORAGE_GET_RANGE_ITEMS_V2 lists a range by pages in the order of item keys: a page starts from fromKey and
+		// the next one from nextKey of the answer until RANGE_ITEMS_LAST is set. Only the items with time tags newer
+		// than changedSince are listed (0 - all of them), maxCount - the maximum number of items in a page (0 - the
+		// storage chooses).
+		// With RANGE_ITEMS_BUCKETS in flags only the items of the digest buckets set in the buckets bitmask are listed
+		static const uint8_t RANGE_ITEMS_BUCKETS = 0x1;
 		struct RangeItemsRequest
 		{
 			TServerID serverID;
 			TRangeID rangeID;
+			TItemKey fromKey;
+			uint32_t maxCount;
+			ModTimeTag changedSince;
+			uint8_t flags;
+			uint8_t buckets[RANGE_DIGEST_BUCKETS / 8];
+			bool hasBucket(const uint32_t bucket) const
+			{
+				return buckets[bucket / 8] & (1 << (bucket % 8));
+			}
 		}__attribute__((packed));
 		
+		static const uint8_t RANGE_ITEMS_LAST = 0x1;
 		struct RangeItemsHeader
 		{
 			TRangeID rangeID;
 			uint32_t count;
+			TItemKey nextKey;
+			uint8_t flags;
 		} __attribute__((packed));
 		
 		struct RangeItemEntry
@@ -212,6 +317,7 @@ namespace fl {
 			TItemKey itemKey;
 			TSize size;
 			ModTimeTag timeTag;
+			TCrc crc;
 		} __attribute__((packed));
 		
 		struct RangeSyncHeader